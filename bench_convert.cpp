@@ -0,0 +1,345 @@
+/**
+ * \file bench_convert.cpp
+ * Throughput benchmark for vg::io::convert_alignments().
+ *
+ * Makes a chain graph and a GAM of simulated reads on it, then times GAM to
+ * GAF and GAF to GAM conversion at 1, 2, 4, ... up to the given number of
+ * threads, in unordered and ordered mode. Ordered output is checked against
+ * the single-threaded output, since it should be the same on every run.
+ *
+ * Then times writing the reads as GAFB, and reading them back from GAF and
+ * from GAFB with the parallel readers, to compare the two formats.
+ *
+ * Usage: bench_convert_alignments [alignments] [max threads] [work directory]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "vg/io/alignment_convert.hpp"
+#include "vg/io/alignment_emitter.hpp"
+#include "vg/io/gaf_binary.hpp"
+#include "vg/io/protobuf_emitter.hpp"
+#include "vg/io/stream.hpp"
+#include "vg/vg.pb.h"
+#include <handlegraph/handle_graph.hpp>
+#include <handlegraph/util.hpp>
+
+/// Length of each node in the chain graph
+const size_t NODE_LENGTH = 32;
+/// Length of each simulated read
+const size_t READ_LENGTH = 150;
+/// Each timing is the best of this many runs
+const size_t REPEATS = 3;
+
+/**
+ * A graph of nodes 1 to N in a chain, with random sequences, just enough for
+ * converting alignments.
+ */
+class ChainGraph : public handlegraph::HandleGraph {
+public:
+    ChainGraph(size_t node_count, std::mt19937& rng) : forward(node_count) {
+        std::uniform_int_distribution<int> base(0, 3);
+        for (auto& sequence : forward) {
+            sequence.resize(NODE_LENGTH);
+            for (auto& c : sequence) {
+                c = "ACGT"[base(rng)];
+            }
+        }
+    }
+
+    bool has_node(handlegraph::nid_t node_id) const {
+        return node_id >= 1 && node_id <= (handlegraph::nid_t) forward.size();
+    }
+
+    handlegraph::handle_t get_handle(const handlegraph::nid_t& node_id, bool is_reverse = false) const {
+        return handlegraph::number_bool_packing::pack(node_id, is_reverse);
+    }
+
+    handlegraph::nid_t get_id(const handlegraph::handle_t& handle) const {
+        return handlegraph::number_bool_packing::unpack_number(handle);
+    }
+
+    bool get_is_reverse(const handlegraph::handle_t& handle) const {
+        return handlegraph::number_bool_packing::unpack_bit(handle);
+    }
+
+    handlegraph::handle_t flip(const handlegraph::handle_t& handle) const {
+        return handlegraph::number_bool_packing::toggle_bit(handle);
+    }
+
+    size_t get_length(const handlegraph::handle_t& handle) const {
+        return NODE_LENGTH;
+    }
+
+    std::string get_sequence(const handlegraph::handle_t& handle) const {
+        const std::string& sequence = forward.at(get_id(handle) - 1);
+        if (!get_is_reverse(handle)) {
+            return sequence;
+        }
+        std::string reversed(sequence.rbegin(), sequence.rend());
+        for (auto& c : reversed) {
+            switch (c) {
+            case 'A': c = 'T'; break;
+            case 'C': c = 'G'; break;
+            case 'G': c = 'C'; break;
+            case 'T': c = 'A'; break;
+            }
+        }
+        return reversed;
+    }
+
+    size_t get_node_count() const {
+        return forward.size();
+    }
+
+    handlegraph::nid_t min_node_id() const {
+        return 1;
+    }
+
+    handlegraph::nid_t max_node_id() const {
+        return forward.size();
+    }
+
+    /// Get the forward sequence of a node.
+    const std::string& sequence(handlegraph::nid_t node_id) const {
+        return forward.at(node_id - 1);
+    }
+
+protected:
+    bool follow_edges_impl(const handlegraph::handle_t& handle, bool go_left,
+                           const std::function<bool(const handlegraph::handle_t&)>& iteratee) const {
+        handlegraph::nid_t next = get_id(handle) + (go_left != get_is_reverse(handle) ? -1 : 1);
+        if (!has_node(next)) {
+            return true;
+        }
+        return iteratee(get_handle(next, get_is_reverse(handle)));
+    }
+
+    bool for_each_handle_impl(const std::function<bool(const handlegraph::handle_t&)>& iteratee,
+                              bool parallel = false) const {
+        for (size_t i = 1; i <= forward.size(); i++) {
+            if (!iteratee(get_handle(i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    std::vector<std::string> forward;
+};
+
+/// Make a read along the chain, mostly matching, with the odd substitution.
+void simulate_read(const ChainGraph& graph, size_t number, std::mt19937& rng, vg::Alignment& aln) {
+    std::uniform_int_distribution<handlegraph::nid_t> start_node(1, graph.get_node_count() - READ_LENGTH / NODE_LENGTH - 1);
+    std::uniform_int_distribution<size_t> start_offset(0, NODE_LENGTH - 1);
+    std::uniform_int_distribution<size_t> roll(0, 99);
+    std::uniform_int_distribution<int> quality(2, 41);
+
+    aln.Clear();
+    aln.set_name("read" + std::to_string(number));
+    handlegraph::nid_t node = start_node(rng);
+    size_t offset = start_offset(rng);
+    std::string& sequence = *aln.mutable_sequence();
+    while (sequence.size() < READ_LENGTH) {
+        vg::Mapping* mapping = aln.mutable_path()->add_mapping();
+        mapping->mutable_position()->set_node_id(node);
+        mapping->mutable_position()->set_offset(offset);
+        mapping->set_rank(aln.path().mapping_size());
+        const std::string& reference = graph.sequence(node);
+        size_t length = std::min(NODE_LENGTH - offset, READ_LENGTH - sequence.size());
+        size_t substitution = roll(rng) < 20 ? roll(rng) % length : length;
+        if (substitution > 0) {
+            vg::Edit* match = mapping->add_edit();
+            match->set_from_length(std::min(substitution, length));
+            match->set_to_length(match->from_length());
+        }
+        sequence += reference.substr(offset, std::min(substitution, length));
+        if (substitution < length) {
+            char replacement = reference[offset + substitution] == 'A' ? 'C' : 'A';
+            vg::Edit* mismatch = mapping->add_edit();
+            mismatch->set_from_length(1);
+            mismatch->set_to_length(1);
+            mismatch->set_sequence(std::string(1, replacement));
+            sequence.push_back(replacement);
+            if (substitution + 1 < length) {
+                vg::Edit* rest = mapping->add_edit();
+                rest->set_from_length(length - substitution - 1);
+                rest->set_to_length(rest->from_length());
+                sequence += reference.substr(offset + substitution + 1, length - substitution - 1);
+            }
+        }
+        node++;
+        offset = 0;
+    }
+    std::string& qualities = *aln.mutable_quality();
+    for (size_t i = 0; i < sequence.size(); i++) {
+        qualities.push_back((char) quality(rng));
+    }
+    aln.set_mapping_quality(60);
+    aln.set_score(sequence.size());
+}
+
+/// Read a whole file into a string.
+std::string slurp(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    return buffer.str();
+}
+
+/// Print a row of timings.
+void print_row(const std::string& direction, const std::string& mode, size_t threads,
+               double seconds, size_t alignment_count, double base_seconds) {
+    std::cout << direction << "\t"
+              << mode << "\t"
+              << threads << "\t"
+              << std::fixed << std::setprecision(3) << seconds << "\t"
+              << std::setprecision(0) << alignment_count / seconds << "\t"
+              << std::setprecision(2) << base_seconds / seconds << std::endl;
+}
+
+/// Time a run that handles all the alignments with the given number of
+/// threads, at each thread count, and print a row for each. The run returns
+/// how many alignments it handled. Returns false if that was ever wrong.
+bool time_runs(const std::string& direction, const std::vector<size_t>& thread_counts, size_t alignment_count,
+               const std::function<size_t(size_t)>& run) {
+    double base_seconds = 0;
+    for (size_t threads : thread_counts) {
+        double best = 0;
+        for (size_t repeat = 0; repeat < REPEATS; repeat++) {
+            auto start = std::chrono::steady_clock::now();
+            size_t handled = run(threads);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (handled != alignment_count) {
+                std::cerr << "error: " << direction << " handled " << handled << " of " << alignment_count << " alignments" << std::endl;
+                return false;
+            }
+            if (repeat == 0 || elapsed.count() < best) {
+                best = elapsed.count();
+            }
+        }
+        if (threads == 1) {
+            base_seconds = best;
+        }
+        print_row(direction, "unordered", threads, best, alignment_count, base_seconds);
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    size_t alignment_count = argc > 1 ? std::stoull(argv[1]) : 1000000;
+    size_t max_threads = argc > 2 ? std::stoull(argv[2]) : omp_get_num_procs();
+    std::string work_directory = argc > 3 ? argv[3] : ".";
+    if (alignment_count == 0 || max_threads == 0) {
+        std::cerr << "usage: " << argv[0] << " [alignments] [max threads] [work directory]" << std::endl;
+        return 1;
+    }
+
+    std::string gam_in = work_directory + "/bench_convert_in.gam";
+    std::string gaf_in = work_directory + "/bench_convert_in.gaf";
+    std::string gam_out = work_directory + "/bench_convert_out.gam";
+    std::string gaf_out = work_directory + "/bench_convert_out.gaf";
+    std::string gafb_out = work_directory + "/bench_convert_out.gafb";
+
+    std::mt19937 rng(1);
+    ChainGraph graph(alignment_count / 10 + READ_LENGTH, rng);
+
+    std::cerr << "Simulating " << alignment_count << " alignments..." << std::endl;
+    {
+        std::ofstream out(gam_in, std::ios::binary);
+        vg::io::ProtobufEmitter<vg::Alignment> emitter(out);
+        vg::Alignment aln;
+        for (size_t i = 0; i < alignment_count; i++) {
+            simulate_read(graph, i, rng, aln);
+            emitter.write_copy(aln);
+        }
+    }
+    // The single-threaded outputs are what ordered runs should reproduce.
+    vg::io::convert_alignments(gam_in, "GAM", gaf_in, "GAF", graph, 1, true);
+    vg::io::convert_alignments(gaf_in, "GAF", gam_out, "GAM", graph, 1, true);
+    std::string expected_gaf = slurp(gaf_in);
+    std::string expected_gam = slurp(gam_out);
+
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    std::cout << "direction\tmode\tthreads\tseconds\talignments/s\tspeedup" << std::endl;
+    bool all_same = true;
+    for (bool to_gaf : {true, false}) {
+        for (bool ordered : {false, true}) {
+            double base_seconds = 0;
+            for (size_t threads : thread_counts) {
+                double best = 0;
+                for (size_t repeat = 0; repeat < REPEATS; repeat++) {
+                    auto start = std::chrono::steady_clock::now();
+                    size_t converted = to_gaf ?
+                        vg::io::convert_alignments(gam_in, "GAM", gaf_out, "GAF", graph, threads, ordered) :
+                        vg::io::convert_alignments(gaf_in, "GAF", gam_out, "GAM", graph, threads, ordered);
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                    if (converted != alignment_count) {
+                        std::cerr << "error: converted " << converted << " of " << alignment_count << " alignments" << std::endl;
+                        return 1;
+                    }
+                    if (repeat == 0 || elapsed.count() < best) {
+                        best = elapsed.count();
+                    }
+                }
+                if (ordered && slurp(to_gaf ? gaf_out : gam_out) != (to_gaf ? expected_gaf : expected_gam)) {
+                    std::cerr << "error: ordered output with " << threads << " threads differs from single-threaded output" << std::endl;
+                    all_same = false;
+                }
+                if (threads == 1) {
+                    base_seconds = best;
+                }
+                print_row(to_gaf ? "GAM->GAF" : "GAF->GAM", ordered ? "ordered" : "unordered",
+                          threads, best, alignment_count, base_seconds);
+            }
+        }
+    }
+
+    bool all_counted = time_runs("GAM->GAFB", thread_counts, alignment_count, [&](size_t threads) {
+        omp_set_num_threads(threads);
+        std::atomic<size_t> count(0);
+        std::unique_ptr<vg::io::AlignmentEmitter> emitter = vg::io::get_non_hts_alignment_emitter(gafb_out, "GAFB", {}, threads, &graph);
+        std::ifstream in(gam_in, std::ios::binary);
+        vg::io::for_each_parallel<vg::Alignment>(in, [&](vg::Alignment& aln) {
+            // The emitter fills a block per thread, so single alignments are fine.
+            emitter->emit_single(std::move(aln));
+            count++;
+        });
+        return count.load();
+    });
+    std::cerr << "GAF is " << slurp(gaf_in).size() << " bytes, GAFB is " << slurp(gafb_out).size() << " bytes" << std::endl;
+    all_counted = all_counted && time_runs("GAF->read", thread_counts, alignment_count, [&](size_t threads) {
+        omp_set_num_threads(threads);
+        return vg::io::gaf_unpaired_for_each_parallel(graph, gaf_in, [](vg::Alignment& aln) {});
+    });
+    all_counted = all_counted && time_runs("GAFB->read", thread_counts, alignment_count, [&](size_t threads) {
+        omp_set_num_threads(threads);
+        return vg::io::gaf_binary_unpaired_for_each_parallel(graph, gafb_out, [](vg::Alignment& aln) {});
+    });
+
+    for (auto& filename : {gam_in, gaf_in, gam_out, gaf_out, gafb_out}) {
+        std::remove(filename.c_str());
+    }
+    return all_same && all_counted ? 0 : 1;
+}
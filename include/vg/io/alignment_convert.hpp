@@ -0,0 +1,46 @@
+#ifndef VG_IO_ALIGNMENT_CONVERT_HPP_INCLUDED
+#define VG_IO_ALIGNMENT_CONVERT_HPP_INCLUDED
+
+/**
+ * \file alignment_convert.hpp
+ * Defines a parallel pipeline for converting alignment files between GAM and
+ * GAF.
+ */
+
+#include <string>
+
+#include "alignment_io.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Convert the alignments in in_path, in in_format ("GAM" or "GAF"), to
+ * out_format ("GAM" or "GAF") in out_path. Either path may be "-" for
+ * standard input or output. GAF input and output are in node ID space, with
+ * node lengths and sequences coming from the given graph.
+ *
+ * One thread reads batches of batch_size records without decoding them, and
+ * up to threads threads decode, convert, and encode whole batches, sending
+ * their output through a StreamMultiplexer. If ordered is set, the output
+ * holds the alignments in input order and is the same on every run;
+ * otherwise each batch is written when it is done.
+ *
+ * Returns the number of alignments converted. Throws if a format is not
+ * supported. Input that turns out not to be in in_format is fatal, as with
+ * the other parallel iterators.
+ */
+size_t convert_alignments(const string& in_path, const string& in_format,
+                          const string& out_path, const string& out_format,
+                          const HandleGraph& graph, size_t threads,
+                          bool ordered = false,
+                          uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE);
+
+}
+
+}
+
+#endif
@@ -8,9 +8,12 @@
  */
 
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <vector>
 #include <deque>
+#include <unordered_map>
+#include <functional>
 
 #include <htslib/hfile.h>
 #include <htslib/hts.h>
@@ -19,6 +22,8 @@
 #include "vg/vg.pb.h"
 #include "protobuf_emitter.hpp"
 #include "stream_multiplexer.hpp"
+#include "gaf_formatter.hpp"
+#include "gaf_binary.hpp"
 #include <handlegraph/handle_graph.hpp>
 #include <handlegraph/named_node_back_translation.hpp>
 
@@ -94,6 +99,22 @@ public:
     virtual void emit_mapped_pair(vector<Alignment>&& alns1, vector<Alignment>&& alns2,
         int64_t tlen_limit = 0);
     
+    // These shared-batch methods take batches that can't be moved from,
+    // because they are being written to several emitters at once. By default
+    // they copy the batch and call the batched methods above. Emitters that
+    // can write without taking the alignments should override them.
+    
+    /// Emit a batch of Alignments without taking them.
+    virtual void emit_shared_singles(const vector<Alignment>& aln_batch);
+    /// Emit a batch of Alignments with secondaries without taking them.
+    virtual void emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch);
+    /// Emit a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_pairs(const vector<Alignment>& aln1_batch, const vector<Alignment>& aln2_batch,
+        const vector<int64_t>& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+        const vector<vector<Alignment>>& alns2_batch, const vector<int64_t>& tlen_limit_batch);
+    
     /// Allow destruction through base class pointer.
     virtual ~AlignmentEmitter() = default;
 };
@@ -124,6 +145,347 @@ public:
         
 };
 
+/**
+ * Wraps another AlignmentEmitter, and runs it on a pool of its own formatter
+ * threads, so the threads emitting alignments don't have to wait for them to
+ * be serialized or formatted.
+ *
+ * Batches are queued up to a limit; once the queue is full, emitting threads
+ * wait for room, so memory use stays bounded if formatting can't keep up.
+ * Everything queued is written before the destructor returns.
+ *
+ * Each emitting thread is assigned to one formatter thread the first time it
+ * emits, and all its batches are formatted there, in the order it emitted
+ * them. So each thread's output keeps its order, even through a wrapped
+ * emitter that buffers per thread. Batches from different threads interleave
+ * in no particular order.
+ *
+ * The formatter threads are an OMP team of their own, numbered from 0, so the
+ * wrapped emitter must have been made for at least that many threads.
+ */
+class AsyncAlignmentEmitter : public AlignmentEmitter {
+public:
+    
+    /// Default number of batches that can be waiting to be formatted
+    static const size_t DEFAULT_MAX_QUEUED_BATCHES;
+    
+    /// Wrap the given emitter, running it on the given number of formatter
+    /// threads, with at most max_queued_batches waiting for them.
+    AsyncAlignmentEmitter(unique_ptr<AlignmentEmitter>&& backing, size_t formatter_threads,
+                          size_t max_queued_batches = DEFAULT_MAX_QUEUED_BATCHES);
+    
+    /// Finish formatting everything queued, and destroy the wrapped emitter.
+    ~AsyncAlignmentEmitter();
+    
+    virtual void emit_extra_message(const std::string& tag, std::string&& data);
+    
+    /// Emit a batch of Alignments.
+    virtual void emit_singles(vector<Alignment>&& aln_batch);
+    /// Emit a batch of Alignments with secondaries. All secondaries must have
+    /// is_secondary set already.
+    virtual void emit_mapped_singles(vector<vector<Alignment>>&& alns_batch);
+    /// Emit a batch of pairs of Alignments.
+    virtual void emit_pairs(vector<Alignment>&& aln1_batch, vector<Alignment>&& aln2_batch,
+        vector<int64_t>&& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments. All secondaries
+    /// must have is_secondary set already.
+    virtual void emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+        vector<vector<Alignment>>&& alns2_batch, vector<int64_t>&& tlen_limit_batch);
+    
+private:
+    
+    /// A call to the wrapped emitter, waiting to be made.
+    struct QueuedBatch {
+        /// Which method to call
+        enum {SINGLES, MAPPED_SINGLES, PAIRS, MAPPED_PAIRS, EXTRA_MESSAGE} kind;
+        /// Alignments, or first mates, for unmapped batches
+        vector<Alignment> alns1;
+        /// Second mates for unmapped batches
+        vector<Alignment> alns2;
+        /// Alignments, or first mates, for mapped batches
+        vector<vector<Alignment>> mapped1;
+        /// Second mates for mapped batches
+        vector<vector<Alignment>> mapped2;
+        /// Pairing distance limits for paired batches
+        vector<int64_t> tlen_limits;
+        /// Tag and data for an extra message
+        string tag;
+        string data;
+    };
+    
+    /// The emitter doing the real work
+    unique_ptr<AlignmentEmitter> backing;
+    
+    /// Most batches that can be waiting, over all the queues
+    size_t max_queued_batches;
+    /// Batches waiting to be formatted, for each formatter thread. Protected
+    /// by queue_mutex.
+    vector<deque<QueuedBatch>> queues;
+    /// Total batches in all the queues. Protected by queue_mutex.
+    size_t queued_batches;
+    /// Which queue each emitting thread's batches go to. Protected by
+    /// queue_mutex.
+    unordered_map<thread::id, size_t> producer_queues;
+    /// Set when the formatters should finish the queue and stop. Protected by
+    /// queue_mutex.
+    bool stopping;
+    mutex queue_mutex;
+    /// Emitting threads wait on this for room in the queue
+    condition_variable queue_has_room;
+    /// Formatter threads wait on this for something in their queues
+    condition_variable queue_has_work;
+    
+    /// Thread that hosts the team of formatter threads
+    thread formatter_thread;
+    
+    /// Add a batch to the calling thread's queue, waiting for room if needed.
+    void enqueue(QueuedBatch&& batch);
+    
+    /// Run the given number of formatter threads until stopped.
+    void run_formatters(size_t formatter_threads);
+    
+    /// Hand a batch to the wrapped emitter, in a formatter thread.
+    void format(QueuedBatch& batch);
+};
+
+/**
+ * Wraps another AlignmentEmitter, and collects alignments emitted one at a
+ * time into per-thread batches for it. A thread's batch is passed on when it
+ * gets big enough, when the thread emits something that can't go in it, and
+ * at destruction.
+ *
+ * Batched calls are passed straight through, after whatever the thread has
+ * buffered, so each thread's output stays in order.
+ */
+class BufferedAlignmentEmitter : public AlignmentEmitter {
+public:
+    
+    /// Default number of reads or pairs to buffer per thread
+    static const size_t DEFAULT_MAX_BUFFERED_RECORDS;
+    /// Default number of sequence and quality bytes to buffer per thread
+    static const size_t DEFAULT_MAX_BUFFERED_BYTES;
+    
+    /// Wrap the given emitter, for use by the given number of OMP threads.
+    BufferedAlignmentEmitter(unique_ptr<AlignmentEmitter>&& backing, size_t max_threads,
+                             size_t max_buffered_records = DEFAULT_MAX_BUFFERED_RECORDS,
+                             size_t max_buffered_bytes = DEFAULT_MAX_BUFFERED_BYTES);
+    
+    /// Pass on everything buffered, and destroy the wrapped emitter.
+    ~BufferedAlignmentEmitter();
+    
+    virtual void emit_extra_message(const std::string& tag, std::string&& data);
+    
+    /// Emit a batch of Alignments.
+    virtual void emit_singles(vector<Alignment>&& aln_batch);
+    /// Emit a batch of Alignments with secondaries. All secondaries must have
+    /// is_secondary set already.
+    virtual void emit_mapped_singles(vector<vector<Alignment>>&& alns_batch);
+    /// Emit a batch of pairs of Alignments.
+    virtual void emit_pairs(vector<Alignment>&& aln1_batch, vector<Alignment>&& aln2_batch,
+        vector<int64_t>&& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments. All secondaries
+    /// must have is_secondary set already.
+    virtual void emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+        vector<vector<Alignment>>&& alns2_batch, vector<int64_t>&& tlen_limit_batch);
+    
+    /// Buffer a single Alignment.
+    virtual void emit_single(Alignment&& aln);
+    /// Buffer a single Alignment with secondaries.
+    virtual void emit_mapped_single(vector<Alignment>&& alns);
+    /// Buffer a pair of Alignments.
+    virtual void emit_pair(Alignment&& aln1, Alignment&& aln2, int64_t tlen_limit = 0);
+    /// Buffer the mappings of a pair of Alignments.
+    virtual void emit_mapped_pair(vector<Alignment>&& alns1, vector<Alignment>&& alns2,
+        int64_t tlen_limit = 0);
+    
+    /// Emit a batch of Alignments without taking them.
+    virtual void emit_shared_singles(const vector<Alignment>& aln_batch);
+    /// Emit a batch of Alignments with secondaries without taking them.
+    virtual void emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch);
+    /// Emit a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_pairs(const vector<Alignment>& aln1_batch, const vector<Alignment>& aln2_batch,
+        const vector<int64_t>& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+        const vector<vector<Alignment>>& alns2_batch, const vector<int64_t>& tlen_limit_batch);
+    
+private:
+    
+    /// One thread's buffered records. Only one kind of record is buffered at
+    /// a time.
+    struct ThreadBuffer {
+        /// Alignments, or first mates, for unmapped records
+        vector<Alignment> alns1;
+        /// Second mates for unmapped pairs
+        vector<Alignment> alns2;
+        /// Alignments, or first mates, for mapped records
+        vector<vector<Alignment>> mapped1;
+        /// Second mates for mapped pairs
+        vector<vector<Alignment>> mapped2;
+        /// Pairing distance limits for pairs
+        vector<int64_t> tlen_limits;
+        /// Sequence and quality bytes buffered
+        size_t bytes = 0;
+    };
+    
+    /// The emitter doing the real work
+    unique_ptr<AlignmentEmitter> backing;
+    
+    /// Thresholds for passing on a thread's buffer
+    size_t max_buffered_records;
+    size_t max_buffered_bytes;
+    
+    /// Buffers for each thread, made by their threads on first use.
+    vector<unique_ptr<ThreadBuffer>> buffers;
+    
+    /// Get the buffer for the calling thread.
+    ThreadBuffer& get_buffer();
+    
+    /// Pass on everything in the given buffer.
+    void flush(ThreadBuffer& buffer);
+    
+    /// Pass on the buffer if it has reached a threshold.
+    void flush_if_full(ThreadBuffer& buffer, size_t records);
+    
+    /// Get the number of buffered bytes we count for an Alignment.
+    static size_t buffered_bytes(const Alignment& aln);
+};
+
+/**
+ * Splits alignments between several other AlignmentEmitters, usually writing
+ * to different files, according to a key computed from each read. Each
+ * shard's emitter has its own multiplexer and compression, so the shards can
+ * be processed in parallel downstream without splitting the output again.
+ *
+ * A read is sent to the shard numbered by its key modulo the number of
+ * shards. Secondaries go with the first alignment of their read, and both
+ * ends of a pair go with the first end, so groups and pairs are never split.
+ * Extra messages go to every shard.
+ */
+class ShardedAlignmentEmitter : public AlignmentEmitter {
+public:
+    
+    /// Function to compute a shard key for an Alignment
+    using ShardKeyFunction = function<size_t(const Alignment&)>;
+    
+    /// Get a key function that hashes the read name.
+    static ShardKeyFunction key_by_name();
+    /// Get a key function that hashes the path name of the first reference
+    /// position, for reads annotated with refpos. Reads without one have key
+    /// 0.
+    static ShardKeyFunction key_by_refpos_path();
+    /// Get a key function that numbers the run of node_range node IDs that
+    /// the first node visited falls in. Unaligned reads have key 0.
+    static ShardKeyFunction key_by_first_node(nid_t node_range);
+    
+    /// Split output between the given emitters by the given key.
+    ShardedAlignmentEmitter(vector<unique_ptr<AlignmentEmitter>>&& shards, const ShardKeyFunction& shard_key);
+    
+    /// Destroy and so finish all the shards' emitters.
+    ~ShardedAlignmentEmitter() = default;
+    
+    virtual void emit_extra_message(const std::string& tag, std::string&& data);
+    
+    /// Emit a batch of Alignments.
+    virtual void emit_singles(vector<Alignment>&& aln_batch);
+    /// Emit a batch of Alignments with secondaries. All secondaries must have
+    /// is_secondary set already.
+    virtual void emit_mapped_singles(vector<vector<Alignment>>&& alns_batch);
+    /// Emit a batch of pairs of Alignments.
+    virtual void emit_pairs(vector<Alignment>&& aln1_batch, vector<Alignment>&& aln2_batch,
+        vector<int64_t>&& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments. All secondaries
+    /// must have is_secondary set already.
+    virtual void emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+        vector<vector<Alignment>>&& alns2_batch, vector<int64_t>&& tlen_limit_batch);
+    
+    /// Emit a single Alignment.
+    virtual void emit_single(Alignment&& aln);
+    /// Emit a single Alignment with secondaries.
+    virtual void emit_mapped_single(vector<Alignment>&& alns);
+    /// Emit a pair of Alignments.
+    virtual void emit_pair(Alignment&& aln1, Alignment&& aln2, int64_t tlen_limit = 0);
+    /// Emit the mappings of a pair of Alignments.
+    virtual void emit_mapped_pair(vector<Alignment>&& alns1, vector<Alignment>&& alns2,
+        int64_t tlen_limit = 0);
+    
+private:
+    
+    /// The emitters for each shard
+    vector<unique_ptr<AlignmentEmitter>> shards;
+    
+    /// How to key reads
+    ShardKeyFunction shard_key;
+    
+    /// Get the shard to send a read to.
+    size_t shard_of(const Alignment& aln) const;
+    
+    /// Get the shard to send a group of alignments to, by its first
+    /// alignment, or by the fallback group if it is empty.
+    size_t shard_of(const vector<Alignment>& alns, const vector<Alignment>& fallback) const;
+};
+
+/**
+ * Writes every alignment to each of several other AlignmentEmitters, for
+ * producing several formats in one pass.
+ *
+ * Each batch is shared between the emitters rather than copied for each.
+ * Emitters that can write from a shared batch without copying it (the GAM,
+ * JSON, GAF, GAFB, and TSV emitters, and the buffering wrapper around them) do
+ * so; others get a copy.
+ *
+ * Each call passes the batch to the emitters one after another, in the
+ * calling thread, and returns once they all have it. It never hands work to
+ * other threads or reaches an OMP scheduling point, so emitters that keep
+ * state for each OMP thread number see the caller's number throughout. The
+ * tee can be called from several threads at once exactly when all the
+ * emitters can; use several threads emitting for parallelism, rather than
+ * the tee.
+ */
+class TeeAlignmentEmitter : public AlignmentEmitter {
+public:
+    
+    /// Write to all of the given emitters.
+    TeeAlignmentEmitter(vector<unique_ptr<AlignmentEmitter>>&& backings);
+    
+    /// Destroy and so finish all the emitters.
+    ~TeeAlignmentEmitter() = default;
+    
+    virtual void emit_extra_message(const std::string& tag, std::string&& data);
+    
+    /// Emit a batch of Alignments.
+    virtual void emit_singles(vector<Alignment>&& aln_batch);
+    /// Emit a batch of Alignments with secondaries. All secondaries must have
+    /// is_secondary set already.
+    virtual void emit_mapped_singles(vector<vector<Alignment>>&& alns_batch);
+    /// Emit a batch of pairs of Alignments.
+    virtual void emit_pairs(vector<Alignment>&& aln1_batch, vector<Alignment>&& aln2_batch,
+        vector<int64_t>&& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments. All secondaries
+    /// must have is_secondary set already.
+    virtual void emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+        vector<vector<Alignment>>&& alns2_batch, vector<int64_t>&& tlen_limit_batch);
+    
+    /// Emit a batch of Alignments without taking them.
+    virtual void emit_shared_singles(const vector<Alignment>& aln_batch);
+    /// Emit a batch of Alignments with secondaries without taking them.
+    virtual void emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch);
+    /// Emit a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_pairs(const vector<Alignment>& aln1_batch, const vector<Alignment>& aln2_batch,
+        const vector<int64_t>& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+        const vector<vector<Alignment>>& alns2_batch, const vector<int64_t>& tlen_limit_batch);
+    
+private:
+    
+    /// The emitters to write to
+    vector<unique_ptr<AlignmentEmitter>> backings;
+    
+    /// Call the given function on each emitter, in turn.
+    void for_each_backing(const function<void(AlignmentEmitter&)>& iteratee);
+};
+
 /**
  * Emit a TSV table describing alignments.
  */
@@ -149,6 +511,17 @@ public:
     virtual void emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
         vector<vector<Alignment>>&& alns2_batch, vector<int64_t>&& tlen_limit_batch);
     
+    /// Emit a batch of Alignments without taking them.
+    virtual void emit_shared_singles(const vector<Alignment>& aln_batch);
+    /// Emit a batch of Alignments with secondaries without taking them.
+    virtual void emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch);
+    /// Emit a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_pairs(const vector<Alignment>& aln1_batch, const vector<Alignment>& aln2_batch,
+        const vector<int64_t>& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+        const vector<vector<Alignment>>& alns2_batch, const vector<int64_t>& tlen_limit_batch);
+    
 private:
 
     /// If we are doing output to a file, this will hold the open file. Otherwise (for stdout) it will be empty.
@@ -160,7 +533,7 @@ private:
 
     /// Emit single alignment as TSV.
     /// This is all we use; we don't do anything for pairing.
-    void emit(Alignment&& aln_batch);
+    void emit(const Alignment& aln);
 };
 
 /**
@@ -193,6 +566,17 @@ public:
     virtual void emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
         vector<vector<Alignment>>&& alns2_batch, vector<int64_t>&& tlen_limit_batch);
     
+    /// Emit a batch of Alignments without taking them.
+    virtual void emit_shared_singles(const vector<Alignment>& aln_batch);
+    /// Emit a batch of Alignments with secondaries without taking them.
+    virtual void emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch);
+    /// Emit a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_pairs(const vector<Alignment>& aln1_batch, const vector<Alignment>& aln2_batch,
+        const vector<int64_t>& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+        const vector<vector<Alignment>>& alns2_batch, const vector<int64_t>& tlen_limit_batch);
+    
 private:
 
     /// If we are doing output to a file, this will hold the open file. Otherwise (for stdout) it will be empty.
@@ -203,7 +587,15 @@ private:
     vg::io::StreamMultiplexer multiplexer;
     
     /// We also keep ProtobufEmitters, one per thread, if we are doing protobuf output.
+    /// With NUMA-aware placement on, they are made lazily by their threads.
     vector<unique_ptr<vg::io::ProtobufEmitter<Alignment>>> proto;
+    
+    /// Get the ProtobufEmitter for the given thread, making it if needed.
+    vg::io::ProtobufEmitter<Alignment>& get_proto(size_t thread_number);
+    
+    /// Write the given Alignments, in order, in the calling thread, and
+    /// breakpoint if possible.
+    void emit_in_order(const vector<const Alignment*>& alns);
 };
 
 /**
@@ -237,8 +629,104 @@ public:
                                    vector<vector<Alignment>>&& alns2_batch,
                                    vector<int64_t>&& tlen_limit_batch);
     
+    /// Emit a batch of Alignments without taking them.
+    virtual void emit_shared_singles(const vector<Alignment>& aln_batch);
+    /// Emit a batch of Alignments with secondaries without taking them.
+    virtual void emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch);
+    /// Emit a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_pairs(const vector<Alignment>& aln1_batch, const vector<Alignment>& aln2_batch,
+        const vector<int64_t>& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+        const vector<vector<Alignment>>& alns2_batch, const vector<int64_t>& tlen_limit_batch);
+    
+private:
+
+    /// If we are doing output to a file, this will hold the open file. Otherwise (for stdout) it will be empty.
+    unique_ptr<ofstream> out_file;
+    
+    /// This holds a StreamMultiplexer on the output stream, for sharing it between threads.
+    vg::io::StreamMultiplexer multiplexer;
+
+    /// Graph that alignments were aligned against
+    const HandleGraph& graph;
+    
+    /// Translation we should use to report in named segment coordinates, if any.
+    const handlegraph::NamedNodeBackTranslation* translate_through;
+
+    /// GAF formatter for each thread, made on first use.
+    vector<unique_ptr<GafFormatter>> formatters;
+
+    /// Get the GAF formatter for the given thread.
+    GafFormatter& get_formatter(size_t thread_number);
+    
+    /// Get the stream buffer the given thread's formatter writes GAF text
+    /// into, which is the thread's stream in the multiplexer.
+    streambuf& get_output(size_t thread_number);
+};
+
+/**
+ * Emit Alignments to a stream in GAFB, the binary form of GAF. Each thread
+ * fills its own blocks, and sends them on as they fill up, so alignments
+ * emitted together stay in the same block.
+ * Thread safe.
+ */
+class GafBinaryAlignmentEmitter : public AlignmentEmitter {
+public:
+    /// Create a GafBinaryAlignmentEmitter writing to the given file (or "-")
+    GafBinaryAlignmentEmitter(const string& filename,
+                              const string& format,
+                              const HandleGraph& graph,
+                              size_t max_threads,
+                              const handlegraph::NamedNodeBackTranslation* translate_through = nullptr);
+    
+    /// Send all the partly-filled blocks and end the file.
+    ~GafBinaryAlignmentEmitter();
+    
+    /// Emit a batch of Alignments.
+    virtual void emit_singles(vector<Alignment>&& aln_batch);
+    /// Emit a batch of Alignments with secondaries. All secondaries must have
+    /// is_secondary set already.
+    virtual void emit_mapped_singles(vector<vector<Alignment>>&& alns_batch);
+    /// Emit a batch of pairs of Alignments.
+    virtual void emit_pairs(vector<Alignment>&& aln1_batch,
+                            vector<Alignment>&& aln2_batch,
+                            vector<int64_t>&& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments. All secondaries
+    /// must have is_secondary set already.
+    virtual void emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+                                   vector<vector<Alignment>>&& alns2_batch,
+                                   vector<int64_t>&& tlen_limit_batch);
+    
+    /// Emit a batch of Alignments without taking them.
+    virtual void emit_shared_singles(const vector<Alignment>& aln_batch);
+    /// Emit a batch of Alignments with secondaries without taking them.
+    virtual void emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch);
+    /// Emit a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_pairs(const vector<Alignment>& aln1_batch, const vector<Alignment>& aln2_batch,
+        const vector<int64_t>& tlen_limit_batch);
+    /// Emit the mappings of a batch of pairs of Alignments without taking them.
+    virtual void emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+        const vector<vector<Alignment>>& alns2_batch, const vector<int64_t>& tlen_limit_batch);
+    
 private:
 
+    /// Everything one thread needs to encode its alignments
+    struct ThreadState {
+        ThreadState(const HandleGraph& graph) : node_cache(graph) {
+            // Nothing to do!
+        }
+        NodeCache node_cache;
+        /// Record to convert each alignment into
+        gafkluge::GafRecord record;
+        /// Space to build field values in
+        string scratch;
+        /// The block being filled
+        GafBinaryEncoder encoder;
+        /// Finished blocks, waiting to go to the multiplexer
+        string buffer;
+    };
+
     /// If we are doing output to a file, this will hold the open file. Otherwise (for stdout) it will be empty.
     unique_ptr<ofstream> out_file;
     
@@ -250,6 +738,19 @@ private:
     
     /// Translation we should use to report in named segment coordinates, if any.
     const handlegraph::NamedNodeBackTranslation* translate_through;
+
+    /// State for each thread, made on first use.
+    vector<unique_ptr<ThreadState>> states;
+
+    /// Get the state for the given thread.
+    ThreadState& get_state(size_t thread_number);
+
+    /// Add an alignment to the given thread's block.
+    void add(ThreadState& state, const Alignment& aln);
+
+    /// Send the given thread's block to the multiplexer if it is full, or if
+    /// force is set, and register a breakpoint after it.
+    void send_block(size_t thread_number, bool force = false);
 };
 
 }
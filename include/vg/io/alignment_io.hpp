@@ -12,6 +12,10 @@
 #include <handlegraph/handle_graph.hpp>
 #include <handlegraph/named_node_back_translation.hpp>
 #include "gafkluge.hpp"
+#include "batch_pool.hpp"
+#include "batch_sizer.hpp"
+#include "node_cache.hpp"
+#include <chrono>
 
 namespace vg {
 
@@ -27,52 +31,114 @@ using HandleGraph = handlegraph::HandleGraph;
 using namespace std;
 
 const uint64_t DEFAULT_PARALLEL_BATCHSIZE = 512;
+/// Decompression threads for the parallel GAF readers, as the parallel GAM
+/// readers use.
+const size_t DEFAULT_DECOMPRESSION_THREADS = 8;
 
 // general (implemented below)
+// If a sizer is given, it decides when batches are full instead of
+// batch_size, using record_bytes (if set) to measure each record just after it
+// is read.
+/// Read records with get_read_if_available and run the lambda on each, in
+/// parallel batches. Records are filled in place in recycled batches: each
+/// record handed to the getter is reset first with reset_record(), so it is
+/// empty, but may keep memory from an earlier read. Protobuf messages are
+/// reset with Clear().
 template<typename T>
 size_t unpaired_for_each_parallel(function<bool(T&)> get_read_if_available,
                                   function<void(T&)> lambda,
-                                  uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE);
+                                  uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE,
+                                  AdaptiveBatchSizer* sizer = nullptr,
+                                  function<size_t(const T&)> record_bytes = nullptr);
 
+/// Read pairs of records with get_pair_if_available and run the lambda on
+/// each, in parallel batches once single_threaded_until_true returns true.
+/// As with unpaired_for_each_parallel(), both records handed to the getter
+/// are reset first with reset_record(), and may keep memory from an earlier
+/// read.
 template<typename T>
 size_t paired_for_each_parallel_after_wait(function<bool(T&, T&)> get_pair_if_available,
                                            function<void(T&, T&)> lambda,
                                            function<bool(void)> single_threaded_until_true,
-                                           uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE);
+                                           uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE,
+                                           AdaptiveBatchSizer* sizer = nullptr,
+                                           function<size_t(const T&)> record_bytes = nullptr);
 // single gaf
+// The GAF readers take a thread count for decompressing bgzipped input, like
+// MessageIterator does for GAM. 0 or 1 decompresses on the reading thread.
+/// Open a GAF file (or "-") for reading, decompressing with the given number
+/// of threads if it is bgzipped. Exits if it can't be opened.
+htsFile* open_gaf(const string& filename, size_t thread_count = 0);
 bool get_next_record_from_gaf(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, htsFile* fp, kstring_t& s_buffer, gafkluge::GafRecord& record);
 bool get_next_record_pair_from_gaf(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, htsFile* fp, kstring_t& s_buffer,
                                    gafkluge::GafRecord& mate1, gafkluge::GafRecord& mate2);
-size_t gaf_unpaired_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename, function<void(Alignment&)> lambda);
-size_t gaf_unpaired_for_each(const HandleGraph& graph, const string& filename, function<void(Alignment&)> lambda);
+size_t gaf_unpaired_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename, function<void(Alignment&)> lambda, size_t thread_count = 0);
+size_t gaf_unpaired_for_each(const HandleGraph& graph, const string& filename, function<void(Alignment&)> lambda, size_t thread_count = 0);
 size_t gaf_paired_interleaved_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename,
-                                       function<void(Alignment&, Alignment&)> lambda);
+                                       function<void(Alignment&, Alignment&)> lambda, size_t thread_count = 0);
 size_t gaf_paired_interleaved_for_each(const HandleGraph& graph, const string& filename,
-                                       function<void(Alignment&, Alignment&)> lambda);
+                                       function<void(Alignment&, Alignment&)> lambda, size_t thread_count = 0);
 
 // parallel gaf
+// If a sizer is given, batches are sized by it, measured in GAF line bytes.
 size_t gaf_unpaired_for_each_parallel(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename,
                                       function<void(Alignment&)> lambda,
-                                      uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE);
+                                      uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE,
+                                      AdaptiveBatchSizer* sizer = nullptr,
+                                      size_t thread_count = DEFAULT_DECOMPRESSION_THREADS);
 size_t gaf_unpaired_for_each_parallel(const HandleGraph& graph, const string& filename,
                                       function<void(Alignment&)> lambda,
-                                      uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE);
+                                      uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE,
+                                      AdaptiveBatchSizer* sizer = nullptr,
+                                      size_t thread_count = DEFAULT_DECOMPRESSION_THREADS);
 size_t gaf_paired_interleaved_for_each_parallel(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename,
                                                 function<void(Alignment&, Alignment&)> lambda,
-                                                uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE);
+                                                uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE,
+                                                AdaptiveBatchSizer* sizer = nullptr,
+                                                size_t thread_count = DEFAULT_DECOMPRESSION_THREADS);
 size_t gaf_paired_interleaved_for_each_parallel(const HandleGraph& graph, const string& filename,
                                                 function<void(Alignment&, Alignment&)> lambda,
-                                                uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE);
+                                                uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE,
+                                                AdaptiveBatchSizer* sizer = nullptr,
+                                                size_t thread_count = DEFAULT_DECOMPRESSION_THREADS);
 size_t gaf_paired_interleaved_for_each_parallel_after_wait(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename,
                                                            function<void(Alignment&, Alignment&)> lambda,
                                                            function<bool(void)> single_threaded_until_true,
-                                                           uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE);
+                                                           uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE,
+                                                           AdaptiveBatchSizer* sizer = nullptr,
+                                                           size_t thread_count = DEFAULT_DECOMPRESSION_THREADS);
 size_t gaf_paired_interleaved_for_each_parallel_after_wait(const HandleGraph& graph, const string& filename,
                                                            function<void(Alignment&, Alignment&)> lambda,
                                                            function<bool(void)> single_threaded_until_true,
-                                                           uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE);
+                                                           uint64_t batch_size = DEFAULT_PARALLEL_BATCHSIZE,
+                                                           AdaptiveBatchSizer* sizer = nullptr,
+                                                           size_t thread_count = DEFAULT_DECOMPRESSION_THREADS);
 // gaf conversion
 
+/// Convert an alignment to GAF in the given record, reusing the memory the
+/// record already holds. The alignment must be in node ID space.
+/// If translate_through is set, output will be in segment name space.
+/// scratch is used to build long field values, and can also be reused.
+// If cs_cigar is true, will store a CIGAR string in the cs tag in the GAF.
+void alignment_to_gaf(NodeCache& node_cache,
+                      const Alignment& aln,
+                      gafkluge::GafRecord& gaf,
+                      string& scratch,
+                      const handlegraph::NamedNodeBackTranslation* translate_through = nullptr,
+                      bool cs_cigar = true,
+                      bool base_quals = true,
+                      bool frag_links = true);
+/// Convert an alignment to GAF. The alignment must be in node ID space.
+/// If translate_through is set, output will be in segment name space.
+/// Node lengths and sequences are looked up through the given cache, which
+/// can be reused across alignments.
+// If cs_cigar is true, will store a CIGAR string in the cs tag in the GAF.
+gafkluge::GafRecord alignment_to_gaf(NodeCache& node_cache,
+                                     const Alignment& aln,
+                                     const handlegraph::NamedNodeBackTranslation* translate_through = nullptr,
+                                     bool cs_cigar = true,
+                                     bool base_quals = true,
+                                     bool frag_links = true);
 /// Convert an alignment to GAF. The alignment must be in node ID space.
 /// If translate_through is set, output will be in segment name space.
 // If cs_cigar is true, will store a CIGAR string in the cs tag in the GAF.
@@ -94,6 +160,12 @@ gafkluge::GafRecord alignment_to_gaf(const HandleGraph& graph,
                                      bool frag_links = true);
 // TODO: These will need to be able to take a forward translation to read named-segment GAF.
 /// Convert a GAF alignment into a vg Alignment. The alignment must be in node ID space.
+/// Node lengths and sequences are looked up through the given cache, which
+/// can be reused across records.
+void gaf_to_alignment(NodeCache& node_cache,
+                      const gafkluge::GafRecord& gaf,
+                      Alignment& aln);
+/// Convert a GAF alignment into a vg Alignment. The alignment must be in node ID space.
 void gaf_to_alignment(function<size_t(nid_t)> node_to_length,
                       function<string(nid_t, bool)> node_to_sequence,
                       const gafkluge::GafRecord& gaf,
@@ -112,50 +184,94 @@ void alignment_quality_char_to_short(Alignment& alignment);
 void alignment_quality_short_to_char(Alignment& alignment);
 
 // implementation
+
+/// Run the lambda on each record in a batch, report the time taken to the
+/// sizer if any, and recycle the batch.
+template<typename T>
+inline void process_record_batch(RecordBatch<T>* batch, BatchPool<RecordBatch<T>>& pool,
+                                 const function<void(T&)>& lambda, AdaptiveBatchSizer* sizer) {
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < batch->size(); i++) {
+        lambda((*batch)[i]);
+    }
+    if (sizer != nullptr) {
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        sizer->record_process(batch->size(), batch->bytes(), batch->limit(), elapsed.count());
+    }
+    pool.give_back(batch);
+}
+
+/// Run the lambda on each pair in a batch, report the time taken to the
+/// sizer if any, and recycle the batch.
+template<typename T>
+inline void process_record_batch(RecordBatch<pair<T, T>>* batch, BatchPool<RecordBatch<pair<T, T>>>& pool,
+                                 const function<void(T&, T&)>& lambda, AdaptiveBatchSizer* sizer) {
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < batch->size(); i++) {
+        lambda((*batch)[i].first, (*batch)[i].second);
+    }
+    if (sizer != nullptr) {
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        sizer->record_process(batch->size() * 2, batch->bytes(), batch->limit(), elapsed.count());
+    }
+    pool.give_back(batch);
+}
+
 template<typename T>
 inline size_t unpaired_for_each_parallel(function<bool(T&)> get_read_if_available,
                                          function<void(T&)> lambda,
-                                         uint64_t batch_size) {
+                                         uint64_t batch_size,
+                                         AdaptiveBatchSizer* sizer,
+                                         function<size_t(const T&)> record_bytes) {
     assert(batch_size % 2 == 0);    
     size_t nLines = 0;
-    vector<T> *batch = nullptr;
+    // Batches are recycled, so the records in them keep their memory
+    BatchPool<RecordBatch<T>> pool;
+    RecordBatch<T> *batch = nullptr;
     // number of batches currently being processed
     uint64_t batches_outstanding = 0;
-#pragma omp parallel default(none) shared(batches_outstanding, batch, nLines, get_read_if_available, lambda, batch_size)
+#pragma omp parallel default(none) shared(batches_outstanding, batch, pool, nLines, get_read_if_available, lambda, batch_size, sizer, record_bytes)
 #pragma omp single
     {
         
         // max # of such batches to be holding in memory
-        uint64_t max_batches_outstanding = batch_size;
+        uint64_t max_batches_outstanding = sizer != nullptr ? sizer->count_limit() : batch_size;
         // max # we will ever increase the batch buffer to
         const uint64_t max_max_batches_outstanding = 1 << 13; // 8192
         
-        // alignments to hold the incoming data
-        T aln;
         // did we find the end of the file yet?
         bool more_data = true;
         
         while (more_data) {
-            // init a new batch
-            batch = new std::vector<T>();
-            batch->reserve(batch_size);
+            // get an empty batch
+            batch = pool.take();
+            batch->set_limit(sizer != nullptr ? sizer->count_limit() : batch_size);
+            auto batch_start = chrono::steady_clock::now();
             
-            // load up to the batch-size number of reads
-            for (int i = 0; i < batch_size; i++) {
+            // load up to the batch-size number of reads, directly into the batch
+            while (sizer != nullptr ? !sizer->batch_full(batch->size(), batch->bytes(), batch->limit()) : batch->size() < batch_size) {
                 
+                T& aln = batch->next_slot();
                 more_data = get_read_if_available(aln);
                 
                 if (more_data) {
-                    batch->emplace_back(std::move(aln));
+                    if (record_bytes) {
+                        batch->add_bytes(record_bytes(aln));
+                    }
+                    batch->commit_slot();
                     nLines++;
                 }
                 else {
                     break;
                 }
             }
+            if (sizer != nullptr && more_data) {
+                chrono::duration<double> elapsed = chrono::steady_clock::now() - batch_start;
+                sizer->record_fill(elapsed.count());
+            }
             
             // did we get a batch?
-            if (batch->size()) {
+            if (!batch->empty()) {
                 
                 // how many batch tasks are outstanding currently, including this one?
                 uint64_t current_batches_outstanding;
@@ -165,10 +281,7 @@ inline size_t unpaired_for_each_parallel(function<bool(T&)> get_read_if_availabl
                 if (current_batches_outstanding >= max_batches_outstanding) {
                     // do this batch in the current thread because we've spawned the maximum number of
                     // concurrent batch tasks
-                    for (auto& aln : *batch) {
-                        lambda(aln);
-                    }
-                    delete batch;
+                    process_record_batch(batch, pool, lambda, sizer);
 #pragma omp atomic capture
                     current_batches_outstanding = --batches_outstanding;
                     
@@ -183,16 +296,15 @@ inline size_t unpaired_for_each_parallel(function<bool(T&)> get_read_if_availabl
                 }
                 else {
                     // spawn a new task to take care of this batch
-#pragma omp task default(none) firstprivate(batch) shared(batches_outstanding, lambda)
+#pragma omp task default(none) firstprivate(batch) shared(batches_outstanding, pool, lambda, sizer)
                     {
-                        for (auto& aln : *batch) {
-                            lambda(aln);
-                        }
-                        delete batch;
+                        process_record_batch(batch, pool, lambda, sizer);
 #pragma omp atomic update
                         batches_outstanding--;
                     }
                 }
+            } else {
+                pool.give_back(batch);
             }
         }
     }
@@ -203,49 +315,60 @@ template<typename T>
 inline size_t paired_for_each_parallel_after_wait(function<bool(T&, T&)> get_pair_if_available,
                                                   function<void(T&, T&)> lambda,
                                                   function<bool(void)> single_threaded_until_true,
-                                                  uint64_t batch_size) {
+                                                  uint64_t batch_size,
+                                                  AdaptiveBatchSizer* sizer,
+                                                  function<size_t(const T&)> record_bytes) {
 
     assert(batch_size % 2 == 0);
     size_t nLines = 0;
-    vector<pair<T, T> > *batch = nullptr;
+    // Batches are recycled, so the records in them keep their memory
+    BatchPool<RecordBatch<pair<T, T>>> pool;
+    RecordBatch<pair<T, T>> *batch = nullptr;
     // number of batches currently being processed
     uint64_t batches_outstanding = 0;
     
-#pragma omp parallel default(none) shared(batches_outstanding, batch, nLines, get_pair_if_available, single_threaded_until_true, lambda, batch_size)
+#pragma omp parallel default(none) shared(batches_outstanding, batch, pool, nLines, get_pair_if_available, single_threaded_until_true, lambda, batch_size, sizer, record_bytes)
 #pragma omp single
     {
 
         // max # of such batches to be holding in memory
-        uint64_t max_batches_outstanding = batch_size;
+        uint64_t max_batches_outstanding = sizer != nullptr ? sizer->count_limit() : batch_size;
         // max # we will ever increase the batch buffer to
         const uint64_t max_max_batches_outstanding = 1 << 13; // 8192
         
-        // alignments to hold the incoming data
-        T mate1, mate2;
         // did we find the end of the file yet?
         bool more_data = true;
         
         while (more_data) {
-            // init a new batch
-            batch = new std::vector<pair<T, T>>();
-            batch->reserve(batch_size);
+            // get an empty batch
+            batch = pool.take();
+            batch->set_limit(sizer != nullptr ? sizer->count_limit() : batch_size);
+            auto batch_start = chrono::steady_clock::now();
             
-            // load up to the batch-size number of pairs
-            for (int i = 0; i < batch_size; i++) {
+            // load up to the batch-size number of pairs, directly into the batch
+            while (sizer != nullptr ? !sizer->batch_full(batch->size() * 2, batch->bytes(), batch->limit()) : batch->size() < batch_size) {
                 
-                more_data = get_pair_if_available(mate1, mate2);
+                pair<T, T>& mates = batch->next_slot();
+                more_data = get_pair_if_available(mates.first, mates.second);
                 
                 if (more_data) {
-                    batch->emplace_back(std::move(mate1), std::move(mate2));
+                    if (record_bytes) {
+                        batch->add_bytes(record_bytes(mates.first) + record_bytes(mates.second));
+                    }
+                    batch->commit_slot();
                     nLines++;
                 }
                 else {
                     break;
                 }
             }
+            if (sizer != nullptr && more_data) {
+                chrono::duration<double> elapsed = chrono::steady_clock::now() - batch_start;
+                sizer->record_fill(elapsed.count());
+            }
             
             // did we get a batch?
-            if (batch->size()) {
+            if (!batch->empty()) {
                 // how many batch tasks are outstanding currently, including this one?
                 uint64_t current_batches_outstanding;
 #pragma omp atomic capture
@@ -255,10 +378,7 @@ inline size_t paired_for_each_parallel_after_wait(function<bool(T&, T&)> get_pai
                 if (current_batches_outstanding >= max_batches_outstanding || do_single_threaded) {
                     // do this batch in the current thread because we've spawned the maximum number of
                     // concurrent batch tasks or because we are directed to work in a single thread
-                    for (auto& p : *batch) {
-                        lambda(p.first, p.second);
-                    }
-                    delete batch;
+                    process_record_batch(batch, pool, lambda, sizer);
 #pragma omp atomic capture
                     current_batches_outstanding = --batches_outstanding;
                     
@@ -276,16 +396,15 @@ inline size_t paired_for_each_parallel_after_wait(function<bool(T&, T&)> get_pai
                 }
                 else {
                     // spawn a new task to take care of this batch
-#pragma omp task default(none) firstprivate(batch) shared(batches_outstanding, lambda)
+#pragma omp task default(none) firstprivate(batch) shared(batches_outstanding, pool, lambda, sizer)
                     {
-                        for (auto& p : *batch) {
-                            lambda(p.first, p.second);
-                        }
-                        delete batch;
+                        process_record_batch(batch, pool, lambda, sizer);
 #pragma omp atomic update
                         batches_outstanding--;
                     }
                 }
+            } else {
+                pool.give_back(batch);
             }
         }
     }
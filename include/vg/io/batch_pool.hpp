@@ -0,0 +1,188 @@
+#ifndef VG_IO_BATCH_POOL_HPP_INCLUDED
+#define VG_IO_BATCH_POOL_HPP_INCLUDED
+
+/**
+ * \file batch_pool.hpp
+ * Defines recyclable batches of records for the parallel iterators, so that
+ * records and their internal buffers are reused instead of rebuilt.
+ */
+
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Tag type for picking the best way to empty a record: an overload taking a
+/// higher N is preferred over one taking a lower N.
+template<size_t N>
+struct ResetPriority : ResetPriority<N - 1> {};
+template<>
+struct ResetPriority<0> {};
+
+/// Empty a Protobuf message, keeping its memory.
+template<typename T>
+inline auto reset_record(T& record, ResetPriority<2>) -> decltype(record.Clear(), void()) {
+    record.Clear();
+}
+
+/// Empty a string or container, keeping its memory.
+template<typename T>
+inline auto reset_record(T& record, ResetPriority<1>) -> decltype(record.clear(), void()) {
+    record.clear();
+}
+
+/// Reset anything else to a default-constructed value.
+template<typename T>
+inline void reset_record(T& record, ResetPriority<0>) {
+    record = T();
+}
+
+/// Put a record back in its default state so it can be filled again. Where
+/// the type allows, its allocated memory is kept.
+template<typename T>
+inline void reset_record(T& record) {
+    reset_record(record, ResetPriority<2>());
+}
+
+/// Reset both records of a pair.
+template<typename T1, typename T2>
+inline void reset_record(pair<T1, T2>& record) {
+    reset_record(record.first);
+    reset_record(record.second);
+}
+
+/**
+ * A batch of records that is filled in place. Slots past size() hold records
+ * from earlier use, which keep their allocated memory for the next fill, and
+ * are reset before they are handed out again.
+ */
+template<typename T>
+class RecordBatch {
+public:
+    /// Get a slot to fill in the next record, making it if needed. The record
+    /// is empty, as if newly constructed, but may keep memory from a previous
+    /// batch.
+    T& next_slot() {
+        if (filled == records.size()) {
+            records.emplace_back();
+        } else {
+            reset_record(records[filled]);
+        }
+        return records[filled];
+    }
+
+    /// Count the slot from next_slot() as part of the batch.
+    void commit_slot() {
+        filled++;
+    }
+
+    /// Get the number of records in the batch.
+    size_t size() const {
+        return filled;
+    }
+
+    /// Return true if the batch has no records.
+    bool empty() const {
+        return filled == 0;
+    }
+
+    /// Get the record at the given index.
+    T& operator[](size_t i) {
+        return records[i];
+    }
+
+    /// Note that the batch holds the given number more bytes of input.
+    void add_bytes(size_t count) {
+        byte_count += count;
+    }
+
+    /// Get the number of bytes of input the batch was noted to hold.
+    size_t bytes() const {
+        return byte_count;
+    }
+
+    /// Note the count limit the batch is being built under.
+    void set_limit(size_t limit) {
+        count_limit = limit;
+    }
+
+    /// Get the count limit the batch was built under.
+    size_t limit() const {
+        return count_limit;
+    }
+
+    /// Empty the batch, keeping the records around for reuse.
+    void clear() {
+        filled = 0;
+        byte_count = 0;
+        count_limit = 0;
+    }
+
+private:
+    /// All the records we have made, used or not.
+    vector<T> records;
+    /// The number of records at the front that are in the batch.
+    size_t filled = 0;
+    /// The number of bytes of input the records came from.
+    size_t byte_count = 0;
+    /// The count limit the batch was built under, if noted.
+    size_t count_limit = 0;
+};
+
+/**
+ * A free list of batches, shared between the thread that fills them and the
+ * tasks that process them. Batches handed out are owned by the caller until
+ * they are given back. Batches still in the pool are deleted with the pool.
+ */
+template<typename Batch>
+class BatchPool {
+public:
+    BatchPool() = default;
+    ~BatchPool() {
+        for (Batch* batch : free_batches) {
+            delete batch;
+        }
+    }
+
+    // Batches are owned through raw pointers, so don't copy the pool.
+    BatchPool(const BatchPool& other) = delete;
+    BatchPool& operator=(const BatchPool& other) = delete;
+
+    /// Get an empty batch, recycling one if possible.
+    Batch* take() {
+        {
+            lock_guard<mutex> lock(free_mutex);
+            if (!free_batches.empty()) {
+                Batch* batch = free_batches.back();
+                free_batches.pop_back();
+                return batch;
+            }
+        }
+        return new Batch();
+    }
+
+    /// Return a batch that is done with, to be reused.
+    void give_back(Batch* batch) {
+        batch->clear();
+        lock_guard<mutex> lock(free_mutex);
+        free_batches.push_back(batch);
+    }
+
+private:
+    /// Batches ready to be reused
+    vector<Batch*> free_batches;
+    /// Lock protecting the free list
+    mutex free_mutex;
+};
+
+}
+
+}
+
+#endif
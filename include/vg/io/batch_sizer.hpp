@@ -0,0 +1,139 @@
+#ifndef VG_IO_BATCH_SIZER_HPP_INCLUDED
+#define VG_IO_BATCH_SIZER_HPP_INCLUDED
+
+/**
+ * \file batch_sizer.hpp
+ * Defines a controller for choosing how big to make the batches the parallel
+ * iterators hand to worker threads.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Statistics about the batches an AdaptiveBatchSizer has seen, and the sizes
+ * it chose.
+ */
+struct BatchSizerStats {
+    /// Number of batches processed
+    size_t batches = 0;
+    /// Total records in those batches
+    size_t records = 0;
+    /// Total bytes in those batches, as reported by the producer
+    size_t bytes = 0;
+    /// Fewest records in a processed batch
+    size_t smallest_batch = 0;
+    /// Most records in a processed batch
+    size_t largest_batch = 0;
+    /// Lowest record count limit chosen so far
+    size_t smallest_limit = 0;
+    /// Highest record count limit chosen so far
+    size_t largest_limit = 0;
+    /// Record count limit currently in force
+    size_t current_limit = 0;
+    /// Number of times the record count limit was changed
+    size_t adjustments = 0;
+    /// Total time the producer spent filling batches
+    double fill_seconds = 0;
+    /// Total time spent processing batches, summed over threads
+    double process_seconds = 0;
+};
+
+/**
+ * Decides when a batch being filled by a parallel iterator's producer is big
+ * enough to hand off.
+ *
+ * A batch is closed when it reaches a byte budget, or a record count limit,
+ * whichever comes first. The byte budget is fixed, and stops batches of long
+ * reads from growing huge. The count limit is adjusted as batches finish: it
+ * grows while batches are processed too quickly to amortize the cost of
+ * handing them off, and shrinks while batches take so long to process that
+ * work is spread unevenly, as long as the producer is keeping up. Each change
+ * is judged on a batch built under the new limit, so it moves at most one
+ * step, up or down, per batch that completes under it.
+ *
+ * Batches always hold an even number of records, so pairs are never split.
+ *
+ * Can be used from the producer and the worker threads at once, but should
+ * only be used for one iteration at a time.
+ */
+class AdaptiveBatchSizer {
+public:
+
+    /// Default byte budget for a batch
+    static const size_t DEFAULT_TARGET_BYTES;
+    /// Default count limit to start at
+    static const size_t DEFAULT_INITIAL_COUNT;
+    /// Default bounds on the count limit
+    static const size_t DEFAULT_MIN_COUNT;
+    static const size_t DEFAULT_MAX_COUNT;
+    /// Default processing time range per batch that we try to stay in
+    static const double DEFAULT_MIN_BATCH_SECONDS;
+    static const double DEFAULT_MAX_BATCH_SECONDS;
+
+    /// Make a sizer with the given byte budget per batch, and the given
+    /// starting count limit and bounds. Counts are rounded up to even.
+    AdaptiveBatchSizer(size_t target_bytes = DEFAULT_TARGET_BYTES,
+                       size_t initial_count = DEFAULT_INITIAL_COUNT,
+                       size_t min_count = DEFAULT_MIN_COUNT,
+                       size_t max_count = DEFAULT_MAX_COUNT);
+
+    /// Set the processing time range per batch to try and stay in.
+    void set_batch_seconds(double min_seconds, double max_seconds);
+
+    /// Return true if a batch with the given number of records and bytes
+    /// should be handed off now, if it is being built under the given count
+    /// limit. Producers should read count_limit() once when they start a
+    /// batch, and use that for the whole batch.
+    bool batch_full(size_t count, size_t bytes, size_t batch_limit) const;
+
+    /// Get the record count limit currently in force.
+    size_t count_limit() const;
+
+    /// Report that the producer spent the given time filling a batch.
+    void record_fill(double seconds);
+
+    /// Report that a batch with the given records and bytes, built under the
+    /// given count limit, took the given time to process, and adjust the
+    /// count limit. Only batches that were closed by the limit in force now
+    /// can change it, so batches that were already in flight when it changed,
+    /// or that were closed by the byte budget or the end of the input, are
+    /// just counted.
+    void record_process(size_t count, size_t bytes, size_t batch_limit, double seconds);
+
+    /// Get the statistics so far.
+    BatchSizerStats get_stats() const;
+
+private:
+    /// Round a count up to even, and into our bounds.
+    size_t clamp_count(size_t count) const;
+
+    const size_t target_bytes;
+    const size_t min_count;
+    const size_t max_count;
+    double min_batch_seconds;
+    double max_batch_seconds;
+
+    /// The limit the producer reads without locking
+    atomic<size_t> limit;
+
+    /// Fill time of the most recent batch, for comparing against processing
+    double last_fill_seconds = 0;
+
+    /// Protects the stats and the fill time
+    mutable mutex stats_mutex;
+    BatchSizerStats stats;
+};
+
+}
+
+}
+
+#endif
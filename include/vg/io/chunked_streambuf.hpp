@@ -0,0 +1,131 @@
+#ifndef VG_IO_CHUNKED_STREAMBUF_HPP_INCLUDED
+#define VG_IO_CHUNKED_STREAMBUF_HPP_INCLUDED
+
+/**
+ * \file chunked_streambuf.hpp
+ * Defines an output stream buffer that writes into a list of fixed-size
+ * chunks from a shared pool, so its contents can be handed off without
+ * copying.
+ */
+
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <vector>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * A thread-safe free list of fixed-size chunks of memory.
+ *
+ * If topology-aware placement is on (see numa.hpp), chunks are kept apart by
+ * the NUMA node of the thread that first took them, which is where their
+ * memory was first touched, and are only handed out again to threads on that
+ * node.
+ *
+ * Each free list holds at most MAX_FREE_CHUNKS chunks. Chunks given back past
+ * that are freed, so a burst of buffered output doesn't pin its peak memory
+ * for the life of the pool.
+ */
+class ChunkPool {
+public:
+    /// Size of every chunk, in bytes
+    static const size_t CHUNK_BYTES;
+    /// Most chunks to keep in each free list
+    static const size_t MAX_FREE_CHUNKS;
+
+    ChunkPool();
+    ~ChunkPool();
+
+    ChunkPool(const ChunkPool& other) = delete;
+    ChunkPool& operator=(const ChunkPool& other) = delete;
+
+    /// Get a chunk, recycling one if possible.
+    char* take();
+
+    /// Return chunks to the pool, and empty the vector.
+    void give_back(vector<char*>& chunks);
+
+private:
+    /// Bytes before each chunk's data, holding the node it belongs to. A
+    /// cache line, so the data stays aligned.
+    static const size_t CHUNK_HEADER_BYTES;
+
+    /// Get the free list for chunks on the calling thread's node.
+    size_t local_list() const;
+
+    /// Chunks ready to be reused, for each NUMA node. There is just one list
+    /// if topology-aware placement is off.
+    vector<vector<char*>> free_chunks;
+    /// Lock protecting the free lists
+    mutex free_mutex;
+};
+
+/**
+ * Data handed off from a ChunkedStreamBuf. All chunks are full except
+ * possibly the last.
+ */
+struct ChunkedData {
+    /// The chunks holding the data, in order
+    vector<char*> chunks;
+    /// The number of bytes of data across all the chunks
+    size_t bytes = 0;
+
+    /// Write all the data to the given stream.
+    void write_to(ostream& out) const;
+};
+
+/**
+ * Output-only stream buffer that stores what is written in chunks from a
+ * ChunkPool. The put position can be moved backward to discard data, and the
+ * data written so far can be moved out without copying.
+ */
+class ChunkedStreamBuf : public streambuf {
+public:
+    /// Make a buffer that gets its chunks from the given pool, which must
+    /// outlive it.
+    ChunkedStreamBuf(ChunkPool& pool);
+    /// Give all our chunks back to the pool.
+    virtual ~ChunkedStreamBuf();
+
+    ChunkedStreamBuf(const ChunkedStreamBuf& other) = delete;
+    ChunkedStreamBuf& operator=(const ChunkedStreamBuf& other) = delete;
+
+    /// Get the number of bytes before the put position.
+    size_t size() const;
+
+    /// Move the data before the put position out into the given ChunkedData,
+    /// which must be empty, and start over empty.
+    void take_data(ChunkedData& destination);
+
+protected:
+    virtual int_type overflow(int_type ch) override;
+    virtual streamsize xsputn(const char_type* s, streamsize count) override;
+    virtual pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which) override;
+    virtual pos_type seekpos(pos_type pos, ios_base::openmode which) override;
+
+private:
+    /// Where our chunks come from
+    ChunkPool& pool;
+    /// All the chunks we hold. The ones after the current chunk hold only
+    /// discarded data.
+    vector<char*> chunks;
+    /// Index of the chunk the put area is in. Only meaningful if we have any
+    /// chunks.
+    size_t current_chunk;
+
+    /// Point the put area at the given chunk, getting it from the pool if
+    /// needed, and at the given offset in it.
+    void enter_chunk(size_t chunk, size_t offset);
+};
+
+}
+
+}
+
+#endif
@@ -37,6 +37,10 @@
 #include <cstdio>
 // for memmove():
 #include <cstring>
+// for INT_MAX:
+#include <climits>
+// for std::min():
+#include <algorithm>
 
 
 // low-level read and write functions
@@ -69,6 +73,10 @@ class fdoutbuf : public std::streambuf {
     // constructor
     fdoutbuf (int _fd) : fd(_fd) {
     }
+    // get the file descriptor written to
+    int get_fd () const {
+        return fd;
+    }
   protected:
     // write one character
     virtual int_type overflow (int_type c) {
@@ -0,0 +1,260 @@
+#ifndef VG_IO_GAF_BINARY_HPP_INCLUDED
+#define VG_IO_GAF_BINARY_HPP_INCLUDED
+
+/**
+ * \file gaf_binary.hpp
+ * Defines GAFB, a compact binary form of GAF. Records are grouped into
+ * blocks, stored a column at a time, and each block is compressed on its own,
+ * so blocks can be decoded in parallel and found again through an index.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "alignment_io.hpp"
+#include "node_cache.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/*
+ * A GAFB file is a 4-byte header, then blocks, then an empty block that
+ * marks the end. Each block has a fixed-size little-endian header giving its
+ * compressed and uncompressed sizes, record count, and the range of node IDs
+ * its records visit, then its columns, deflated together.
+ *
+ * Within a block, each part of the records is in its own column: names,
+ * zigzag varint numbers, strands, step counts and flags, node IDs as varint
+ * differences from the step before, stable path names and intervals, and
+ * optional fields as indexes into a per-block dictionary of tags and types.
+ * cs difference strings are stored as operation codes, run lengths, and bases
+ * packed 2 bits each, with each operation remembering whether its bases were
+ * upper- or lower-case. A cs string that mixes cases inside one operation, or
+ * otherwise doesn't fit these forms, is kept as text, so every GAF record
+ * comes back exactly as it went in.
+ */
+
+/**
+ * Collects GAF records into GAFB blocks.
+ *
+ * Not thread safe: keep one per thread.
+ */
+class GafBinaryEncoder {
+public:
+    /// Default number of records to put in a block
+    static const size_t DEFAULT_BLOCK_RECORDS;
+    /// Default number of uncompressed column bytes after which a block is full
+    static const size_t DEFAULT_BLOCK_BYTES;
+
+    /// Make an encoder for blocks of the given size.
+    GafBinaryEncoder(size_t block_records = DEFAULT_BLOCK_RECORDS, size_t block_bytes = DEFAULT_BLOCK_BYTES);
+
+    /// Add a record to the current block.
+    void add(const gafkluge::GafRecord& record);
+
+    /// Get the number of records in the current block.
+    size_t size() const;
+
+    /// Return true if the current block should be finished before adding more.
+    bool full() const;
+
+    /// Compress the current block onto the end of the given buffer, and start
+    /// a new, empty block. Does nothing if the block is empty.
+    void finish_block(string& out);
+
+private:
+    /// Add a cs difference string to the packed columns, or return false and
+    /// add nothing if it can't be packed.
+    bool add_packed_cs(const char* cs, size_t length);
+
+    /// Add 2 bits for a base to the packed bases.
+    void add_base(char base);
+
+    size_t block_records;
+    size_t block_bytes;
+
+    /// Number of records in the current block
+    size_t record_count = 0;
+    /// Previous node ID in the current block, for differencing
+    int64_t previous_node = 0;
+    /// Range of node IDs visited in the current block
+    int64_t min_node;
+    int64_t max_node;
+    /// Tag keys and types in the current block, in order of first use
+    vector<pair<uint16_t, string>> dictionary;
+    /// Packed bases not yet filling a byte, and how many there are
+    uint8_t base_byte = 0;
+    size_t base_count = 0;
+
+    /// The columns of the current block
+    vector<string> columns;
+    /// Space to build the uncompressed block in
+    string payload;
+};
+
+/**
+ * Reads GAF records back out of GAFB blocks.
+ *
+ * Not thread safe: keep one per thread.
+ */
+class GafBinaryDecoder {
+public:
+    /// Start reading the records in the given block, as read by
+    /// read_gaf_binary_block(). Throws if the block is corrupt.
+    void load_block(const string& block);
+
+    /// Get the number of records in the loaded block.
+    size_t size() const;
+
+    /// Read the next record in the block into the given record, reusing its
+    /// memory. Returns false if there are no more records. Throws if the block
+    /// is corrupt.
+    bool next(gafkluge::GafRecord& record);
+
+private:
+    /// Part of a column still to be read
+    struct Cursor {
+        const char* pos = nullptr;
+        const char* end = nullptr;
+        uint64_t varint();
+        int64_t zigzag();
+        uint8_t byte();
+        const char* bytes(size_t count);
+    };
+
+    /// Read the next packed base, in lower case if asked.
+    char next_base(bool lower);
+
+    size_t record_count = 0;
+    size_t records_read = 0;
+    int64_t previous_node = 0;
+    vector<pair<uint16_t, string>> dictionary;
+    /// Packed bases, and how many of them have been read
+    Cursor bases;
+    size_t bases_read = 0;
+
+    /// Decompressed columns
+    string payload;
+    /// Where each column is up to
+    vector<Cursor> columns;
+    /// Space to rebuild field values in
+    string scratch;
+};
+
+/// Write the GAFB file header.
+void write_gaf_binary_header(ostream& out);
+
+/// Write the empty block that ends a GAFB file.
+void write_gaf_binary_end(ostream& out);
+
+/// Read the GAFB file header, or throw if the stream does not hold GAFB.
+void read_gaf_binary_header(istream& in);
+
+/// Read the next block, header and all, into the given string, reusing its
+/// memory. Returns false at the end of the file. Throws if the file is
+/// truncated.
+bool read_gaf_binary_block(istream& in, string& block);
+
+/**
+ * Index of the blocks of a GAFB file, with the range of node IDs visited by
+ * each block's records. Works on files in any order, but skips the most
+ * blocks when they are sorted by node ID.
+ */
+class GafBinaryIndex {
+public:
+    /// Extension added to the GAFB file name to get the index file name
+    static const string FILE_EXTENSION;
+
+    /// One block of the file
+    struct Block {
+        /// Offset of the block in the file
+        uint64_t offset;
+        /// Number of records in the block
+        uint64_t record_count;
+        /// Lowest node ID visited by any record in the block
+        nid_t min_node;
+        /// Highest node ID visited by any record in the block
+        nid_t max_node;
+    };
+
+    /// Index the given GAFB file, replacing anything already indexed. Only
+    /// the block headers are read.
+    void index(const string& filename);
+
+    /// Save the index to the given stream.
+    void save(ostream& out) const;
+    /// Load an index saved by save(), replacing anything already indexed.
+    /// Throws if the data is not an index.
+    void load(istream& in);
+
+    /// Get the offsets, in file order, of the blocks that may have records
+    /// visiting a node in the given inclusive range.
+    vector<uint64_t> find(nid_t min_node, nid_t max_node) const;
+
+    /// Get the blocks, in file order.
+    const vector<Block>& get_blocks() const;
+
+private:
+    vector<Block> blocks;
+};
+
+/// Index the given GAFB file, and save the index next to it, with
+/// GafBinaryIndex::FILE_EXTENSION added.
+void index_gaf_binary(const string& filename);
+
+/// Run the lambda on each alignment in the given GAFB file (or "-"), in file
+/// order, and return the number of alignments.
+size_t gaf_binary_unpaired_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                    const string& filename, function<void(Alignment&)> lambda);
+size_t gaf_binary_unpaired_for_each(const HandleGraph& graph, const string& filename,
+                                    function<void(Alignment&)> lambda);
+
+/// Run the lambda on each alignment in the given GAFB file (or "-"), in
+/// parallel, and return the number of alignments. Whole blocks are handed out
+/// to be decompressed and decoded by the worker threads.
+size_t gaf_binary_unpaired_for_each_parallel(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                             const string& filename, function<void(Alignment&)> lambda);
+size_t gaf_binary_unpaired_for_each_parallel(const HandleGraph& graph, const string& filename,
+                                             function<void(Alignment&)> lambda);
+
+/// Run the lambda on each pair of alignments in the given GAFB file (or "-"),
+/// which holds mates one after the other, in file order, and return the
+/// number of alignments. Pairs may span blocks. An odd alignment at the end is
+/// skipped.
+size_t gaf_binary_paired_interleaved_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                              const string& filename, function<void(Alignment&, Alignment&)> lambda);
+size_t gaf_binary_paired_interleaved_for_each(const HandleGraph& graph, const string& filename,
+                                              function<void(Alignment&, Alignment&)> lambda);
+
+/// Run the lambda on each pair of alignments in the given GAFB file (or "-"),
+/// which holds mates one after the other, in parallel, and return the number
+/// of alignments. Blocks are handed out whole, along with any following
+/// blocks needed to finish a pair that spans them.
+size_t gaf_binary_paired_interleaved_for_each_parallel(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                                       const string& filename, function<void(Alignment&, Alignment&)> lambda);
+size_t gaf_binary_paired_interleaved_for_each_parallel(const HandleGraph& graph, const string& filename,
+                                                       function<void(Alignment&, Alignment&)> lambda);
+
+/// Run the lambda on each alignment in the given GAFB file that visits a node
+/// in the given inclusive range, in file order, and return the number of
+/// alignments found. Only the blocks that might hold them are read.
+size_t gaf_binary_for_each_in_node_range(const HandleGraph& graph, const string& filename, const GafBinaryIndex& index,
+                                         nid_t min_node, nid_t max_node,
+                                         function<void(Alignment&)> lambda);
+/// Run the lambda on each alignment in the given GAFB file that visits a node
+/// in the given inclusive range, loading the index saved next to the file.
+size_t gaf_binary_for_each_in_node_range(const HandleGraph& graph, const string& filename,
+                                         nid_t min_node, nid_t max_node,
+                                         function<void(Alignment&)> lambda);
+
+}
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef VG_IO_GAF_FORMATTER_HPP_INCLUDED
+#define VG_IO_GAF_FORMATTER_HPP_INCLUDED
+
+/**
+ * \file gaf_formatter.hpp
+ * Defines a formatter for writing Alignments as GAF text into a buffer.
+ */
+
+#include <functional>
+#include <streambuf>
+#include <string>
+
+#include "alignment_io.hpp"
+#include "node_cache.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Writes Alignments as GAF lines into a caller-owned buffer. The record,
+ * field text, and node lookups are all kept between alignments, so once a
+ * formatter has seen the biggest alignment it stops allocating.
+ *
+ * Not thread safe: keep one per thread.
+ */
+class GafFormatter {
+public:
+    /// Make a formatter for alignments to the given graph, which must outlive
+    /// it. If translate_through is set, output will be in segment name space.
+    GafFormatter(const HandleGraph& graph,
+                 const handlegraph::NamedNodeBackTranslation* translate_through = nullptr,
+                 bool cs_cigar = true,
+                 bool base_quals = true,
+                 bool frag_links = true);
+
+    /// Make a formatter that looks up nodes with the given functions.
+    GafFormatter(function<size_t(nid_t)> node_to_length,
+                 function<string(nid_t, bool)> node_to_sequence,
+                 const handlegraph::NamedNodeBackTranslation* translate_through = nullptr,
+                 bool cs_cigar = true,
+                 bool base_quals = true,
+                 bool frag_links = true);
+
+    /// Append the GAF line for the given alignment, with its newline, to the
+    /// end of the buffer.
+    void append(const Alignment& aln, string& buffer);
+
+    /// Write the GAF line for the given alignment, with its newline, straight
+    /// into the put area of the given stream buffer, such as one of a
+    /// StreamMultiplexer's thread streams.
+    void append(const Alignment& aln, streambuf& out);
+
+private:
+    NodeCache node_cache;
+    const handlegraph::NamedNodeBackTranslation* translate_through;
+    bool cs_cigar;
+    bool base_quals;
+    bool frag_links;
+
+    /// Record to convert each alignment into
+    gafkluge::GafRecord record;
+    /// Space to build field values in
+    string scratch;
+};
+
+}
+
+}
+
+#endif
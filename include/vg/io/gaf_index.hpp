@@ -0,0 +1,112 @@
+#ifndef VG_IO_GAF_INDEX_HPP_INCLUDED
+#define VG_IO_GAF_INDEX_HPP_INCLUDED
+
+/**
+ * \file gaf_index.hpp
+ * Defines an index of node-sorted, bgzipped GAF files by node ID, for pulling
+ * out the reads that touch part of the graph without reading the whole file.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "alignment_io.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Index of a bgzipped GAF file, sorted by the lowest node ID each record
+ * visits, that records the range of node IDs visited by the records starting
+ * in each BGZF block.
+ *
+ * Records whose paths are missing, use stable path names, or name segments
+ * instead of numbering nodes are not indexed, and may be anywhere in the
+ * file.
+ */
+class GafNodeIndex {
+public:
+    /// Extension added to the GAF file name to get the index file name
+    static const string FILE_EXTENSION;
+
+    /// The records starting in one BGZF block
+    struct Block {
+        /// Virtual offset of the first indexed record in the block
+        uint64_t virtual_offset;
+        /// Lowest node ID visited by any record in the block
+        nid_t min_node;
+        /// Highest node ID visited by any record in the block
+        nid_t max_node;
+    };
+
+    /// Make an empty index.
+    GafNodeIndex() = default;
+
+    /// Index the given bgzipped GAF file, replacing anything already indexed.
+    /// Throws if the file is not bgzipped or not sorted.
+    void index(const string& gaf_filename);
+
+    /// Save the index to the given stream.
+    void save(ostream& out) const;
+    /// Load an index saved by save(), replacing anything already indexed.
+    /// Throws if the data is not an index.
+    void load(istream& in);
+
+    /// Get the ranges of virtual offsets, in file order, that hold all the
+    /// indexed records visiting any node in the given inclusive range. A range
+    /// ending at UINT64_MAX runs to the end of the file. The ranges may hold
+    /// other records too.
+    vector<pair<uint64_t, uint64_t>> find(nid_t min_node, nid_t max_node) const;
+
+    /// Get the indexed blocks, in file order.
+    const vector<Block>& get_blocks() const;
+
+private:
+    /// The blocks with at least one indexed record. Both their offsets and
+    /// their min nodes are in order.
+    vector<Block> blocks;
+};
+
+/// Return true if a GAF step name is a node ID: all digits, and short enough
+/// to always fit in a nid_t. Segment names and the like are not.
+bool is_node_id(const string& name);
+
+/// Get the lowest and highest node IDs visited by a GAF record, if it visits
+/// nodes by ID. Returns false if it does not, or if any step is not a node ID.
+bool gaf_node_range(const gafkluge::GafRecord& record, nid_t& min_node, nid_t& max_node);
+
+/// Index the given bgzipped, node-sorted GAF file, and save the index next to
+/// it, with GafNodeIndex::FILE_EXTENSION added.
+void index_gaf(const string& gaf_filename);
+
+/// Run the lambda on each alignment in the given indexed GAF file that visits
+/// a node in the given inclusive range, in file order, and return the number
+/// of alignments found. Only the BGZF blocks that might hold them are read.
+size_t gaf_for_each_in_node_range(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                  const string& filename, const GafNodeIndex& index,
+                                  nid_t min_node, nid_t max_node,
+                                  function<void(Alignment&)> lambda);
+/// Run the lambda on each alignment in the given indexed GAF file that visits
+/// a node in the given inclusive range, loading the index saved next to the
+/// file.
+size_t gaf_for_each_in_node_range(const HandleGraph& graph, const string& filename,
+                                  nid_t min_node, nid_t max_node,
+                                  function<void(Alignment&)> lambda);
+/// Run the lambda on each alignment in the given indexed GAF file that visits
+/// a node in the given inclusive range, using an index already loaded.
+size_t gaf_for_each_in_node_range(const HandleGraph& graph, const string& filename, const GafNodeIndex& index,
+                                  nid_t min_node, nid_t max_node,
+                                  function<void(Alignment&)> lambda);
+
+}
+
+}
+
+#endif
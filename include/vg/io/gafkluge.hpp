@@ -7,7 +7,11 @@
  * Named in honour of gfakluge
  */
 
+#include <algorithm>
+#include <cassert>
 #include <string>
+#include <cstring>
+#include <stdexcept>
 #include <iostream>
 #include <sstream>
 #include <cstdint>
@@ -50,6 +54,244 @@ struct GafStep {
     int64_t end;               // 0-based end (inclusive). only defined if is_stable and is_interval are true
 };
 
+/**
+ * Part of a string held elsewhere.
+ */
+struct GafFieldView {
+    const char* data = nullptr;
+    size_t length = 0;
+
+    std::string str() const {
+        return std::string(data, length);
+    }
+    bool operator==(const char* other) const {
+        return strlen(other) == length && memcmp(data, other, length) == 0;
+    }
+    bool operator!=(const char* other) const {
+        return !(*this == other);
+    }
+};
+
+/**
+ * The optional fields of a GAF record, kept sorted by their two-character
+ * tags. Works like the std::map from tag to type and value that GafRecord used
+ * to have, but the fields live in a vector, and keep their strings when
+ * cleared, so a record reused for many lines stops allocating for its fields
+ * once it has seen the longest.
+ *
+ * Unlike with a map, adding or removing a field invalidates iterators and
+ * references to other fields, and the tags of fields must not be changed in
+ * place.
+ */
+class GafOptFields {
+public:
+    typedef std::string key_type;
+    typedef std::pair<std::string, std::string> mapped_type;
+    typedef std::pair<std::string, mapped_type> value_type;
+    typedef std::vector<value_type>::iterator iterator;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+
+    /// Index returned when a field is not found
+    static const size_t npos = (size_t) -1;
+
+    /// Pack a two-character tag into a key. Keys sort in the same order as
+    /// their tags.
+    static uint16_t pack_tag(char first, char second) {
+        return (uint16_t) (((unsigned char) first << 8) | (unsigned char) second);
+    }
+    /// Pack a two-character tag into a key, or throw if it is not two characters.
+    static uint16_t pack_tag(const std::string& tag) {
+        if (tag.size() != 2) {
+            throw std::runtime_error("GAF optional field tags must be two characters: " + tag);
+        }
+        return pack_tag(tag[0], tag[1]);
+    }
+
+    /// Get the number of fields.
+    size_t size() const {
+        return field_count;
+    }
+    /// Return true if there are no fields.
+    bool empty() const {
+        return field_count == 0;
+    }
+    /// Remove all the fields, keeping our memory.
+    void clear() {
+        field_count = 0;
+    }
+
+    iterator begin() {
+        return fields.begin();
+    }
+    iterator end() {
+        return fields.begin() + field_count;
+    }
+    const_iterator begin() const {
+        return fields.begin();
+    }
+    const_iterator end() const {
+        return fields.begin() + field_count;
+    }
+
+    /// Get the index of the field with the given key, or npos.
+    size_t index_of(uint16_t key) const {
+        size_t i = lower_bound(key);
+        return i < field_count && this->key(i) == key ? i : npos;
+    }
+    /// Get the field with the given tag, or end().
+    iterator find(const std::string& tag) {
+        size_t i = tag.size() == 2 ? index_of(pack_tag(tag)) : npos;
+        return i == npos ? end() : begin() + i;
+    }
+    /// Get the field with the given tag, or end().
+    const_iterator find(const std::string& tag) const {
+        size_t i = tag.size() == 2 ? index_of(pack_tag(tag)) : npos;
+        return i == npos ? end() : begin() + i;
+    }
+    /// Count the fields with the given tag.
+    size_t count(const std::string& tag) const {
+        return find(tag) == end() ? 0 : 1;
+    }
+
+    /// Get the type and value of the field with the given tag, adding an
+    /// empty one if it is not there.
+    mapped_type& operator[](const std::string& tag) {
+        uint16_t key = pack_tag(tag);
+        size_t i = lower_bound(key);
+        if (i == field_count || this->key(i) != key) {
+            make_field(i, key);
+            fields[i].second.first.clear();
+            fields[i].second.second.clear();
+        }
+        return fields[i].second;
+    }
+    /// Get the type and value of the field with the given tag, or throw
+    /// std::out_of_range if it is not there.
+    mapped_type& at(const std::string& tag) {
+        auto found = find(tag);
+        if (found == end()) {
+            throw std::out_of_range("No GAF optional field " + tag);
+        }
+        return found->second;
+    }
+    /// Get the type and value of the field with the given tag, or throw
+    /// std::out_of_range if it is not there.
+    const mapped_type& at(const std::string& tag) const {
+        auto found = find(tag);
+        if (found == end()) {
+            throw std::out_of_range("No GAF optional field " + tag);
+        }
+        return found->second;
+    }
+
+    /// Add a field if its tag is not there already. Returns the field with
+    /// that tag, and whether it was added.
+    std::pair<iterator, bool> insert(const value_type& field) {
+        uint16_t key = pack_tag(field.first);
+        size_t i = lower_bound(key);
+        if (i < field_count && this->key(i) == key) {
+            return std::make_pair(begin() + i, false);
+        }
+        make_field(i, key);
+        fields[i].second = field.second;
+        return std::make_pair(begin() + i, true);
+    }
+    /// Remove the field at the given position, and return the position
+    /// after it.
+    iterator erase(const_iterator position) {
+        size_t i = position - fields.cbegin();
+        // Keep the removed field's strings around for reuse.
+        std::rotate(fields.begin() + i, fields.begin() + i + 1, fields.begin() + field_count);
+        field_count--;
+        return begin() + i;
+    }
+    /// Remove the field with the given tag, if present, and return the
+    /// number removed.
+    size_t erase(const std::string& tag) {
+        auto found = find(tag);
+        if (found == end()) {
+            return 0;
+        }
+        erase(found);
+        return 1;
+    }
+
+    /// Get the key of the field at the given index.
+    uint16_t key(size_t i) const {
+        return pack_tag(fields[i].first[0], fields[i].first[1]);
+    }
+    /// Get the tag of the field at the given index.
+    const std::string& tag(size_t i) const {
+        return fields[i].first;
+    }
+    /// Get the type of the field at the given index. It is invalidated when
+    /// fields are changed.
+    GafFieldView type(size_t i) const {
+        return {fields[i].second.first.data(), fields[i].second.first.size()};
+    }
+    /// Get the value of the field at the given index. It is invalidated when
+    /// fields are changed.
+    GafFieldView value(size_t i) const {
+        return {fields[i].second.second.data(), fields[i].second.second.size()};
+    }
+
+    /// Set the type and value of the field with the given key, adding it if
+    /// it is not there.
+    void set(uint16_t key, const char* type, size_t type_length, const char* value, size_t value_length) {
+        size_t i = lower_bound(key);
+        if (i == field_count || this->key(i) != key) {
+            make_field(i, key);
+        }
+        // Assigning in place reuses the strings' memory.
+        fields[i].second.first.assign(type, type_length);
+        fields[i].second.second.assign(value, value_length);
+    }
+    /// Set the type and value of the field with the given tag, adding it if
+    /// it is not there.
+    void set(const std::string& tag, const std::string& type, const std::string& value) {
+        set(pack_tag(tag), type.data(), type.size(), value.data(), value.size());
+    }
+
+    /// Get the fields as a std::map from tag to type and value.
+    std::map<std::string, mapped_type> to_map() const {
+        return std::map<std::string, mapped_type>(begin(), end());
+    }
+    /// Replace the fields with the ones in a map from tag to type and value.
+    void assign(const std::map<std::string, mapped_type>& other) {
+        clear();
+        for (const auto& kv : other) {
+            set(kv.first, kv.second.first, kv.second.second);
+        }
+    }
+
+private:
+    /// Get the index of the first field with a key not less than the given one.
+    size_t lower_bound(uint16_t key) const {
+        size_t i = 0;
+        while (i < field_count && this->key(i) < key) {
+            i++;
+        }
+        return i;
+    }
+
+    /// Add a field at the given index with the given key, and whatever type
+    /// and value a spare field had.
+    void make_field(size_t i, uint16_t key) {
+        if (field_count == fields.size()) {
+            fields.emplace_back();
+        }
+        // Move the spare field just past the end into place.
+        std::rotate(fields.begin() + i, fields.begin() + field_count, fields.begin() + field_count + 1);
+        field_count++;
+        fields[i].first.assign({(char) (key >> 8), (char) (key & 0xFF)});
+    }
+
+    /// The fields in key order, and then spare ones to reuse
+    std::vector<value_type> fields;
+    /// The number of fields in use
+    size_t field_count = 0;
+};
+
 /**
  * One line of GAF as described here: https://github.com/lh3/gfatools/blob/master/doc/rGFA.md
  */
@@ -68,9 +310,9 @@ struct GafRecord {
     char strand;                 // strand relative to the path + or -
     std::vector<GafStep> path;   // the path
 
-    // Map a tag name to its type and value
-    // ex: "de:f:0.2183" in the GAF would appear as opt_fields["de"] = ("f", "0.2183")
-    std::map<std::string, std::pair<std::string, std::string>>  opt_fields;
+    // Optional fields, each a tag, type and value
+    // ex: "de:f:0.2183" in the GAF would appear as tag "de", type "f" and value "0.2183"
+    GafOptFields opt_fields;
 
     // Init everything to missing
     GafRecord() : query_length(missing_int), query_start(missing_int), query_end(missing_int),
@@ -79,128 +321,206 @@ struct GafRecord {
 };
 
 /**
- * Parse a single GAF record
+ * Find the next occurrence of c in [start, end), or end if there is none.
+ */
+inline const char* find_char(const char* start, const char* end, char c) {
+    const char* found = (const char*) memchr(start, c, end - start);
+    return found == nullptr ? end : found;
+}
+
+/**
+ * Parse the integer in [start, end), allowing a sign, and ignoring anything
+ * after the digits, like std::stol. Throws if there are no digits, or if the
+ * value doesn't fit in 64 bits.
+ */
+inline int64_t parse_int(const char* start, const char* end) {
+    const char* cursor = start;
+    bool negative = false;
+    if (cursor != end && (*cursor == '-' || *cursor == '+')) {
+        negative = *cursor == '-';
+        ++cursor;
+    }
+    if (cursor == end || *cursor < '0' || *cursor > '9') {
+        throw std::runtime_error("Error parsing GAF integer " + std::string(start, end));
+    }
+    // Work in unsigned so the most negative value can be reached
+    uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+    uint64_t value = 0;
+    for (; cursor != end && *cursor >= '0' && *cursor <= '9'; ++cursor) {
+        uint64_t digit = *cursor - '0';
+        if (value > (limit - digit) / 10) {
+            throw std::runtime_error("Error parsing GAF integer " + std::string(start, end));
+        }
+        value = value * 10 + digit;
+    }
+    return negative ? (int64_t) (0 - value) : (int64_t) value;
+}
+
+/**
+ * Parse the integer in [start, end), or "*" for missing.
+ */
+inline int64_t parse_int_or_missing(const char* start, const char* end) {
+    if (end - start == 1 && *start == missing_string[0]) {
+        return missing_int;
+    }
+    return parse_int(start, end);
+}
+
+/**
+ * Parse a single GAF record from the given length of text, without the
+ * trailing newline.
+ *
+ * The record's strings and vectors are reused, so parsing many lines into the
+ * same record only allocates when a line needs more space than any before it.
  */ 
-inline void parse_gaf_record(const std::string& gaf_line, GafRecord& gaf_record) {
+inline void parse_gaf_record(const char* gaf_line, size_t length, GafRecord& gaf_record) {
 
-    std::istringstream in(gaf_line);
-    std::string buffer;
+    const char* line_end = gaf_line + length;
+    // The current column runs from column_start to column_end.
+    const char* column_start = gaf_line;
+    const char* column_end = gaf_line;
     
-    int col = 1;
+    int col = 0;
     
-    std::function<void(void)> scan_column = [&]() {
-        getline(in, buffer, '\t');
-        if (!in || buffer.empty()) {
-            throw std::runtime_error("Error parsing GAF column " + std::to_string(col));
+    auto scan_column = [&]() {
+        if (col != 0) {
+            if (column_end == line_end) {
+                // There is no next column
+                throw std::runtime_error("Error parsing GAF column " + std::to_string(col + 1));
+            }
+            column_start = column_end + 1;
         }
+        column_end = find_char(column_start, line_end, '\t');
         ++col;
+        if (column_start == column_end) {
+            throw std::runtime_error("Error parsing GAF column " + std::to_string(col));
+        }
     };
     
     scan_column();
-    gaf_record.query_name = std::move(buffer);
+    gaf_record.query_name.assign(column_start, column_end);
 
     scan_column();
-    gaf_record.query_length = string_to_int(buffer);
+    gaf_record.query_length = parse_int_or_missing(column_start, column_end);
 
     scan_column();
-    gaf_record.query_start = string_to_int(buffer);
+    gaf_record.query_start = parse_int_or_missing(column_start, column_end);
 
     scan_column();
-    gaf_record.query_end = string_to_int(buffer);
+    gaf_record.query_end = parse_int_or_missing(column_start, column_end);
 
     scan_column();
-    if (buffer == "-" || buffer == missing_string || buffer == "+") {
-        gaf_record.strand = buffer[0];
+    if (column_end - column_start == 1 && (*column_start == '-' || *column_start == missing_string[0] || *column_start == '+')) {
+        gaf_record.strand = *column_start;
     } else {
-        throw std::runtime_error("Error parsing GAF strand: " + buffer);
+        throw std::runtime_error("Error parsing GAF strand: " + std::string(column_start, column_end));
     }
 
-    gaf_record.path.clear();
     scan_column();
-    if (buffer[0] == '<' || buffer[0] == '>') {
+    size_t step_count = 0;
+    if (*column_start == '<' || *column_start == '>') {
         // our path is a list of oriented segments or intervales
-        size_t pos = 0;
-        size_t next;
-        do {
-            GafStep step;
-            pos = buffer.find_first_of("><", pos);
-            next = buffer.find_first_of("><", pos + 1);
-            std::string step_token = buffer.substr(pos, next != std::string::npos ? next - pos : std::string::npos);
-            size_t colon = step_token.find_first_of(':');
-            step.is_reverse = step_token[0] == '<';
-            if (colon == std::string::npos) {
+        const char* step_start = column_start;
+        while (step_start != column_end) {
+            // Steps run up to the next orientation character
+            const char* step_end = step_start + 1;
+            while (step_end != column_end && *step_end != '<' && *step_end != '>') {
+                ++step_end;
+            }
+            if (step_count == gaf_record.path.size()) {
+                gaf_record.path.emplace_back();
+            }
+            // Reuse the step, and its name's memory, from earlier records.
+            GafStep& step = gaf_record.path[step_count];
+            ++step_count;
+            step.is_reverse = *step_start == '<';
+            const char* colon = find_char(step_start, step_end, ':');
+            if (colon == step_end) {
                 // no colon, we interpret the step as a segID
-                step.name = step_token.substr(1);
+                step.name.assign(step_start + 1, step_end);
                 step.is_stable = false;
                 step.is_interval = false;
             } else {
                 // colon, we interpret the step as a stable path interval
-                step.name = step_token.substr(1, colon - 1);
+                step.name.assign(step_start + 1, colon);
                 step.is_stable = true;
                 step.is_interval = true;
-                size_t dash = step_token.find_first_of('-', colon);
-                if (dash == std::string::npos) {
-                    throw std::runtime_error("Error parsing GAF range of " + step_token);
+                const char* dash = find_char(colon, step_end, '-');
+                if (dash == step_end) {
+                    throw std::runtime_error("Error parsing GAF range of " + std::string(step_start, step_end));
                 }
-                step.start = std::stol(step_token.substr(colon + 1, dash - colon));
-                step.end = std::stol(step_token.substr(dash + 1));
+                step.start = parse_int(colon + 1, dash);
+                step.end = parse_int(dash + 1, step_end);
             }
-            gaf_record.path.push_back(step);
-            pos = next;
-        } while (next != std::string::npos);
-    } else if (buffer != "*") {
+            step_start = step_end;
+        }
+    } else if (!(column_end - column_start == 1 && *column_start == missing_string[0])) {
         // our path is a stable path name
-        gaf_record.path.resize(1);
-        gaf_record.path[0].name = buffer;
-        gaf_record.path[0].is_reverse = false;
-        gaf_record.path[0].is_stable = true;
-        gaf_record.path[0].is_interval = false;
+        if (gaf_record.path.empty()) {
+            gaf_record.path.emplace_back();
+        }
+        GafStep& step = gaf_record.path[0];
+        step_count = 1;
+        step.name.assign(column_start, column_end);
+        step.is_reverse = false;
+        step.is_stable = true;
+        step.is_interval = false;
     }
+    gaf_record.path.resize(step_count);
 
     scan_column();
-    gaf_record.path_length = string_to_int(buffer);
+    gaf_record.path_length = parse_int_or_missing(column_start, column_end);
     
     scan_column();
-    gaf_record.path_start = string_to_int(buffer);
+    gaf_record.path_start = parse_int_or_missing(column_start, column_end);
     
     scan_column();
-    gaf_record.path_end = string_to_int(buffer);
+    gaf_record.path_end = parse_int_or_missing(column_start, column_end);
 
     scan_column();
-    gaf_record.matches = string_to_int(buffer);
+    gaf_record.matches = parse_int_or_missing(column_start, column_end);
     
     scan_column();
-    gaf_record.block_length = string_to_int(buffer);
+    gaf_record.block_length = parse_int_or_missing(column_start, column_end);
 
     scan_column();
-    if (buffer == missing_string) {
+    if (column_end - column_start == 1 && *column_start == missing_string[0]) {
         gaf_record.mapq = missing_int;
     } else {
-        gaf_record.mapq = std::stoi(buffer);
-        if (gaf_record.mapq >= 255) {
-            gaf_record.mapq = missing_int;
-        }
+        // Check the range before narrowing, so huge values don't wrap into it.
+        int64_t mapq = parse_int(column_start, column_end);
+        gaf_record.mapq = (mapq < 0 || mapq >= 255) ? missing_int : (int32_t) mapq;
     }
 
+    // Everything else is optional fields, which we check and split at their
+    // first two colons. The fields keep their memory for this record's values.
     gaf_record.opt_fields.clear();
-    do {
-        getline(in, buffer, '\t');
-        if (in && !buffer.empty()) {
-            size_t col1 = buffer.find_first_of(':');
-            size_t col2 = buffer.find_first_of(':', col1 + 1);
-            if (buffer.length() < 5 || col1 == std::string::npos || col2 == std::string::npos) {
-                throw std::runtime_error("Unable to parse optional tag " + buffer);
-            }
-            std::string tag = buffer.substr(0, col1);
-            std::string type = buffer.substr(col1 + 1, col2 - col1 - 1);
-            std::string val = buffer.substr(col2 + 1);
-            if (gaf_record.opt_fields.count(tag)) {
-                throw std::runtime_error("Duplicate optional field found: " + tag);
-            }
-            gaf_record.opt_fields[tag] = make_pair(type, val);
+    const char* field_end = column_end;
+    while (field_end != line_end) {
+        const char* field_start = field_end + 1;
+        field_end = find_char(field_start, line_end, '\t');
+        if (field_start == field_end) {
+            // Skip empty fields
+            continue;
+        }
+        const char* col1 = find_char(field_start, field_end, ':');
+        const char* col2 = col1 == field_end ? field_end : find_char(col1 + 1, field_end, ':');
+        if (field_end - field_start < 5 || col2 == field_end || col1 - field_start != 2) {
+            throw std::runtime_error("Unable to parse optional tag " + std::string(field_start, field_end));
         }
-    } while (bool(in));
+        uint16_t key = GafOptFields::pack_tag(field_start[0], field_start[1]);
+        if (gaf_record.opt_fields.index_of(key) != GafOptFields::npos) {
+            throw std::runtime_error("Duplicate optional field found: " + std::string(field_start, col1));
+        }
+        gaf_record.opt_fields.set(key, col1 + 1, col2 - col1 - 1, col2 + 1, field_end - col2 - 1);
+    }
+}
 
+/**
+ * Parse a single GAF record
+ */ 
+inline void parse_gaf_record(const std::string& gaf_line, GafRecord& gaf_record) {
+    parse_gaf_record(gaf_line.c_str(), gaf_line.size(), gaf_record);
 }
 
 /*
@@ -208,8 +528,9 @@ inline void parse_gaf_record(const std::string& gaf_line, GafRecord& gaf_record)
  * https://github.com/lh3/minimap2#the-cs-optional-tag
  */
 inline void for_each_cs(const GafRecord& gaf_record, std::function<void(const std::string&)> fn) {
-    if (gaf_record.opt_fields.count("cs")) {
-        const std::string& cs_cigar = gaf_record.opt_fields.find("cs")->second.second;
+    auto cs_field = gaf_record.opt_fields.find("cs");
+    if (cs_field != gaf_record.opt_fields.end()) {
+        const std::string& cs_cigar = cs_field->second.second;
         size_t next;
         for (size_t co = 0; co != std::string::npos; co = next) {
             next = cs_cigar.find_first_of(":*-+", co + 1);
@@ -224,8 +545,9 @@ inline void for_each_cs(const GafRecord& gaf_record, std::function<void(const st
  * |([0-9]+[MIDNSHPX=])+
  */
 inline void for_each_cg(const GafRecord& gaf_record, std::function<void(const char&, const size_t&)> fn) {
-    if (gaf_record.opt_fields.count("cg")) {
-        const std::string& cg_cigar = gaf_record.opt_fields.find("cg")->second.second;
+    auto cg_field = gaf_record.opt_fields.find("cg");
+    if (cg_field != gaf_record.opt_fields.end()) {
+        const std::string& cg_cigar = cg_field->second.second;
         size_t next;
         for (size_t co = 0; co != std::string::npos && co < cg_cigar.length(); co = next) {
             next = cg_cigar.find_first_of("MIDNSHPX=", co);
@@ -238,88 +560,236 @@ inline void for_each_cg(const GafRecord& gaf_record, std::function<void(const ch
     }
 }
 
+/**
+ * One operation from a cs or cg cigar.
+ */
+struct CigarToken {
+    char op;                // One of :*-+ for cs, or MIDNSHPX= for cg
+    size_t length;          // Number of bases the operation covers
+    GafFieldView query;     // Inserted or substituted query bases. Only filled for cs.
+    GafFieldView target;    // Deleted or substituted target bases. Only filled for cs.
+};
+
+/**
+ * Walks the operations of a record's cs cigar if it has one, or its cg cigar
+ * otherwise, without allocating. Tokens point into the record's optional
+ * fields, and so are invalidated if the record changes.
+ */
+class CigarIterator {
+public:
+    /// Start at the first operation of the record's cigar.
+    explicit CigarIterator(const GafRecord& gaf_record) {
+        size_t field = gaf_record.opt_fields.index_of(GafOptFields::pack_tag('c', 's'));
+        is_cs = field != GafOptFields::npos;
+        if (!is_cs) {
+            field = gaf_record.opt_fields.index_of(GafOptFields::pack_tag('c', 'g'));
+        }
+        if (field != GafOptFields::npos) {
+            GafFieldView cigar = gaf_record.opt_fields.value(field);
+            cursor = cigar.data;
+            end = cigar.data + cigar.length;
+        }
+    }
+
+    /// Fill in the next operation and return true, or return false if there
+    /// are no more. Throws if the cigar is malformed.
+    bool next(CigarToken& token) {
+        if (cursor == end) {
+            return false;
+        }
+        const char* token_start = cursor;
+        if (is_cs) {
+            // cs operations run up to the next operation character
+            token.op = *cursor;
+            ++cursor;
+            while (cursor != end && *cursor != ':' && *cursor != '*' && *cursor != '-' && *cursor != '+') {
+                ++cursor;
+            }
+            GafFieldView bases = {token_start + 1, (size_t) (cursor - token_start - 1)};
+            token.query = GafFieldView();
+            token.target = GafFieldView();
+            switch (token.op) {
+            case ':':
+                token.length = parse_int(bases.data, cursor);
+                break;
+            case '+':
+                token.length = bases.length;
+                token.query = bases;
+                break;
+            case '-':
+                token.length = bases.length;
+                token.target = bases;
+                break;
+            case '*':
+                if (bases.length != 2) {
+                    throw std::runtime_error("Error parsing cs substitution " + std::string(token_start, cursor));
+                }
+                token.length = 1;
+                token.target = {bases.data, 1};
+                token.query = {bases.data + 1, 1};
+                break;
+            default:
+                throw std::runtime_error("Error parsing cs operation " + std::string(token_start, cursor));
+            }
+        } else {
+            // cg operations are a length and then an operation character
+            while (cursor != end && *cursor >= '0' && *cursor <= '9') {
+                ++cursor;
+            }
+            if (cursor == end || cursor == token_start || strchr("MIDNSHPX=", *cursor) == nullptr) {
+                throw std::runtime_error("Error parsing cg operation " + std::string(token_start, cursor == end ? end : cursor + 1));
+            }
+            token.length = parse_int(token_start, cursor);
+            token.op = *cursor;
+            token.query = GafFieldView();
+            token.target = GafFieldView();
+            ++cursor;
+        }
+        return true;
+    }
+
+private:
+    const char* cursor = nullptr;
+    const char* end = nullptr;
+    bool is_cs = false;
+};
+
 /*
  * Generic cigar function that will visit cs cigars if present, but fall back on cg cigars otherwise
  * Function takes in token {:*-+MIDNSHPX=}, length, query-string, target-string
  * The latter two strings are only filled by cs records and will be left empty for cg
  */
 inline void for_each_cigar(const GafRecord& gaf_record, std::function<void(const char&, const size_t&, const std::string&, const std::string&)> fn) {
-    if (gaf_record.opt_fields.count("cs")) {
-        for_each_cs(gaf_record, [&](const std::string& cs_str) {
-                if (cs_str[0] == ':') {
-                    fn(cs_str[0], std::stol(cs_str.substr(1)), "", "");
-                } else if (cs_str[0] == '+') {
-                    std::string qs = cs_str.substr(1);
-                    fn(cs_str[0], qs.length(), qs, "");
-                } else if (cs_str[0] == '-') {
-                    std::string ts = cs_str.substr(1);
-                    fn(cs_str[0], ts.length(), "", ts);
-                } else if (cs_str[0] == '*') {
-                    assert(cs_str.length() == 3);
-                    fn(cs_str[0], 1, cs_str.substr(2,1), cs_str.substr(1,1));
-                } else {
-                    assert(false);
-                }
-            });
-    } else {
-        for_each_cg(gaf_record, [&](const char& cg_tok, const size_t& cg_len) {
-                fn(cg_tok, cg_len, "", "");
-            });
+    CigarIterator cigar(gaf_record);
+    CigarToken token;
+    while (cigar.next(token)) {
+        fn(token.op, token.length, token.query.str(), token.target.str());
     }
 }
     
-/*
- * Write a GAF Step to a stream
+/**
+ * Append the decimal form of an integer to a string, without making a
+ * temporary string.
+ *
+ * This and the other append functions work on anything with a string's
+ * push_back(char), append(const char*, size_t), and append(const string&).
  */
-inline std::ostream& operator<<(std::ostream& os, const gafkluge::GafStep& gaf_step) {
+template<typename Buffer>
+inline void append_int(Buffer& buffer, int64_t i) {
+    // Enough for any int64_t, with its sign
+    char digits[20];
+    char* cursor = digits + sizeof(digits);
+    uint64_t magnitude = i < 0 ? -(uint64_t) i : (uint64_t) i;
+    do {
+        *--cursor = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (i < 0) {
+        *--cursor = '-';
+    }
+    buffer.append(cursor, digits + sizeof(digits) - cursor);
+}
+
+/**
+ * Append an integer to a string, or missing_string if it is missing.
+ */
+template<typename Buffer>
+inline void append_int_or_missing(Buffer& buffer, int64_t i) {
+    if (is_missing(i)) {
+        buffer.append(missing_string);
+    } else {
+        append_int(buffer, i);
+    }
+}
+
+/**
+ * Append a GAF Step to a string
+ */
+template<typename Buffer>
+inline void append_gaf_step(Buffer& buffer, const GafStep& gaf_step) {
     if (!gaf_step.is_stable || gaf_step.is_interval) {
-        os << (gaf_step.is_reverse ? "<" : ">");
+        buffer.push_back(gaf_step.is_reverse ? '<' : '>');
     }
-    os << gaf_step.name;
+    buffer.append(gaf_step.name);
     if (gaf_step.is_interval) {
-        os << ":" <<  gaf_step.start << "-" << gaf_step.end;
+        buffer.push_back(':');
+        append_int(buffer, gaf_step.start);
+        buffer.push_back('-');
+        append_int(buffer, gaf_step.end);
     }
-    return os;
 }
 
 /**
- * Write a GAF record to a stream
+ * Append a GAF record to a string, without a trailing newline. A string
+ * reused for many records stops allocating once it has held the longest.
  */
-inline std::ostream& operator<<(std::ostream& os, const gafkluge::GafRecord& gaf_record) {
-
-    os << (gaf_record.query_name.empty() ? gafkluge::missing_string : gaf_record.query_name)  << "\t"
-       << gafkluge::int_to_string(gaf_record.query_length) << "\t"
-       << gafkluge::int_to_string(gaf_record.query_start) << "\t"
-       << gafkluge::int_to_string(gaf_record.query_end) << "\t"
-       << gaf_record.strand << "\t";
+template<typename Buffer>
+inline void append_gaf_record(Buffer& buffer, const GafRecord& gaf_record) {
+
+    buffer.append(gaf_record.query_name.empty() ? missing_string : gaf_record.query_name);
+    buffer.push_back('\t');
+    append_int_or_missing(buffer, gaf_record.query_length);
+    buffer.push_back('\t');
+    append_int_or_missing(buffer, gaf_record.query_start);
+    buffer.push_back('\t');
+    append_int_or_missing(buffer, gaf_record.query_end);
+    buffer.push_back('\t');
+    buffer.push_back(gaf_record.strand);
+    buffer.push_back('\t');
 
     if (gaf_record.path.empty()) {
-        os << gafkluge::missing_string << "\t"
-           << gafkluge::missing_string << "\t"
-           << gafkluge::missing_string << "\t"
-           << gafkluge::missing_string << "\t"
-           << gafkluge::missing_string << "\t"
-           << gafkluge::missing_string << "\t";
+        for (size_t i = 0; i < 6; i++) {
+            buffer.append(missing_string);
+            buffer.push_back('\t');
+        }
     } else {
-        for (const gafkluge::GafStep& step : gaf_record.path) {
-            os << step;
+        for (const GafStep& step : gaf_record.path) {
+            append_gaf_step(buffer, step);
         }
-        
-        os << "\t"
-           << gafkluge::int_to_string(gaf_record.path_length) << "\t"
-           << gafkluge::int_to_string(gaf_record.path_start) << "\t"
-           << gafkluge::int_to_string(gaf_record.path_end) << "\t"
-           << gafkluge::int_to_string(gaf_record.matches) << "\t"
-           << gafkluge::int_to_string(gaf_record.block_length) << "\t";
+        buffer.push_back('\t');
+        append_int_or_missing(buffer, gaf_record.path_length);
+        buffer.push_back('\t');
+        append_int_or_missing(buffer, gaf_record.path_start);
+        buffer.push_back('\t');
+        append_int_or_missing(buffer, gaf_record.path_end);
+        buffer.push_back('\t');
+        append_int_or_missing(buffer, gaf_record.matches);
+        buffer.push_back('\t');
+        append_int_or_missing(buffer, gaf_record.block_length);
+        buffer.push_back('\t');
     }
-    
-    os << (gaf_record.mapq == gafkluge::missing_int ? 255 : gaf_record.mapq);
 
-    for (const auto& it : gaf_record.opt_fields) {
-        os << "\t" << it.first << ":" << it.second.first << ":" << it.second.second;
+    append_int(buffer, gaf_record.mapq == missing_int ? 255 : gaf_record.mapq);
+
+    for (size_t i = 0; i < gaf_record.opt_fields.size(); i++) {
+        GafFieldView type = gaf_record.opt_fields.type(i);
+        GafFieldView value = gaf_record.opt_fields.value(i);
+        buffer.push_back('\t');
+        buffer.push_back((char) (gaf_record.opt_fields.key(i) >> 8));
+        buffer.push_back((char) (gaf_record.opt_fields.key(i) & 0xFF));
+        buffer.push_back(':');
+        buffer.append(type.data, type.length);
+        buffer.push_back(':');
+        buffer.append(value.data, value.length);
     }
+}
+
+/*
+ * Write a GAF Step to a stream
+ */
+inline std::ostream& operator<<(std::ostream& os, const gafkluge::GafStep& gaf_step) {
+    std::string buffer;
+    append_gaf_step(buffer, gaf_step);
+    return os << buffer;
+}
 
-    return os;
+/**
+ * Write a GAF record to a stream
+ */
+inline std::ostream& operator<<(std::ostream& os, const gafkluge::GafRecord& gaf_record) {
+    std::string buffer;
+    append_gaf_record(buffer, gaf_record);
+    return os << buffer;
 }
 
 } // namesapce gafkluge
@@ -0,0 +1,62 @@
+#ifndef VG_IO_LINE_BLOCK_READER_HPP_INCLUDED
+#define VG_IO_LINE_BLOCK_READER_HPP_INCLUDED
+
+/**
+ * \file line_block_reader.hpp
+ * Defines a reader that pulls lines out of an htslib text file by reading big
+ * blocks and finding the line breaks in them, without any parsing.
+ */
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <htslib/hts.h>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Reads lines from an open htslib file, compressed or not. Data is read in big
+ * blocks, and line breaks are found with memchr, which is much faster than
+ * hts_getline()'s byte-at-a-time scan. Lines are handed out without their line
+ * breaks, or any carriage returns before them.
+ *
+ * Does not own the file, and must be the only thing reading from it.
+ */
+class LineBlockReader {
+public:
+    /// Number of bytes to read from the file at a time
+    static const size_t BLOCK_BYTES;
+
+    /// Make a reader for the given file, which must outlive it.
+    LineBlockReader(htsFile* fp);
+
+    /// Read the next line into the given string, reusing its memory. Returns
+    /// false, and leaves the string empty, if there are no more lines.
+    bool next_line(string& line);
+
+private:
+    /// Read the next block from the file, after whatever data is unused.
+    /// Returns false if there is no more data.
+    bool refill();
+
+    /// The file we read from
+    htsFile* fp;
+    /// The data read from the file
+    vector<char> block;
+    /// Where the unused data in the block starts
+    size_t block_start = 0;
+    /// Where the data in the block ends
+    size_t block_end = 0;
+    /// Whether we have hit the end of the file
+    bool at_eof = false;
+};
+
+}
+
+}
+
+#endif
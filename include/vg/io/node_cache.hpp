@@ -0,0 +1,173 @@
+#ifndef VG_IO_NODE_CACHE_HPP_INCLUDED
+#define VG_IO_NODE_CACHE_HPP_INCLUDED
+
+/**
+ * \file node_cache.hpp
+ * Defines a cache of node lengths and sequences, for converting many
+ * alignments against the same part of a graph.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <handlegraph/handle_graph.hpp>
+
+namespace vg {
+
+namespace io {
+
+using nid_t = handlegraph::nid_t;
+using HandleGraph = handlegraph::HandleGraph;
+
+using namespace std;
+
+/**
+ * Keeps the lengths and oriented sequences of the most recently used nodes,
+ * in front of either a pair of lookup functions or a HandleGraph.
+ *
+ * Not thread safe: keep one per thread.
+ */
+class NodeCache {
+public:
+    /// Default number of node lengths, and of oriented node sequences, to keep
+    static const size_t DEFAULT_CAPACITY;
+
+    /// Make a cache in front of the given functions. node_to_sequence may be
+    /// empty, if sequences will not be needed.
+    NodeCache(function<size_t(nid_t)> node_to_length,
+              function<string(nid_t, bool)> node_to_sequence,
+              size_t capacity = DEFAULT_CAPACITY);
+
+    /// Make a cache in front of the given graph, which must outlive it.
+    explicit NodeCache(const HandleGraph& graph, size_t capacity = DEFAULT_CAPACITY);
+
+    /// Get the length of a node.
+    size_t get_length(nid_t node_id);
+
+    /// Get the sequence of a node in the given orientation. The reference is
+    /// good until the next call to get_sequence().
+    const string& get_sequence(nid_t node_id, bool is_reverse);
+
+    /// Return true if we can look up sequences.
+    bool has_sequences() const;
+
+private:
+
+    /**
+     * Least recently used table of values by key.
+     */
+    template<typename Value>
+    class Table {
+    public:
+        Table(size_t capacity) : capacity(max<size_t>(capacity, 1)) {
+            // Nothing to do!
+        }
+
+        /// Get the value for the given key, making it with fill(key, value)
+        /// if we don't have it.
+        template<typename Fill>
+        const Value& get(uint64_t key, const Fill& fill) {
+            auto found = slots.find(key);
+            size_t slot;
+            if (found != slots.end()) {
+                slot = found->second;
+                unlink(slot);
+            } else {
+                if (entries.size() < capacity) {
+                    slot = entries.size();
+                    entries.emplace_back();
+                } else {
+                    // Recycle the least recently used entry, and its memory.
+                    slot = oldest;
+                    unlink(slot);
+                    slots.erase(entries[slot].key);
+                }
+                try {
+                    fill(key, entries[slot].value);
+                } catch (...) {
+                    // Leave the slot to be used next.
+                    entries[slot].key = NO_KEY;
+                    link_oldest(slot);
+                    throw;
+                }
+                entries[slot].key = key;
+                slots.emplace(key, slot);
+            }
+            link_newest(slot);
+            return entries[slot].value;
+        }
+
+    private:
+        static const size_t NONE = numeric_limits<size_t>::max();
+        static const uint64_t NO_KEY = numeric_limits<uint64_t>::max();
+
+        struct Entry {
+            uint64_t key = NO_KEY;
+            Value value;
+            /// Next more recently used entry
+            size_t newer = NONE;
+            /// Next less recently used entry
+            size_t older = NONE;
+        };
+
+        void unlink(size_t slot) {
+            Entry& entry = entries[slot];
+            if (entry.newer != NONE) {
+                entries[entry.newer].older = entry.older;
+            } else if (newest == slot) {
+                newest = entry.older;
+            }
+            if (entry.older != NONE) {
+                entries[entry.older].newer = entry.newer;
+            } else if (oldest == slot) {
+                oldest = entry.newer;
+            }
+            entry.newer = NONE;
+            entry.older = NONE;
+        }
+
+        void link_newest(size_t slot) {
+            entries[slot].older = newest;
+            if (newest != NONE) {
+                entries[newest].newer = slot;
+            }
+            newest = slot;
+            if (oldest == NONE) {
+                oldest = slot;
+            }
+        }
+
+        void link_oldest(size_t slot) {
+            entries[slot].newer = oldest;
+            if (oldest != NONE) {
+                entries[oldest].older = slot;
+            }
+            oldest = slot;
+            if (newest == NONE) {
+                newest = slot;
+            }
+        }
+
+        size_t capacity;
+        vector<Entry> entries;
+        unordered_map<uint64_t, size_t> slots;
+        size_t newest = NONE;
+        size_t oldest = NONE;
+    };
+
+    function<size_t(nid_t)> node_to_length;
+    function<string(nid_t, bool)> node_to_sequence;
+    /// Lengths by node ID
+    Table<size_t> lengths;
+    /// Sequences by node ID and orientation
+    Table<string> sequences;
+};
+
+}
+
+}
+
+#endif
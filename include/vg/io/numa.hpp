@@ -0,0 +1,80 @@
+#ifndef VG_IO_NUMA_HPP_INCLUDED
+#define VG_IO_NUMA_HPP_INCLUDED
+
+/**
+ * \file numa.hpp
+ * Defines optional NUMA-aware placement for the threads the library runs
+ * itself, like the parallel readers' producer and the StreamMultiplexer
+ * writer.
+ */
+
+#include <cstddef>
+#include <vector>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Turn topology-aware thread placement on or off. It is off by default, and
+ * can also be turned on by setting the VGIO_NUMA environment variable to 1.
+ *
+ * When on, the threads the library owns are bound to the NUMA node they
+ * start on, so they stay next to the buffers they fill, and per-thread
+ * buffers are first touched by the thread that uses them. Chunks for
+ * StreamMultiplexer thread streams are recycled to threads on the node they
+ * were first used on. Worker threads belong to the caller and should be
+ * placed with OMP_PROC_BIND and OMP_PLACES.
+ */
+void set_numa_aware(bool enabled);
+
+/// Return true if topology-aware thread placement is on.
+bool numa_aware();
+
+/// Get the number of NUMA nodes in the system, or 1 if it can't be determined.
+size_t numa_node_count();
+
+/// Get the NUMA node the calling thread is currently running on, or 0 if it
+/// can't be determined.
+int current_numa_node();
+
+/// Restrict the calling thread to the CPUs of the given NUMA node. With
+/// libnuma, also make the thread's new memory prefer that node; otherwise
+/// memory stays local through first touch. Returns true on success, and false
+/// if the node is unknown or binding failed.
+bool bind_thread_to_numa_node(int node);
+
+/**
+ * While it exists, keeps the calling thread bound to the NUMA node it was
+ * running on when the object was made, if topology-aware placement is on.
+ * Restores the thread's previous CPU affinity, and the default local
+ * allocation policy, when destroyed, so threads borrowed from the caller are
+ * handed back as they were.
+ */
+class ScopedNumaBinding {
+public:
+    /// Bind the calling thread, if topology-aware placement is on.
+    ScopedNumaBinding();
+    /// Restore the calling thread's previous affinity.
+    ~ScopedNumaBinding();
+
+    ScopedNumaBinding(const ScopedNumaBinding& other) = delete;
+    ScopedNumaBinding& operator=(const ScopedNumaBinding& other) = delete;
+
+    /// Get the node the thread is bound to, or -1 if it isn't bound.
+    int node() const;
+
+private:
+    /// The node we bound to, or -1
+    int bound_node;
+    /// The saved CPU affinity mask, as raw bytes.
+    vector<unsigned char> saved_affinity;
+};
+
+}
+
+}
+
+#endif
@@ -79,6 +79,11 @@ public:
     /// To use when you have something you can't move.
     void write_copy(const T& item);
     
+    /// Emit copies of the given items in order, with no other intervening
+    /// items between them. Takes pointers, so items that are shared, or spread
+    /// across several collections, can be written without copying them first.
+    void write_many_copy(const vector<const T*>& ordered_items);
+    
     /// Define a type for group emission event listeners.
     /// The arguments are the start virtual offset and the past-end virtual offset.
     using group_listener_t = std::function<void(int64_t, int64_t)>;
@@ -235,6 +240,28 @@ auto ProtobufEmitter<T>::write_copy(const T& item) -> void {
     }
 }
 
+template<typename T>
+auto ProtobufEmitter<T>::write_many_copy(const vector<const T*>& ordered_items) -> void {
+    // Encode them all to strings
+    vector<string> encoded(ordered_items.size());
+    for (size_t i = 0; i < ordered_items.size(); i++) {
+        handle(ordered_items[i]->SerializeToString(&encoded[i]));
+    }
+    
+    // Lock the backing emitter
+    lock_guard<mutex> lock(out_mutex);
+    
+    for (size_t i = 0; i < ordered_items.size(); i++) {
+        // Write each message with the correct tag.
+        message_emitter.write(tag, std::move(encoded[i]));
+        
+        for (auto& handler : message_handlers) {
+            // Fire the handlers in serial
+            handler(*ordered_items[i]);
+        }
+    }
+}
+
 template<typename T>
 auto ProtobufEmitter<T>::on_group(group_listener_t&& listener) -> void {
     // Lock the handler list
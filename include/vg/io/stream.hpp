@@ -12,11 +12,18 @@
 #include <vector>
 #include <list>
 #include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <chrono>
 
 #include "registry.hpp"
+#include "numa.hpp"
 #include "message_iterator.hpp"
 #include "protobuf_iterator.hpp"
 #include "protobuf_emitter.hpp"
+#include "wire_filter.hpp"
+#include "batch_sizer.hpp"
 
 namespace vg {
 
@@ -75,6 +82,18 @@ bool write(std::ostream& out, size_t count, const std::function<T(size_t)>& lamb
     return true;
 }
 
+/// Serialize, and BGZF-compress if requested, count objects into a
+/// self-contained run of bytes that can be appended to an output stream of
+/// the same kind. To get the objects, calls lambda with the index of the
+/// object to retrieve. Takes no locks, so threads can encode their own
+/// batches concurrently and only need to serialize appending the results.
+template <typename T>
+std::string encode(size_t count, const std::function<T&(size_t)>& lambda, bool compressed = true) {
+    std::stringstream encoded;
+    write(encoded, count, lambda, compressed);
+    return encoded.str();
+}
+
 /// Start, continue, or finish a buffered stream of objects.
 /// If the length of the buffer is greater than the limit, writes the buffer out.
 /// Otherwise, leaves the objects in the buffer.
@@ -82,22 +101,132 @@ bool write(std::ostream& out, size_t count, const std::function<T(size_t)>& lamb
 /// When called with a buffer limit of 0, automatically appends an EOF marker.
 /// Returns true unless an error occurs.
 /// Needs to know whether to BGZF-compress the output or not.
+///
+/// Serialization and compression happen in the calling thread; only the
+/// append of the finished bytes to the stream is done in the stream_out
+/// critical section.
 template <typename T>
 bool write_buffered(std::ostream& out, std::vector<T>& buffer, size_t buffer_limit, bool compressed = true) {
     bool wrote = false;
     if (buffer.size() >= buffer_limit) {
-        std::function<T(size_t)> lambda = [&buffer](size_t n) { return buffer.at(n); };
+        std::function<T&(size_t)> lambda = [&buffer](size_t n) -> T& { return buffer.at(n); };
+        // Do all the expensive work outside the critical section.
+        std::string encoded = encode(buffer.size(), lambda, compressed);
 #pragma omp critical (stream_out)
-        wrote = write(out, buffer.size(), lambda, compressed);
+        {
+            out.write(encoded.data(), encoded.size());
+            wrote = out.good();
+        }
         buffer.clear();
     }
     if (buffer_limit == 0) {
         // The session is over. Append the EOF marker.
+#pragma omp critical (stream_out)
         finish(out, compressed);
     }
     return wrote;
 }
 
+/**
+ * Shared writer for a stream of objects that many threads contribute batches
+ * to. Each thread serializes and compresses its batch into independent BGZF
+ * blocks without holding any lock; only appending the finished bytes to the
+ * backing stream is serialized. The result is a valid concatenated BGZF
+ * stream, with batches appearing in the order their appends happen.
+ *
+ * Finishes the stream with an EOF marker on destruction, unless finish() has
+ * already been called.
+ */
+template <typename T>
+class BufferedWriter {
+public:
+    /// Make a writer appending to the given stream, which must outlive it.
+    /// Needs to know whether to BGZF-compress the output or not.
+    BufferedWriter(std::ostream& out, bool compressed = true);
+    
+    /// Finish the stream, if not already finished.
+    ~BufferedWriter();
+    
+    // Can't be copied or moved since threads share it.
+    BufferedWriter(const BufferedWriter& other) = delete;
+    BufferedWriter& operator=(const BufferedWriter& other) = delete;
+    
+    /// Encode the given batch in the calling thread and append it to the
+    /// stream. Returns true unless an error occurs.
+    bool write(const std::vector<T>& batch);
+    
+    /// Write and clear the given thread-local buffer if it has reached the
+    /// given limit. Returns true if anything was written successfully.
+    bool write_buffered(std::vector<T>& buffer, size_t buffer_limit);
+    
+    /// Append the EOF marker. No more batches may be written after this.
+    void finish();
+    
+private:
+    /// The stream we append to
+    std::ostream& out;
+    /// Whether we BGZF-compress
+    bool compressed;
+    /// Set once the EOF marker has been written
+    bool finished;
+    /// Controls appending to the stream. Only held for the copy of
+    /// already-compressed bytes.
+    std::mutex out_mutex;
+    
+    /// Append already-encoded bytes to the stream.
+    bool append(const std::string& encoded);
+};
+
+template <typename T>
+BufferedWriter<T>::BufferedWriter(std::ostream& out, bool compressed) : out(out), compressed(compressed), finished(false) {
+    // Nothing to do
+}
+
+template <typename T>
+BufferedWriter<T>::~BufferedWriter() {
+    finish();
+}
+
+template <typename T>
+bool BufferedWriter<T>::write(const std::vector<T>& batch) {
+    if (batch.empty()) {
+        return true;
+    }
+    // The items are only ever serialized, never modified.
+    std::function<T&(size_t)> lambda = [&batch](size_t n) -> T& { return const_cast<T&>(batch.at(n)); };
+    return append(encode(batch.size(), lambda, compressed));
+}
+
+template <typename T>
+bool BufferedWriter<T>::write_buffered(std::vector<T>& buffer, size_t buffer_limit) {
+    bool wrote = false;
+    if (!buffer.empty() && buffer.size() >= buffer_limit) {
+        wrote = write(buffer);
+        buffer.clear();
+    }
+    return wrote;
+}
+
+template <typename T>
+void BufferedWriter<T>::finish() {
+    std::lock_guard<std::mutex> lock(out_mutex);
+    if (!finished) {
+        vg::io::finish(out, compressed);
+        out.flush();
+        finished = true;
+    }
+}
+
+template <typename T>
+bool BufferedWriter<T>::append(const std::string& encoded) {
+    std::lock_guard<std::mutex> lock(out_mutex);
+    if (finished) {
+        throw std::runtime_error("io::BufferedWriter: cannot write after finish()");
+    }
+    out.write(encoded.data(), encoded.size());
+    return out.good();
+}
+
 /// Write a single message to a file.
 template <typename T>
 void write_to_file(const T& item, const string& filename) {
@@ -145,6 +274,62 @@ void for_each(std::istream& in,
 
 // Parallelized versions of for_each
 
+/// Drop the serialized messages in the batch that the filter rejects. If
+/// pairs is set, the messages are considered as interleaved pairs, and a pair
+/// is dropped if either of its messages is rejected.
+void filter_batch(std::vector<std::string>& batch, const WireFilter& filter, bool pairs);
+
+/// Parse the serialized messages in a batch and invoke lambda2 on interleaved
+/// pairs of them, and lambda1 on an odd last message, if any.
+template <typename T>
+void for_each_parallel_batch(const std::vector<std::string>& batch,
+                             const std::function<void(T&,T&)>& lambda2,
+                             const std::function<void(T&)>& lambda1) {
+    auto handle = [](bool retval) -> void {
+        if (!retval) throw std::runtime_error("obsolete, invalid, or corrupt protobuf input");
+    };
+    
+    T obj1, obj2;
+    size_t i = 0;
+    for (; i + 1 < batch.size(); i += 2) {
+        // parse protobuf objects and invoke lambda on the pair
+        handle(ProtobufIterator<T>::parse_from_string(obj1, batch[i]));
+        handle(ProtobufIterator<T>::parse_from_string(obj2, batch[i+1]));
+        lambda2(obj1, obj2);
+    }
+    if (i < batch.size()) {
+        // odd last object
+        handle(ProtobufIterator<T>::parse_from_string(obj1, batch[i]));
+        lambda1(obj1);
+    }
+}
+
+/// Filter, parse, and process a batch handed off by for_each_parallel_impl,
+/// reporting how long it took to the sizer, if any, along with the count limit
+/// the batch was built under. Deletes the batch.
+template <typename T>
+void process_parallel_batch(std::vector<std::string>* batch,
+                            const std::function<void(T&,T&)>& lambda2,
+                            const std::function<void(T&)>& lambda1,
+                            const WireFilter* filter,
+                            bool filter_pairs,
+                            AdaptiveBatchSizer* sizer,
+                            size_t batch_bytes,
+                            size_t batch_limit) {
+    auto start = std::chrono::steady_clock::now();
+    size_t count = batch->size();
+    // Drop anything the filter rejects before parsing
+    if (filter != nullptr) {
+        filter_batch(*batch, *filter, filter_pairs);
+    }
+    for_each_parallel_batch(*batch, lambda2, lambda1);
+    delete batch;
+    if (sizer != nullptr) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        sizer->record_process(count, batch_bytes, batch_limit, elapsed.count());
+    }
+}
+
 // First, an internal implementation underlying several variants below.
 // lambda2 is invoked on interleaved pairs of elements from the stream. The
 // elements of each pair are in order, but the overall order in which lambda2
@@ -154,14 +339,23 @@ void for_each(std::istream& in,
 // must be divisible by 2.
 // The progress function is invoked periodically with the input stream offset
 // and length, or std::numeric_limits<size_t>::max() if they are unavailable.
-
+// If a filter is given, messages it rejects are dropped in the worker threads
+// before they are parsed. If filter_pairs is set, a pair is dropped if either
+// of its messages is rejected; otherwise messages are dropped individually and
+// the survivors are re-paired, so this is only appropriate when lambda2 just
+// calls lambda1 on each element.
+// If a sizer is given, it decides when batches are full instead of
+// batch_size, and is told how long batches take to fill and process.
 template <typename T>
 void for_each_parallel_impl(std::istream& in,
                             const std::function<void(T&,T&)>& lambda2,
                             const std::function<void(T&)>& lambda1,
                             const std::function<bool(void)>& single_threaded_until_true,
                             size_t batch_size,
-                            const std::function<void(size_t, size_t)>& progress = NO_PROGRESS) {
+                            const std::function<void(size_t, size_t)>& progress = NO_PROGRESS,
+                            const WireFilter* filter = nullptr,
+                            bool filter_pairs = false,
+                            AdaptiveBatchSizer* sizer = nullptr) {
 
     size_t stream_length = get_stream_length(in);
     if (stream_length == std::numeric_limits<size_t>::max()) {
@@ -178,17 +372,21 @@ void for_each_parallel_impl(std::istream& in,
     size_t batches_outstanding = 0;
     
 #ifdef debug
-    cerr << "Looping over file in batches of size " << batch_size << endl;
+    if (sizer != nullptr) {
+        cerr << "Looping over file in adaptive batches starting at size " << sizer->count_limit() << endl;
+    } else {
+        cerr << "Looping over file in batches of size " << batch_size << endl;
+    }
 #endif
 
     // this loop handles a chunked file with many pieces
     // such as we might write in a multithreaded process
-    #pragma omp parallel default(none) shared(in, lambda1, lambda2, progress, stream_length, batches_outstanding, max_batches_outstanding, single_threaded_until_true, cerr, batch_size)
+    #pragma omp parallel default(none) shared(in, lambda1, lambda2, progress, stream_length, batches_outstanding, max_batches_outstanding, single_threaded_until_true, cerr, batch_size, filter, filter_pairs, sizer)
     #pragma omp single
     {
-        auto handle = [](bool retval) -> void {
-            if (!retval) throw std::runtime_error("obsolete, invalid, or corrupt protobuf input");
-        };
+        // If asked, keep the producer next to the decompression buffers it
+        // fills for the duration of the loop.
+        ScopedNumaBinding producer_binding;
         
         // We do our own multi-threaded Protobuf decoding, but we batch up our
         // strings by pulling them from this iterator, which we also
@@ -196,6 +394,11 @@ void for_each_parallel_impl(std::istream& in,
         MessageIterator message_it(in, false, 8);
 
         std::vector<std::string> *batch = nullptr;
+        // Serialized bytes in the batch, the count limit it is being built
+        // under, and when we started filling it
+        size_t batch_bytes = 0;
+        size_t batch_limit = batch_size;
+        auto batch_start = std::chrono::steady_clock::now();
         
         bool first_message = true;
 
@@ -224,17 +427,27 @@ void for_each_parallel_impl(std::istream& in,
             // Make sure we have a batch
             if (batch == nullptr) {
                 batch = new vector<string>();
+                batch_bytes = 0;
+                if (sizer != nullptr) {
+                    batch_limit = sizer->count_limit();
+                    batch_start = std::chrono::steady_clock::now();
+                }
             }
             
             if (tag_and_data.second.get() != nullptr) {
                 // Add the message to the batch, if it exists
+                batch_bytes += tag_and_data.second->size();
                 batch->push_back(std::move(*tag_and_data.second));
             }
             
-            if (batch->size() == batch_size) {
+            if (sizer != nullptr ? sizer->batch_full(batch->size(), batch_bytes, batch_limit) : batch->size() == batch_size) {
 #ifdef debug
-                cerr << "Found full batch of size " << batch_size << endl;
+                cerr << "Found full batch of size " << batch->size() << endl;
 #endif
+                if (sizer != nullptr) {
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - batch_start;
+                    sizer->record_fill(elapsed.count());
+                }
             
                 // time to enqueue this batch for processing. first, block if
                 // we've hit max_batches_outstanding.
@@ -250,16 +463,7 @@ void for_each_parallel_impl(std::istream& in,
 #endif
                     
                     // process this batch in the current thread
-                    {
-                        T obj1, obj2;
-                        for (int i = 0; i<batch_size; i+=2) {
-                            // parse protobuf objects and invoke lambda on the pair
-                            handle(ProtobufIterator<T>::parse_from_string(obj1, batch->at(i)));
-                            handle(ProtobufIterator<T>::parse_from_string(obj2, batch->at(i+1)));
-                            lambda2(obj1,obj2);
-                        }
-                    } // scope obj1 & obj2
-                    delete batch;
+                    process_parallel_batch(batch, lambda2, lambda1, filter, filter_pairs, sizer, batch_bytes, batch_limit);
 #pragma omp atomic capture
                     b = --batches_outstanding;
                     
@@ -280,22 +484,13 @@ void for_each_parallel_impl(std::istream& in,
 #endif
                 
                     // spawn a task in another thread to process this batch
-#pragma omp task default(none) firstprivate(batch) shared(batches_outstanding, lambda2, handle, single_threaded_until_true, cerr, batch_size)
+#pragma omp task default(none) firstprivate(batch, batch_bytes, batch_limit) shared(batches_outstanding, lambda1, lambda2, cerr, filter, filter_pairs, sizer)
                     {
 #ifdef debug
                         cerr << "Batch task is running" << endl;
 #endif
                         
-                        {
-                            T obj1, obj2;
-                            for (int i = 0; i<batch_size; i+=2) {
-                                // parse protobuf objects and invoke lambda on the pair
-                                handle(ProtobufIterator<T>::parse_from_string(obj1, batch->at(i)));
-                                handle(ProtobufIterator<T>::parse_from_string(obj2, batch->at(i+1)));
-                                lambda2(obj1,obj2);
-                            }
-                        } // scope obj1 & obj2
-                        delete batch;
+                        process_parallel_batch(batch, lambda2, lambda1, filter, filter_pairs, sizer, batch_bytes, batch_limit);
 #pragma omp atomic update
                         batches_outstanding--;
                     }
@@ -316,21 +511,7 @@ void for_each_parallel_impl(std::istream& in,
 #ifdef debug
             cerr << "Run final batch of size " << batch->size() << " in current thread" << endl;
 #endif
-            if (!batch->empty()) {
-                // We require the batch to not be empty (so we can subtract from the size).
-                T obj1, obj2;
-                int i = 0;
-                for (; i < batch->size()-1; i+=2) {
-                    handle(ProtobufIterator<T>::parse_from_string(obj1, batch->at(i)));
-                    handle(ProtobufIterator<T>::parse_from_string(obj2, batch->at(i+1)));
-                    lambda2(obj1, obj2);
-                }
-                if (i == batch->size()-1) { // odd last object
-                    handle(ProtobufIterator<T>::parse_from_string(obj1, batch->at(i)));
-                    lambda1(obj1);
-                }
-            }
-            delete batch;
+            process_parallel_batch(batch, lambda2, lambda1, filter, filter_pairs, sizer, batch_bytes, batch_limit);
         }
     }
 }
@@ -346,6 +527,34 @@ void for_each_interleaved_pair_parallel(std::istream& in,
     };
     for_each_parallel_impl(in, lambda2, err1, NO_WAIT, batch_size, progress);
 }
+
+// parallel iteration over interleaved pairs of elements, dropping pairs where
+// either element is rejected by the given filter before they are parsed;
+// error out if there's an odd number of elements
+template <typename T>
+void for_each_interleaved_pair_parallel(std::istream& in,
+                                        const std::function<void(T&,T&)>& lambda2,
+                                        const WireFilter& filter,
+                                        size_t batch_size = 256,
+                                        const std::function<void(size_t, size_t)>& progress = NO_PROGRESS) {
+    std::function<void(T&)> err1 = [](T&){
+        throw std::runtime_error("io::for_each_interleaved_pair_parallel: expected input stream of interleaved pairs, but it had odd number of elements");
+    };
+    for_each_parallel_impl(in, lambda2, err1, NO_WAIT, batch_size, progress, &filter, true);
+}
+    
+// parallel iteration over interleaved pairs of elements, in batches sized by
+// the given AdaptiveBatchSizer; error out if there's an odd number of elements
+template <typename T>
+void for_each_interleaved_pair_parallel(std::istream& in,
+                                        const std::function<void(T&,T&)>& lambda2,
+                                        AdaptiveBatchSizer& sizer,
+                                        const std::function<void(size_t, size_t)>& progress = NO_PROGRESS) {
+    std::function<void(T&)> err1 = [](T&){
+        throw std::runtime_error("io::for_each_interleaved_pair_parallel: expected input stream of interleaved pairs, but it had odd number of elements");
+    };
+    for_each_parallel_impl(in, lambda2, err1, NO_WAIT, sizer.count_limit(), progress, nullptr, false, &sizer);
+}
     
 template <typename T>
 void for_each_interleaved_pair_parallel_after_wait(std::istream& in,
@@ -369,6 +578,31 @@ void for_each_parallel(std::istream& in,
     for_each_parallel_impl(in, lambda2, lambda1, NO_WAIT, batch_size, progress);
 }
 
+// parallelized for each individual element that passes the given filter.
+// Elements the filter rejects are dropped in the worker threads without ever
+// being parsed.
+template <typename T>
+void for_each_parallel(std::istream& in,
+                       const std::function<void(T&)>& lambda1,
+                       const WireFilter& filter,
+                       size_t batch_size = 256,
+                       const std::function<void(size_t, size_t)>& progress = NO_PROGRESS) {
+    std::function<void(T&,T&)> lambda2 = [&lambda1](T& o1, T& o2) { lambda1(o1); lambda1(o2); };
+    for_each_parallel_impl(in, lambda2, lambda1, NO_WAIT, batch_size, progress, &filter, false);
+}
+
+// parallelized for each individual element, in batches sized by the given
+// AdaptiveBatchSizer. Its statistics can be checked afterward to see the
+// batch sizes it chose.
+template <typename T>
+void for_each_parallel(std::istream& in,
+                       const std::function<void(T&)>& lambda1,
+                       AdaptiveBatchSizer& sizer,
+                       const std::function<void(size_t, size_t)>& progress = NO_PROGRESS) {
+    std::function<void(T&,T&)> lambda2 = [&lambda1](T& o1, T& o2) { lambda1(o1); lambda1(o2); };
+    for_each_parallel_impl(in, lambda2, lambda1, NO_WAIT, sizer.count_limit(), progress, nullptr, false, &sizer);
+}
+
         template<typename T>
         void for_each_parallel_impl_shuffle(std::istream &in,
                                             const std::function<void(T &, T &)> &lambda2,
@@ -9,10 +9,19 @@
 
 #include <sstream>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <atomic>
 #include <vector>
 #include <list>
+#include <map>
+#include <chrono>
+#include <string>
+#include <memory>
+
+#include <sys/uio.h>
+
+#include "chunked_streambuf.hpp"
 
 namespace vg {
 
@@ -21,22 +30,74 @@ namespace io {
 using namespace std;
 
 
+/**
+ * Counters describing how a StreamMultiplexer's output path is doing, for
+ * telling whether output is what is holding up a job.
+ */
+struct StreamMultiplexerStats {
+    /// Seconds since the multiplexer was made
+    double elapsed_seconds = 0;
+    /// Bytes handed to the writer by each thread
+    vector<size_t> thread_bytes;
+    /// Items handed to the writer by each thread
+    vector<size_t> thread_items;
+    /// Seconds each thread spent waiting for room in its queue, or in the
+    /// reorder window in ordered mode
+    vector<double> thread_blocked_seconds;
+    /// Bytes the writer has written to the backing stream or file
+    size_t bytes_written = 0;
+    /// Seconds the writer spent writing
+    double writer_busy_seconds = 0;
+    /// Seconds the writer spent looking for or waiting for work
+    double writer_idle_seconds = 0;
+    /// Most items ever waiting in one thread's queue
+    size_t max_queue_depth = 0;
+    /// Most bytes ever waiting in one thread's queue
+    size_t max_queue_bytes = 0;
+    /// Most units ever waiting to be put in order, in ordered mode
+    size_t max_reorder_depth = 0;
+    
+    /// Describe the stats as a single-line JSON object.
+    string to_json() const;
+};
+
 /**
  * Tool to allow multiple threads to write to streams that are multiplexed into
  * an output stream, by breaking at allowed points.
  *
- * Assumes an external source of thread numbering.
+ * Each writer has a numbered slot with its own stream. The first max_threads
+ * slots are for threads with an external source of thread numbering, like
+ * OMP. Writers without a stable thread number, like untied tasks or threads
+ * from some other pool, can lease a slot for as long as they need one, and
+ * more slots are made as needed. Everything that takes a thread number takes
+ * a slot number.
  */
 class StreamMultiplexer {
 
 public:
     /**
      * Make a new StreamMultiplexer sending output to the given output stream.
+     * If the stream is an fdostream, output goes to its file descriptor
+     * directly, as with the file descriptor constructor.
      *
      * Needs to know the maximum number of threads that will use the multiplexer.
      */
     StreamMultiplexer(ostream& backing, size_t max_threads);
     
+    /**
+     * Make a new StreamMultiplexer sending output directly to the given file
+     * descriptor, which is not closed. Ready output from several threads is
+     * sent in a single writev() call.
+     *
+     * If direct_io is set, output is packed into large aligned writes, and
+     * O_DIRECT is used if the file system allows it and the descriptor is at
+     * an aligned offset. This is meant for big output files on parallel file
+     * systems.
+     *
+     * Needs to know the maximum number of threads that will use the multiplexer.
+     */
+    StreamMultiplexer(int backing_fd, size_t max_threads, bool direct_io = false);
+    
     /**
      * Clean up and flush a StreamMultiplexer.
      *
@@ -58,10 +119,49 @@ public:
      * may be destroyed or recreated in place, or moved out of, during calls to
      * register_breakpoint().
      *
-     * Note that using this function in an "untied" (i.e. not thread bound) OMP
-     * task is not supported!
+     * Note that using a thread number in an "untied" (i.e. not thread bound)
+     * OMP task is not supported! Lease a slot for the task instead.
      */
     ostream& get_thread_stream(size_t thread_number);
+    
+    /**
+     * Get a slot, numbered max_threads or higher, that no one else is using,
+     * making a new one if needed. The slot belongs to the caller, whatever
+     * thread it is on, until it is released.
+     */
+    size_t lease_slot();
+    
+    /**
+     * Give back a slot from lease_slot(). Implicitly creates a breakpoint, so
+     * nothing written so far can be discarded by the next user. In ordered
+     * mode, anything written since the last sequenced breakpoint becomes part
+     * of the next unit written in the slot, so release right after one.
+     */
+    void release_slot(size_t slot_number);
+    
+    /**
+     * A slot leased for the lifetime of the object.
+     */
+    class SlotLease {
+    public:
+        /// Lease a slot from the given multiplexer, which must outlive us.
+        SlotLease(StreamMultiplexer& multiplexer);
+        /// Release the slot.
+        ~SlotLease();
+        
+        SlotLease(const SlotLease& other) = delete;
+        SlotLease& operator=(const SlotLease& other) = delete;
+        
+        /// Get the slot number, to pass in place of a thread number.
+        size_t slot() const;
+        
+        /// Get the slot's stream.
+        ostream& stream();
+        
+    private:
+        StreamMultiplexer& multiplexer;
+        size_t slot_number;
+    };
 
     /**
      * This function must be called after batches of writes to the stream from
@@ -76,6 +176,43 @@ public:
      */
     void register_breakpoint(size_t thread_number);
     
+    /**
+     * Put the multiplexer in ordered mode, where output is emitted in the
+     * order of the sequence numbers passed to the sequenced
+     * register_breakpoint(), instead of whenever threads get to it. This
+     * makes output byte-identical between runs, as long as each sequence
+     * number's data is.
+     *
+     * At most window sequence numbers past the next one to be written are
+     * held in memory; threads trying to go further ahead wait. This is the
+     * throughput cost of ordering: one slow unit holds up output, and once
+     * the window fills behind it, every thread stalls until it is done. Make
+     * the window several times the thread count, and keep units small
+     * relative to the total work, to keep stalls rare. Units are also always
+     * handed off whole, even if they are small.
+     *
+     * Must be called before any thread writes anything.
+     */
+    void set_ordered(size_t window = DEFAULT_REORDER_WINDOW);
+    
+    /**
+     * In ordered mode, mark the end of the unit of output with the given
+     * sequence number, consisting of everything written by the thread since
+     * its previous sequenced breakpoint. Unsequenced breakpoints in between
+     * can still be discarded back to.
+     *
+     * Sequence numbers start at 0, and every number must be used exactly
+     * once, across all threads, even if the unit is empty. Writers that
+     * buffer internally (like ProtobufEmitter) must be flushed first.
+     *
+     * May wait if sequence_number is too far ahead of the next unit to be
+     * written. All the units before it must therefore be produced by threads
+     * that are not themselves stuck waiting here; in particular, a thread must
+     * not wait here while holding work, like a tied OMP task, that another
+     * unit in the window depends on.
+     */
+    void register_breakpoint(size_t thread_number, size_t sequence_number);
+    
     /**
      * Check if the multiplexer would like a breakpoint (i.e. has a substantial
      * amount of data been written since the last breakpoint.
@@ -91,6 +228,8 @@ public:
      * thread is guaranteed to appear later in the file than what has been
      * written by the given thread so far. Implicitly also creates a
      * breakpoint.
+     *
+     * Not available in ordered mode.
      */
      void register_barrier(size_t thread_number);
      
@@ -106,52 +245,183 @@ public:
      * bytes since the last breakpoint, rewinds only to the last breakpoint.
      */
      void discard_bytes(size_t thread_number, size_t count);
+     
+    /**
+     * Get the current values of the counters for the output path. Can be
+     * called from any thread at any time.
+     */
+    StreamMultiplexerStats get_stats() const;
+    
+    /**
+     * Have the writer thread write the stats as a line of JSON to the given
+     * stream every interval_seconds, and once more when the multiplexer is
+     * destroyed. The stream must outlive the multiplexer, and not be written
+     * to by anything else meanwhile.
+     */
+    void dump_stats_periodically(ostream& out, double interval_seconds);
     
 private:
+    
+    /// Counters updated by one writing thread, which can be read by any.
+    struct ThreadCounters {
+        atomic<size_t> bytes{0};
+        atomic<size_t> items{0};
+        atomic<uint64_t> blocked_nanoseconds{0};
+        atomic<size_t> max_queue_depth{0};
+        atomic<size_t> max_queue_bytes{0};
+    };
+    
+    /**
+     * Everything belonging to one thread number or leased slot. Slots never
+     * move once made, so the writer thread can work on them while more are
+     * being added.
+     */
+    struct ThreadSlot {
+        /// Make a slot with an empty buffer drawing from the given pool.
+        ThreadSlot(ChunkPool& pool);
+        
+        /// The buffer the slot's writer is currently writing to
+        ChunkedStreamBuf buffer;
+        /// And a stream over that buffer
+        ostream stream;
+        
+        /// Not every breakpoint results in the buffer being cleared out and
+        /// enqueued. We only actually use a breakpoint if we have enough data
+        /// in the stream. But we still have to support discard_to_breakpoint.
+        /// So we keep a cursor for where the most recent breakpoint was. The
+        /// actual current position in the stream is tracked by the put
+        /// pointer (seekp()/tellp()).
+        size_t breakpoint_cursor;
+        
+        /// When the writer reaches a breakpoint and its buffer is big enough,
+        /// the buffer's chunks are moved into this queue at the back, and the
+        /// buffer starts over empty.
+        ///
+        /// We use a ring buffer, so that the writer thread never needs to
+        /// deallocate anything. To prevent ambiguity, the ring buffer always
+        /// contains at least 1 empty slot.
+        vector<ChunkedData> queue;
+        /// This is the number of the next slot in the ring buffer whose data
+        /// can be overwritten.
+        size_t queue_empty_slot;
+        /// This is the number of the last used slot in the ring buffer. If it
+        /// is equal to queue_empty_slot, no slots are used.
+        size_t queue_filled_slot;
+        
+        // Note that items in the ring buffers are never really cleared out.
+        // They just get overwritten in the worker threads.
+        
+        /// This tracks the number of bytes of data in the queue.
+        size_t queue_byte_count;
+        /// Access to the queue and byte count is controlled by a mutex. The
+        /// mutex only has to be held long enough to a little moving, and can
+        /// only ever be contended between two threads.
+        mutex queue_mutex;
+        /// The slot's writer waits on this, with the queue mutex, for the
+        /// writer thread to make space in or drain its queue.
+        condition_variable queue_drained;
+        
+        /// Counters for the stats
+        ThreadCounters counters;
+    };
+    
+    /// Slots are kept in blocks that double in size, so that a slot can be
+    /// found without locking while more are added. Slot i is in block
+    /// log2(i + 1). This is enough blocks for any slot number.
+    static const size_t MAX_SLOT_BLOCKS = 64;
+    
+    /// Pointers to the blocks of slots that have been made, or null
+    atomic<unique_ptr<ThreadSlot>*> slot_blocks[MAX_SLOT_BLOCKS];
+    /// Number of slots that exist
+    atomic<size_t> slot_count;
+    /// Leased slots that have been given back, to be used again
+    vector<size_t> free_slots;
+    /// Protects adding slots, and the free list
+    mutex slots_mutex;
+    
+    /// Get the slot with the given number, which must exist.
+    ThreadSlot& get_slot(size_t slot_number) const;
+    
+    /// Get the number of the block holding the given slot.
+    static size_t slot_block(size_t slot_number);
+    
+    /// Make a new slot at the end. Caller must hold slots_mutex, or be the
+    /// constructor.
+    size_t add_slot();
+    
+    /// When we were made
+    chrono::steady_clock::time_point start_time;
+    /// Counters for the writer thread
+    atomic<size_t> bytes_written;
+    atomic<uint64_t> writer_busy_nanoseconds;
+    /// Most units in the reorder buffer. Protected by reorder_mutex.
+    atomic<size_t> max_reorder_depth;
+    
+    /// Where to dump stats, if anywhere. Protected by writer_wakeup_mutex
+    /// until the writer picks it up.
+    ostream* stats_out;
+    /// How often to dump stats
+    chrono::steady_clock::duration stats_interval;
+    
+    /// Record that the given thread put an item of the given size in the
+    /// queue, which now has the given depth and total bytes.
+    void count_enqueue(size_t thread_number, size_t item_bytes, size_t queue_depth, size_t queue_bytes);
+    
+    /// Record that the given thread waited for the given time.
+    void count_blocked(size_t thread_number, chrono::steady_clock::duration waited);
+
+    /// Set up a StreamMultiplexer writing to the given stream, or to the given
+    /// file descriptor if it is not -1.
+    StreamMultiplexer(ostream* backing, int backing_fd, size_t max_threads, bool direct_io);
+
+    /// Remember the backing stream we wrap, if any
+    ostream* backing_stream;
+    
+    /// The file descriptor to write to directly instead, or -1
+    int backing_fd;
+    
+    /// If we turned on O_DIRECT on the file descriptor, the flags it had
+    /// before. Otherwise -1.
+    int direct_io_flags;
+    
+    /// In direct I/O mode, an aligned buffer to pack output into
+    char* staging_buffer;
+    /// And the number of bytes in it
+    size_t staging_bytes;
 
-    /// Remember the backing stream we wrap
-    ostream& backing_stream;
-
-    /// Each thread gets a slot in this vector for a stringstream it is
-    /// supposed to be currently writing to.
-    vector<stringstream> thread_streams;
-    
-    /// Not every breakpoint results in the stream for a thread being cleared
-    /// out and enqueued. We only actually use a breakpoint if we have enough
-    /// data in the stream. But we still have to support discard_to_breakpoint.
-    /// So we keep a cursor for where the most recent breakpoint was. The
-    /// actual current position in each stream is tracked by the put pointer
-    /// (seekp()/tellp()).
-    vector<size_t> thread_breakpoint_cursors;
-    
-    /// When a thread reaches a breakpoint and its stringstream is big enough,
-    /// its string data is copied into this queue at the back, and the stream
-    /// is emptied.
-    ///
-    /// We use a ring buffer, so that the writer thread never needs to
-    /// deallocate anything. To prevent ambiguity, the ring buffer always
-    /// contains at least 1 empty slot.
-    vector<vector<string>> thread_queues;
-    /// This is the number of the next slot in the ring buffer whose data can
-    /// be overwritten.
-    vector<size_t> thread_queue_empty_slots;
-    /// This is the number of the last used slot in the ring buffer. If it is
-    /// equal to thread_queue_empty, no slots are used.
-    vector<size_t> thread_queue_filled_slots;
-    
-    // Note that items in the ring buffers are never really cleared out. They
-    // just get overwritten in the worker threads.
-    
-    /// This tracks the number of bytes of data in each thread's queue.
-    vector<size_t> thread_queue_byte_counts;
-    /// Access to each thread's queue and byte count is controlled by a mutex.
-    /// The mutex only has to be held long enough to a little moving, and can
-    /// only ever be contended between two threads.
-    vector<mutex> thread_queue_mutexes;
+    /// All the threads' output is stored in chunks from this pool, which go
+    /// through the queues without being copied and come back once written.
+    /// Must outlive the slots.
+    ChunkPool chunk_pool;
+    
+    /// True if we are in ordered mode. Only read by writing threads.
+    bool ordered;
+    /// How far ahead of the next sequence number we can buffer
+    size_t reorder_window;
+    /// In ordered mode, finished units waiting to be written, by sequence
+    /// number. Protected by reorder_mutex.
+    map<size_t, ChunkedData> reorder_buffer;
+    /// The next sequence number to write. Protected by reorder_mutex.
+    size_t next_sequence;
+    /// Protects the reorder buffer and next sequence number
+    mutex reorder_mutex;
+    /// Threads wait on this for room in the reorder window
+    condition_variable reorder_space;
     
     /// When set to true, cause the writer thread to finish writing all queues and terminate.
     atomic<bool> writer_stop;
     
+    /// Set when anything is enqueued, so the writer knows not to sleep.
+    /// Protected by writer_wakeup_mutex.
+    bool writer_work_pending;
+    /// Protects writer_work_pending.
+    mutex writer_wakeup_mutex;
+    /// The writer sleeps on this when it runs out of work.
+    condition_variable writer_wakeup;
+    
+    /// NUMA node the writer thread should run on, or -1 to leave it unbound.
+    int writer_numa_node;
+    
     /// This thread is responsible for servicing all the queues and dumping the
     /// bytes to the real backing stream.
     thread writer_thread;
@@ -163,6 +433,19 @@ private:
     /// What is the number of slots in each queue ring buffer?
     static const size_t RING_BUFFER_SIZE;
     
+    /// What alignment do buffers, sizes, and offsets need for direct I/O?
+    static const size_t DIRECT_ALIGNMENT;
+    
+    /// How big are the writes in direct I/O mode?
+    static const size_t DIRECT_WRITE_BYTES;
+    
+    /// How many sequence numbers ahead can ordered mode buffer by default?
+    static const size_t DEFAULT_REORDER_WINDOW;
+    
+    /// How many passes over the queues should the writer make without
+    /// finding anything, before it goes to sleep until woken?
+    static const size_t WRITER_SPIN_PASSES;
+    
     /// Return if the ring buffer for the given thread is full.
     /// Lock on the thread's ring buffer must be held.
     bool ring_buffer_full(size_t thread_number) const;
@@ -174,21 +457,61 @@ private:
     /// Assuming the ring buffer for the given thread is not full, mark the
     /// next space as occupied and return a reference to it.
     /// Lock on the thread's ring buffer must be held.
-    string& ring_buffer_push(size_t thread_number);
+    ChunkedData& ring_buffer_push(size_t thread_number);
+    
+    /// Get the number of used slots in the ring buffer for the given thread.
+    /// Lock on the thread's ring buffer must be held.
+    size_t ring_buffer_size(size_t thread_number) const;
     
-    /// Assuming the ring buffer for the given thread is not empty, get a
-    /// reference to the next thing that would be popped.
+    /// Assuming the ring buffer for the given thread has more than offset
+    /// items, get a reference to the item that would be popped after offset
+    /// others. Only the writer thread may use it after the lock is released.
     /// Lock on the thread's ring buffer must be held.
-    const string& ring_buffer_peek(size_t thread_number);
+    ChunkedData& ring_buffer_peek(size_t thread_number, size_t offset = 0);
     
     /// Assuming the ring buffer for the given thread is not empty, remove the
     /// thing that is visible via peek.
     /// Lock on the thread's ring buffer must be held.
     void ring_buffer_pop(size_t thread_number);
     
+    /// Wait until the ring buffer for the given thread is not full.
+    /// Lock on the thread's ring buffer must be held by the passed lock.
+    void wait_for_space(size_t thread_number, unique_lock<mutex>& lock);
+    
+    /// Tell the writer thread that there is something to write.
+    void wake_writer();
+    
+    /// If the given stream writes to a file descriptor, flush it and return
+    /// the descriptor. Otherwise, return -1.
+    static int find_fd(ostream& backing);
+    
+    /// In ordered mode, move the units that are next in sequence out of the
+    /// reorder buffer and onto the end of items, where they are owned by the
+    /// caller. If take_all is set, take everything, even past gaps.
+    void take_sequenced_items(vector<ChunkedData*>& items, bool take_all);
+    
+    /// Write out the given items, in order, from the writer thread.
+    void write_items(const vector<ChunkedData*>& items);
+    
+    /// Write all of the given pieces to the file descriptor, retrying on
+    /// partial writes. The pieces are modified.
+    void write_fully(vector<iovec>& pieces);
+    
+    /// Add data to the direct I/O staging buffer, writing it when full.
+    void stage(const char* data, size_t length);
+    
+    /// Turn off O_DIRECT on the file descriptor, if we turned it on. Return
+    /// true if it was on.
+    bool disable_direct_io();
+    
+    /// Write out anything still held back for alignment, once there will be
+    /// no more output.
+    void finish_output();
+    
     /**
      * Function which is run as the writer thread.
-     * Empties queues as fast as it can.
+     * Empties queues as fast as it can, and sleeps when there is nothing to
+     * write.
      */
     void writer_thread_function();
     
@@ -0,0 +1,120 @@
+#ifndef VG_IO_WIRE_FILTER_HPP_INCLUDED
+#define VG_IO_WIRE_FILTER_HPP_INCLUDED
+
+/**
+ * \file wire_filter.hpp
+ * Defines declarative filters that run on serialized Protobuf messages, so
+ * records can be dropped without ever being parsed.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "vg/vg.pb.h"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * A conjunction of predicates on the top-level fields of a serialized Protobuf
+ * message, evaluated directly on the wire bytes.
+ *
+ * Fields are identified by field number. Absent fields are treated as having
+ * their proto3 default value (0, false, or the empty string), and if a field
+ * appears more than once the last occurrence wins, as in a real parse.
+ *
+ * Messages that cannot be scanned are accepted, so that the full parse can
+ * report the problem.
+ */
+class WireFilter {
+public:
+
+    /// Maximum number of predicates a filter can hold.
+    static const size_t MAX_PREDICATES = 64;
+
+    /// Keep only messages where the given varint field, read as a signed
+    /// 64-bit integer, is in [min, max].
+    WireFilter& require_range(uint32_t field_number, int64_t min, int64_t max);
+
+    /// Keep only messages where the given bool field has the given value.
+    WireFilter& require_bool(uint32_t field_number, bool value);
+
+    /// Keep only messages where the given string or bytes field starts with
+    /// the given prefix.
+    WireFilter& require_prefix(uint32_t field_number, const string& prefix);
+
+    /// Keep only messages where the given string or bytes field is exactly
+    /// the given value.
+    WireFilter& require_equal(uint32_t field_number, const string& value);
+
+    /// Return true if the filter has no predicates and accepts everything.
+    bool empty() const;
+
+    /// Return true if the given serialized message passes all predicates.
+    bool accepts(const string& serialized) const;
+
+    /// Return true if the serialized message in the given buffer passes all
+    /// predicates.
+    bool accepts(const char* data, size_t length) const;
+
+private:
+
+    /// What kind of test a predicate does
+    enum predicate_kind_t {
+        RANGE,
+        PREFIX,
+        EQUAL
+    };
+
+    /// A test on one field
+    struct Predicate {
+        uint32_t field_number;
+        predicate_kind_t kind;
+        int64_t min;
+        int64_t max;
+        string text;
+    };
+
+    /// All the predicates, which must all pass
+    vector<Predicate> predicates;
+
+    /// Bit mask of the predicates that pass on a message with all fields absent
+    uint64_t pass_on_default = 0;
+
+    /// Add a predicate and work out whether it passes on the default value.
+    WireFilter& add(Predicate&& predicate);
+
+    /// Return true if the predicate passes on the given varint value.
+    static bool passes(const Predicate& predicate, uint64_t value);
+
+    /// Return true if the predicate passes on the given length-delimited value.
+    static bool passes(const Predicate& predicate, const char* data, size_t length);
+};
+
+/**
+ * WireFilter with named predicates for the Alignment fields that are commonly
+ * used to discard reads.
+ */
+class AlignmentWireFilter : public WireFilter {
+public:
+    /// Keep only alignments with at least the given mapping quality.
+    AlignmentWireFilter& min_mapping_quality(int32_t mapq);
+    /// Keep only alignments with at least the given score.
+    AlignmentWireFilter& min_score(int32_t score);
+    /// Keep only alignments with the given secondary status.
+    AlignmentWireFilter& is_secondary(bool secondary);
+    /// Keep only alignments whose name starts with the given prefix.
+    AlignmentWireFilter& name_prefix(const string& prefix);
+    /// Keep only alignments in the given read group.
+    AlignmentWireFilter& read_group(const string& group);
+};
+
+}
+
+}
+
+#endif
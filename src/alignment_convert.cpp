@@ -0,0 +1,288 @@
+/**
+ * \file alignment_convert.cpp
+ * Implementations for converting alignment files between GAM and GAF.
+ */
+
+#include "vg/io/alignment_convert.hpp"
+#include "vg/io/batch_pool.hpp"
+#include "vg/io/gaf_formatter.hpp"
+#include "vg/io/line_block_reader.hpp"
+#include "vg/io/message_iterator.hpp"
+#include "vg/io/numa.hpp"
+#include "vg/io/protobuf_emitter.hpp"
+#include "vg/io/protobuf_iterator.hpp"
+#include "vg/io/registry.hpp"
+#include "vg/io/stream_multiplexer.hpp"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <omp.h>
+
+//#define debug
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Check that a format name is one we can convert, or throw.
+static void check_convert_format(const string& format) {
+    if (format != "GAM" && format != "GAF") {
+        throw runtime_error("Cannot convert alignments in unsupported format " + format);
+    }
+}
+
+/**
+ * Everything a thread needs to convert batches, so that its buffers are reused
+ * from batch to batch. Made by the thread that uses it.
+ */
+struct ConvertScratch {
+    ConvertScratch(const HandleGraph& graph) : node_cache(graph) {
+        // Nothing to do!
+    }
+    /// Parsed GAF input record
+    gafkluge::GafRecord record;
+    /// The alignment being converted
+    Alignment aln;
+    /// Node lengths and sequences, for GAF input
+    NodeCache node_cache;
+    /// Record formatter, for GAF output, which writes into the thread's
+    /// stream in the multiplexer
+    unique_ptr<GafFormatter> formatter;
+    /// Group compressor on the thread's output stream, for GAM output
+    unique_ptr<ProtobufEmitter<Alignment>> emitter;
+};
+
+size_t convert_alignments(const string& in_path, const string& in_format,
+                          const string& out_path, const string& out_format,
+                          const HandleGraph& graph, size_t threads,
+                          bool ordered, uint64_t batch_size) {
+
+    check_convert_format(in_format);
+    check_convert_format(out_format);
+    threads = max<size_t>(threads, 1);
+    batch_size = max<uint64_t>(batch_size, 1);
+
+    bool gaf_in = (in_format == "GAF");
+    bool gaf_out = (out_format == "GAF");
+
+    // Open the input before the output, so a bad input doesn't leave an empty
+    // output file behind.
+    htsFile* gaf_file = nullptr;
+    unique_ptr<ifstream> gam_file;
+    if (gaf_in) {
+        gaf_file = open_gaf(in_path, threads > 1 ? DEFAULT_DECOMPRESSION_THREADS : 0);
+    } else if (in_path != "-") {
+        gam_file.reset(new ifstream(in_path, ios::binary));
+        if (!*gam_file) {
+            throw runtime_error("Could not open " + in_path + " for reading GAM input");
+        }
+    }
+
+    unique_ptr<ofstream> out_file(out_path == "-" ? nullptr : new ofstream(out_path, ios::binary));
+    if (out_file.get() != nullptr && !*out_file) {
+        cerr << "[vg::io::convert_alignments] failed to open " << out_path << " for writing " << out_format << " output" << endl;
+        exit(1);
+    }
+
+    size_t batch_count = 0;
+    atomic<size_t> converted(0);
+    {
+        // The multiplexer has to go before the file it writes to.
+        StreamMultiplexer multiplexer(out_file.get() != nullptr ? *out_file : cout, threads);
+
+        // Don't have more than this many batches read but not yet written.
+        size_t max_batches_outstanding = 4 * threads;
+        if (ordered) {
+            // Output batches may wait this far ahead of the next one to be
+            // written. The reader finishes each window's worth of batches
+            // before starting on the next, so every batch in flight is
+            // inside the window and never has to wait for room.
+            multiplexer.set_ordered(max_batches_outstanding);
+        }
+
+        // Serialized GAM messages or GAF lines, decoded by the workers
+        BatchPool<RecordBatch<string>> pool;
+        vector<unique_ptr<ConvertScratch>> scratch(threads);
+
+        // Decode, convert, and encode one batch on the current thread, and
+        // hand its output to the multiplexer as the given unit of output.
+        auto process_batch = [&](RecordBatch<string>* batch, size_t sequence_number) {
+            size_t thread_number = omp_get_thread_num();
+            unique_ptr<ConvertScratch>& mine = scratch.at(thread_number);
+            if (mine.get() == nullptr) {
+                // Only the owning thread ever touches its slot, so no lock is needed.
+                mine.reset(new ConvertScratch(graph));
+                if (gaf_out) {
+                    mine->formatter.reset(new GafFormatter(graph));
+                } else {
+                    mine->emitter.reset(new ProtobufEmitter<Alignment>(multiplexer.get_thread_stream(thread_number)));
+                }
+            }
+
+            for (size_t i = 0; i < batch->size(); i++) {
+                const string& data = (*batch)[i];
+                if (gaf_in) {
+                    gafkluge::parse_gaf_record(data.data(), data.size(), mine->record);
+                    gaf_to_alignment(mine->node_cache, mine->record, mine->aln);
+                } else if (!ProtobufIterator<Alignment>::parse_from_string(mine->aln, data)) {
+                    throw runtime_error("obsolete, invalid, or corrupt protobuf input");
+                }
+                if (gaf_out) {
+                    mine->formatter->append(mine->aln, *multiplexer.get_thread_stream(thread_number).rdbuf());
+                } else {
+                    mine->emitter->write_copy(mine->aln);
+                }
+            }
+
+            if (!gaf_out) {
+                // Finish the group so the batch can be handed off whole.
+                mine->emitter->flush();
+            }
+            if (ordered) {
+                multiplexer.register_breakpoint(thread_number, sequence_number);
+            } else {
+                multiplexer.register_breakpoint(thread_number);
+            }
+
+            converted += batch->size();
+            pool.give_back(batch);
+        };
+
+        // number of batches currently being processed
+        size_t batches_outstanding = 0;
+#pragma omp parallel num_threads(threads) default(none) shared(batches_outstanding, max_batches_outstanding, batch_count, pool, process_batch, ordered, gaf_in, gaf_file, gam_file, batch_size, in_path, cin)
+#pragma omp single
+        {
+            // If asked, keep the reader next to the decompression buffers it
+            // fills for the duration of the loop.
+            ScopedNumaBinding producer_binding;
+
+            // Only one of these is used, depending on the input format.
+            unique_ptr<LineBlockReader> gaf_reader;
+            unique_ptr<MessageIterator> gam_reader;
+            if (gaf_in) {
+                gaf_reader.reset(new LineBlockReader(gaf_file));
+            } else {
+                gam_reader.reset(new MessageIterator(gam_file.get() != nullptr ? *gam_file : cin, false,
+                                                     omp_get_num_threads() > 1 ? DEFAULT_DECOMPRESSION_THREADS : 0));
+            }
+            bool first_message = true;
+
+            // Put the next record's data in the given string, or return false
+            // if there are no more records.
+            auto next_record = [&](string& data) {
+                if (gaf_in) {
+                    // An empty line ends the GAF, as with hts_getline().
+                    return gaf_reader->next_line(data) && !data.empty();
+                }
+                while (gam_reader->has_current()) {
+                    auto tag_and_data = std::move(gam_reader->take());
+                    if (!Registry::check_protobuf_tag<Alignment>(tag_and_data.first)) {
+                        if (first_message) {
+                            throw runtime_error("expected a stream of " + Alignment::descriptor()->full_name() +
+                                                " in " + in_path + " but found first message with tag " + tag_and_data.first);
+                        }
+                        // Skip messages of other types.
+                        continue;
+                    }
+                    first_message = false;
+                    if (tag_and_data.second.get() != nullptr) {
+                        data = std::move(*tag_and_data.second);
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            bool more_data = true;
+            while (more_data) {
+                RecordBatch<string>* batch = pool.take();
+                while (batch->size() < batch_size) {
+                    if (!next_record(batch->next_slot())) {
+                        more_data = false;
+                        break;
+                    }
+                    batch->commit_slot();
+                }
+
+                if (batch->empty()) {
+                    pool.give_back(batch);
+                    continue;
+                }
+
+                // Every non-empty batch is a unit of output, in input order.
+                size_t sequence_number = batch_count++;
+
+                size_t current_batches_outstanding;
+#pragma omp atomic capture
+                current_batches_outstanding = ++batches_outstanding;
+
+                if (current_batches_outstanding >= max_batches_outstanding && !ordered) {
+                    // Do this batch in the current thread because we've
+                    // spawned the maximum number of concurrent batch tasks.
+                    process_batch(batch, sequence_number);
+#pragma omp atomic update
+                    batches_outstanding--;
+                } else {
+#pragma omp task default(none) firstprivate(batch, sequence_number) shared(batches_outstanding, process_batch)
+                    {
+                        process_batch(batch, sequence_number);
+#pragma omp atomic update
+                        batches_outstanding--;
+                    }
+                    if (ordered && (sequence_number + 1) % max_batches_outstanding == 0) {
+                        // That was the last batch in this reorder window. A
+                        // batch from the next one could have to wait for room
+                        // behind a slow batch from this one, and the count of
+                        // batches in flight doesn't bound how far apart they
+                        // are. So help finish this window before going on.
+#pragma omp taskwait
+                    }
+                }
+            }
+#pragma omp taskwait
+        }
+
+        if (!gaf_out) {
+            // Each emitter ends its stream with an EOF marker as it goes away,
+            // wherever its thread's last batch landed. Drop those, and end the
+            // file once, after everything else, so the output doesn't depend
+            // on which threads did what.
+            for (size_t i = 0; i < threads; i++) {
+                scratch[i].reset();
+                multiplexer.discard_to_breakpoint(i);
+                if (!ordered) {
+                    // Make sure the thread's batches are out before the end.
+                    multiplexer.register_barrier(i);
+                }
+            }
+            {
+                // This also says what the file holds, if there were no alignments.
+                ProtobufEmitter<Alignment> trailer(multiplexer.get_thread_stream(0));
+            }
+            if (ordered) {
+                multiplexer.register_breakpoint(0, batch_count);
+            } else {
+                multiplexer.register_breakpoint(0);
+            }
+        }
+    }
+
+    if (gaf_file != nullptr) {
+        hts_close(gaf_file);
+    }
+
+#ifdef debug
+    cerr << "Converted " << converted << " alignments in " << batch_count << " batches from " << in_format << " to " << out_format << endl;
+#endif
+
+    return converted;
+}
+
+}
+
+}
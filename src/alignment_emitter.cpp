@@ -9,9 +9,11 @@
 #include "vg/io/json2pb.h"
 #include "vg/io/hfile_cppstream.hpp"
 #include "vg/io/stream.hpp"
+#include "vg/io/numa.hpp"
 #include <omp.h>
 
 #include <sstream>
+#include <algorithm>
 
 //#define debug
 
@@ -25,28 +27,60 @@ void AlignmentEmitter::emit_extra_message(const std::string& tag, std::string&&
     // Just throw away extra tagged data by default
 }
 
-// Implement all the single-read methods in terms of one-read batches
+// Implement all the single-read methods in terms of one-read batches. An
+// initializer list would copy, so move the records in.
 void AlignmentEmitter::emit_single(Alignment&& aln) {
-    vector<Alignment> batch = { aln };
+    vector<Alignment> batch;
+    batch.emplace_back(std::move(aln));
     emit_singles(std::move(batch));
 }
 void AlignmentEmitter::emit_mapped_single(vector<Alignment>&& alns) {
-    vector<vector<Alignment>> batch = { alns };
+    vector<vector<Alignment>> batch;
+    batch.emplace_back(std::move(alns));
     emit_mapped_singles(std::move(batch));
 }
 void AlignmentEmitter::emit_pair(Alignment&& aln1, Alignment&& aln2, int64_t tlen_limit) {
-    vector<Alignment> batch1 = { aln1 };
-    vector<Alignment> batch2 = { aln2 };
+    vector<Alignment> batch1;
+    batch1.emplace_back(std::move(aln1));
+    vector<Alignment> batch2;
+    batch2.emplace_back(std::move(aln2));
     vector<int64_t> tlen_limit_batch(1, tlen_limit);
     emit_pairs(std::move(batch1), std::move(batch2), std::move(tlen_limit_batch));
 }
 void AlignmentEmitter::emit_mapped_pair(vector<Alignment>&& alns1, vector<Alignment>&& alns2, int64_t tlen_limit) {
-    vector<vector<Alignment>> batch1 = { alns1 };
-    vector<vector<Alignment>> batch2 = { alns2 };
+    vector<vector<Alignment>> batch1;
+    batch1.emplace_back(std::move(alns1));
+    vector<vector<Alignment>> batch2;
+    batch2.emplace_back(std::move(alns2));
     vector<int64_t> tlen_limit_batch(1, tlen_limit);
     emit_mapped_pairs(std::move(batch1), std::move(batch2), std::move(tlen_limit_batch));
 }
 
+// Implement all the shared-batch methods by copying the batch.
+void AlignmentEmitter::emit_shared_singles(const vector<Alignment>& aln_batch) {
+    vector<Alignment> batch(aln_batch);
+    emit_singles(std::move(batch));
+}
+void AlignmentEmitter::emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch) {
+    vector<vector<Alignment>> batch(alns_batch);
+    emit_mapped_singles(std::move(batch));
+}
+void AlignmentEmitter::emit_shared_pairs(const vector<Alignment>& aln1_batch, const vector<Alignment>& aln2_batch,
+                                         const vector<int64_t>& tlen_limit_batch) {
+    vector<Alignment> batch1(aln1_batch);
+    vector<Alignment> batch2(aln2_batch);
+    vector<int64_t> tlen_limits(tlen_limit_batch);
+    emit_pairs(std::move(batch1), std::move(batch2), std::move(tlen_limits));
+}
+void AlignmentEmitter::emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+                                                const vector<vector<Alignment>>& alns2_batch,
+                                                const vector<int64_t>& tlen_limit_batch) {
+    vector<vector<Alignment>> batch1(alns1_batch);
+    vector<vector<Alignment>> batch2(alns2_batch);
+    vector<int64_t> tlen_limits(tlen_limit_batch);
+    emit_mapped_pairs(std::move(batch1), std::move(batch2), std::move(tlen_limits));
+}
+
 unique_ptr<AlignmentEmitter> get_non_hts_alignment_emitter(const string& filename, const string& format,
     const map<string, int64_t>& path_length, size_t max_threads, const HandleGraph* graph, const handlegraph::NamedNodeBackTranslation* translate_through) {
 
@@ -57,6 +91,8 @@ unique_ptr<AlignmentEmitter> get_non_hts_alignment_emitter(const string& filenam
         backing = new VGAlignmentEmitter(filename, format, max_threads);
     } else if (format == "GAF") {
         backing = new GafAlignmentEmitter(filename, format, *graph, max_threads, translate_through);
+    } else if (format == "GAFB") {
+        backing = new GafBinaryAlignmentEmitter(filename, format, *graph, max_threads, translate_through);
     } else if (format == "TSV") {
         backing = new TSVAlignmentEmitter(filename, max_threads);
     } else {
@@ -64,8 +100,560 @@ unique_ptr<AlignmentEmitter> get_non_hts_alignment_emitter(const string& filenam
         exit(1);
     }
     
-    // Wrap it in a unique_ptr that will delete it
-    return unique_ptr<AlignmentEmitter>(backing);
+    // Collect reads emitted one at a time into batches for it.
+    return unique_ptr<AlignmentEmitter>(new BufferedAlignmentEmitter(unique_ptr<AlignmentEmitter>(backing), max_threads));
+}
+
+/// Enough that breakpoints and per-batch locking are amortized.
+const size_t BufferedAlignmentEmitter::DEFAULT_MAX_BUFFERED_RECORDS = 256;
+/// Keep long reads from piling up.
+const size_t BufferedAlignmentEmitter::DEFAULT_MAX_BUFFERED_BYTES = 4 * 1024 * 1024;
+
+BufferedAlignmentEmitter::BufferedAlignmentEmitter(unique_ptr<AlignmentEmitter>&& backing, size_t max_threads,
+                                                   size_t max_buffered_records, size_t max_buffered_bytes) :
+    backing(std::move(backing)),
+    max_buffered_records(max(max_buffered_records, (size_t) 1)),
+    max_buffered_bytes(max_buffered_bytes),
+    buffers(max_threads) {
+    // Nothing to do!
+}
+
+BufferedAlignmentEmitter::~BufferedAlignmentEmitter() {
+    // No thread can be emitting now, so we can pass on everyone's records
+    // from here.
+    for (auto& buffer : buffers) {
+        if (buffer.get() != nullptr) {
+            flush(*buffer);
+        }
+    }
+    // The wrapped emitter is destroyed next, and flushes its output.
+}
+
+BufferedAlignmentEmitter::ThreadBuffer& BufferedAlignmentEmitter::get_buffer() {
+    auto& buffer = buffers.at(omp_get_thread_num());
+    if (buffer.get() == nullptr) {
+        // Only the owning thread ever touches its slot, so no lock is needed.
+        buffer.reset(new ThreadBuffer());
+    }
+    return *buffer;
+}
+
+size_t BufferedAlignmentEmitter::buffered_bytes(const Alignment& aln) {
+    // This is most of the size for long reads, and costs nothing to get.
+    return aln.sequence().size() + aln.quality().size();
+}
+
+void BufferedAlignmentEmitter::flush(ThreadBuffer& buffer) {
+    // Moving out of the vectors leaves them empty, so we can't reuse their
+    // allocations, but the wrapped emitter owns them now anyway.
+    if (!buffer.alns2.empty()) {
+        backing->emit_pairs(std::move(buffer.alns1), std::move(buffer.alns2), std::move(buffer.tlen_limits));
+    } else if (!buffer.alns1.empty()) {
+        backing->emit_singles(std::move(buffer.alns1));
+    } else if (!buffer.mapped2.empty()) {
+        backing->emit_mapped_pairs(std::move(buffer.mapped1), std::move(buffer.mapped2), std::move(buffer.tlen_limits));
+    } else if (!buffer.mapped1.empty()) {
+        backing->emit_mapped_singles(std::move(buffer.mapped1));
+    }
+    // Make sure everything is really empty and not just moved-from.
+    buffer.alns1.clear();
+    buffer.alns2.clear();
+    buffer.mapped1.clear();
+    buffer.mapped2.clear();
+    buffer.tlen_limits.clear();
+    buffer.bytes = 0;
+}
+
+void BufferedAlignmentEmitter::flush_if_full(ThreadBuffer& buffer, size_t records) {
+    if (records >= max_buffered_records || buffer.bytes >= max_buffered_bytes) {
+        flush(buffer);
+    }
+}
+
+void BufferedAlignmentEmitter::emit_extra_message(const std::string& tag, std::string&& data) {
+    flush(get_buffer());
+    backing->emit_extra_message(tag, std::move(data));
+}
+
+void BufferedAlignmentEmitter::emit_singles(vector<Alignment>&& aln_batch) {
+    flush(get_buffer());
+    backing->emit_singles(std::move(aln_batch));
+}
+
+void BufferedAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_batch) {
+    flush(get_buffer());
+    backing->emit_mapped_singles(std::move(alns_batch));
+}
+
+void BufferedAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
+                                          vector<Alignment>&& aln2_batch,
+                                          vector<int64_t>&& tlen_limit_batch) {
+    flush(get_buffer());
+    backing->emit_pairs(std::move(aln1_batch), std::move(aln2_batch), std::move(tlen_limit_batch));
+}
+
+void BufferedAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+                                                 vector<vector<Alignment>>&& alns2_batch,
+                                                 vector<int64_t>&& tlen_limit_batch) {
+    flush(get_buffer());
+    backing->emit_mapped_pairs(std::move(alns1_batch), std::move(alns2_batch), std::move(tlen_limit_batch));
+}
+
+void BufferedAlignmentEmitter::emit_single(Alignment&& aln) {
+    ThreadBuffer& buffer = get_buffer();
+    if (!buffer.alns2.empty() || !buffer.mapped1.empty()) {
+        // Something else is buffered, and has to go first.
+        flush(buffer);
+    }
+    buffer.bytes += buffered_bytes(aln);
+    buffer.alns1.emplace_back(std::move(aln));
+    flush_if_full(buffer, buffer.alns1.size());
+}
+
+void BufferedAlignmentEmitter::emit_mapped_single(vector<Alignment>&& alns) {
+    ThreadBuffer& buffer = get_buffer();
+    if (!buffer.alns1.empty() || !buffer.mapped2.empty()) {
+        // Something else is buffered, and has to go first.
+        flush(buffer);
+    }
+    for (auto& aln : alns) {
+        buffer.bytes += buffered_bytes(aln);
+    }
+    buffer.mapped1.emplace_back(std::move(alns));
+    flush_if_full(buffer, buffer.mapped1.size());
+}
+
+void BufferedAlignmentEmitter::emit_pair(Alignment&& aln1, Alignment&& aln2, int64_t tlen_limit) {
+    ThreadBuffer& buffer = get_buffer();
+    if (buffer.alns1.size() != buffer.alns2.size() || !buffer.mapped1.empty()) {
+        // Something else is buffered, and has to go first.
+        flush(buffer);
+    }
+    buffer.bytes += buffered_bytes(aln1) + buffered_bytes(aln2);
+    buffer.alns1.emplace_back(std::move(aln1));
+    buffer.alns2.emplace_back(std::move(aln2));
+    buffer.tlen_limits.push_back(tlen_limit);
+    flush_if_full(buffer, buffer.alns1.size());
+}
+
+void BufferedAlignmentEmitter::emit_mapped_pair(vector<Alignment>&& alns1, vector<Alignment>&& alns2, int64_t tlen_limit) {
+    ThreadBuffer& buffer = get_buffer();
+    if (buffer.mapped1.size() != buffer.mapped2.size() || !buffer.alns1.empty()) {
+        // Something else is buffered, and has to go first.
+        flush(buffer);
+    }
+    for (auto& aln : alns1) {
+        buffer.bytes += buffered_bytes(aln);
+    }
+    for (auto& aln : alns2) {
+        buffer.bytes += buffered_bytes(aln);
+    }
+    buffer.mapped1.emplace_back(std::move(alns1));
+    buffer.mapped2.emplace_back(std::move(alns2));
+    buffer.tlen_limits.push_back(tlen_limit);
+    flush_if_full(buffer, buffer.mapped1.size());
+}
+
+void BufferedAlignmentEmitter::emit_shared_singles(const vector<Alignment>& aln_batch) {
+    flush(get_buffer());
+    backing->emit_shared_singles(aln_batch);
+}
+
+void BufferedAlignmentEmitter::emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch) {
+    flush(get_buffer());
+    backing->emit_shared_mapped_singles(alns_batch);
+}
+
+void BufferedAlignmentEmitter::emit_shared_pairs(const vector<Alignment>& aln1_batch,
+                                                 const vector<Alignment>& aln2_batch,
+                                                 const vector<int64_t>& tlen_limit_batch) {
+    flush(get_buffer());
+    backing->emit_shared_pairs(aln1_batch, aln2_batch, tlen_limit_batch);
+}
+
+void BufferedAlignmentEmitter::emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+                                                        const vector<vector<Alignment>>& alns2_batch,
+                                                        const vector<int64_t>& tlen_limit_batch) {
+    flush(get_buffer());
+    backing->emit_shared_mapped_pairs(alns1_batch, alns2_batch, tlen_limit_batch);
+}
+
+/// Enough to keep a few formatters busy through a burst without holding
+/// too many alignments in memory.
+const size_t AsyncAlignmentEmitter::DEFAULT_MAX_QUEUED_BATCHES = 64;
+
+AsyncAlignmentEmitter::AsyncAlignmentEmitter(unique_ptr<AlignmentEmitter>&& backing, size_t formatter_threads,
+                                             size_t max_queued_batches) :
+    backing(std::move(backing)),
+    max_queued_batches(max(max_queued_batches, (size_t) 1)),
+    queues(max(formatter_threads, (size_t) 1)),
+    queued_batches(0),
+    stopping(false) {
+    
+    // Start the formatters only once everything is set up.
+    formatter_thread = thread(&AsyncAlignmentEmitter::run_formatters, this, queues.size());
+}
+
+AsyncAlignmentEmitter::~AsyncAlignmentEmitter() {
+    {
+        // Tell the formatters to stop once the queue is empty.
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_has_work.notify_all();
+    formatter_thread.join();
+    // The wrapped emitter is destroyed next, and flushes its output.
+}
+
+void AsyncAlignmentEmitter::emit_extra_message(const std::string& tag, std::string&& data) {
+    QueuedBatch batch;
+    batch.kind = QueuedBatch::EXTRA_MESSAGE;
+    batch.tag = tag;
+    batch.data = std::move(data);
+    enqueue(std::move(batch));
+}
+
+void AsyncAlignmentEmitter::emit_singles(vector<Alignment>&& aln_batch) {
+    QueuedBatch batch;
+    batch.kind = QueuedBatch::SINGLES;
+    batch.alns1 = std::move(aln_batch);
+    enqueue(std::move(batch));
+}
+
+void AsyncAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_batch) {
+    QueuedBatch batch;
+    batch.kind = QueuedBatch::MAPPED_SINGLES;
+    batch.mapped1 = std::move(alns_batch);
+    enqueue(std::move(batch));
+}
+
+void AsyncAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
+                                       vector<Alignment>&& aln2_batch,
+                                       vector<int64_t>&& tlen_limit_batch) {
+    QueuedBatch batch;
+    batch.kind = QueuedBatch::PAIRS;
+    batch.alns1 = std::move(aln1_batch);
+    batch.alns2 = std::move(aln2_batch);
+    batch.tlen_limits = std::move(tlen_limit_batch);
+    enqueue(std::move(batch));
+}
+
+void AsyncAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+                                              vector<vector<Alignment>>&& alns2_batch,
+                                              vector<int64_t>&& tlen_limit_batch) {
+    QueuedBatch batch;
+    batch.kind = QueuedBatch::MAPPED_PAIRS;
+    batch.mapped1 = std::move(alns1_batch);
+    batch.mapped2 = std::move(alns2_batch);
+    batch.tlen_limits = std::move(tlen_limit_batch);
+    enqueue(std::move(batch));
+}
+
+void AsyncAlignmentEmitter::enqueue(QueuedBatch&& batch) {
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        // Apply backpressure if the formatters are behind.
+        queue_has_room.wait(lock, [&]() {
+            return queued_batches < max_queued_batches;
+        });
+        // Deal new producers out to the formatters in turn.
+        auto found = producer_queues.emplace(this_thread::get_id(), producer_queues.size() % queues.size());
+        queues[found.first->second].emplace_back(std::move(batch));
+        queued_batches++;
+    }
+    // We can't wake just the right formatter, so wake them all.
+    queue_has_work.notify_all();
+}
+
+void AsyncAlignmentEmitter::run_formatters(size_t formatter_threads) {
+    // Start a team of our own, so the wrapped emitter sees OMP thread numbers.
+    #pragma omp parallel num_threads(formatter_threads)
+    {
+        // If we got a smaller team than we asked for, serve several queues.
+        size_t thread_number = omp_get_thread_num();
+        size_t team_size = omp_get_num_threads();
+        size_t next_queue = thread_number;
+        QueuedBatch batch;
+        while (true) {
+            {
+                unique_lock<mutex> lock(queue_mutex);
+                // Find one of our queues with work, starting after the last
+                // one we took from so none of them starves.
+                auto has_work = [&]() {
+                    for (size_t i = 0; i < queues.size(); i += team_size) {
+                        if (!queues[next_queue].empty()) {
+                            return true;
+                        }
+                        next_queue += team_size;
+                        if (next_queue >= queues.size()) {
+                            next_queue = thread_number;
+                        }
+                    }
+                    return false;
+                };
+                queue_has_work.wait(lock, [&]() {
+                    return has_work() || stopping;
+                });
+                if (queues[next_queue].empty()) {
+                    // We must be stopping, and there is nothing left to do.
+                    break;
+                }
+                batch = std::move(queues[next_queue].front());
+                queues[next_queue].pop_front();
+                queued_batches--;
+                next_queue += team_size;
+                if (next_queue >= queues.size()) {
+                    next_queue = thread_number;
+                }
+            }
+            queue_has_room.notify_one();
+            
+#ifdef debug
+            #pragma omp critical (cerr)
+            cerr << "AsyncAlignmentEmitter formatting a batch in thread " << omp_get_thread_num() << endl;
+#endif
+            
+            format(batch);
+        }
+    }
+}
+
+void AsyncAlignmentEmitter::format(QueuedBatch& batch) {
+    switch (batch.kind) {
+    case QueuedBatch::SINGLES:
+        backing->emit_singles(std::move(batch.alns1));
+        break;
+    case QueuedBatch::MAPPED_SINGLES:
+        backing->emit_mapped_singles(std::move(batch.mapped1));
+        break;
+    case QueuedBatch::PAIRS:
+        backing->emit_pairs(std::move(batch.alns1), std::move(batch.alns2), std::move(batch.tlen_limits));
+        break;
+    case QueuedBatch::MAPPED_PAIRS:
+        backing->emit_mapped_pairs(std::move(batch.mapped1), std::move(batch.mapped2), std::move(batch.tlen_limits));
+        break;
+    case QueuedBatch::EXTRA_MESSAGE:
+        backing->emit_extra_message(batch.tag, std::move(batch.data));
+        break;
+    }
+}
+
+ShardedAlignmentEmitter::ShardKeyFunction ShardedAlignmentEmitter::key_by_name() {
+    return [](const Alignment& aln) {
+        return std::hash<string>()(aln.name());
+    };
+}
+
+ShardedAlignmentEmitter::ShardKeyFunction ShardedAlignmentEmitter::key_by_refpos_path() {
+    return [](const Alignment& aln) -> size_t {
+        if (aln.refpos_size() == 0) {
+            return 0;
+        }
+        return std::hash<string>()(aln.refpos(0).name());
+    };
+}
+
+ShardedAlignmentEmitter::ShardKeyFunction ShardedAlignmentEmitter::key_by_first_node(nid_t node_range) {
+    if (node_range < 1) {
+        throw runtime_error("ShardedAlignmentEmitter: node range must be positive");
+    }
+    return [node_range](const Alignment& aln) -> size_t {
+        if (aln.path().mapping_size() == 0) {
+            return 0;
+        }
+        return aln.path().mapping(0).position().node_id() / node_range;
+    };
+}
+
+ShardedAlignmentEmitter::ShardedAlignmentEmitter(vector<unique_ptr<AlignmentEmitter>>&& shards,
+                                                 const ShardKeyFunction& shard_key) :
+    shards(std::move(shards)),
+    shard_key(shard_key) {
+    
+    if (this->shards.empty()) {
+        throw runtime_error("ShardedAlignmentEmitter: no shards to write to");
+    }
+}
+
+size_t ShardedAlignmentEmitter::shard_of(const Alignment& aln) const {
+    return shard_key(aln) % shards.size();
+}
+
+size_t ShardedAlignmentEmitter::shard_of(const vector<Alignment>& alns, const vector<Alignment>& fallback) const {
+    if (!alns.empty()) {
+        return shard_of(alns.front());
+    }
+    if (!fallback.empty()) {
+        return shard_of(fallback.front());
+    }
+    return 0;
+}
+
+void ShardedAlignmentEmitter::emit_extra_message(const std::string& tag, std::string&& data) {
+    for (size_t i = 0; i + 1 < shards.size(); i++) {
+        shards[i]->emit_extra_message(tag, string(data));
+    }
+    // The last one can have the original.
+    shards.back()->emit_extra_message(tag, std::move(data));
+}
+
+void ShardedAlignmentEmitter::emit_singles(vector<Alignment>&& aln_batch) {
+    vector<vector<Alignment>> split(shards.size());
+    for (auto& aln : aln_batch) {
+        split[shard_of(aln)].emplace_back(std::move(aln));
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (!split[i].empty()) {
+            shards[i]->emit_singles(std::move(split[i]));
+        }
+    }
+}
+
+void ShardedAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_batch) {
+    vector<vector<vector<Alignment>>> split(shards.size());
+    vector<Alignment> no_fallback;
+    for (auto& alns : alns_batch) {
+        split[shard_of(alns, no_fallback)].emplace_back(std::move(alns));
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (!split[i].empty()) {
+            shards[i]->emit_mapped_singles(std::move(split[i]));
+        }
+    }
+}
+
+void ShardedAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
+                                         vector<Alignment>&& aln2_batch,
+                                         vector<int64_t>&& tlen_limit_batch) {
+    assert(aln1_batch.size() == aln2_batch.size());
+    vector<vector<Alignment>> split1(shards.size());
+    vector<vector<Alignment>> split2(shards.size());
+    vector<vector<int64_t>> split_tlen_limits(shards.size());
+    for (size_t i = 0; i < aln1_batch.size(); i++) {
+        // Go by the first end, so the pair stays together.
+        size_t shard = shard_of(aln1_batch[i]);
+        split1[shard].emplace_back(std::move(aln1_batch[i]));
+        split2[shard].emplace_back(std::move(aln2_batch[i]));
+        split_tlen_limits[shard].push_back(i < tlen_limit_batch.size() ? tlen_limit_batch[i] : 0);
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (!split1[i].empty()) {
+            shards[i]->emit_pairs(std::move(split1[i]), std::move(split2[i]), std::move(split_tlen_limits[i]));
+        }
+    }
+}
+
+void ShardedAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+                                                vector<vector<Alignment>>&& alns2_batch,
+                                                vector<int64_t>&& tlen_limit_batch) {
+    assert(alns1_batch.size() == alns2_batch.size());
+    vector<vector<vector<Alignment>>> split1(shards.size());
+    vector<vector<vector<Alignment>>> split2(shards.size());
+    vector<vector<int64_t>> split_tlen_limits(shards.size());
+    for (size_t i = 0; i < alns1_batch.size(); i++) {
+        // Go by the first end, so the pair stays together.
+        size_t shard = shard_of(alns1_batch[i], alns2_batch[i]);
+        split1[shard].emplace_back(std::move(alns1_batch[i]));
+        split2[shard].emplace_back(std::move(alns2_batch[i]));
+        split_tlen_limits[shard].push_back(i < tlen_limit_batch.size() ? tlen_limit_batch[i] : 0);
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (!split1[i].empty()) {
+            shards[i]->emit_mapped_pairs(std::move(split1[i]), std::move(split2[i]), std::move(split_tlen_limits[i]));
+        }
+    }
+}
+
+void ShardedAlignmentEmitter::emit_single(Alignment&& aln) {
+    // Let the shard buffer single reads if it wants to.
+    size_t shard = shard_of(aln);
+    shards[shard]->emit_single(std::move(aln));
+}
+
+void ShardedAlignmentEmitter::emit_mapped_single(vector<Alignment>&& alns) {
+    size_t shard = shard_of(alns, vector<Alignment>());
+    shards[shard]->emit_mapped_single(std::move(alns));
+}
+
+void ShardedAlignmentEmitter::emit_pair(Alignment&& aln1, Alignment&& aln2, int64_t tlen_limit) {
+    size_t shard = shard_of(aln1);
+    shards[shard]->emit_pair(std::move(aln1), std::move(aln2), tlen_limit);
+}
+
+void ShardedAlignmentEmitter::emit_mapped_pair(vector<Alignment>&& alns1, vector<Alignment>&& alns2, int64_t tlen_limit) {
+    size_t shard = shard_of(alns1, alns2);
+    shards[shard]->emit_mapped_pair(std::move(alns1), std::move(alns2), tlen_limit);
+}
+
+TeeAlignmentEmitter::TeeAlignmentEmitter(vector<unique_ptr<AlignmentEmitter>>&& backings) :
+    backings(std::move(backings)) {
+    
+    if (this->backings.empty()) {
+        throw runtime_error("TeeAlignmentEmitter: no emitters to write to");
+    }
+}
+
+void TeeAlignmentEmitter::for_each_backing(const function<void(AlignmentEmitter&)>& iteratee) {
+    // Stay in this thread: a task or taskwait here would let the thread pick
+    // up other work partway through, and emitters that buffer per thread
+    // number could then have the same buffer in use twice at once.
+    for (auto& backing : backings) {
+        iteratee(*backing);
+    }
+}
+
+void TeeAlignmentEmitter::emit_extra_message(const std::string& tag, std::string&& data) {
+    for_each_backing([&](AlignmentEmitter& backing) {
+        backing.emit_extra_message(tag, string(data));
+    });
+}
+
+void TeeAlignmentEmitter::emit_singles(vector<Alignment>&& aln_batch) {
+    emit_shared_singles(aln_batch);
+}
+
+void TeeAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_batch) {
+    emit_shared_mapped_singles(alns_batch);
+}
+
+void TeeAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
+                                     vector<Alignment>&& aln2_batch,
+                                     vector<int64_t>&& tlen_limit_batch) {
+    emit_shared_pairs(aln1_batch, aln2_batch, tlen_limit_batch);
+}
+
+void TeeAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+                                            vector<vector<Alignment>>&& alns2_batch,
+                                            vector<int64_t>&& tlen_limit_batch) {
+    emit_shared_mapped_pairs(alns1_batch, alns2_batch, tlen_limit_batch);
+}
+
+void TeeAlignmentEmitter::emit_shared_singles(const vector<Alignment>& aln_batch) {
+    for_each_backing([&](AlignmentEmitter& backing) {
+        backing.emit_shared_singles(aln_batch);
+    });
+}
+
+void TeeAlignmentEmitter::emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch) {
+    for_each_backing([&](AlignmentEmitter& backing) {
+        backing.emit_shared_mapped_singles(alns_batch);
+    });
+}
+
+void TeeAlignmentEmitter::emit_shared_pairs(const vector<Alignment>& aln1_batch,
+                                            const vector<Alignment>& aln2_batch,
+                                            const vector<int64_t>& tlen_limit_batch) {
+    for_each_backing([&](AlignmentEmitter& backing) {
+        backing.emit_shared_pairs(aln1_batch, aln2_batch, tlen_limit_batch);
+    });
+}
+
+void TeeAlignmentEmitter::emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+                                                   const vector<vector<Alignment>>& alns2_batch,
+                                                   const vector<int64_t>& tlen_limit_batch) {
+    for_each_backing([&](AlignmentEmitter& backing) {
+        backing.emit_shared_mapped_pairs(alns1_batch, alns2_batch, tlen_limit_batch);
+    });
 }
 
 TSVAlignmentEmitter::TSVAlignmentEmitter(const string& filename, size_t max_threads) :
@@ -80,52 +668,73 @@ TSVAlignmentEmitter::TSVAlignmentEmitter(const string& filename, size_t max_thre
 }
 
 void TSVAlignmentEmitter::emit_singles(vector<Alignment>&& aln_batch) {
-    for (auto&& aln : aln_batch) {
-        emit(std::move(aln));
+    // We only read the alignments, so there is no need to take them.
+    emit_shared_singles(aln_batch);
+}
+
+void TSVAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_batch) {
+    emit_shared_mapped_singles(alns_batch);
+}
+
+void TSVAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
+                                     vector<Alignment>&& aln2_batch, 
+                                     vector<int64_t>&& tlen_limit_batch) {
+    emit_shared_pairs(aln1_batch, aln2_batch, tlen_limit_batch);
+}
+
+void TSVAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+                                            vector<vector<Alignment>>&& alns2_batch,
+                                            vector<int64_t>&& tlen_limit_batch) {
+    emit_shared_mapped_pairs(alns1_batch, alns2_batch, tlen_limit_batch);
+}
+
+void TSVAlignmentEmitter::emit_shared_singles(const vector<Alignment>& aln_batch) {
+    for (auto& aln : aln_batch) {
+        emit(aln);
     }
     multiplexer.register_breakpoint(omp_get_thread_num());
 }
 
-void TSVAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_batch) {
-    for (auto&& alns : alns_batch) {
-        for (auto&& aln : alns) {
-            emit(std::move(aln));
+void TSVAlignmentEmitter::emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch) {
+    for (auto& alns : alns_batch) {
+        for (auto& aln : alns) {
+            emit(aln);
         }
     }
     multiplexer.register_breakpoint(omp_get_thread_num());
 }
 
-void TSVAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
-                                     vector<Alignment>&& aln2_batch, 
-                                     vector<int64_t>&& tlen_limit_batch) {
+void TSVAlignmentEmitter::emit_shared_pairs(const vector<Alignment>& aln1_batch,
+                                            const vector<Alignment>& aln2_batch, 
+                                            const vector<int64_t>& tlen_limit_batch) {
     // Ignore the tlen limit.
     assert(aln1_batch.size() == aln2_batch.size());
     for (size_t i = 0; i < aln1_batch.size(); i++) {
         // Emit each pair in order as read 1, then read 2
-        emit(std::move(aln1_batch[i]));
-        emit(std::move(aln2_batch[i]));
+        emit(aln1_batch[i]);
+        emit(aln2_batch[i]);
     }
     multiplexer.register_breakpoint(omp_get_thread_num());
 }
 
 
-void TSVAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
-                                            vector<vector<Alignment>>&& alns2_batch,
-                                            vector<int64_t>&& tlen_limit_batch) {
+void TSVAlignmentEmitter::emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+                                                   const vector<vector<Alignment>>& alns2_batch,
+                                                   const vector<int64_t>& tlen_limit_batch) {
     assert(alns1_batch.size() == alns2_batch.size());
     for (size_t i = 0; i < alns1_batch.size(); i++) {
         // For each pair
         assert(alns1_batch[i].size() == alns2_batch[i].size());
         for (size_t j = 0; j < alns1_batch[i].size(); j++) {
             // Emit read 1 and read 2 pairs, together
-            emit(std::move(alns1_batch[i][j]));
-            emit(std::move(alns2_batch[i][j]));
+            emit(alns1_batch[i][j]);
+            emit(alns2_batch[i][j]);
         }
     }
     multiplexer.register_breakpoint(omp_get_thread_num());
 }
 
-void TSVAlignmentEmitter::emit(Alignment&& aln) {
+void TSVAlignmentEmitter::emit(const Alignment& aln) {
     Position refpos;
     if (aln.refpos_size()) {
         refpos = aln.refpos(0);
@@ -168,11 +777,15 @@ VGAlignmentEmitter::VGAlignmentEmitter(const string& filename, const string& for
     
     if (format == "GAM") {
         // We need per-thread emitters
-        proto.reserve(max_threads);
-        for (size_t i = 0; i < max_threads; i++) {
-            // Make an emitter for each thread.
-            proto.emplace_back(new vg::io::ProtobufEmitter<Alignment>(multiplexer.get_thread_stream(i)));
+        proto.resize(max_threads);
+        if (!numa_aware()) {
+            for (size_t i = 0; i < max_threads; i++) {
+                // Make an emitter for each thread.
+                proto[i].reset(new vg::io::ProtobufEmitter<Alignment>(multiplexer.get_thread_stream(i)));
+            }
         }
+        // Otherwise each thread makes its own on first use, so its
+        // compression buffers are allocated on the thread's NUMA node.
     }
     
     // We later infer our format and output destination from out_file and proto being empty/set.
@@ -189,7 +802,16 @@ VGAlignmentEmitter::~VGAlignmentEmitter() {
 #endif
 
     if (!proto.empty()) {
+        if (std::none_of(proto.begin(), proto.end(), [](const unique_ptr<vg::io::ProtobufEmitter<Alignment>>& emitter) {
+            return emitter.get() != nullptr;
+        })) {
+            // Nobody wrote anything, but the file still needs to say what type it holds.
+            get_proto(0);
+        }
         for (auto& emitter : proto) {
+            if (emitter.get() == nullptr) {
+                continue;
+            }
             // Flush each ProtobufEmitter
             emitter->flush(); 
             // Make it go away before the stream
@@ -202,6 +824,15 @@ VGAlignmentEmitter::~VGAlignmentEmitter() {
 #endif
 }
 
+vg::io::ProtobufEmitter<Alignment>& VGAlignmentEmitter::get_proto(size_t thread_number) {
+    auto& emitter = proto.at(thread_number);
+    if (emitter.get() == nullptr) {
+        // Only the owning thread ever touches its slot, so no lock is needed.
+        emitter.reset(new vg::io::ProtobufEmitter<Alignment>(multiplexer.get_thread_stream(thread_number)));
+    }
+    return *emitter;
+}
+
 void VGAlignmentEmitter::emit_extra_message(const std::string& tag, std::string&& data) {
     if (!proto.empty()) {
         // We are using Protobuf as the output format so we can hide this message in here under our thread.
@@ -214,7 +845,7 @@ void VGAlignmentEmitter::emit_extra_message(const std::string& tag, std::string&
         
         
         // Flush the Protobuf emitter
-        proto[thread_number]->flush();
+        get_proto(thread_number).flush();
         {
             // Sneakily make a compressed message emitter on the same stream
             vg::io::MessageEmitter emitter(multiplexer.get_thread_stream(thread_number), true);
@@ -242,11 +873,11 @@ void VGAlignmentEmitter::emit_singles(vector<Alignment>&& aln_batch) {
         #pragma omp critical (cerr)
         cerr << "VGAlignmentEmitter emitting " << aln_batch.size() << " reads to Protobuf in thread " << thread_number << endl;
 #endif
-        proto[thread_number]->write_many(std::move(aln_batch));
+        get_proto(thread_number).write_many(std::move(aln_batch));
         if (multiplexer.want_breakpoint(thread_number)) {
             // The multiplexer wants our data.
             // Flush and create a breakpoint.
-            proto[thread_number]->flush();
+            get_proto(thread_number).flush();
             multiplexer.register_breakpoint(thread_number);
         }
     } else {
@@ -287,11 +918,11 @@ void VGAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_ba
         }
         
         // Save in protobuf
-        proto[thread_number]->write_many(std::move(all));
+        get_proto(thread_number).write_many(std::move(all));
         if (multiplexer.want_breakpoint(thread_number)) {
             // The multiplexer wants our data.
             // Flush and create a breakpoint.
-            proto[thread_number]->flush();
+            get_proto(thread_number).flush();
             multiplexer.register_breakpoint(thread_number);
 #ifdef debug
             cerr << "Sent breakpoint from thread " << thread_number << endl;
@@ -338,11 +969,11 @@ void VGAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
         }
         
         // Save in protobuf
-        proto[thread_number]->write_many(std::move(all));
+        get_proto(thread_number).write_many(std::move(all));
         if (multiplexer.want_breakpoint(thread_number)) {
             // The multiplexer wants our data.
             // Flush and create a breakpoint.
-            proto[thread_number]->flush();
+            get_proto(thread_number).flush();
             multiplexer.register_breakpoint(thread_number);
         }
     } else {
@@ -397,11 +1028,11 @@ void VGAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_bat
         }
         
         // Save in protobuf
-        proto[thread_number]->write_many(std::move(all));
+        get_proto(thread_number).write_many(std::move(all));
         if (multiplexer.want_breakpoint(thread_number)) {
             // The multiplexer wants our data.
             // Flush and create a breakpoint.
-            proto[thread_number]->flush();
+            get_proto(thread_number).flush();
             multiplexer.register_breakpoint(thread_number);
         }
     } else {
@@ -420,6 +1051,79 @@ void VGAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_bat
     }
 }
 
+void VGAlignmentEmitter::emit_in_order(const vector<const Alignment*>& alns) {
+    size_t thread_number = omp_get_thread_num();
+    if (!proto.empty()) {
+        if (alns.empty()) {
+            // Nothing to do
+            return;
+        }
+        // Serialize straight from the shared alignments.
+        get_proto(thread_number).write_many_copy(alns);
+        if (multiplexer.want_breakpoint(thread_number)) {
+            // The multiplexer wants our data.
+            // Flush and create a breakpoint.
+            get_proto(thread_number).flush();
+            multiplexer.register_breakpoint(thread_number);
+        }
+    } else {
+        for (const Alignment* aln : alns) {
+            multiplexer.get_thread_stream(thread_number) << pb2json(*aln) << endl;
+        }
+        // No need to flush, we can always register a breakpoint.
+        multiplexer.register_breakpoint(thread_number);
+    }
+}
+
+void VGAlignmentEmitter::emit_shared_singles(const vector<Alignment>& aln_batch) {
+    vector<const Alignment*> alns;
+    alns.reserve(aln_batch.size());
+    for (auto& aln : aln_batch) {
+        alns.push_back(&aln);
+    }
+    emit_in_order(alns);
+}
+
+void VGAlignmentEmitter::emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch) {
+    vector<const Alignment*> alns;
+    for (auto& group : alns_batch) {
+        for (auto& aln : group) {
+            alns.push_back(&aln);
+        }
+    }
+    emit_in_order(alns);
+}
+
+void VGAlignmentEmitter::emit_shared_pairs(const vector<Alignment>& aln1_batch,
+                                           const vector<Alignment>& aln2_batch,
+                                           const vector<int64_t>& tlen_limit_batch) {
+    assert(aln1_batch.size() == aln2_batch.size());
+    // Collate the pairs
+    vector<const Alignment*> alns;
+    alns.reserve(aln1_batch.size() * 2);
+    for (size_t i = 0; i < aln1_batch.size(); i++) {
+        alns.push_back(&aln1_batch[i]);
+        alns.push_back(&aln2_batch[i]);
+    }
+    emit_in_order(alns);
+}
+
+void VGAlignmentEmitter::emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+                                                  const vector<vector<Alignment>>& alns2_batch,
+                                                  const vector<int64_t>& tlen_limit_batch) {
+    assert(alns1_batch.size() == alns2_batch.size());
+    // Interleave the ends of each pair
+    vector<const Alignment*> alns;
+    for (size_t i = 0; i < alns1_batch.size(); i++) {
+        assert(alns1_batch[i].size() == alns2_batch[i].size());
+        for (size_t j = 0; j < alns1_batch[i].size(); j++) {
+            alns.push_back(&alns1_batch[i][j]);
+            alns.push_back(&alns2_batch[i][j]);
+        }
+    }
+    emit_in_order(alns);
+}
+
 GafAlignmentEmitter::GafAlignmentEmitter(const string& filename,
                                          const string& format,
                                          const HandleGraph& graph,
@@ -427,7 +1131,7 @@ GafAlignmentEmitter::GafAlignmentEmitter(const string& filename,
                                          const handlegraph::NamedNodeBackTranslation* translate_through):
     out_file(filename == "-" ? nullptr : new ofstream(filename)),
     multiplexer(out_file.get() != nullptr ? *out_file : cout, max_threads),
-    graph(graph), translate_through(translate_through) {
+    graph(graph), translate_through(translate_through), formatters(max_threads) {
     
     // We only support GAF format
     assert(format == "GAF");
@@ -468,22 +1172,62 @@ GafAlignmentEmitter::~GafAlignmentEmitter() {
 #endif
 }
 
+GafFormatter& GafAlignmentEmitter::get_formatter(size_t thread_number) {
+    auto& formatter = formatters.at(thread_number);
+    if (!formatter) {
+        // Make the formatter the first time the thread needs it.
+        formatter.reset(new GafFormatter(graph, translate_through));
+    }
+    return *formatter;
+}
+
+streambuf& GafAlignmentEmitter::get_output(size_t thread_number) {
+    // Formatters write into the multiplexer's chunks directly, without going
+    // through the ostream or a string of our own.
+    return *multiplexer.get_thread_stream(thread_number).rdbuf();
+}
+
 void GafAlignmentEmitter::emit_singles(vector<Alignment>&& aln_batch) {
+    // We only read the alignments, so there is no need to take them.
+    emit_shared_singles(aln_batch);
+}
+
+void GafAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_batch) {
+    emit_shared_mapped_singles(alns_batch);
+}
+
+void GafAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
+                                    vector<Alignment>&& aln2_batch,
+                                    vector<int64_t>&& tlen_limit_batch) {
+    emit_shared_pairs(aln1_batch, aln2_batch, tlen_limit_batch);
+}
+
+void GafAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+                                           vector<vector<Alignment>>&& alns2_batch,
+                                           vector<int64_t>&& tlen_limit_batch) {
+    emit_shared_mapped_pairs(alns1_batch, alns2_batch, tlen_limit_batch);
+}
+
+void GafAlignmentEmitter::emit_shared_singles(const vector<Alignment>& aln_batch) {
     size_t thread_number = omp_get_thread_num();
-    // Serialize to a string in our thread
+    GafFormatter& formatter = get_formatter(thread_number);
+    streambuf& out = get_output(thread_number);
+    // Serialize in our thread
     for (auto& aln : aln_batch) {
-        multiplexer.get_thread_stream(thread_number) << alignment_to_gaf(graph, aln, translate_through) << endl;
+        formatter.append(aln, out);
     }
     // No need to flush, we can always register a breakpoint.
     multiplexer.register_breakpoint(thread_number);
 }
 
-void GafAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_batch) {
+void GafAlignmentEmitter::emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch) {
     size_t thread_number = omp_get_thread_num();
-    // Serialize to a string in our thread
+    GafFormatter& formatter = get_formatter(thread_number);
+    streambuf& out = get_output(thread_number);
+    // Serialize in our thread
     for (auto& alns : alns_batch) {
         for (auto& aln : alns) {
-            multiplexer.get_thread_stream(thread_number) << alignment_to_gaf(graph, aln, translate_through) << endl;
+            formatter.append(aln, out);
         }
     }
     // No need to flush, we can always register a breakpoint.
@@ -493,43 +1237,198 @@ void GafAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_b
 #endif
 }
 
-void GafAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
-                                    vector<Alignment>&& aln2_batch,
-                                    vector<int64_t>&& tlen_limit_batch) {
+void GafAlignmentEmitter::emit_shared_pairs(const vector<Alignment>& aln1_batch,
+                                           const vector<Alignment>& aln2_batch,
+                                           const vector<int64_t>& tlen_limit_batch) {
     // Sizes need to match up
     assert(aln1_batch.size() == aln2_batch.size());
     assert(aln1_batch.size() == tlen_limit_batch.size());
     
     size_t thread_number = omp_get_thread_num();
+    GafFormatter& formatter = get_formatter(thread_number);
+    streambuf& out = get_output(thread_number);
     
-    // Serialize to a string in our thread in collated order
+    // Serialize in our thread in collated order
     for (size_t i = 0; i < aln1_batch.size(); i++) {
-        multiplexer.get_thread_stream(thread_number) << alignment_to_gaf(graph, aln1_batch[i], translate_through) << endl
-                                                     << alignment_to_gaf(graph, aln2_batch[i], translate_through) << endl;
+        formatter.append(aln1_batch[i], out);
+        formatter.append(aln2_batch[i], out);
     }
     // No need to flush, we can always register a breakpoint.
     multiplexer.register_breakpoint(thread_number);
 }
 
-void GafAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
-                                           vector<vector<Alignment>>&& alns2_batch,
-                                           vector<int64_t>&& tlen_limit_batch) {
+void GafAlignmentEmitter::emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+                                                  const vector<vector<Alignment>>& alns2_batch,
+                                                  const vector<int64_t>& tlen_limit_batch) {
     // Sizes need to match up
     assert(alns1_batch.size() == alns2_batch.size());
     assert(alns1_batch.size() == tlen_limit_batch.size());
     
     size_t thread_number = omp_get_thread_num();
-    // Serialize to an interleaved string in our thread
+    GafFormatter& formatter = get_formatter(thread_number);
+    streambuf& out = get_output(thread_number);
+    // Serialize interleaved in our thread
     for (size_t i = 0; i < alns1_batch.size(); i++) {
         assert(alns1_batch[i].size() == alns1_batch[i].size());
         for (size_t j = 0; j < alns1_batch[i].size(); j++) {
-            multiplexer.get_thread_stream(thread_number) << alignment_to_gaf(graph, alns1_batch[i][j], translate_through) << endl
-                                                         << alignment_to_gaf(graph, alns2_batch[i][j], translate_through) << endl;
+            formatter.append(alns1_batch[i][j], out);
+            formatter.append(alns2_batch[i][j], out);
         }
     }
     // No need to flush, we can always register a breakpoint.
     multiplexer.register_breakpoint(thread_number);
 }
 
+GafBinaryAlignmentEmitter::GafBinaryAlignmentEmitter(const string& filename,
+                                                     const string& format,
+                                                     const HandleGraph& graph,
+                                                     size_t max_threads,
+                                                     const handlegraph::NamedNodeBackTranslation* translate_through):
+    out_file(filename == "-" ? nullptr : new ofstream(filename, ios::binary)),
+    multiplexer(out_file.get() != nullptr ? *out_file : cout, max_threads),
+    graph(graph), translate_through(translate_through), states(max_threads) {
+    
+    // We only support GAFB format
+    assert(format == "GAFB");
+    
+    if (filename != "-") {
+        // Check the file
+        if (!*out_file) {
+            // We couldn't get it open
+            cerr << "[vg::GafBinaryAlignmentEmitter] failed to open " << filename << " for writing " << format << " output" << endl;
+            exit(1);
+        }
+    }
+    
+    // The header has to come out before any thread's blocks.
+    write_gaf_binary_header(multiplexer.get_thread_stream(0));
+    multiplexer.register_barrier(0);
+}
+
+GafBinaryAlignmentEmitter::~GafBinaryAlignmentEmitter() {
+    // No thread can be emitting now, so we can send everyone's last block
+    // from here.
+    for (size_t i = 0; i < states.size(); i++) {
+        if (states[i].get() != nullptr) {
+            send_block(i, true);
+        }
+    }
+    // Make sure all the blocks are out before the end.
+    for (size_t i = 0; i < states.size(); i++) {
+        multiplexer.register_barrier(i);
+    }
+    write_gaf_binary_end(multiplexer.get_thread_stream(0));
+    multiplexer.register_breakpoint(0);
+    
+#ifdef debug
+    cerr << "Destroyed GafBinaryAlignmentEmitter" << endl;
+#endif
+}
+
+GafBinaryAlignmentEmitter::ThreadState& GafBinaryAlignmentEmitter::get_state(size_t thread_number) {
+    auto& state = states.at(thread_number);
+    if (!state) {
+        // Make the state the first time the thread needs it.
+        state.reset(new ThreadState(graph));
+    }
+    return *state;
+}
+
+void GafBinaryAlignmentEmitter::add(ThreadState& state, const Alignment& aln) {
+    alignment_to_gaf(state.node_cache, aln, state.record, state.scratch, translate_through);
+    state.encoder.add(state.record);
+}
+
+void GafBinaryAlignmentEmitter::send_block(size_t thread_number, bool force) {
+    ThreadState& state = get_state(thread_number);
+    if (!force && !state.encoder.full()) {
+        // Keep filling the block.
+        return;
+    }
+    state.encoder.finish_block(state.buffer);
+    // Copy it all into the multiplexer's chunks at once.
+    multiplexer.get_thread_stream(thread_number).write(state.buffer.data(), state.buffer.size());
+    state.buffer.clear();
+    // Blocks stand alone, so we can always register a breakpoint.
+    multiplexer.register_breakpoint(thread_number);
+}
+
+void GafBinaryAlignmentEmitter::emit_singles(vector<Alignment>&& aln_batch) {
+    // We only read the alignments, so there is no need to take them.
+    emit_shared_singles(aln_batch);
+}
+
+void GafBinaryAlignmentEmitter::emit_mapped_singles(vector<vector<Alignment>>&& alns_batch) {
+    emit_shared_mapped_singles(alns_batch);
+}
+
+void GafBinaryAlignmentEmitter::emit_pairs(vector<Alignment>&& aln1_batch,
+                                           vector<Alignment>&& aln2_batch,
+                                           vector<int64_t>&& tlen_limit_batch) {
+    emit_shared_pairs(aln1_batch, aln2_batch, tlen_limit_batch);
+}
+
+void GafBinaryAlignmentEmitter::emit_mapped_pairs(vector<vector<Alignment>>&& alns1_batch,
+                                                  vector<vector<Alignment>>&& alns2_batch,
+                                                  vector<int64_t>&& tlen_limit_batch) {
+    emit_shared_mapped_pairs(alns1_batch, alns2_batch, tlen_limit_batch);
+}
+
+void GafBinaryAlignmentEmitter::emit_shared_singles(const vector<Alignment>& aln_batch) {
+    size_t thread_number = omp_get_thread_num();
+    ThreadState& state = get_state(thread_number);
+    for (auto& aln : aln_batch) {
+        add(state, aln);
+    }
+    send_block(thread_number);
+}
+
+void GafBinaryAlignmentEmitter::emit_shared_mapped_singles(const vector<vector<Alignment>>& alns_batch) {
+    size_t thread_number = omp_get_thread_num();
+    ThreadState& state = get_state(thread_number);
+    for (auto& alns : alns_batch) {
+        for (auto& aln : alns) {
+            add(state, aln);
+        }
+    }
+    send_block(thread_number);
+}
+
+void GafBinaryAlignmentEmitter::emit_shared_pairs(const vector<Alignment>& aln1_batch,
+                                                  const vector<Alignment>& aln2_batch,
+                                                  const vector<int64_t>& tlen_limit_batch) {
+    // Sizes need to match up
+    assert(aln1_batch.size() == aln2_batch.size());
+    assert(aln1_batch.size() == tlen_limit_batch.size());
+    
+    size_t thread_number = omp_get_thread_num();
+    ThreadState& state = get_state(thread_number);
+    // Add in collated order, so mates end up next to each other in a block
+    for (size_t i = 0; i < aln1_batch.size(); i++) {
+        add(state, aln1_batch[i]);
+        add(state, aln2_batch[i]);
+    }
+    send_block(thread_number);
+}
+
+void GafBinaryAlignmentEmitter::emit_shared_mapped_pairs(const vector<vector<Alignment>>& alns1_batch,
+                                                         const vector<vector<Alignment>>& alns2_batch,
+                                                         const vector<int64_t>& tlen_limit_batch) {
+    // Sizes need to match up
+    assert(alns1_batch.size() == alns2_batch.size());
+    assert(alns1_batch.size() == tlen_limit_batch.size());
+    
+    size_t thread_number = omp_get_thread_num();
+    ThreadState& state = get_state(thread_number);
+    for (size_t i = 0; i < alns1_batch.size(); i++) {
+        assert(alns1_batch[i].size() == alns2_batch[i].size());
+        for (size_t j = 0; j < alns1_batch[i].size(); j++) {
+            add(state, alns1_batch[i][j]);
+            add(state, alns2_batch[i][j]);
+        }
+    }
+    send_block(thread_number);
+}
+
 }
 }
@@ -1,10 +1,12 @@
 #include "vg/io/alignment_io.hpp"
 #include "vg/io/gafkluge.hpp"
 #include "vg/io/edit.hpp"
+#include "vg/io/line_block_reader.hpp"
 
 #include <sstream>
 #include <regex>
 #include <cmath>
+#include <omp.h>
 
 //#define debug_translation
 
@@ -12,13 +14,25 @@ namespace vg {
 
 namespace io {
 
+htsFile* open_gaf(const string& filename, size_t thread_count) {
+    htsFile* in = hts_open(filename.c_str(), "r");
+    if (in == NULL) {
+        cerr << "[vg::alignment.cpp] couldn't open " << filename << endl; exit(1);
+    }
+    // This is a no-op for uncompressed files.
+    if (thread_count > 1 && hts_set_threads(in, thread_count) != 0) {
+        cerr << "[vg::alignment.cpp] couldn't start " << thread_count << " decompression threads for " << filename << endl; exit(1);
+    }
+    return in;
+}
+
 bool get_next_record_from_gaf(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, htsFile* fp, kstring_t& s_buffer, gafkluge::GafRecord& record) {
     
     if (hts_getline(fp, '\n', &s_buffer) <= 0) {
         return false;
     }
 
-    gafkluge::parse_gaf_record(ks_str(&s_buffer), record);
+    gafkluge::parse_gaf_record(ks_str(&s_buffer), ks_len(&s_buffer), record);
     return true;
 }
 
@@ -28,20 +42,18 @@ bool get_next_interleaved_record_pair_from_gaf(function<size_t(nid_t)> node_to_l
         get_next_record_from_gaf(node_to_length, node_to_sequence, fp, s_buffer, record2);
 }
 
-size_t gaf_unpaired_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename, function<void(Alignment&)> lambda) {
+size_t gaf_unpaired_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename, function<void(Alignment&)> lambda, size_t thread_count) {
 
-    htsFile* in = hts_open(filename.c_str(), "r");
-    if (in == NULL) {
-        cerr << "[vg::alignment.cpp] couldn't open " << filename << endl; exit(1);
-    }
+    htsFile* in = open_gaf(filename, thread_count);
     
     kstring_t s_buffer = KS_INITIALIZE;
     Alignment aln;
     gafkluge::GafRecord gaf;
+    NodeCache node_cache(node_to_length, node_to_sequence);
     size_t count = 0;
 
     while (get_next_record_from_gaf(node_to_length, node_to_sequence, in, s_buffer, gaf) == true) {
-        gaf_to_alignment(node_to_length, node_to_sequence, gaf, aln);
+        gaf_to_alignment(node_cache, gaf, aln);
         lambda(aln);
         ++count;
     }
@@ -51,32 +63,30 @@ size_t gaf_unpaired_for_each(function<size_t(nid_t)> node_to_length, function<st
     return count;
 }
 
-size_t gaf_unpaired_for_each(const HandleGraph& graph, const string& filename, function<void(Alignment&)> lambda) {
+size_t gaf_unpaired_for_each(const HandleGraph& graph, const string& filename, function<void(Alignment&)> lambda, size_t thread_count) {
     function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
         return graph.get_length(graph.get_handle(node_id));
     };
     function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
         return graph.get_sequence(graph.get_handle(node_id, is_reversed));
     };
-    return gaf_unpaired_for_each(node_to_length, node_to_sequence, filename, lambda);
+    return gaf_unpaired_for_each(node_to_length, node_to_sequence, filename, lambda, thread_count);
 }
 
 size_t gaf_paired_interleaved_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename,
-                                       function<void(Alignment&, Alignment&)> lambda) {
+                                       function<void(Alignment&, Alignment&)> lambda, size_t thread_count) {
 
-    htsFile* in = hts_open(filename.c_str(), "r");
-    if (in == NULL) {
-        cerr << "[vg::alignment.cpp] couldn't open " << filename << endl; exit(1);
-    }
+    htsFile* in = open_gaf(filename, thread_count);
     
     kstring_t s_buffer = KS_INITIALIZE;
     Alignment aln1, aln2;
     gafkluge::GafRecord gaf1, gaf2;
+    NodeCache node_cache(node_to_length, node_to_sequence);
     size_t count = 0;
 
     while (get_next_interleaved_record_pair_from_gaf(node_to_length, node_to_sequence, in, s_buffer, gaf1, gaf2) == true) {
-        gaf_to_alignment(node_to_length, node_to_sequence, gaf1, aln1);
-        gaf_to_alignment(node_to_length, node_to_sequence, gaf2, aln2);
+        gaf_to_alignment(node_cache, gaf1, aln1);
+        gaf_to_alignment(node_cache, gaf2, aln2);
         lambda(aln1, aln2);
         count += 2;
     }
@@ -87,38 +97,75 @@ size_t gaf_paired_interleaved_for_each(function<size_t(nid_t)> node_to_length, f
 }
 
 size_t gaf_paired_interleaved_for_each(const HandleGraph& graph, const string& filename,
-                                       function<void(Alignment&, Alignment&)> lambda) {
+                                       function<void(Alignment&, Alignment&)> lambda, size_t thread_count) {
     function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
         return graph.get_length(graph.get_handle(node_id));
     };
     function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
         return graph.get_sequence(graph.get_handle(node_id, is_reversed));
     };
-    return gaf_paired_interleaved_for_each(node_to_length, node_to_sequence, filename, lambda);
+    return gaf_paired_interleaved_for_each(node_to_length, node_to_sequence, filename, lambda, thread_count);
 }
 
-size_t gaf_unpaired_for_each_parallel(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename,
-                                      function<void(Alignment&)> lambda,
-                                      uint64_t batch_size) {
+/**
+ * A GAF line found by the reading thread, with room for a worker to parse and
+ * convert it. These live in the recycled batches, so the record and Alignment
+ * belong to the batch being processed and not to a thread: if the lambda lets
+ * its thread pick up another batch, that batch has its own.
+ */
+struct GafLineSlot {
+    string line;
+    gafkluge::GafRecord gaf;
+    Alignment aln;
 
-    htsFile* in = hts_open(filename.c_str(), "r");
-    if (in == NULL) {
-        cerr << "[vg::alignment.cpp] couldn't open " << filename << endl; exit(1);
+    /// Empty the slot for the next line. The record and Alignment are
+    /// overwritten when the line is converted, so they keep their memory.
+    void clear() {
+        line.clear();
     }
+};
+
+/// Make a node cache for each thread. A thread only uses its cache inside
+/// gaf_to_alignment(), which can't switch tasks, so sharing one between a
+/// thread's batches is safe.
+static vector<NodeCache> make_node_caches(const function<size_t(nid_t)>& node_to_length,
+                                          const function<string(nid_t, bool)>& node_to_sequence) {
+    vector<NodeCache> node_caches;
+    size_t max_threads = omp_get_max_threads();
+    node_caches.reserve(max_threads);
+    for (size_t i = 0; i < max_threads; i++) {
+        node_caches.emplace_back(node_to_length, node_to_sequence);
+    }
+    return node_caches;
+}
 
-    kstring_t s_buffer = KS_INITIALIZE;
-    
-    function<bool(gafkluge::GafRecord&)> get_read = [&](gafkluge::GafRecord& gaf) {
-        return get_next_record_from_gaf(node_to_length, node_to_sequence, in, s_buffer, gaf);
+size_t gaf_unpaired_for_each_parallel(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename,
+                                      function<void(Alignment&)> lambda,
+                                      uint64_t batch_size,
+                                      AdaptiveBatchSizer* sizer,
+                                      size_t thread_count) {
+
+    htsFile* in = open_gaf(filename, thread_count);
+
+    // The reading thread only finds the lines. Parsing them is left to the
+    // workers.
+    LineBlockReader reader(in);
+    function<bool(GafLineSlot&)> get_read = [&](GafLineSlot& slot) {
+        // An empty line ends the GAF, as with hts_getline().
+        return reader.next_line(slot.line) && !slot.line.empty();
+    };
+    function<size_t(const GafLineSlot&)> record_bytes = [&](const GafLineSlot& slot) {
+        return slot.line.size() + 1;
     };
 
-    function<void(gafkluge::GafRecord&)> gaf_lambda = [&] (gafkluge::GafRecord& gaf) {
-        Alignment aln;
-        gaf_to_alignment(node_to_length, node_to_sequence, gaf, aln);
-        lambda(aln);
+    vector<NodeCache> node_caches = make_node_caches(node_to_length, node_to_sequence);
+    function<void(GafLineSlot&)> gaf_lambda = [&] (GafLineSlot& slot) {
+        gafkluge::parse_gaf_record(slot.line.data(), slot.line.size(), slot.gaf);
+        gaf_to_alignment(node_caches.at(omp_get_thread_num()), slot.gaf, slot.aln);
+        lambda(slot.aln);
     };
         
-    size_t nLines = unpaired_for_each_parallel(get_read, gaf_lambda, batch_size);
+    size_t nLines = unpaired_for_each_parallel(get_read, gaf_lambda, batch_size, sizer, record_bytes);
     
     hts_close(in);
     return nLines;
@@ -127,51 +174,65 @@ size_t gaf_unpaired_for_each_parallel(function<size_t(nid_t)> node_to_length, fu
 
 size_t gaf_unpaired_for_each_parallel(const HandleGraph& graph, const string& filename,
                                       function<void(Alignment&)> lambda,
-                                      uint64_t batch_size) {    
+                                      uint64_t batch_size,
+                                      AdaptiveBatchSizer* sizer,
+                                      size_t thread_count) {    
     function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
         return graph.get_length(graph.get_handle(node_id));
     };
     function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
         return graph.get_sequence(graph.get_handle(node_id, is_reversed));
     };
-    return gaf_unpaired_for_each_parallel(node_to_length, node_to_sequence, filename, lambda, batch_size);
+    return gaf_unpaired_for_each_parallel(node_to_length, node_to_sequence, filename, lambda, batch_size, sizer, thread_count);
 }
 
 size_t gaf_paired_interleaved_for_each_parallel(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename,
                                                 function<void(Alignment&, Alignment&)> lambda,
-                                                uint64_t batch_size) {
-    return gaf_paired_interleaved_for_each_parallel_after_wait(node_to_length, node_to_sequence, filename, lambda, [](void) {return true;}, batch_size);
+                                                uint64_t batch_size,
+                                                AdaptiveBatchSizer* sizer,
+                                                size_t thread_count) {
+    return gaf_paired_interleaved_for_each_parallel_after_wait(node_to_length, node_to_sequence, filename, lambda, [](void) {return true;}, batch_size, sizer, thread_count);
 }
 
 size_t gaf_paired_interleaved_for_each_parallel(const HandleGraph& graph, const string& filename,
                                                 function<void(Alignment&, Alignment&)> lambda,
-                                                uint64_t batch_size) {
-    return gaf_paired_interleaved_for_each_parallel_after_wait(graph, filename, lambda, [](void) {return true;}, batch_size);
+                                                uint64_t batch_size,
+                                                AdaptiveBatchSizer* sizer,
+                                                size_t thread_count) {
+    return gaf_paired_interleaved_for_each_parallel_after_wait(graph, filename, lambda, [](void) {return true;}, batch_size, sizer, thread_count);
 }
 
 size_t gaf_paired_interleaved_for_each_parallel_after_wait(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence, const string& filename,
                                                            function<void(Alignment&, Alignment&)> lambda,
                                                            function<bool(void)> single_threaded_until_true,
-                                                           uint64_t batch_size) {
-    
-    htsFile* in = hts_open(filename.c_str(), "r");
-    if (in == NULL) {
-        cerr << "[vg::alignment.cpp] couldn't open " << filename << endl; exit(1);
-    }
-
-    kstring_t s_buffer = KS_INITIALIZE;
+                                                           uint64_t batch_size,
+                                                           AdaptiveBatchSizer* sizer,
+                                                           size_t thread_count) {
     
-    function<bool(gafkluge::GafRecord&, gafkluge::GafRecord&)> get_pair = [&](gafkluge::GafRecord& mate1, gafkluge::GafRecord& mate2) {
-        return get_next_interleaved_record_pair_from_gaf(node_to_length, node_to_sequence, in, s_buffer, mate1, mate2);
+    htsFile* in = open_gaf(filename, thread_count);
+
+    // The reading thread only finds the lines. Parsing them is left to the
+    // workers.
+    LineBlockReader reader(in);
+    function<bool(GafLineSlot&, GafLineSlot&)> get_pair = [&](GafLineSlot& slot1, GafLineSlot& slot2) {
+        // An empty line ends the GAF, as with hts_getline().
+        return reader.next_line(slot1.line) && !slot1.line.empty() &&
+            reader.next_line(slot2.line) && !slot2.line.empty();
+    };
+    function<size_t(const GafLineSlot&)> record_bytes = [&](const GafLineSlot& slot) {
+        return slot.line.size() + 1;
     };
 
-    function<void(gafkluge::GafRecord&, gafkluge::GafRecord&)> gaf_lambda = [&] (gafkluge::GafRecord& mate1, gafkluge::GafRecord& mate2) {
-        Alignment aln1, aln2;
-        gaf_to_alignment(node_to_length, node_to_sequence, mate1, aln1);
-        gaf_to_alignment(node_to_length, node_to_sequence, mate2, aln2);
-        lambda(aln1, aln2);        
+    vector<NodeCache> node_caches = make_node_caches(node_to_length, node_to_sequence);
+    function<void(GafLineSlot&, GafLineSlot&)> gaf_lambda = [&] (GafLineSlot& slot1, GafLineSlot& slot2) {
+        NodeCache& node_cache = node_caches.at(omp_get_thread_num());
+        gafkluge::parse_gaf_record(slot1.line.data(), slot1.line.size(), slot1.gaf);
+        gafkluge::parse_gaf_record(slot2.line.data(), slot2.line.size(), slot2.gaf);
+        gaf_to_alignment(node_cache, slot1.gaf, slot1.aln);
+        gaf_to_alignment(node_cache, slot2.gaf, slot2.aln);
+        lambda(slot1.aln, slot2.aln);
     };
-    size_t nLines = paired_for_each_parallel_after_wait(get_pair, gaf_lambda, single_threaded_until_true, batch_size);
+    size_t nLines = paired_for_each_parallel_after_wait(get_pair, gaf_lambda, single_threaded_until_true, batch_size, sizer, record_bytes);
 
     hts_close(in);
     return nLines;    
@@ -180,23 +241,26 @@ size_t gaf_paired_interleaved_for_each_parallel_after_wait(function<size_t(nid_t
 size_t gaf_paired_interleaved_for_each_parallel_after_wait(const HandleGraph& graph, const string& filename,
                                                            function<void(Alignment&, Alignment&)> lambda,
                                                            function<bool(void)> single_threaded_until_true,
-                                                           uint64_t batch_size) {
+                                                           uint64_t batch_size,
+                                                           AdaptiveBatchSizer* sizer,
+                                                           size_t thread_count) {
     function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
         return graph.get_length(graph.get_handle(node_id));
     };
     function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
         return graph.get_sequence(graph.get_handle(node_id, is_reversed));
     };
-    return gaf_paired_interleaved_for_each_parallel_after_wait(node_to_length, node_to_sequence, filename, lambda, single_threaded_until_true, batch_size);
+    return gaf_paired_interleaved_for_each_parallel_after_wait(node_to_length, node_to_sequence, filename, lambda, single_threaded_until_true, batch_size, sizer, thread_count);
 }
 
-gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
-                                     function<string(nid_t, bool)> node_to_sequence,
-                                     const Alignment& aln,
-                                     const handlegraph::NamedNodeBackTranslation* translate_through,
-                                     bool cs_cigar,
-                                     bool base_quals,
-                                     bool frag_links) {
+void alignment_to_gaf(NodeCache& node_cache,
+                      const Alignment& aln,
+                      gafkluge::GafRecord& gaf,
+                      string& scratch,
+                      const handlegraph::NamedNodeBackTranslation* translate_through,
+                      bool cs_cigar,
+                      bool base_quals,
+                      bool frag_links) {
 
     // TODO: We can't support translations with alignments that end up split
     // (arriving to or leaving from the middle of a segment) in segment space,
@@ -208,7 +272,18 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
     // Don't use translation with graphs where segments have been anything but
     // straightforwardly chopped, or where any alignments are split/can jump!
 
-    gafkluge::GafRecord gaf;
+    // Start the record over as missing, keeping its memory.
+    gaf.query_start = gafkluge::missing_int;
+    gaf.query_end = gafkluge::missing_int;
+    gaf.strand = gafkluge::missing_string[0];
+    gaf.path_length = gafkluge::missing_int;
+    gaf.path_start = gafkluge::missing_int;
+    gaf.path_end = gafkluge::missing_int;
+    gaf.matches = gafkluge::missing_int;
+    gaf.block_length = gafkluge::missing_int;
+    gaf.opt_fields.clear();
+    // Steps we have filled in, reusing the ones already there
+    size_t step_count = 0;
 
     //1 string Query sequence name
     gaf.query_name = aln.name();
@@ -225,8 +300,7 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
     // TODO: ugly that we have to replicate parts of vg's nice annotation.hpp system here...
     const auto& annotations = aln.annotation();
     if (annotations.fields().count("tags")) {
-        vector<string> tokens;
-        string tag_string = annotations.fields().at("tags").string_value();
+        const string& tag_string = annotations.fields().at("tags").string_value();
         size_t i = 0;
         while (i < tag_string.size() && isspace(tag_string[i])) {
             ++i;
@@ -234,22 +308,21 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
         while (i < tag_string.size()) {
             size_t j = tag_string.find_first_of(" \t\n\r\f\v", i + 1);
             if (j > i + 1) {
-                tokens.emplace_back(tag_string.substr(i, j - i));
+                // Look at the tag where it is.
+                const char* tag = tag_string.data() + i;
+                size_t tag_length = min(j, tag_string.size()) - i;
+                if (tag_length < 6 || tag[2] != ':' || tag[4] != ':') {
+                    cerr << "error: invalid SAM-style tag annotation: " << tag_string.substr(i, tag_length) << '\n';
+                    exit(1);
+                }
+                // split into values
+                gaf.opt_fields.set(gafkluge::GafOptFields::pack_tag(tag[0], tag[1]), tag + 3, 1, tag + 5, tag_length - 5);
             }
             i = j;
             while (i < tag_string.size() && isspace(tag_string[i])) {
                 ++i;
             }
         }
-        
-        for (const auto& tag : tokens) {
-            if (tag.size() < 6 || tag[2] != ':' || tag[4] != ':') {
-                cerr << "error: invalid SAM-style tag annotation: " << tag << '\n';
-                exit(1);
-            }
-            // split into values
-            gaf.opt_fields[tag.substr(0, 2)] = make_pair(tag.substr(3, 1), tag.substr(5, string::npos));
-        }
     }
     
     if (aln.has_path() && aln.path().mapping_size() > 0) {    
@@ -266,7 +339,9 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
         //10 int Number of residue matches
         gaf.matches = 0;
         gaf.path.reserve(aln.path().mapping_size());
-        string cs_cigar_str;
+        // Build the cs string in place in the scratch space.
+        string& cs_cigar_str = scratch;
+        cs_cigar_str.clear();
         size_t running_match_length = 0;
         // Track running deletion status for CIGAR string.
         // if set, can just print bases (without "-") to continue
@@ -284,8 +359,10 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
             size_t offset = start_offset_on_node;
             // This is our difference from node offset to segment offset, if applicable
             size_t node_to_segment_offset = 0;
-            size_t node_length = node_to_length(position.node_id());
-            string node_seq;
+            size_t node_length = node_cache.get_length(position.node_id());
+            // Sequence of the node, if needed. It lives in the cache, and we
+            // only look up one sequence per mapping, so it stays valid.
+            const string* node_seq = nullptr;
             bool skip_step = false;
 
 #ifdef debug_translation
@@ -306,8 +383,8 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
                         // We can't do this if we don't have a way to get segment lengths, and that's not in the interface yet.
                         throw std::runtime_error("Split alignments cannot be converted to named-segment-space GAF");
                     }
-                    if (node_seq.empty()) {
-                        node_seq = node_to_sequence(position.node_id(), position.is_reverse());
+                    if (node_seq == nullptr) {
+                        node_seq = &node_cache.get_sequence(position.node_id(), position.is_reverse());
                     }
                     // vg's chunked mapper will happily add new Mappings on the same node
                     // so we try to keep that in mind here where we subtract out the previous offset
@@ -319,13 +396,14 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
                     if (start_offset_on_node > del_start_offset) {
                         if (running_match_length > 0) {
                             // Matches are : followed by the match length
-                            cs_cigar_str += ":" + std::to_string(running_match_length);
+                            cs_cigar_str.push_back(':');
+                            gafkluge::append_int(cs_cigar_str, running_match_length);
                             running_match_length = 0;
                         }
                         if (!running_deletion) {
-                            cs_cigar_str += "-";
+                            cs_cigar_str.push_back('-');
                         }
-                        cs_cigar_str += node_seq.substr(del_start_offset, start_offset_on_node - del_start_offset);
+                        cs_cigar_str.append(*node_seq, del_start_offset, start_offset_on_node - del_start_offset);
                         running_deletion = true;
                     }
                 }
@@ -350,32 +428,36 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
                     } else {
                         if (running_match_length > 0) {
                             // Matches are : followed by the match length
-                            cs_cigar_str += ":" + std::to_string(running_match_length);
+                            cs_cigar_str.push_back(':');
+                            gafkluge::append_int(cs_cigar_str, running_match_length);
                             running_match_length = 0;                            
                         }
                         if (edit_is_sub(edit)) {
-                            if (node_seq.empty()) {
-                                node_seq = node_to_sequence(position.node_id(), position.is_reverse());
+                            if (node_seq == nullptr) {
+                                node_seq = &node_cache.get_sequence(position.node_id(), position.is_reverse());
                             }
                             // Substitions expressed one base at a time, preceded by *
                             for (size_t k = 0; k < edit.from_length(); ++k) {
-                                cs_cigar_str += "*" + node_seq.substr(offset + k, 1) + edit.sequence().substr(k, 1); 
+                                cs_cigar_str.push_back('*');
+                                cs_cigar_str.append(*node_seq, offset + k, 1);
+                                cs_cigar_str.append(edit.sequence(), k, 1);
                             }
                             running_deletion = false;
                         } else if (edit_is_deletion(edit)) {
-                            if (node_seq.empty()) {
-                                node_seq = node_to_sequence(position.node_id(), position.is_reverse());
+                            if (node_seq == nullptr) {
+                                node_seq = &node_cache.get_sequence(position.node_id(), position.is_reverse());
                             }
                             // Deletion is - followed by deleted sequence
-                            assert(offset + edit.from_length() <= node_seq.length());
+                            assert(offset + edit.from_length() <= node_seq->length());
                             if (!running_deletion) {
-                                cs_cigar_str += "-";
+                                cs_cigar_str.push_back('-');
                             }
-                            cs_cigar_str += node_seq.substr(offset, edit.from_length());
+                            cs_cigar_str.append(*node_seq, offset, edit.from_length());
                             running_deletion = true;
                         } else if (edit_is_insertion(edit)) {
                             // Insertion is "+" followed by inserted sequence
-                            cs_cigar_str += "+" + edit.sequence();
+                            cs_cigar_str.push_back('+');
+                            cs_cigar_str.append(edit.sequence());
                             running_deletion = false;
                         }
                     }
@@ -456,18 +538,19 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
                         // We can't do this if we don't have a way to get segment lengths, and that's not in the interface yet.
                         throw std::runtime_error("Split alignments cannot be converted to named-segment-space GAF");
                     }
-                    if (node_seq.empty()) {
-                        node_seq = node_to_sequence(position.node_id(), position.is_reverse());
+                    if (node_seq == nullptr) {
+                        node_seq = &node_cache.get_sequence(position.node_id(), position.is_reverse());
                     }
                     if (running_match_length > 0) {
                         // Matches are : followed by the match length
-                        cs_cigar_str += ":" + std::to_string(running_match_length);
+                        cs_cigar_str.push_back(':');
+                        gafkluge::append_int(cs_cigar_str, running_match_length);
                         running_match_length = 0;
                     }
                     if (!running_deletion) {
-                        cs_cigar_str += "-";
+                        cs_cigar_str.push_back('-');
                     } 
-                    cs_cigar_str += node_seq.substr(offset);
+                    cs_cigar_str.append(*node_seq, offset, string::npos);
                     running_deletion = true;
                 } else {
                     // we have a duplicate node mapping.  vg map actually produces these sometimes
@@ -542,13 +625,19 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
                 
                 if (!skip_step) {
                     // Actually report this visit to this node or segment.
-                    gafkluge::GafStep step;
-                    step.name = translate_through ? translate_through->get_back_graph_node_name(std::get<0>(range)) : std::to_string(std::get<0>(range));
+                    if (step_count == gaf.path.size()) {
+                        gaf.path.emplace_back();
+                    }
+                    gafkluge::GafStep& step = gaf.path[step_count++];
+                    if (translate_through) {
+                        step.name = translate_through->get_back_graph_node_name(std::get<0>(range));
+                    } else {
+                        step.name.clear();
+                        gafkluge::append_int(step.name, std::get<0>(range));
+                    }
                     step.is_stable = false;
                     step.is_reverse = std::get<1>(range);
                     step.is_interval = false;
-                    
-                    gaf.path.push_back(std::move(step));
 #ifdef debug_translation
                     std::cerr << "Added step to GAF path" << std::endl;
 #endif
@@ -602,7 +691,8 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
             prev_offset = offset;
         }
         if (cs_cigar && running_match_length > 0) {
-            cs_cigar_str += ":" + std::to_string(running_match_length);
+            cs_cigar_str.push_back(':');
+            gafkluge::append_int(cs_cigar_str, running_match_length);
             running_match_length = 0;
         }
 
@@ -618,36 +708,43 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
 
         // optional cs-cigar string
         if (cs_cigar) {
-            gaf.opt_fields["cs"] = make_pair("Z", std::move(cs_cigar_str));
+            gaf.opt_fields.set(gafkluge::GafOptFields::pack_tag('c', 's'), "Z", 1, cs_cigar_str.data(), cs_cigar_str.size());
         }
 
         // convert the identity into the dv divergence field
         // https://lh3.github.io/minimap2/minimap2.html#10
         if (aln.identity() > 0) {
-            stringstream dv_str;
-            dv_str << std::floor((1. - aln.identity()) * 10000. + 0.5) / 10000.;
-            gaf.opt_fields["dv"] = make_pair("f", dv_str.str());
+            // %g matches what an ostream prints by default.
+            char dv_str[32];
+            int dv_length = snprintf(dv_str, sizeof(dv_str), "%g", std::floor((1. - aln.identity()) * 10000. + 0.5) / 10000.);
+            gaf.opt_fields.set(gafkluge::GafOptFields::pack_tag('d', 'v'), "f", 1, dv_str, dv_length);
         }
 
         // convert the score into the AS field
         // https://lh3.github.io/minimap2/minimap2.html#10
         if (aln.score() > 0) {
-            gaf.opt_fields["AS"] = make_pair("i", std::to_string(aln.score()));
+            scratch.clear();
+            gafkluge::append_int(scratch, aln.score());
+            gaf.opt_fields.set(gafkluge::GafOptFields::pack_tag('A', 'S'), "i", 1, scratch.data(), scratch.size());
         }
 
         // optional base qualities
         if (base_quals && !aln.quality().empty()) { 
-            gaf.opt_fields["bq"] = make_pair("Z", string_quality_short_to_char(aln.quality()));
+            scratch.clear();
+            for (char q : aln.quality()) {
+                scratch.push_back(quality_short_to_char(q));
+            }
+            gaf.opt_fields.set(gafkluge::GafOptFields::pack_tag('b', 'q'), "Z", 1, scratch.data(), scratch.size());
         }
 
         if (aln.has_annotation()) {
             auto& annotation = aln.annotation();
             if (annotation.fields().count("proper_pair")) {
                 bool is_properly_paired = (annotation.fields().at("proper_pair")).bool_value();
-                gaf.opt_fields["pd"] = make_pair("b", is_properly_paired ? "1" : "0");
+                gaf.opt_fields.set("pd", "b", is_properly_paired ? "1" : "0");
             }
             if (annotation.fields().count("support")) {
-                gaf.opt_fields["AD"] = make_pair("i", (annotation.fields().at("support")).string_value());
+                gaf.opt_fields.set("AD", "i", (annotation.fields().at("support")).string_value());
             }
         }
     }
@@ -655,34 +752,51 @@ gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
     // optional frag_next/prev names
     if (frag_links == true) {
       if (aln.has_fragment_next()) {
-        gaf.opt_fields["fn"] = make_pair("Z", aln.fragment_next().name());
+        gaf.opt_fields.set("fn", "Z", aln.fragment_next().name());
       }
       if (aln.has_fragment_prev()) {
-        gaf.opt_fields["fp"] = make_pair("Z", aln.fragment_prev().name());
+        gaf.opt_fields.set("fp", "Z", aln.fragment_prev().name());
       }
     }
 
-    return gaf;    
+    // Drop any steps left from a previous record.
+    gaf.path.resize(step_count);
 }
 
-gafkluge::GafRecord alignment_to_gaf(const HandleGraph& graph,
+gafkluge::GafRecord alignment_to_gaf(NodeCache& node_cache,
                                      const Alignment& aln,
                                      const handlegraph::NamedNodeBackTranslation* translate_through,
                                      bool cs_cigar,
                                      bool base_quals,
                                      bool frag_links) {
+    gafkluge::GafRecord gaf;
+    string scratch;
+    alignment_to_gaf(node_cache, aln, gaf, scratch, translate_through, cs_cigar, base_quals, frag_links);
+    return gaf;
+}
 
-    function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
-        return graph.get_length(graph.get_handle(node_id));
-    };
-    function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
-        return graph.get_sequence(graph.get_handle(node_id, is_reversed));
-    };
-    return alignment_to_gaf(node_to_length, node_to_sequence, aln, translate_through, cs_cigar, base_quals, frag_links);
+gafkluge::GafRecord alignment_to_gaf(function<size_t(nid_t)> node_to_length,
+                                     function<string(nid_t, bool)> node_to_sequence,
+                                     const Alignment& aln,
+                                     const handlegraph::NamedNodeBackTranslation* translate_through,
+                                     bool cs_cigar,
+                                     bool base_quals,
+                                     bool frag_links) {
+    NodeCache node_cache(node_to_length, node_to_sequence);
+    return alignment_to_gaf(node_cache, aln, translate_through, cs_cigar, base_quals, frag_links);
 }
 
-void gaf_to_alignment(function<size_t(nid_t)> node_to_length,
-                      function<string(nid_t, bool)> node_to_sequence,
+gafkluge::GafRecord alignment_to_gaf(const HandleGraph& graph,
+                                     const Alignment& aln,
+                                     const handlegraph::NamedNodeBackTranslation* translate_through,
+                                     bool cs_cigar,
+                                     bool base_quals,
+                                     bool frag_links) {
+    NodeCache node_cache(graph);
+    return alignment_to_gaf(node_cache, aln, translate_through, cs_cigar, base_quals, frag_links);
+}
+
+void gaf_to_alignment(NodeCache& node_cache,
                       const gafkluge::GafRecord& gaf,
                       Alignment& aln){
 
@@ -715,101 +829,106 @@ void gaf_to_alignment(function<size_t(nid_t)> node_to_length,
         size_t cur_mapping = 0;
         int64_t cur_offset = gaf.path_start;
         Position cur_position = aln.path().mapping(cur_mapping).position();
-        size_t cur_len = node_to_length(cur_position.node_id());
+        size_t cur_len = node_cache.get_length(cur_position.node_id());
         string& sequence = *aln.mutable_sequence();
         bool from_cg = false;
         // Use the CS cigar string to add Edits into our Path, as well as set the sequence
-        gafkluge::for_each_cigar(gaf, [&] (const char& cigar_cat, const size_t& cigar_len, const string& cigar_query, const string& cigar_target) {
-                assert(cur_offset < cur_len || ((cigar_cat == '+' || cigar_cat == 'I' || cigar_cat == 'S') && cur_offset <= cur_len));
-                if (!from_cg && cigar_cat != ':' && cigar_cat != '+' && cigar_cat != '-' && cigar_cat != '*') {
-                    from_cg = true;
-                }
+        // Tokens point into the cs or cg tag, so we don't copy them.
+        gafkluge::CigarIterator cigar(gaf);
+        gafkluge::CigarToken token;
+        while (cigar.next(token)) {
+            const char cigar_cat = token.op;
+            const size_t cigar_len = token.length;
+            assert(cur_offset < cur_len || ((cigar_cat == '+' || cigar_cat == 'I' || cigar_cat == 'S') && cur_offset <= cur_len));
+            if (!from_cg && cigar_cat != ':' && cigar_cat != '+' && cigar_cat != '-' && cigar_cat != '*') {
+                from_cg = true;
+            }
 
-                if (cigar_cat == ':' || cigar_cat == 'M' || cigar_cat == '=' || cigar_cat == 'X') {
-                    int64_t match_len = (int64_t)cigar_len;
-                    while (match_len > 0) {
-                        int64_t current_match = std::min(match_len, (int64_t)node_to_length(cur_position.node_id()) - cur_offset);
-                        Edit* edit = aln.mutable_path()->mutable_mapping(cur_mapping)->add_edit();
-                        edit->set_from_length(current_match);
-                        edit->set_to_length(current_match);
-                        if (cigar_cat == 'X') {
-                            // add a phony snp
-                            edit->set_sequence(string(current_match, 'N'));
-                        }
-                        if (node_to_sequence) {
-                            sequence += node_to_sequence(cur_position.node_id(), cur_position.is_reverse()).substr(cur_offset, current_match);
-                        }
-                        match_len -= current_match;
-                        cur_offset += current_match;
-                        if (match_len > 0) {
-                            assert(cur_mapping < aln.path().mapping_size() - 1);
-                            ++cur_mapping;
-                            cur_offset = 0;
-                            cur_position = aln.path().mapping(cur_mapping).position();
-                            cur_len = node_to_length(cur_position.node_id());
-                        }
-                    }
-                } else if (cigar_cat == '+' || cigar_cat == 'I' || cigar_cat == 'S') {
-                    size_t tgt_mapping = cur_mapping;
-                    // left-align insertions to try to be more consistent with vg
-                    if (cur_offset == 0 && cur_mapping > 0 && (!aln.path().mapping(cur_mapping - 1).position().is_reverse()
-                                                               || cur_mapping == aln.path().mapping_size())) {
-                        --tgt_mapping;
+            if (cigar_cat == ':' || cigar_cat == 'M' || cigar_cat == '=' || cigar_cat == 'X') {
+                int64_t match_len = (int64_t)cigar_len;
+                while (match_len > 0) {
+                    int64_t current_match = std::min(match_len, (int64_t)node_cache.get_length(cur_position.node_id()) - cur_offset);
+                    Edit* edit = aln.mutable_path()->mutable_mapping(cur_mapping)->add_edit();
+                    edit->set_from_length(current_match);
+                    edit->set_to_length(current_match);
+                    if (cigar_cat == 'X') {
+                        // add a phony snp
+                        edit->set_sequence(string(current_match, 'N'));
                     }
-                    Edit* edit = aln.mutable_path()->mutable_mapping(tgt_mapping)->add_edit();
-                    edit->set_from_length(0);
-                    edit->set_to_length(cigar_len);
-                    if (cigar_cat == '+') {
-                        edit->set_sequence(cigar_query);
-                    } else {
-                        // todo: better to leave this empty?  I think client code may be expecting sequence so we give it
-                        edit->set_sequence(string(cigar_len, 'N'));
+                    if (node_cache.has_sequences()) {
+                        sequence.append(node_cache.get_sequence(cur_position.node_id(), cur_position.is_reverse()), cur_offset, current_match);
                     }
-                    sequence += edit->sequence();
-                } else if (cigar_cat == '-' || cigar_cat == 'D') {
-                    int64_t del_len = (int64_t)cigar_len;
-                    while (del_len > 0) {
-                        int64_t current_del = std::min(del_len, (int64_t)node_to_length(cur_position.node_id()) - cur_offset);
-                        Edit* edit = aln.mutable_path()->mutable_mapping(cur_mapping)->add_edit();
-                        edit->set_to_length(0);
-                        edit->set_from_length(current_del);
-                        del_len -= current_del;
-                        cur_offset += current_del;
-                        // like matches, we allow deletions to span multiple nodes now.
-                        if (del_len > 0) {
-                            assert(cur_mapping < aln.path().mapping_size() - 1);
-                            ++cur_mapping;
-                            cur_offset = 0;
-                            cur_position = aln.path().mapping(cur_mapping).position();
-                            cur_len = node_to_length(cur_position.node_id());
-                        }
+                    match_len -= current_match;
+                    cur_offset += current_match;
+                    if (match_len > 0) {
+                        assert(cur_mapping < aln.path().mapping_size() - 1);
+                        ++cur_mapping;
+                        cur_offset = 0;
+                        cur_position = aln.path().mapping(cur_mapping).position();
+                        cur_len = node_cache.get_length(cur_position.node_id());
                     }
-                } else if (cigar_cat == '*') {
-                    assert(cigar_len == 1);
-                    assert(!node_to_sequence || node_to_sequence(cur_position.node_id(), cur_position.is_reverse()).substr(cur_offset,1) == cigar_target);
-                    Edit* edit = aln.mutable_path()->mutable_mapping(cur_mapping)->add_edit();
-                    // todo: support multibase snps
-                    edit->set_from_length(cigar_len);
-                    edit->set_to_length(cigar_len);
-                    edit->set_sequence(cigar_query);
-                    sequence += edit->sequence();
-                    ++cur_offset;
+                }
+            } else if (cigar_cat == '+' || cigar_cat == 'I' || cigar_cat == 'S') {
+                size_t tgt_mapping = cur_mapping;
+                // left-align insertions to try to be more consistent with vg
+                if (cur_offset == 0 && cur_mapping > 0 && (!aln.path().mapping(cur_mapping - 1).position().is_reverse()
+                                                           || cur_mapping == aln.path().mapping_size())) {
+                    --tgt_mapping;
+                }
+                Edit* edit = aln.mutable_path()->mutable_mapping(tgt_mapping)->add_edit();
+                edit->set_from_length(0);
+                edit->set_to_length(cigar_len);
+                if (cigar_cat == '+') {
+                    edit->set_sequence(token.query.data, token.query.length);
                 } else {
-                    //todo: better error (warning?)
-                    assert(false);
+                    // todo: better to leave this empty?  I think client code may be expecting sequence so we give it
+                    edit->set_sequence(string(cigar_len, 'N'));
                 }
-            
-                // advance to the next mapping if we've pushed the offset past the current node
-                assert(cur_offset <= cur_len);
-                if (cur_offset == cur_len) {
-                    ++cur_mapping;
-                    cur_offset = 0;
-                    if (cur_mapping < aln.path().mapping_size()) {
+                sequence += edit->sequence();
+            } else if (cigar_cat == '-' || cigar_cat == 'D') {
+                int64_t del_len = (int64_t)cigar_len;
+                while (del_len > 0) {
+                    int64_t current_del = std::min(del_len, (int64_t)node_cache.get_length(cur_position.node_id()) - cur_offset);
+                    Edit* edit = aln.mutable_path()->mutable_mapping(cur_mapping)->add_edit();
+                    edit->set_to_length(0);
+                    edit->set_from_length(current_del);
+                    del_len -= current_del;
+                    cur_offset += current_del;
+                    // like matches, we allow deletions to span multiple nodes now.
+                    if (del_len > 0) {
+                        assert(cur_mapping < aln.path().mapping_size() - 1);
+                        ++cur_mapping;
+                        cur_offset = 0;
                         cur_position = aln.path().mapping(cur_mapping).position();
-                        cur_len = node_to_length(cur_position.node_id());
+                        cur_len = node_cache.get_length(cur_position.node_id());
                     }
                 }
-            });
+            } else if (cigar_cat == '*') {
+                assert(cigar_len == 1);
+                assert(!node_cache.has_sequences() || node_cache.get_sequence(cur_position.node_id(), cur_position.is_reverse()).substr(cur_offset,1) == token.target.str());
+                Edit* edit = aln.mutable_path()->mutable_mapping(cur_mapping)->add_edit();
+                // todo: support multibase snps
+                edit->set_from_length(cigar_len);
+                edit->set_to_length(cigar_len);
+                edit->set_sequence(token.query.data, token.query.length);
+                sequence += edit->sequence();
+                ++cur_offset;
+            } else {
+                //todo: better error (warning?)
+                assert(false);
+            }
+        
+            // advance to the next mapping if we've pushed the offset past the current node
+            assert(cur_offset <= cur_len);
+            if (cur_offset == cur_len) {
+                ++cur_mapping;
+                cur_offset = 0;
+                if (cur_mapping < aln.path().mapping_size()) {
+                    cur_position = aln.path().mapping(cur_mapping).position();
+                    cur_len = node_cache.get_length(cur_position.node_id());
+                }
+            }
+        }
 
         // this is to support gafs that were made from alignments where the last mapping is
         // nothing but a soft clip:
@@ -836,45 +955,49 @@ void gaf_to_alignment(function<size_t(nid_t)> node_to_length,
         }
     }
 
-    for (auto opt_it : gaf.opt_fields) {
-        if (opt_it.first == "dv") {
+    for (size_t i = 0; i < gaf.opt_fields.size(); i++) {
+        uint16_t key = gaf.opt_fields.key(i);
+        gafkluge::GafFieldView value = gaf.opt_fields.value(i);
+        if (key == gafkluge::GafOptFields::pack_tag('d', 'v')) {
             // get the identity from the dv divergence field
             // https://lh3.github.io/minimap2/minimap2.html#10
-            aln.set_identity(1. - std::stof(opt_it.second.second));
-        } else if (opt_it.first == "AS") {
+            aln.set_identity(1. - std::stof(value.str()));
+        } else if (key == gafkluge::GafOptFields::pack_tag('A', 'S')) {
             // get the score from the AS field
             // https://lh3.github.io/minimap2/minimap2.html#10
-            aln.set_score(std::stoi(opt_it.second.second));
-        } else if (opt_it.first == "bq") {
+            aln.set_score(std::stoi(value.str()));
+        } else if (key == gafkluge::GafOptFields::pack_tag('b', 'q')) {
             // get the quality from the bq field
-            aln.set_quality(string_quality_char_to_short(opt_it.second.second));
-        } else if (opt_it.first == "fp") {
+            aln.set_quality(string_quality_char_to_short(value.str()));
+        } else if (key == gafkluge::GafOptFields::pack_tag('f', 'p')) {
             // get the fragment_previous field
-            aln.mutable_fragment_prev()->set_name(opt_it.second.second);
-        } else if (opt_it.first == "fn") {
+            aln.mutable_fragment_prev()->set_name(value.data, value.length);
+        } else if (key == gafkluge::GafOptFields::pack_tag('f', 'n')) {
             // get the fragment_next field
-            aln.mutable_fragment_next()->set_name(opt_it.second.second);
-        } else if (opt_it.first == "pd") {
+            aln.mutable_fragment_next()->set_name(value.data, value.length);
+        } else if (key == gafkluge::GafOptFields::pack_tag('p', 'd')) {
             //Is this read properly paired
             auto* annotation = aln.mutable_annotation();
             google::protobuf::Value is_properly_paired;
-            is_properly_paired.set_bool_value(opt_it.second.second == "1");
+            is_properly_paired.set_bool_value(value == "1");
             (*annotation->mutable_fields())["proper_pair"] = is_properly_paired;
         }
     }
 }
 
-void gaf_to_alignment(const HandleGraph& graph,
+void gaf_to_alignment(function<size_t(nid_t)> node_to_length,
+                      function<string(nid_t, bool)> node_to_sequence,
                       const gafkluge::GafRecord& gaf,
                       Alignment& aln) {
+    NodeCache node_cache(node_to_length, node_to_sequence);
+    gaf_to_alignment(node_cache, gaf, aln);
+}
 
-    function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
-        return graph.get_length(graph.get_handle(node_id));
-    };
-    function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
-        return graph.get_sequence(graph.get_handle(node_id, is_reversed));
-    };
-    gaf_to_alignment(node_to_length, node_to_sequence, gaf, aln); 
+void gaf_to_alignment(const HandleGraph& graph,
+                      const gafkluge::GafRecord& gaf,
+                      Alignment& aln) {
+    NodeCache node_cache(graph);
+    gaf_to_alignment(node_cache, gaf, aln);
 }
 
 short quality_char_to_short(char c) {
@@ -0,0 +1,128 @@
+/**
+ * \file batch_sizer.cpp
+ * Implementations for adaptive batch sizing in the parallel iterators.
+ */
+
+#include "vg/io/batch_sizer.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Long reads can be hundreds of KB each, so don't let a batch go much past this.
+const size_t AdaptiveBatchSizer::DEFAULT_TARGET_BYTES = 16 * 1024 * 1024;
+/// Start where the fixed-size iterators are.
+const size_t AdaptiveBatchSizer::DEFAULT_INITIAL_COUNT = 256;
+const size_t AdaptiveBatchSizer::DEFAULT_MIN_COUNT = 2;
+const size_t AdaptiveBatchSizer::DEFAULT_MAX_COUNT = 64 * 1024;
+/// Tasks much shorter than this are mostly overhead.
+const double AdaptiveBatchSizer::DEFAULT_MIN_BATCH_SECONDS = 0.002;
+/// Tasks much longer than this balance badly at the end of the input.
+const double AdaptiveBatchSizer::DEFAULT_MAX_BATCH_SECONDS = 0.1;
+
+AdaptiveBatchSizer::AdaptiveBatchSizer(size_t target_bytes, size_t initial_count, size_t min_count, size_t max_count) :
+    target_bytes(target_bytes),
+    min_count(min_count + (min_count % 2)),
+    max_count(max(max_count + (max_count % 2), min_count + (min_count % 2))),
+    min_batch_seconds(DEFAULT_MIN_BATCH_SECONDS),
+    max_batch_seconds(DEFAULT_MAX_BATCH_SECONDS),
+    limit(0) {
+
+    limit.store(clamp_count(initial_count));
+    stats.smallest_limit = limit.load();
+    stats.largest_limit = limit.load();
+    stats.current_limit = limit.load();
+}
+
+void AdaptiveBatchSizer::set_batch_seconds(double min_seconds, double max_seconds) {
+    lock_guard<mutex> lock(stats_mutex);
+    min_batch_seconds = min_seconds;
+    max_batch_seconds = max(min_seconds, max_seconds);
+}
+
+bool AdaptiveBatchSizer::batch_full(size_t count, size_t bytes, size_t batch_limit) const {
+    if (count == 0 || count % 2 != 0) {
+        // Never split a pair.
+        return false;
+    }
+    return count >= batch_limit || bytes >= target_bytes;
+}
+
+size_t AdaptiveBatchSizer::count_limit() const {
+    return limit.load();
+}
+
+void AdaptiveBatchSizer::record_fill(double seconds) {
+    lock_guard<mutex> lock(stats_mutex);
+    last_fill_seconds = seconds;
+    stats.fill_seconds += seconds;
+}
+
+void AdaptiveBatchSizer::record_process(size_t count, size_t bytes, size_t batch_limit, double seconds) {
+    lock_guard<mutex> lock(stats_mutex);
+
+    if (stats.batches == 0 || count < stats.smallest_batch) {
+        stats.smallest_batch = count;
+    }
+    if (count > stats.largest_batch) {
+        stats.largest_batch = count;
+    }
+    stats.batches++;
+    stats.records += count;
+    stats.bytes += bytes;
+    stats.process_seconds += seconds;
+
+    size_t old_limit = limit.load();
+    if (batch_limit != old_limit) {
+        // This batch was built before the last change, which has already
+        // accounted for batches its size. Let batches of the new size decide.
+        return;
+    }
+    if (count < batch_limit) {
+        // This batch was closed by the byte budget, or is a short final
+        // batch, so the count limit didn't decide its size and its timing
+        // says nothing about it.
+        return;
+    }
+
+    size_t new_limit = old_limit;
+    if (seconds < min_batch_seconds) {
+        // Batches are too quick to pay for handing them off.
+        new_limit = clamp_count(old_limit * 2);
+    } else if (seconds > max_batch_seconds && last_fill_seconds < seconds) {
+        // Batches are slow, and the producer could keep up with smaller ones.
+        new_limit = clamp_count(old_limit / 2);
+    }
+
+    if (new_limit != old_limit) {
+#ifdef debug
+        cerr << "AdaptiveBatchSizer: batch of " << count << " records and " << bytes << " bytes took "
+            << seconds << " s after " << last_fill_seconds << " s to fill; count limit "
+            << old_limit << " -> " << new_limit << endl;
+#endif
+        limit.store(new_limit);
+        stats.adjustments++;
+        stats.current_limit = new_limit;
+        stats.smallest_limit = min(stats.smallest_limit, new_limit);
+        stats.largest_limit = max(stats.largest_limit, new_limit);
+    }
+}
+
+BatchSizerStats AdaptiveBatchSizer::get_stats() const {
+    lock_guard<mutex> lock(stats_mutex);
+    return stats;
+}
+
+size_t AdaptiveBatchSizer::clamp_count(size_t count) const {
+    count += count % 2;
+    return min(max(count, min_count), max_count);
+}
+
+}
+
+}
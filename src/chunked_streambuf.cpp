@@ -0,0 +1,219 @@
+/**
+ * \file chunked_streambuf.cpp
+ * Implementations for the pooled chunk stream buffer.
+ */
+
+#include "vg/io/chunked_streambuf.hpp"
+#include "vg/io/numa.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Big enough that bookkeeping is negligible, small enough that a nearly
+/// empty stream doesn't waste much.
+const size_t ChunkPool::CHUNK_BYTES = 64 * 1024;
+
+/// 64 MB per node, which is plenty for a writer per thread to keep a few
+/// chunks each in steady state.
+const size_t ChunkPool::MAX_FREE_CHUNKS = 1024;
+
+/// One cache line
+const size_t ChunkPool::CHUNK_HEADER_BYTES = 64;
+
+ChunkPool::ChunkPool() : free_chunks(numa_aware() ? numa_node_count() : 1) {
+    // Nothing to do!
+}
+
+ChunkPool::~ChunkPool() {
+    for (auto& list : free_chunks) {
+        for (char* chunk : list) {
+            delete[] (chunk - CHUNK_HEADER_BYTES);
+        }
+    }
+}
+
+size_t ChunkPool::local_list() const {
+    if (free_chunks.size() == 1) {
+        return 0;
+    }
+    return min((size_t) current_numa_node(), free_chunks.size() - 1);
+}
+
+char* ChunkPool::take() {
+    size_t list = local_list();
+    {
+        lock_guard<mutex> lock(free_mutex);
+        if (!free_chunks[list].empty()) {
+            char* chunk = free_chunks[list].back();
+            free_chunks[list].pop_back();
+            return chunk;
+        }
+    }
+    // Writing the header touches the chunk first from this thread, and the
+    // thread that takes a chunk is the one that fills it.
+    char* chunk = new char[CHUNK_HEADER_BYTES + CHUNK_BYTES] + CHUNK_HEADER_BYTES;
+    memcpy(chunk - CHUNK_HEADER_BYTES, &list, sizeof(list));
+    return chunk;
+}
+
+void ChunkPool::give_back(vector<char*>& chunks) {
+    if (chunks.empty()) {
+        return;
+    }
+    // Chunks that don't fit in their free list, to free outside the lock
+    vector<char*> excess;
+    {
+        lock_guard<mutex> lock(free_mutex);
+        for (char* chunk : chunks) {
+            // Chunks go back to the node they were made on, whoever returns them.
+            size_t list;
+            memcpy(&list, chunk - CHUNK_HEADER_BYTES, sizeof(list));
+            if (free_chunks[list].size() < MAX_FREE_CHUNKS) {
+                free_chunks[list].push_back(chunk);
+            } else {
+                excess.push_back(chunk);
+            }
+        }
+    }
+    for (char* chunk : excess) {
+        delete[] (chunk - CHUNK_HEADER_BYTES);
+    }
+    chunks.clear();
+}
+
+void ChunkedData::write_to(ostream& out) const {
+    size_t remaining = bytes;
+    for (char* chunk : chunks) {
+        if (remaining == 0) {
+            break;
+        }
+        size_t chunk_bytes = min(remaining, ChunkPool::CHUNK_BYTES);
+        out.write(chunk, chunk_bytes);
+        remaining -= chunk_bytes;
+    }
+}
+
+ChunkedStreamBuf::ChunkedStreamBuf(ChunkPool& pool) : pool(pool), current_chunk(0) {
+    // Start with no put area, so we don't take a chunk until written to.
+    setp(nullptr, nullptr);
+}
+
+ChunkedStreamBuf::~ChunkedStreamBuf() {
+    pool.give_back(chunks);
+}
+
+size_t ChunkedStreamBuf::size() const {
+    if (chunks.empty()) {
+        return 0;
+    }
+    return current_chunk * ChunkPool::CHUNK_BYTES + (pptr() - pbase());
+}
+
+void ChunkedStreamBuf::take_data(ChunkedData& destination) {
+    size_t used = size();
+    destination.bytes = used;
+    // Chunks up to and including the current one have live data, unless the
+    // current one is empty.
+    size_t used_chunks = (used + ChunkPool::CHUNK_BYTES - 1) / ChunkPool::CHUNK_BYTES;
+    destination.chunks.assign(chunks.begin(), chunks.begin() + used_chunks);
+    // Keep one spare chunk to carry on writing into, and give back the rest.
+    vector<char*> spare(chunks.begin() + used_chunks, chunks.end());
+    chunks.clear();
+    if (!spare.empty()) {
+        chunks.push_back(spare.back());
+        spare.pop_back();
+        pool.give_back(spare);
+        enter_chunk(0, 0);
+    } else {
+        setp(nullptr, nullptr);
+    }
+    current_chunk = 0;
+}
+
+ChunkedStreamBuf::int_type ChunkedStreamBuf::overflow(int_type ch) {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+        return traits_type::not_eof(ch);
+    }
+    // Move on to the next chunk. If we haven't started yet, that's the first one.
+    enter_chunk(chunks.empty() ? 0 : current_chunk + 1, 0);
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+    return ch;
+}
+
+streamsize ChunkedStreamBuf::xsputn(const char_type* s, streamsize count) {
+    streamsize written = 0;
+    while (written < count) {
+        if (pptr() == epptr()) {
+            enter_chunk(chunks.empty() ? 0 : current_chunk + 1, 0);
+        }
+        size_t to_copy = min((size_t) (count - written), (size_t) (epptr() - pptr()));
+        memcpy(pptr(), s + written, to_copy);
+        // pbump takes an int, but chunks are much smaller than that.
+        pbump((int) to_copy);
+        written += to_copy;
+    }
+    return written;
+}
+
+ChunkedStreamBuf::pos_type ChunkedStreamBuf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which) {
+    if (!(which & ios_base::out) || (which & ios_base::in)) {
+        // We have no get area.
+        return pos_type(off_type(-1));
+    }
+    off_type target;
+    switch (dir) {
+    case ios_base::beg:
+        target = off;
+        break;
+    case ios_base::cur:
+    case ios_base::end:
+        // Everything after the put position is discarded, so the end is here.
+        target = (off_type) size() + off;
+        break;
+    default:
+        return pos_type(off_type(-1));
+    }
+    return seekpos(pos_type(target), which);
+}
+
+ChunkedStreamBuf::pos_type ChunkedStreamBuf::seekpos(pos_type pos, ios_base::openmode which) {
+    off_type target = off_type(pos);
+    if (!(which & ios_base::out) || (which & ios_base::in) || target < 0 || (size_t) target > size()) {
+        // We can only rewind over data we have, not seek into the unknown.
+        return pos_type(off_type(-1));
+    }
+    if (target == (off_type) size()) {
+        // Nothing to do
+        return pos;
+    }
+    // Go to the chunk with the target position, or the end of the previous
+    // chunk if it is on a boundary, so we don't need a new chunk.
+    size_t chunk = target / ChunkPool::CHUNK_BYTES;
+    size_t offset = target % ChunkPool::CHUNK_BYTES;
+    if (offset == 0 && chunk > 0) {
+        chunk--;
+        offset = ChunkPool::CHUNK_BYTES;
+    }
+    enter_chunk(chunk, offset);
+    return pos;
+}
+
+void ChunkedStreamBuf::enter_chunk(size_t chunk, size_t offset) {
+    while (chunk >= chunks.size()) {
+        chunks.push_back(pool.take());
+    }
+    current_chunk = chunk;
+    setp(chunks[chunk], chunks[chunk] + ChunkPool::CHUNK_BYTES);
+    pbump((int) offset);
+}
+
+}
+
+}
@@ -0,0 +1,1069 @@
+/**
+ * \file gaf_binary.cpp
+ * Implementations for reading, writing, and indexing GAFB files.
+ */
+
+#include "vg/io/gaf_binary.hpp"
+#include "vg/io/gaf_index.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <omp.h>
+#include <zlib.h>
+
+//#define debug
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Enough records that each column compresses well, while a block of long
+/// reads still fits comfortably in memory for each thread.
+const size_t GafBinaryEncoder::DEFAULT_BLOCK_RECORDS = 4096;
+/// Keep blocks of very long reads from growing without bound.
+const size_t GafBinaryEncoder::DEFAULT_BLOCK_BYTES = 4 * 1024 * 1024;
+
+/// "GAF binary index"
+const string GafBinaryIndex::FILE_EXTENSION = ".gbi";
+
+/// Magic number at the start of GAFB files, including a format version.
+static const char GAF_BINARY_MAGIC[4] = {'G', 'F', 'B', '1'};
+/// Magic number at the start of saved indexes, including a format version.
+static const char INDEX_MAGIC[4] = {'G', 'B', 'I', '1'};
+
+/// Size of the header before each block: compressed size, uncompressed size,
+/// and record count as 32-bit values, and min and max node as 64-bit values.
+static const size_t BLOCK_HEADER_BYTES = 28;
+
+/// The columns in a block, in the order they are stored.
+enum GafBinaryColumn {
+    DICTIONARY_COLUMN,
+    NAME_COLUMN,
+    NUMBER_COLUMN,
+    STRAND_COLUMN,
+    STEP_COUNT_COLUMN,
+    STEP_FLAG_COLUMN,
+    NODE_COLUMN,
+    STEP_NAME_COLUMN,
+    INTERVAL_COLUMN,
+    TAG_COLUMN,
+    TAG_VALUE_COLUMN,
+    CS_OP_COLUMN,
+    CS_LENGTH_COLUMN,
+    CS_BASE_COLUMN,
+    COLUMN_COUNT
+};
+
+/// Flags for each step of a path
+static const uint8_t STEP_REVERSE = 1;
+static const uint8_t STEP_STABLE = 2;
+static const uint8_t STEP_INTERVAL = 4;
+/// The step's name is stored as text, even though it isn't stable.
+static const uint8_t STEP_NAMED = 8;
+
+/// Operations in packed cs strings, as ':', '*', '+', and '-'
+static const char CS_OPS[4] = {':', '*', '+', '-'};
+/// Flag on a packed cs operation whose bases are all lower-case
+static const uint8_t CS_LOWER = 4;
+
+/// Key of the cs optional field
+static const uint16_t CS_KEY = gafkluge::GafOptFields::pack_tag('c', 's');
+
+static void append_varint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char) (value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char) value);
+}
+
+static void append_zigzag(string& out, int64_t value) {
+    append_varint(out, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+static void append_text(string& out, const char* text, size_t length) {
+    append_varint(out, length);
+    out.append(text, length);
+}
+
+static void put_little_endian(char* dest, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        dest[i] = (char) (value >> (8 * i));
+    }
+}
+
+static uint64_t get_little_endian(const char* src, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value |= (uint64_t) (unsigned char) src[i] << (8 * i);
+    }
+    return value;
+}
+
+/// The fields of a block header
+struct GafBinaryBlockHeader {
+    uint32_t compressed_bytes;
+    uint32_t uncompressed_bytes;
+    uint32_t record_count;
+    int64_t min_node;
+    int64_t max_node;
+};
+
+static void write_block_header(char* dest, const GafBinaryBlockHeader& header) {
+    put_little_endian(dest, header.compressed_bytes, 4);
+    put_little_endian(dest + 4, header.uncompressed_bytes, 4);
+    put_little_endian(dest + 8, header.record_count, 4);
+    put_little_endian(dest + 12, (uint64_t) header.min_node, 8);
+    put_little_endian(dest + 20, (uint64_t) header.max_node, 8);
+}
+
+static GafBinaryBlockHeader read_block_header(const char* src) {
+    GafBinaryBlockHeader header;
+    header.compressed_bytes = get_little_endian(src, 4);
+    header.uncompressed_bytes = get_little_endian(src + 4, 4);
+    header.record_count = get_little_endian(src + 8, 4);
+    header.min_node = (int64_t) get_little_endian(src + 12, 8);
+    header.max_node = (int64_t) get_little_endian(src + 20, 8);
+    return header;
+}
+
+/// Return true if the header is the empty block that ends the file.
+static bool is_end_block(const GafBinaryBlockHeader& header) {
+    return header.compressed_bytes == 0 && header.record_count == 0;
+}
+
+/// Return true if a step name is a node ID that prints back the same.
+static bool is_canonical_node_id(const string& name) {
+    return is_node_id(name) && (name[0] != '0' || name.size() == 1);
+}
+
+/// Get the 2-bit code for a base of either case, or -1 if it is not a base.
+static int base_code(char base) {
+    switch (base) {
+    case 'A':
+    case 'a':
+        return 0;
+    case 'C':
+    case 'c':
+        return 1;
+    case 'G':
+    case 'g':
+        return 2;
+    case 'T':
+    case 't':
+        return 3;
+    default:
+        return -1;
+    }
+}
+
+/// Get the case flag shared by a run of bases: 0 if they are all upper-case,
+/// CS_LOWER if they are all lower-case, or -1 if they are mixed or not bases.
+static int bases_case(const char* bases, size_t count) {
+    int flags = -1;
+    for (size_t i = 0; i < count; i++) {
+        if (base_code(bases[i]) < 0) {
+            return -1;
+        }
+        int base_flags = bases[i] >= 'a' ? CS_LOWER : 0;
+        if (flags != -1 && flags != base_flags) {
+            return -1;
+        }
+        flags = base_flags;
+    }
+    return flags;
+}
+
+/// Find where the cs operation starting at the given position ends.
+static size_t cs_op_end(const char* cs, size_t length, size_t start) {
+    size_t end = start + 1;
+    while (end < length && cs[end] != ':' && cs[end] != '*' && cs[end] != '+' && cs[end] != '-') {
+        ++end;
+    }
+    return end;
+}
+
+GafBinaryEncoder::GafBinaryEncoder(size_t block_records, size_t block_bytes) :
+    block_records(max<size_t>(block_records, 1)), block_bytes(block_bytes),
+    min_node(numeric_limits<int64_t>::max()), max_node(numeric_limits<int64_t>::min()),
+    columns(COLUMN_COUNT) {
+    // Nothing to do!
+}
+
+void GafBinaryEncoder::add(const gafkluge::GafRecord& record) {
+    append_text(columns[NAME_COLUMN], record.query_name.data(), record.query_name.size());
+
+    string& numbers = columns[NUMBER_COLUMN];
+    append_zigzag(numbers, record.query_length);
+    append_zigzag(numbers, record.query_start);
+    append_zigzag(numbers, record.query_end);
+    append_zigzag(numbers, record.path_length);
+    append_zigzag(numbers, record.path_start);
+    append_zigzag(numbers, record.path_end);
+    append_zigzag(numbers, record.matches);
+    append_zigzag(numbers, record.block_length);
+    append_zigzag(numbers, record.mapq);
+
+    columns[STRAND_COLUMN].push_back(record.strand);
+
+    append_varint(columns[STEP_COUNT_COLUMN], record.path.size());
+    for (const gafkluge::GafStep& step : record.path) {
+        uint8_t flags = (step.is_reverse ? STEP_REVERSE : 0) |
+                        (step.is_stable ? STEP_STABLE : 0) |
+                        (step.is_interval ? STEP_INTERVAL : 0);
+        if (!step.is_stable && is_canonical_node_id(step.name)) {
+            // Nearby steps visit nearby node IDs, so store the difference.
+            int64_t node = std::stoll(step.name);
+            append_zigzag(columns[NODE_COLUMN], node - previous_node);
+            previous_node = node;
+            min_node = min(min_node, node);
+            max_node = max(max_node, node);
+        } else {
+            if (!step.is_stable) {
+                flags |= STEP_NAMED;
+                if (is_node_id(step.name)) {
+                    // Zero-padded, but still a node the index has to cover.
+                    int64_t node = std::stoll(step.name);
+                    min_node = min(min_node, node);
+                    max_node = max(max_node, node);
+                }
+            }
+            append_text(columns[STEP_NAME_COLUMN], step.name.data(), step.name.size());
+        }
+        if (step.is_interval) {
+            append_zigzag(columns[INTERVAL_COLUMN], step.start);
+            append_zigzag(columns[INTERVAL_COLUMN], step.end);
+        }
+        columns[STEP_FLAG_COLUMN].push_back((char) flags);
+    }
+
+    append_varint(columns[TAG_COLUMN], record.opt_fields.size());
+    for (size_t i = 0; i < record.opt_fields.size(); i++) {
+        uint16_t key = record.opt_fields.key(i);
+        gafkluge::GafFieldView type = record.opt_fields.type(i);
+        gafkluge::GafFieldView value = record.opt_fields.value(i);
+        size_t entry = 0;
+        while (entry < dictionary.size() &&
+               (dictionary[entry].first != key || dictionary[entry].second.compare(0, string::npos, type.data, type.length) != 0)) {
+            ++entry;
+        }
+        if (entry == dictionary.size()) {
+            dictionary.emplace_back(key, type.str());
+        }
+        bool packed = key == CS_KEY && type == "Z" && add_packed_cs(value.data, value.length);
+        append_varint(columns[TAG_COLUMN], (entry << 1) | (packed ? 1 : 0));
+        if (!packed) {
+            append_text(columns[TAG_VALUE_COLUMN], value.data, value.length);
+        }
+    }
+
+    ++record_count;
+}
+
+bool GafBinaryEncoder::add_packed_cs(const char* cs, size_t length) {
+    if (length == 0) {
+        return false;
+    }
+
+    // Make sure it all packs before adding anything. Each operation keeps
+    // the case of its bases, so mixing cases between operations is fine.
+    size_t op_count = 0;
+    char previous_op = 0;
+    int previous_case = -1;
+    int op_case = -1;
+    for (size_t i = 0; i < length; ) {
+        size_t end = cs_op_end(cs, length, i);
+        op_case = -1;
+        if (cs[i] == ':') {
+            // Lengths must print back the same.
+            if (end == i + 1 || end - i - 1 > 18 || cs[i + 1] == '0') {
+                return false;
+            }
+            for (size_t j = i + 1; j < end; j++) {
+                if (cs[j] < '0' || cs[j] > '9') {
+                    return false;
+                }
+            }
+        } else if (cs[i] == '*') {
+            op_case = bases_case(cs + i + 1, end - i - 1);
+            if (end != i + 3 || op_case < 0) {
+                return false;
+            }
+            if (previous_op == '*' && previous_case == op_case) {
+                // This continues a run of substitutions.
+                i = end;
+                continue;
+            }
+        } else if (cs[i] == '+' || cs[i] == '-') {
+            op_case = bases_case(cs + i + 1, end - i - 1);
+            if (op_case < 0) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        ++op_count;
+        previous_op = cs[i];
+        previous_case = op_case;
+        i = end;
+    }
+
+    string& ops = columns[CS_OP_COLUMN];
+    string& lengths = columns[CS_LENGTH_COLUMN];
+    append_varint(lengths, op_count);
+    for (size_t i = 0; i < length; ) {
+        size_t end = cs_op_end(cs, length, i);
+        if (cs[i] == ':') {
+            uint64_t match_length = 0;
+            for (size_t j = i + 1; j < end; j++) {
+                match_length = match_length * 10 + (cs[j] - '0');
+            }
+            ops.push_back(0);
+            append_varint(lengths, match_length);
+        } else if (cs[i] == '*') {
+            // Take the whole run of substitutions in the same case at once.
+            int run_case = bases_case(cs + i + 1, 2);
+            size_t run = 0;
+            while (end == i + 3 && cs[i] == '*' && bases_case(cs + i + 1, 2) == run_case) {
+                add_base(cs[i + 1]);
+                add_base(cs[i + 2]);
+                ++run;
+                i = end;
+                end = i < length ? cs_op_end(cs, length, i) : i;
+            }
+            ops.push_back((char) (1 | run_case));
+            append_varint(lengths, run);
+            continue;
+        } else {
+            ops.push_back((char) ((cs[i] == '+' ? 2 : 3) | bases_case(cs + i + 1, end - i - 1)));
+            append_varint(lengths, end - i - 1);
+            for (size_t j = i + 1; j < end; j++) {
+                add_base(cs[j]);
+            }
+        }
+        i = end;
+    }
+    return true;
+}
+
+void GafBinaryEncoder::add_base(char base) {
+    base_byte |= (uint8_t) (base_code(base) << (2 * (base_count % 4)));
+    ++base_count;
+    if (base_count % 4 == 0) {
+        columns[CS_BASE_COLUMN].push_back((char) base_byte);
+        base_byte = 0;
+    }
+}
+
+size_t GafBinaryEncoder::size() const {
+    return record_count;
+}
+
+bool GafBinaryEncoder::full() const {
+    if (record_count >= block_records) {
+        return true;
+    }
+    size_t bytes = 0;
+    for (const string& column : columns) {
+        bytes += column.size();
+    }
+    return bytes >= block_bytes;
+}
+
+void GafBinaryEncoder::finish_block(string& out) {
+    if (record_count == 0) {
+        return;
+    }
+
+    if (base_count % 4 != 0) {
+        columns[CS_BASE_COLUMN].push_back((char) base_byte);
+    }
+    string& dictionary_column = columns[DICTIONARY_COLUMN];
+    append_varint(dictionary_column, dictionary.size());
+    for (const auto& entry : dictionary) {
+        dictionary_column.push_back((char) (entry.first >> 8));
+        dictionary_column.push_back((char) (entry.first & 0xFF));
+        append_text(dictionary_column, entry.second.data(), entry.second.size());
+    }
+
+    payload.clear();
+    for (const string& column : columns) {
+        append_text(payload, column.data(), column.size());
+    }
+    if (payload.size() > numeric_limits<uint32_t>::max()) {
+        throw runtime_error("GAFB block of " + to_string(record_count) + " records is too big");
+    }
+
+    // Compress straight into the output, after room for the header.
+    size_t start = out.size();
+    uLongf compressed_bytes = compressBound(payload.size());
+    out.resize(start + BLOCK_HEADER_BYTES + compressed_bytes);
+    int status = compress2((Bytef*) &out[start + BLOCK_HEADER_BYTES], &compressed_bytes,
+                           (const Bytef*) payload.data(), payload.size(), Z_DEFAULT_COMPRESSION);
+    if (status != Z_OK) {
+        throw runtime_error("Could not compress GAFB block: zlib error " + to_string(status));
+    }
+    out.resize(start + BLOCK_HEADER_BYTES + compressed_bytes);
+    write_block_header(&out[start], {(uint32_t) compressed_bytes, (uint32_t) payload.size(), (uint32_t) record_count, min_node, max_node});
+
+#ifdef debug
+    cerr << "Finished GAFB block of " << record_count << " records in " << payload.size() << " bytes, "
+         << compressed_bytes << " compressed" << endl;
+#endif
+
+    // Start over, keeping our memory.
+    record_count = 0;
+    previous_node = 0;
+    min_node = numeric_limits<int64_t>::max();
+    max_node = numeric_limits<int64_t>::min();
+    dictionary.clear();
+    base_byte = 0;
+    base_count = 0;
+    for (string& column : columns) {
+        column.clear();
+    }
+}
+
+uint64_t GafBinaryDecoder::Cursor::varint() {
+    uint64_t value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        uint8_t next = byte();
+        value |= (uint64_t) (next & 0x7F) << shift;
+        if (!(next & 0x80)) {
+            return value;
+        }
+    }
+    throw runtime_error("Corrupt GAFB block: varint is too long");
+}
+
+int64_t GafBinaryDecoder::Cursor::zigzag() {
+    uint64_t value = varint();
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+uint8_t GafBinaryDecoder::Cursor::byte() {
+    if (pos == end) {
+        throw runtime_error("Corrupt GAFB block: column ends early");
+    }
+    return (uint8_t) *pos++;
+}
+
+const char* GafBinaryDecoder::Cursor::bytes(size_t count) {
+    if (count > (size_t) (end - pos)) {
+        throw runtime_error("Corrupt GAFB block: column ends early");
+    }
+    const char* start = pos;
+    pos += count;
+    return start;
+}
+
+void GafBinaryDecoder::load_block(const string& block) {
+    if (block.size() < BLOCK_HEADER_BYTES) {
+        throw runtime_error("Corrupt GAFB block: header is truncated");
+    }
+    GafBinaryBlockHeader header = read_block_header(block.data());
+    if (block.size() != BLOCK_HEADER_BYTES + header.compressed_bytes) {
+        throw runtime_error("Corrupt GAFB block: size does not match header");
+    }
+
+    payload.resize(header.uncompressed_bytes);
+    uLongf uncompressed_bytes = payload.size();
+    int status = uncompress((Bytef*) &payload[0], &uncompressed_bytes,
+                            (const Bytef*) block.data() + BLOCK_HEADER_BYTES, header.compressed_bytes);
+    if (status != Z_OK || uncompressed_bytes != payload.size()) {
+        throw runtime_error("Corrupt GAFB block: could not decompress");
+    }
+
+    Cursor all;
+    all.pos = payload.data();
+    all.end = payload.data() + payload.size();
+    columns.resize(COLUMN_COUNT);
+    for (Cursor& column : columns) {
+        size_t length = all.varint();
+        column.pos = all.bytes(length);
+        column.end = column.pos + length;
+    }
+
+    Cursor& dictionary_column = columns[DICTIONARY_COLUMN];
+    dictionary.resize(dictionary_column.varint());
+    for (auto& entry : dictionary) {
+        uint16_t high = dictionary_column.byte();
+        entry.first = (uint16_t) ((high << 8) | dictionary_column.byte());
+        size_t length = dictionary_column.varint();
+        entry.second.assign(dictionary_column.bytes(length), length);
+    }
+
+    bases = columns[CS_BASE_COLUMN];
+    bases_read = 0;
+    record_count = header.record_count;
+    records_read = 0;
+    previous_node = 0;
+}
+
+size_t GafBinaryDecoder::size() const {
+    return record_count;
+}
+
+char GafBinaryDecoder::next_base(bool lower) {
+    size_t byte_index = bases_read / 4;
+    if (byte_index >= (size_t) (bases.end - bases.pos)) {
+        throw runtime_error("Corrupt GAFB block: column ends early");
+    }
+    char base = (lower ? "acgt" : "ACGT")[((uint8_t) bases.pos[byte_index] >> (2 * (bases_read % 4))) & 3];
+    ++bases_read;
+    return base;
+}
+
+bool GafBinaryDecoder::next(gafkluge::GafRecord& record) {
+    if (records_read == record_count) {
+        return false;
+    }
+
+    Cursor& names = columns[NAME_COLUMN];
+    size_t name_length = names.varint();
+    record.query_name.assign(names.bytes(name_length), name_length);
+
+    Cursor& numbers = columns[NUMBER_COLUMN];
+    record.query_length = numbers.zigzag();
+    record.query_start = numbers.zigzag();
+    record.query_end = numbers.zigzag();
+    record.path_length = numbers.zigzag();
+    record.path_start = numbers.zigzag();
+    record.path_end = numbers.zigzag();
+    record.matches = numbers.zigzag();
+    record.block_length = numbers.zigzag();
+    record.mapq = (int32_t) numbers.zigzag();
+
+    record.strand = (char) columns[STRAND_COLUMN].byte();
+
+    // Reuse the steps, and their names' memory, from earlier records.
+    record.path.resize(columns[STEP_COUNT_COLUMN].varint());
+    for (gafkluge::GafStep& step : record.path) {
+        uint8_t flags = columns[STEP_FLAG_COLUMN].byte();
+        step.is_reverse = flags & STEP_REVERSE;
+        step.is_stable = flags & STEP_STABLE;
+        step.is_interval = flags & STEP_INTERVAL;
+        if (step.is_stable || (flags & STEP_NAMED)) {
+            Cursor& step_names = columns[STEP_NAME_COLUMN];
+            size_t length = step_names.varint();
+            step.name.assign(step_names.bytes(length), length);
+        } else {
+            previous_node += columns[NODE_COLUMN].zigzag();
+            step.name.clear();
+            gafkluge::append_int(step.name, previous_node);
+        }
+        if (step.is_interval) {
+            step.start = columns[INTERVAL_COLUMN].zigzag();
+            step.end = columns[INTERVAL_COLUMN].zigzag();
+        }
+    }
+
+    record.opt_fields.clear();
+    size_t field_count = columns[TAG_COLUMN].varint();
+    for (size_t i = 0; i < field_count; i++) {
+        uint64_t code = columns[TAG_COLUMN].varint();
+        if ((code >> 1) >= dictionary.size()) {
+            throw runtime_error("Corrupt GAFB block: tag is not in dictionary");
+        }
+        const auto& entry = dictionary[code >> 1];
+        const char* value;
+        size_t value_length;
+        if (code & 1) {
+            // Unpack a cs string.
+            scratch.clear();
+            Cursor& ops = columns[CS_OP_COLUMN];
+            Cursor& lengths = columns[CS_LENGTH_COLUMN];
+            size_t op_count = lengths.varint();
+            for (size_t j = 0; j < op_count; j++) {
+                uint8_t op = ops.byte();
+                uint64_t length = lengths.varint();
+                bool lower = op & CS_LOWER;
+                op &= ~CS_LOWER;
+                if (op >= sizeof(CS_OPS) || (lower && op == 0)) {
+                    throw runtime_error("Corrupt GAFB block: unknown cs operation");
+                }
+                if (op == 0) {
+                    scratch.push_back(':');
+                    gafkluge::append_int(scratch, length);
+                } else if (op == 1) {
+                    for (uint64_t k = 0; k < length; k++) {
+                        scratch.push_back('*');
+                        scratch.push_back(next_base(lower));
+                        scratch.push_back(next_base(lower));
+                    }
+                } else {
+                    scratch.push_back(CS_OPS[op]);
+                    for (uint64_t k = 0; k < length; k++) {
+                        scratch.push_back(next_base(lower));
+                    }
+                }
+            }
+            value = scratch.data();
+            value_length = scratch.size();
+        } else {
+            Cursor& values = columns[TAG_VALUE_COLUMN];
+            value_length = values.varint();
+            value = values.bytes(value_length);
+        }
+        record.opt_fields.set(entry.first, entry.second.data(), entry.second.size(), value, value_length);
+    }
+
+    ++records_read;
+    return true;
+}
+
+void write_gaf_binary_header(ostream& out) {
+    out.write(GAF_BINARY_MAGIC, sizeof(GAF_BINARY_MAGIC));
+}
+
+void write_gaf_binary_end(ostream& out) {
+    char header[BLOCK_HEADER_BYTES];
+    write_block_header(header, {0, 0, 0, 0, 0});
+    out.write(header, sizeof(header));
+}
+
+void read_gaf_binary_header(istream& in) {
+    char magic[sizeof(GAF_BINARY_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, GAF_BINARY_MAGIC, sizeof(magic)) != 0) {
+        throw runtime_error("Data is not GAFB");
+    }
+}
+
+bool read_gaf_binary_block(istream& in, string& block) {
+    block.resize(BLOCK_HEADER_BYTES);
+    in.read(&block[0], BLOCK_HEADER_BYTES);
+    if (!in) {
+        throw runtime_error("GAFB file is truncated");
+    }
+    GafBinaryBlockHeader header = read_block_header(block.data());
+    if (is_end_block(header)) {
+        return false;
+    }
+    block.resize(BLOCK_HEADER_BYTES + header.compressed_bytes);
+    in.read(&block[BLOCK_HEADER_BYTES], header.compressed_bytes);
+    if (!in) {
+        throw runtime_error("GAFB file is truncated");
+    }
+    return true;
+}
+
+void GafBinaryIndex::index(const string& filename) {
+    blocks.clear();
+    ifstream in(filename, ios::binary);
+    if (!in) {
+        throw runtime_error("Could not open GAFB file " + filename);
+    }
+    read_gaf_binary_header(in);
+
+    char header_bytes[BLOCK_HEADER_BYTES];
+    while (true) {
+        uint64_t offset = in.tellg();
+        in.read(header_bytes, sizeof(header_bytes));
+        if (!in) {
+            throw runtime_error("GAFB file " + filename + " is truncated");
+        }
+        GafBinaryBlockHeader header = read_block_header(header_bytes);
+        if (is_end_block(header)) {
+            break;
+        }
+        blocks.push_back({offset, header.record_count, header.min_node, header.max_node});
+        // Skip the data; we only need the headers.
+        in.seekg(header.compressed_bytes, ios::cur);
+    }
+
+#ifdef debug
+    cerr << "Indexed " << blocks.size() << " blocks of " << filename << endl;
+#endif
+}
+
+void GafBinaryIndex::save(ostream& out) const {
+    out.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    uint64_t count = blocks.size();
+    out.write((const char*) &count, sizeof(count));
+    for (const Block& block : blocks) {
+        int64_t fields[4] = {(int64_t) block.offset, (int64_t) block.record_count, (int64_t) block.min_node, (int64_t) block.max_node};
+        out.write((const char*) fields, sizeof(fields));
+    }
+    if (!out) {
+        throw runtime_error("Could not write GAFB index");
+    }
+}
+
+void GafBinaryIndex::load(istream& in) {
+    blocks.clear();
+    char magic[sizeof(INDEX_MAGIC)];
+    uint64_t count = 0;
+    in.read(magic, sizeof(magic));
+    in.read((char*) &count, sizeof(count));
+    if (!in || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0) {
+        throw runtime_error("Data is not a GAFB index");
+    }
+    // The count hasn't been checked against the data yet, so don't let a bad
+    // one make us allocate much before we run out of blocks.
+    blocks.reserve(min(count, (uint64_t) 1 << 16));
+    for (uint64_t i = 0; i < count; i++) {
+        int64_t fields[4];
+        in.read((char*) fields, sizeof(fields));
+        if (!in) {
+            throw runtime_error("GAFB index is truncated");
+        }
+        blocks.push_back({(uint64_t) fields[0], (uint64_t) fields[1], (nid_t) fields[2], (nid_t) fields[3]});
+    }
+}
+
+vector<uint64_t> GafBinaryIndex::find(nid_t min_node, nid_t max_node) const {
+    vector<uint64_t> offsets;
+    for (const Block& block : blocks) {
+        // Blocks that visit no nodes have an empty range, and never match.
+        if (block.min_node <= max_node && block.max_node >= min_node) {
+            offsets.push_back(block.offset);
+        }
+    }
+    return offsets;
+}
+
+const vector<GafBinaryIndex::Block>& GafBinaryIndex::get_blocks() const {
+    return blocks;
+}
+
+void index_gaf_binary(const string& filename) {
+    GafBinaryIndex index;
+    index.index(filename);
+    string index_filename = filename + GafBinaryIndex::FILE_EXTENSION;
+    ofstream out(index_filename, ios::binary);
+    if (!out) {
+        throw runtime_error("Could not open " + index_filename + " for writing");
+    }
+    index.save(out);
+}
+
+/// Open a GAFB file (or "-") and read its header. The file, if any, is kept
+/// in the given pointer.
+static istream& open_gaf_binary(const string& filename, unique_ptr<ifstream>& file) {
+    if (filename != "-") {
+        file.reset(new ifstream(filename, ios::binary));
+        if (!*file) {
+            throw runtime_error("Could not open GAFB file " + filename);
+        }
+    }
+    istream& in = file.get() != nullptr ? *file : cin;
+    read_gaf_binary_header(in);
+    return in;
+}
+
+size_t gaf_binary_unpaired_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                    const string& filename, function<void(Alignment&)> lambda) {
+    unique_ptr<ifstream> file;
+    istream& in = open_gaf_binary(filename, file);
+
+    string block;
+    GafBinaryDecoder decoder;
+    gafkluge::GafRecord record;
+    Alignment aln;
+    NodeCache node_cache(node_to_length, node_to_sequence);
+    size_t count = 0;
+    while (read_gaf_binary_block(in, block)) {
+        decoder.load_block(block);
+        while (decoder.next(record)) {
+            gaf_to_alignment(node_cache, record, aln);
+            lambda(aln);
+            ++count;
+        }
+    }
+    return count;
+}
+
+size_t gaf_binary_unpaired_for_each(const HandleGraph& graph, const string& filename,
+                                    function<void(Alignment&)> lambda) {
+    function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
+        return graph.get_length(graph.get_handle(node_id));
+    };
+    function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
+        return graph.get_sequence(graph.get_handle(node_id, is_reversed));
+    };
+    return gaf_binary_unpaired_for_each(node_to_length, node_to_sequence, filename, lambda);
+}
+
+/**
+ * A block found by the reading thread, with the decoder, record, and
+ * Alignment a worker uses to go through it. These live in the recycled
+ * batches, so if the lambda lets its thread pick up another block, that block
+ * has its own and doesn't disturb this one.
+ */
+struct GafBinaryBlockSlot {
+    string block;
+    GafBinaryDecoder decoder;
+    gafkluge::GafRecord gaf;
+    Alignment aln;
+
+    /// Empty the slot for the next block. Everything else is overwritten when
+    /// the block is decoded, so it keeps its memory.
+    void clear() {
+        block.clear();
+    }
+};
+
+size_t gaf_binary_unpaired_for_each_parallel(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                             const string& filename, function<void(Alignment&)> lambda) {
+    unique_ptr<ifstream> file;
+    istream& in = open_gaf_binary(filename, file);
+
+    // The reading thread only finds the blocks. Decompressing and decoding
+    // them is left to the workers.
+    function<bool(GafBinaryBlockSlot&)> get_block = [&](GafBinaryBlockSlot& slot) {
+        return read_gaf_binary_block(in, slot.block);
+    };
+    function<size_t(const GafBinaryBlockSlot&)> block_bytes = [&](const GafBinaryBlockSlot& slot) {
+        return slot.block.size();
+    };
+
+    vector<NodeCache> node_caches;
+    size_t thread_count = omp_get_max_threads();
+    node_caches.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        node_caches.emplace_back(node_to_length, node_to_sequence);
+    }
+    atomic<size_t> count(0);
+    function<void(GafBinaryBlockSlot&)> block_lambda = [&](GafBinaryBlockSlot& slot) {
+        slot.decoder.load_block(slot.block);
+        while (slot.decoder.next(slot.gaf)) {
+            // A thread only uses its node cache in here, where it can't switch
+            // to another block, so one per thread is enough.
+            gaf_to_alignment(node_caches.at(omp_get_thread_num()), slot.gaf, slot.aln);
+            lambda(slot.aln);
+        }
+        count += slot.decoder.size();
+    };
+
+    // Blocks already hold thousands of records, so tasks only need a couple.
+    unpaired_for_each_parallel(get_block, block_lambda, 2, nullptr, block_bytes);
+    return count;
+}
+
+size_t gaf_binary_unpaired_for_each_parallel(const HandleGraph& graph, const string& filename,
+                                             function<void(Alignment&)> lambda) {
+    function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
+        return graph.get_length(graph.get_handle(node_id));
+    };
+    function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
+        return graph.get_sequence(graph.get_handle(node_id, is_reversed));
+    };
+    return gaf_binary_unpaired_for_each_parallel(node_to_length, node_to_sequence, filename, lambda);
+}
+
+size_t gaf_binary_paired_interleaved_for_each(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                              const string& filename, function<void(Alignment&, Alignment&)> lambda) {
+    unique_ptr<ifstream> file;
+    istream& in = open_gaf_binary(filename, file);
+
+    string block;
+    GafBinaryDecoder decoder;
+    gafkluge::GafRecord record1, record2;
+    Alignment aln1, aln2;
+    NodeCache node_cache(node_to_length, node_to_sequence);
+    size_t count = 0;
+    // Set when record1 holds a first mate still waiting for its partner,
+    // which may be in the next block
+    bool have_first = false;
+    while (read_gaf_binary_block(in, block)) {
+        decoder.load_block(block);
+        while (decoder.next(have_first ? record2 : record1)) {
+            if (!have_first) {
+                have_first = true;
+                continue;
+            }
+            gaf_to_alignment(node_cache, record1, aln1);
+            gaf_to_alignment(node_cache, record2, aln2);
+            lambda(aln1, aln2);
+            count += 2;
+            have_first = false;
+        }
+    }
+    return count;
+}
+
+size_t gaf_binary_paired_interleaved_for_each(const HandleGraph& graph, const string& filename,
+                                              function<void(Alignment&, Alignment&)> lambda) {
+    function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
+        return graph.get_length(graph.get_handle(node_id));
+    };
+    function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
+        return graph.get_sequence(graph.get_handle(node_id, is_reversed));
+    };
+    return gaf_binary_paired_interleaved_for_each(node_to_length, node_to_sequence, filename, lambda);
+}
+
+/**
+ * Blocks found by the reading thread that hold whole pairs between them:
+ * usually one, but more if a pair spans blocks. Has the decoder, records, and
+ * Alignments a worker uses to go through them, which live in the recycled
+ * batches like GafBinaryBlockSlot's.
+ */
+struct GafBinaryPairedBlockSlot {
+    /// The blocks, of which the first block_count are in use
+    vector<string> blocks;
+    size_t block_count = 0;
+    GafBinaryDecoder decoder;
+    gafkluge::GafRecord gaf1, gaf2;
+    Alignment aln1, aln2;
+
+    /// Empty the slot for the next blocks, keeping their memory.
+    void clear() {
+        block_count = 0;
+    }
+};
+
+size_t gaf_binary_paired_interleaved_for_each_parallel(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                                       const string& filename, function<void(Alignment&, Alignment&)> lambda) {
+    unique_ptr<ifstream> file;
+    istream& in = open_gaf_binary(filename, file);
+
+    // Read blocks until they hold an even number of records, so no pair is
+    // split between workers. The counts are in the block headers, so this
+    // still doesn't decompress anything.
+    // Set once we have read the end block, which can't be read again
+    bool at_end = false;
+    function<bool(GafBinaryPairedBlockSlot&)> get_blocks = [&](GafBinaryPairedBlockSlot& slot) {
+        size_t record_count = 0;
+        do {
+            if (slot.block_count == slot.blocks.size()) {
+                slot.blocks.emplace_back();
+            }
+            string& block = slot.blocks[slot.block_count];
+            if (at_end || !read_gaf_binary_block(in, block)) {
+                // Pass on an odd record at the end, which the worker will skip.
+                at_end = true;
+                return slot.block_count > 0;
+            }
+            record_count += read_block_header(block.data()).record_count;
+            slot.block_count++;
+        } while (record_count % 2 != 0);
+        return true;
+    };
+    function<size_t(const GafBinaryPairedBlockSlot&)> block_bytes = [&](const GafBinaryPairedBlockSlot& slot) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < slot.block_count; i++) {
+            bytes += slot.blocks[i].size();
+        }
+        return bytes;
+    };
+
+    vector<NodeCache> node_caches;
+    size_t thread_count = omp_get_max_threads();
+    node_caches.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        node_caches.emplace_back(node_to_length, node_to_sequence);
+    }
+    atomic<size_t> count(0);
+    function<void(GafBinaryPairedBlockSlot&)> blocks_lambda = [&](GafBinaryPairedBlockSlot& slot) {
+        size_t pairs = 0;
+        bool have_first = false;
+        for (size_t i = 0; i < slot.block_count; i++) {
+            slot.decoder.load_block(slot.blocks[i]);
+            while (slot.decoder.next(have_first ? slot.gaf2 : slot.gaf1)) {
+                if (!have_first) {
+                    have_first = true;
+                    continue;
+                }
+                // As in the unpaired reader, the node cache is only used
+                // where the thread can't switch to other blocks.
+                NodeCache& node_cache = node_caches.at(omp_get_thread_num());
+                gaf_to_alignment(node_cache, slot.gaf1, slot.aln1);
+                gaf_to_alignment(node_cache, slot.gaf2, slot.aln2);
+                lambda(slot.aln1, slot.aln2);
+                pairs++;
+                have_first = false;
+            }
+        }
+        count += pairs * 2;
+    };
+
+    unpaired_for_each_parallel(get_blocks, blocks_lambda, 2, nullptr, block_bytes);
+    return count;
+}
+
+size_t gaf_binary_paired_interleaved_for_each_parallel(const HandleGraph& graph, const string& filename,
+                                                       function<void(Alignment&, Alignment&)> lambda) {
+    function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
+        return graph.get_length(graph.get_handle(node_id));
+    };
+    function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
+        return graph.get_sequence(graph.get_handle(node_id, is_reversed));
+    };
+    return gaf_binary_paired_interleaved_for_each_parallel(node_to_length, node_to_sequence, filename, lambda);
+}
+
+size_t gaf_binary_for_each_in_node_range(const HandleGraph& graph, const string& filename, const GafBinaryIndex& index,
+                                         nid_t min_node, nid_t max_node,
+                                         function<void(Alignment&)> lambda) {
+    vector<uint64_t> offsets = index.find(min_node, max_node);
+    if (offsets.empty()) {
+        return 0;
+    }
+
+    ifstream in(filename, ios::binary);
+    if (!in) {
+        throw runtime_error("Could not open GAFB file " + filename);
+    }
+    string block;
+    GafBinaryDecoder decoder;
+    gafkluge::GafRecord record;
+    Alignment aln;
+    NodeCache node_cache(graph);
+    size_t count = 0;
+    for (uint64_t offset : offsets) {
+        in.seekg(offset);
+        if (!read_gaf_binary_block(in, block)) {
+            throw runtime_error("GAFB index does not match file " + filename);
+        }
+        decoder.load_block(block);
+        while (decoder.next(record)) {
+            // Does the record visit a node in the range? Records using stable
+            // path names or segment names can't be put in node ID space, so
+            // they are skipped, as they are when indexing GAF.
+            bool visits = false;
+            bool in_node_space = true;
+            for (const auto& step : record.path) {
+                if (step.is_stable || !is_node_id(step.name)) {
+                    in_node_space = false;
+                    break;
+                }
+                nid_t node = std::stoll(step.name);
+                if (node >= min_node && node <= max_node) {
+                    visits = true;
+                }
+            }
+            if (visits && in_node_space) {
+                gaf_to_alignment(node_cache, record, aln);
+                lambda(aln);
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+size_t gaf_binary_for_each_in_node_range(const HandleGraph& graph, const string& filename,
+                                         nid_t min_node, nid_t max_node,
+                                         function<void(Alignment&)> lambda) {
+    string index_filename = filename + GafBinaryIndex::FILE_EXTENSION;
+    ifstream in(index_filename, ios::binary);
+    if (!in) {
+        throw runtime_error("Could not open GAFB index " + index_filename);
+    }
+    GafBinaryIndex index;
+    index.load(in);
+    return gaf_binary_for_each_in_node_range(graph, filename, index, min_node, max_node, lambda);
+}
+
+}
+
+}
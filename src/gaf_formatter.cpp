@@ -0,0 +1,64 @@
+/**
+ * \file gaf_formatter.cpp
+ * Implementations for writing Alignments as GAF text into a buffer.
+ */
+
+#include "vg/io/gaf_formatter.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Lets the gafkluge writers append to a stream buffer as if it were a string.
+ */
+struct StreamBufAppender {
+    streambuf& out;
+
+    void push_back(char c) {
+        out.sputc(c);
+    }
+    void append(const char* data, size_t length) {
+        out.sputn(data, length);
+    }
+    void append(const string& data) {
+        out.sputn(data.data(), data.size());
+    }
+};
+
+GafFormatter::GafFormatter(const HandleGraph& graph,
+                           const handlegraph::NamedNodeBackTranslation* translate_through,
+                           bool cs_cigar, bool base_quals, bool frag_links) :
+    node_cache(graph), translate_through(translate_through),
+    cs_cigar(cs_cigar), base_quals(base_quals), frag_links(frag_links) {
+    // Nothing to do!
+}
+
+GafFormatter::GafFormatter(function<size_t(nid_t)> node_to_length,
+                           function<string(nid_t, bool)> node_to_sequence,
+                           const handlegraph::NamedNodeBackTranslation* translate_through,
+                           bool cs_cigar, bool base_quals, bool frag_links) :
+    node_cache(node_to_length, node_to_sequence), translate_through(translate_through),
+    cs_cigar(cs_cigar), base_quals(base_quals), frag_links(frag_links) {
+    // Nothing to do!
+}
+
+void GafFormatter::append(const Alignment& aln, string& buffer) {
+    alignment_to_gaf(node_cache, aln, record, scratch, translate_through, cs_cigar, base_quals, frag_links);
+    gafkluge::append_gaf_record(buffer, record);
+    buffer.push_back('\n');
+}
+
+void GafFormatter::append(const Alignment& aln, streambuf& out) {
+    // Convert first, since that can throw, so we never write half a line.
+    alignment_to_gaf(node_cache, aln, record, scratch, translate_through, cs_cigar, base_quals, frag_links);
+    StreamBufAppender appender{out};
+    gafkluge::append_gaf_record(appender, record);
+    appender.push_back('\n');
+}
+
+}
+
+}
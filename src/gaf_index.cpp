@@ -0,0 +1,274 @@
+/**
+ * \file gaf_index.cpp
+ * Implementations for indexing and querying bgzipped GAF files by node ID.
+ */
+
+#include "vg/io/gaf_index.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <htslib/bgzf.h>
+
+//#define debug
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// "GAF node index"
+const string GafNodeIndex::FILE_EXTENSION = ".gni";
+
+/// Magic number at the start of saved indexes, including a format version.
+static const char INDEX_MAGIC[4] = {'G', 'N', 'I', '1'};
+
+/// Open a GAF file for seeking, or throw if it is not bgzipped.
+static BGZF* open_bgzipped_gaf(const string& gaf_filename) {
+    BGZF* fp = bgzf_open(gaf_filename.c_str(), "r");
+    if (fp == nullptr) {
+        throw runtime_error("Could not open GAF file " + gaf_filename);
+    }
+    if (bgzf_compression(fp) != 2) {
+        // We need BGZF blocks to seek to.
+        bgzf_close(fp);
+        throw runtime_error("GAF file " + gaf_filename + " must be bgzipped to be indexed");
+    }
+    return fp;
+}
+
+bool is_node_id(const string& name) {
+    // 18 digits can't overflow a 64-bit ID.
+    if (name.empty() || name.size() > 18) {
+        return false;
+    }
+    for (char c : name) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool gaf_node_range(const gafkluge::GafRecord& record, nid_t& min_node, nid_t& max_node) {
+    bool found = false;
+    for (const auto& step : record.path) {
+        if (step.is_stable || !is_node_id(step.name)) {
+            // This is a path or segment name, not a node ID.
+            return false;
+        }
+        nid_t node = std::stoll(step.name);
+        if (!found || node < min_node) {
+            min_node = node;
+        }
+        if (!found || node > max_node) {
+            max_node = node;
+        }
+        found = true;
+    }
+    return found;
+}
+
+void GafNodeIndex::index(const string& gaf_filename) {
+    blocks.clear();
+    BGZF* fp = open_bgzipped_gaf(gaf_filename);
+
+    kstring_t line = KS_INITIALIZE;
+    gafkluge::GafRecord record;
+    nid_t min_node;
+    nid_t max_node;
+    while (true) {
+        uint64_t virtual_offset = bgzf_tell(fp);
+        int got = bgzf_getline(fp, '\n', &line);
+        if (got < -1) {
+            ks_free(&line);
+            bgzf_close(fp);
+            throw runtime_error("Error reading GAF file " + gaf_filename);
+        }
+        if (got <= 0) {
+            // End of file, or an empty line that ends the GAF
+            break;
+        }
+        gafkluge::parse_gaf_record(ks_str(&line), ks_len(&line), record);
+        if (!gaf_node_range(record, min_node, max_node)) {
+            continue;
+        }
+        if (!blocks.empty() && min_node < blocks.back().min_node) {
+            ks_free(&line);
+            bgzf_close(fp);
+            throw runtime_error("GAF file " + gaf_filename + " is not sorted by node ID at record " + record.query_name);
+        }
+        if (blocks.empty() || (blocks.back().virtual_offset >> 16) != (virtual_offset >> 16)) {
+            // This is the first indexed record in its block.
+            blocks.push_back({virtual_offset, min_node, max_node});
+        } else {
+            blocks.back().max_node = max(blocks.back().max_node, max_node);
+        }
+    }
+
+#ifdef debug
+    cerr << "Indexed " << blocks.size() << " blocks of " << gaf_filename << endl;
+#endif
+
+    ks_free(&line);
+    bgzf_close(fp);
+}
+
+void GafNodeIndex::save(ostream& out) const {
+    out.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    uint64_t count = blocks.size();
+    out.write((const char*) &count, sizeof(count));
+    for (const Block& block : blocks) {
+        int64_t fields[3] = {(int64_t) block.virtual_offset, (int64_t) block.min_node, (int64_t) block.max_node};
+        out.write((const char*) fields, sizeof(fields));
+    }
+    if (!out) {
+        throw runtime_error("Could not write GAF node index");
+    }
+}
+
+void GafNodeIndex::load(istream& in) {
+    blocks.clear();
+    char magic[sizeof(INDEX_MAGIC)];
+    uint64_t count = 0;
+    in.read(magic, sizeof(magic));
+    in.read((char*) &count, sizeof(count));
+    if (!in || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0) {
+        throw runtime_error("Data is not a GAF node index");
+    }
+    // The count hasn't been checked against the data yet, so don't let a bad
+    // one make us allocate much before we run out of blocks.
+    blocks.reserve(min(count, (uint64_t) 1 << 16));
+    for (uint64_t i = 0; i < count; i++) {
+        int64_t fields[3];
+        in.read((char*) fields, sizeof(fields));
+        if (!in) {
+            throw runtime_error("GAF node index is truncated");
+        }
+        blocks.push_back({(uint64_t) fields[0], (nid_t) fields[1], (nid_t) fields[2]});
+    }
+}
+
+vector<pair<uint64_t, uint64_t>> GafNodeIndex::find(nid_t min_node, nid_t max_node) const {
+    vector<pair<uint64_t, uint64_t>> ranges;
+    // Blocks from here on only visit higher nodes than we want.
+    auto end = upper_bound(blocks.begin(), blocks.end(), max_node, [](nid_t node, const Block& block) {
+        return node < block.min_node;
+    });
+    for (auto it = blocks.begin(); it != end; ++it) {
+        if (it->max_node < min_node) {
+            continue;
+        }
+        // Blocks run up to the next indexed block.
+        uint64_t range_end = (it + 1 == blocks.end()) ? numeric_limits<uint64_t>::max() : (it + 1)->virtual_offset;
+        if (!ranges.empty() && ranges.back().second == it->virtual_offset) {
+            // Carry on from the previous block.
+            ranges.back().second = range_end;
+        } else {
+            ranges.emplace_back(it->virtual_offset, range_end);
+        }
+    }
+    return ranges;
+}
+
+const vector<GafNodeIndex::Block>& GafNodeIndex::get_blocks() const {
+    return blocks;
+}
+
+void index_gaf(const string& gaf_filename) {
+    GafNodeIndex index;
+    index.index(gaf_filename);
+    string index_filename = gaf_filename + GafNodeIndex::FILE_EXTENSION;
+    ofstream out(index_filename, ios::binary);
+    if (!out) {
+        throw runtime_error("Could not open " + index_filename + " for writing");
+    }
+    index.save(out);
+}
+
+size_t gaf_for_each_in_node_range(function<size_t(nid_t)> node_to_length, function<string(nid_t, bool)> node_to_sequence,
+                                  const string& filename, const GafNodeIndex& index,
+                                  nid_t min_node, nid_t max_node,
+                                  function<void(Alignment&)> lambda) {
+
+    vector<pair<uint64_t, uint64_t>> ranges = index.find(min_node, max_node);
+    if (ranges.empty()) {
+        return 0;
+    }
+
+    BGZF* fp = open_bgzipped_gaf(filename);
+    kstring_t line = KS_INITIALIZE;
+    gafkluge::GafRecord record;
+    Alignment aln;
+    // Records from the same part of a sorted file visit the same nodes.
+    NodeCache node_cache(node_to_length, node_to_sequence);
+    size_t count = 0;
+    nid_t record_min;
+    nid_t record_max;
+    for (auto& range : ranges) {
+        if (bgzf_seek(fp, range.first, SEEK_SET) < 0) {
+            ks_free(&line);
+            bgzf_close(fp);
+            throw runtime_error("Could not seek in GAF file " + filename);
+        }
+        // The range may run a little past the end of the last block, but
+        // records from there can't visit the nodes we want.
+        while ((uint64_t) bgzf_tell(fp) < range.second && bgzf_getline(fp, '\n', &line) > 0) {
+            gafkluge::parse_gaf_record(ks_str(&line), ks_len(&line), record);
+            if (!gaf_node_range(record, record_min, record_max) || record_max < min_node || record_min > max_node) {
+                continue;
+            }
+            // The record spans the range, but does it visit a node in it? We
+            // know all its steps are node IDs now.
+            bool visits = false;
+            for (const auto& step : record.path) {
+                nid_t node = std::stoll(step.name);
+                if (node >= min_node && node <= max_node) {
+                    visits = true;
+                    break;
+                }
+            }
+            if (visits) {
+                gaf_to_alignment(node_cache, record, aln);
+                lambda(aln);
+                ++count;
+            }
+        }
+    }
+
+    ks_free(&line);
+    bgzf_close(fp);
+    return count;
+}
+
+size_t gaf_for_each_in_node_range(const HandleGraph& graph, const string& filename,
+                                  nid_t min_node, nid_t max_node,
+                                  function<void(Alignment&)> lambda) {
+    string index_filename = filename + GafNodeIndex::FILE_EXTENSION;
+    ifstream in(index_filename, ios::binary);
+    if (!in) {
+        throw runtime_error("Could not open GAF node index " + index_filename);
+    }
+    GafNodeIndex index;
+    index.load(in);
+    return gaf_for_each_in_node_range(graph, filename, index, min_node, max_node, lambda);
+}
+
+size_t gaf_for_each_in_node_range(const HandleGraph& graph, const string& filename, const GafNodeIndex& index,
+                                  nid_t min_node, nid_t max_node,
+                                  function<void(Alignment&)> lambda) {
+    function<size_t(nid_t)> node_to_length = [&graph](nid_t node_id) {
+        return graph.get_length(graph.get_handle(node_id));
+    };
+    function<string(nid_t, bool)> node_to_sequence = [&graph](nid_t node_id, bool is_reversed) {
+        return graph.get_sequence(graph.get_handle(node_id, is_reversed));
+    };
+    return gaf_for_each_in_node_range(node_to_length, node_to_sequence, filename, index, min_node, max_node, lambda);
+}
+
+}
+
+}
@@ -0,0 +1,83 @@
+/**
+ * \file line_block_reader.cpp
+ * Implementations for reading lines from text files in big blocks.
+ */
+
+#include "vg/io/line_block_reader.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Big enough to hold hundreds of short-read GAF lines, and to amortize the
+/// read calls, but still cheap to keep around.
+const size_t LineBlockReader::BLOCK_BYTES = 1024 * 1024;
+
+LineBlockReader::LineBlockReader(htsFile* fp) : fp(fp), block(BLOCK_BYTES) {
+    // Nothing to do!
+}
+
+bool LineBlockReader::next_line(string& line) {
+    line.clear();
+    while (true) {
+        const char* start = block.data() + block_start;
+        const char* newline = (const char*) memchr(start, '\n', block_end - block_start);
+        if (newline != nullptr) {
+            // We have the rest of the line.
+            line.append(start, newline);
+            block_start = newline + 1 - block.data();
+            break;
+        }
+        // Take what we have of the line and get more.
+        line.append(start, block_end - block_start);
+        block_start = block_end;
+        if (!refill()) {
+            if (line.empty()) {
+                // There was no line at all.
+                return false;
+            }
+            // The last line had no line break.
+            break;
+        }
+    }
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    return true;
+}
+
+bool LineBlockReader::refill() {
+    if (at_eof) {
+        return false;
+    }
+    // Nothing before block_start is still needed.
+    block_start = 0;
+    block_end = 0;
+    ssize_t got;
+    if (fp->format.compression == no_compression) {
+        got = hread(fp->fp.hfile, block.data(), block.size());
+    } else {
+        got = bgzf_read(fp->fp.bgzf, block.data(), block.size());
+    }
+    if (got < 0) {
+        cerr << "[vg::io::LineBlockReader] error reading " << (fp->fn ? fp->fn : "file") << endl;
+        exit(1);
+    }
+    if (got == 0) {
+        at_eof = true;
+        return false;
+    }
+    block_end = got;
+    return true;
+}
+
+}
+
+}
@@ -0,0 +1,53 @@
+/**
+ * \file node_cache.cpp
+ * Implementations for caching node lengths and sequences.
+ */
+
+#include "vg/io/node_cache.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Enough for the nodes a batch of long reads in one region touches, while
+/// still small for short nodes.
+const size_t NodeCache::DEFAULT_CAPACITY = 4096;
+
+NodeCache::NodeCache(function<size_t(nid_t)> node_to_length,
+                     function<string(nid_t, bool)> node_to_sequence,
+                     size_t capacity) :
+    node_to_length(node_to_length), node_to_sequence(node_to_sequence),
+    lengths(capacity), sequences(capacity) {
+    // Nothing to do!
+}
+
+NodeCache::NodeCache(const HandleGraph& graph, size_t capacity) :
+    NodeCache([&graph](nid_t node_id) {
+        return graph.get_length(graph.get_handle(node_id));
+    }, [&graph](nid_t node_id, bool is_reversed) {
+        return graph.get_sequence(graph.get_handle(node_id, is_reversed));
+    }, capacity) {
+    // Nothing to do!
+}
+
+size_t NodeCache::get_length(nid_t node_id) {
+    return lengths.get((uint64_t) node_id, [&](uint64_t key, size_t& length) {
+        length = node_to_length(node_id);
+    });
+}
+
+const string& NodeCache::get_sequence(nid_t node_id, bool is_reverse) {
+    return sequences.get(((uint64_t) node_id << 1) | (is_reverse ? 1 : 0), [&](uint64_t key, string& sequence) {
+        sequence = node_to_sequence(node_id, is_reverse);
+    });
+}
+
+bool NodeCache::has_sequences() const {
+    return (bool) node_to_sequence;
+}
+
+}
+
+}
@@ -0,0 +1,199 @@
+/**
+ * \file numa.cpp
+ * Implementations for NUMA-aware thread placement, using libnuma if it was
+ * available at build time, and Linux sysfs otherwise.
+ */
+
+#include "vg/io/numa.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef VGIO_HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Holds the node-to-CPU layout of the machine, as read from sysfs.
+struct NumaTopology {
+    /// For each node, the CPUs it has.
+    vector<vector<int>> node_cpus;
+    /// For each CPU, the node it is on.
+    vector<int> cpu_nodes;
+
+    NumaTopology();
+};
+
+/// Parse a sysfs CPU list like "0-3,8,10-11".
+static vector<int> parse_cpu_list(const string& list) {
+    vector<int> cpus;
+    stringstream ranges(list);
+    string range;
+    while (getline(ranges, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+NumaTopology::NumaTopology() {
+    for (int node = 0; ; node++) {
+        ifstream cpulist("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        if (!cpulist) {
+            // Nodes are numbered densely on all the systems we care about.
+            break;
+        }
+        string list;
+        getline(cpulist, list);
+        node_cpus.push_back(parse_cpu_list(list));
+        for (int cpu : node_cpus.back()) {
+            if (cpu >= (int) cpu_nodes.size()) {
+                cpu_nodes.resize(cpu + 1, 0);
+            }
+            cpu_nodes[cpu] = node;
+        }
+    }
+}
+
+/// Get the topology, reading it the first time.
+static const NumaTopology& get_topology() {
+    static NumaTopology topology;
+    return topology;
+}
+
+/// Work out the initial setting from the environment.
+static bool numa_aware_from_environment() {
+    const char* setting = getenv("VGIO_NUMA");
+    return setting != nullptr && strcmp(setting, "1") == 0;
+}
+
+/// Holds whether we are doing topology-aware placement.
+static atomic<bool> numa_aware_flag(numa_aware_from_environment());
+
+void set_numa_aware(bool enabled) {
+    numa_aware_flag.store(enabled);
+}
+
+bool numa_aware() {
+    return numa_aware_flag.load();
+}
+
+size_t numa_node_count() {
+#ifdef VGIO_HAVE_LIBNUMA
+    if (numa_available() >= 0) {
+        return numa_max_node() + 1;
+    }
+#endif
+    size_t count = get_topology().node_cpus.size();
+    return count == 0 ? 1 : count;
+}
+
+int current_numa_node() {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        return 0;
+    }
+#ifdef VGIO_HAVE_LIBNUMA
+    if (numa_available() >= 0) {
+        int node = numa_node_of_cpu(cpu);
+        return node < 0 ? 0 : node;
+    }
+#endif
+    auto& cpu_nodes = get_topology().cpu_nodes;
+    return cpu < (int) cpu_nodes.size() ? cpu_nodes[cpu] : 0;
+#else
+    return 0;
+#endif
+}
+
+bool bind_thread_to_numa_node(int node) {
+#ifdef VGIO_HAVE_LIBNUMA
+    if (numa_available() >= 0) {
+        if (numa_run_on_node(node) != 0) {
+            return false;
+        }
+        // Running there isn't enough to keep new memory there, so ask for it.
+        numa_set_preferred(node);
+        return true;
+    }
+#endif
+#ifdef __linux__
+    auto& node_cpus = get_topology().node_cpus;
+    if (node < 0 || node >= (int) node_cpus.size() || node_cpus[node].empty()) {
+        return false;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu : node_cpus[node]) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    // With the thread pinned, first-touch allocation keeps its memory local.
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+    return false;
+#endif
+}
+
+ScopedNumaBinding::ScopedNumaBinding() : bound_node(-1) {
+    if (!numa_aware() || numa_node_count() < 2) {
+        return;
+    }
+#ifdef __linux__
+    // Remember where the thread was allowed to run.
+    saved_affinity.resize(sizeof(cpu_set_t));
+    if (sched_getaffinity(0, sizeof(cpu_set_t), (cpu_set_t*) saved_affinity.data()) != 0) {
+        saved_affinity.clear();
+        return;
+    }
+    int node = current_numa_node();
+    if (bind_thread_to_numa_node(node)) {
+        bound_node = node;
+    }
+#endif
+}
+
+ScopedNumaBinding::~ScopedNumaBinding() {
+#ifdef __linux__
+    if (bound_node != -1 && !saved_affinity.empty()) {
+        sched_setaffinity(0, sizeof(cpu_set_t), (cpu_set_t*) saved_affinity.data());
+#ifdef VGIO_HAVE_LIBNUMA
+        if (numa_available() >= 0) {
+            // Go back to the default of allocating wherever the thread runs.
+            numa_set_localalloc();
+        }
+#endif
+    }
+#endif
+}
+
+int ScopedNumaBinding::node() const {
+    return bound_node;
+}
+
+}
+
+}
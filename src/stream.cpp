@@ -15,6 +15,31 @@ void finish(std::ostream& out, bool compressed) {
     }
 }
 
+void filter_batch(std::vector<std::string>& batch, const WireFilter& filter, bool pairs) {
+    if (filter.empty()) {
+        return;
+    }
+    
+    // Compact the survivors to the front of the batch, in order.
+    size_t kept = 0;
+    size_t stride = pairs ? 2 : 1;
+    for (size_t i = 0; i < batch.size(); i += stride) {
+        bool keep = filter.accepts(batch[i]);
+        if (pairs && i + 1 < batch.size()) {
+            keep = keep && filter.accepts(batch[i + 1]);
+        }
+        if (keep) {
+            for (size_t j = i; j < i + stride && j < batch.size(); j++) {
+                if (kept != j) {
+                    batch[kept] = std::move(batch[j]);
+                }
+                kept++;
+            }
+        }
+    }
+    batch.resize(kept);
+}
+
 size_t get_stream_length(std::istream& in) {
     in.clear();
     // Get where we are right now
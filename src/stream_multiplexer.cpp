@@ -4,7 +4,17 @@
  */
 
 #include "vg/io/stream_multiplexer.hpp"
+#include "vg/io/numa.hpp"
+#include "vg/io/fdstream.hpp"
 #include <iostream>
+#include <sstream>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace vg {
 
@@ -18,18 +28,80 @@ const size_t StreamMultiplexer::MIN_QUEUE_ITEM_BYTES = 10 * 64 * 1024;
 /// Don't allow more than a few items per ring buffer
 const size_t StreamMultiplexer::RING_BUFFER_SIZE = 10;
 
+/// Enough for a few batches per thread on a big machine.
+const size_t StreamMultiplexer::DEFAULT_REORDER_WINDOW = 1024;
+
+/// Spin just long enough to catch items coming in back to back without
+/// paying for a wakeup.
+const size_t StreamMultiplexer::WRITER_SPIN_PASSES = 64;
+
+/// Direct I/O needs buffers, sizes, and file offsets aligned to the file
+/// system block size, which is at most this on everything we care about.
+const size_t StreamMultiplexer::DIRECT_ALIGNMENT = 4096;
+
+/// Big writes are what parallel file systems want.
+const size_t StreamMultiplexer::DIRECT_WRITE_BYTES = 4 * 1024 * 1024;
+
 StreamMultiplexer::StreamMultiplexer(ostream& backing, size_t max_threads) :
+    StreamMultiplexer(&backing, find_fd(backing), max_threads, false) {
+    // Nothing to do!
+}
+
+StreamMultiplexer::StreamMultiplexer(int backing_fd, size_t max_threads, bool direct_io) :
+    StreamMultiplexer(nullptr, backing_fd, max_threads, direct_io) {
+    // Nothing to do!
+}
+
+StreamMultiplexer::StreamMultiplexer(ostream* backing, int backing_fd, size_t max_threads, bool direct_io) :
+    slot_count(0),
+    start_time(chrono::steady_clock::now()),
+    bytes_written(0),
+    writer_busy_nanoseconds(0),
+    max_reorder_depth(0),
+    stats_out(nullptr),
+    stats_interval(0),
     backing_stream(backing),
-    thread_streams(max_threads),
-    thread_breakpoint_cursors(max_threads, 0),
-    thread_queues(max_threads, vector<string>(RING_BUFFER_SIZE)),
-    thread_queue_empty_slots(max_threads, 0),
-    thread_queue_filled_slots(max_threads, 0),
-    thread_queue_byte_counts(max_threads, 0), 
-    thread_queue_mutexes(max_threads),
+    backing_fd(backing_fd),
+    direct_io_flags(-1),
+    staging_buffer(nullptr),
+    staging_bytes(0),
+    ordered(false),
+    reorder_window(DEFAULT_REORDER_WINDOW),
+    next_sequence(0),
     writer_stop(false),
-    writer_thread(&StreamMultiplexer::writer_thread_function, this) {
-    // Nothing to do! Writer thread is now running!
+    writer_work_pending(false),
+    writer_numa_node(numa_aware() ? current_numa_node() : -1) {
+    
+    if (direct_io && backing_fd != -1) {
+        // We will send everything through an aligned buffer.
+        void* allocated;
+        if (posix_memalign(&allocated, DIRECT_ALIGNMENT, DIRECT_WRITE_BYTES) != 0) {
+            throw runtime_error("StreamMultiplexer could not allocate direct I/O buffer");
+        }
+        staging_buffer = (char*) allocated;
+#ifdef O_DIRECT
+        // Only bypass the page cache if we start at an aligned offset, and
+        // the descriptor lets us. Otherwise we still make big aligned writes.
+        off_t position = lseek(backing_fd, 0, SEEK_CUR);
+        int flags = fcntl(backing_fd, F_GETFL);
+        if (position != -1 && position % DIRECT_ALIGNMENT == 0 && flags != -1 &&
+            fcntl(backing_fd, F_SETFL, flags | O_DIRECT) == 0) {
+            // Remember how to put it back
+            direct_io_flags = flags;
+        }
+#endif
+    }
+    
+    // Make the slots for all the numbered threads.
+    for (size_t i = 0; i < MAX_SLOT_BLOCKS; i++) {
+        slot_blocks[i].store(nullptr);
+    }
+    for (size_t i = 0; i < max_threads; i++) {
+        add_slot();
+    }
+    
+    // Now that everything is set up, start the writer.
+    writer_thread = thread(&StreamMultiplexer::writer_thread_function, this);
 }
 
 StreamMultiplexer::~StreamMultiplexer() {
@@ -37,36 +109,141 @@ StreamMultiplexer::~StreamMultiplexer() {
     cerr << "StreamMultiplexer destructing" << endl;
 #endif
 
-    // Tell the writer to finish.
-    writer_stop.store(true);
+    // Tell the writer to finish, waking it up if it is asleep.
+    {
+        lock_guard<mutex> lock(writer_wakeup_mutex);
+        writer_stop.store(true);
+    }
+    writer_wakeup.notify_one();
     // Wait for it to finish.
     writer_thread.join();
     
-    // Make sure to flush the backing stream, so output is on disk.
-    // Probably not necessary, but makes sense.
-    backing_stream.flush();
+    if (backing_stream != nullptr) {
+        // Make sure to flush the backing stream, so output is on disk.
+        // Probably not necessary, but makes sense.
+        backing_stream->flush();
+    }
+    
+    if (staging_buffer != nullptr) {
+        free(staging_buffer);
+    }
+    
+    for (size_t i = 0; i < MAX_SLOT_BLOCKS; i++) {
+        // Clean up all the slots
+        delete[] slot_blocks[i].load();
+    }
     
 #ifdef debug
     cerr << "StreamMultiplexer destroyed" << endl;
 #endif
 }
 
+int StreamMultiplexer::find_fd(ostream& backing) {
+    fdoutbuf* fd_buffer = dynamic_cast<fdoutbuf*>(backing.rdbuf());
+    if (fd_buffer == nullptr) {
+        return -1;
+    }
+    // Anything already written needs to go out before what we write to the
+    // descriptor directly. fdoutbuf doesn't buffer, but be safe.
+    backing.flush();
+    return fd_buffer->get_fd();
+}
+
+StreamMultiplexer::ThreadSlot::ThreadSlot(ChunkPool& pool) :
+    buffer(pool),
+    stream(&buffer),
+    breakpoint_cursor(0),
+    queue(RING_BUFFER_SIZE),
+    queue_empty_slot(0),
+    queue_filled_slot(0),
+    queue_byte_count(0) {
+    // Nothing to do!
+}
+
+StreamMultiplexer::ThreadSlot& StreamMultiplexer::get_slot(size_t slot_number) const {
+    if (slot_number >= slot_count.load(memory_order_acquire)) {
+        throw out_of_range("StreamMultiplexer: no slot " + to_string(slot_number));
+    }
+    size_t block = slot_block(slot_number);
+    size_t offset = slot_number + 1 - ((size_t) 1 << block);
+    return *slot_blocks[block].load(memory_order_acquire)[offset];
+}
+
+size_t StreamMultiplexer::slot_block(size_t slot_number) {
+    // Block b holds slots 2^b - 1 through 2^(b + 1) - 2.
+    size_t block = 0;
+    while (((size_t) 2 << block) <= slot_number + 1) {
+        block++;
+    }
+    return block;
+}
+
+size_t StreamMultiplexer::add_slot() {
+    size_t slot_number = slot_count.load();
+    size_t block = slot_block(slot_number);
+    size_t offset = slot_number + 1 - ((size_t) 1 << block);
+    if (offset == 0) {
+        // This slot starts a new block.
+        slot_blocks[block].store(new unique_ptr<ThreadSlot>[(size_t) 1 << block], memory_order_release);
+    }
+    slot_blocks[block].load()[offset].reset(new ThreadSlot(chunk_pool));
+    // Publish the slot.
+    slot_count.store(slot_number + 1, memory_order_release);
+    return slot_number;
+}
+
 ostream& StreamMultiplexer::get_thread_stream(size_t thread_number) {
     // The stream is always in the same place for a given thread.
-    return thread_streams.at(thread_number);
+    return get_slot(thread_number).stream;
+}
+
+size_t StreamMultiplexer::lease_slot() {
+    lock_guard<mutex> lock(slots_mutex);
+    if (!free_slots.empty()) {
+        // Reuse the most recently released slot, which is probably still in cache.
+        size_t slot_number = free_slots.back();
+        free_slots.pop_back();
+        return slot_number;
+    }
+    return add_slot();
+}
+
+void StreamMultiplexer::release_slot(size_t slot_number) {
+    // Don't let the next user discard what we wrote.
+    register_breakpoint(slot_number);
+    lock_guard<mutex> lock(slots_mutex);
+    free_slots.push_back(slot_number);
+}
+
+StreamMultiplexer::SlotLease::SlotLease(StreamMultiplexer& multiplexer) :
+    multiplexer(multiplexer), slot_number(multiplexer.lease_slot()) {
+    // Nothing to do!
+}
+
+StreamMultiplexer::SlotLease::~SlotLease() {
+    multiplexer.release_slot(slot_number);
+}
+
+size_t StreamMultiplexer::SlotLease::slot() const {
+    return slot_number;
+}
+
+ostream& StreamMultiplexer::SlotLease::stream() {
+    return multiplexer.get_thread_stream(slot_number);
 }
 
 void StreamMultiplexer::register_breakpoint(size_t thread_number) {
     // The thread says we can break here.
     // Also, we are in the thread.
     
-    // Get our stream
-    stringstream& our_stream = thread_streams.at(thread_number);
+    // Get our slot and buffer
+    ThreadSlot& our_slot = get_slot(thread_number);
+    ChunkedStreamBuf& our_buffer = our_slot.buffer;
     
     // See how much data it has
-    size_t item_bytes = our_stream.tellp();
+    size_t item_bytes = our_buffer.size();
     
-    if (item_bytes >= MIN_QUEUE_ITEM_BYTES) {
+    if (item_bytes >= MIN_QUEUE_ITEM_BYTES && !ordered) {
         // We have enough data to justify a block.
         
 #ifdef debug
@@ -74,36 +251,30 @@ void StreamMultiplexer::register_breakpoint(size_t thread_number) {
 #endif
         
         // Lock our queue
-        thread_queue_mutexes[thread_number].lock();
+        unique_lock<mutex> lock(our_slot.queue_mutex);
         
-        while (ring_buffer_full(thread_number)) {
-            // The queue is over-full.
-            
-            // Unlock, yield, and lock again, to give the writer time to empty our queue.
-            thread_queue_mutexes[thread_number].unlock();
-            std::this_thread::yield();
-            thread_queue_mutexes[thread_number].lock();
-            // TODO: use a condition variable here to alert the writer that we want writing.
-        }
+        // If the queue is over-full, sleep until the writer empties some of it.
+        wait_for_space(thread_number, lock);
         
         // Add in the space usage
-        thread_queue_byte_counts[thread_number] += item_bytes;
+        our_slot.queue_byte_count += item_bytes;
         
-        // Move the right number of bytes from the stringstream into the queue at the back
-        // TODO: can we avoid a copy here?
-        ring_buffer_push(thread_number) = std::move(our_stream.str().substr(0, item_bytes));
+        // Hand the chunks with the data over to the queue at the back. This
+        // also empties the buffer so it can be filled up again.
+        our_buffer.take_data(ring_buffer_push(thread_number));
+        count_enqueue(thread_number, item_bytes, ring_buffer_size(thread_number), our_slot.queue_byte_count);
         
         // Unlock the queue
-        thread_queue_mutexes[thread_number].unlock();
+        lock.unlock();
+        
+        // Make sure the writer knows there's work
+        wake_writer();
         
-        // Reset the stream so it can be filled up again.
-        // Empty the contents and clear the state bits.
-        // Move might do this but it's not guaranteed.
-        our_stream.str(std::string());
-        our_stream.clear();
+        // Clear the stream's state bits.
+        our_slot.stream.clear();
         
         // Reset the breakpoint cursor
-        thread_breakpoint_cursors[thread_number] = 0;
+        our_slot.breakpoint_cursor = 0;
     } else {
 #ifdef debug
         cerr << "StreamMultiplexer skipped breakpoint for " << item_bytes << " bytes in thread " << thread_number << endl;
@@ -111,17 +282,70 @@ void StreamMultiplexer::register_breakpoint(size_t thread_number) {
 
         // We aren't going to actually cut the data here, but remember the
         // breakpoint position in case we have to rewind to it.
-        thread_breakpoint_cursors[thread_number] = item_bytes;
+        our_slot.breakpoint_cursor = item_bytes;
     }
     
     
 }
 
-bool StreamMultiplexer::want_breakpoint(size_t thread_number) {
-    stringstream& our_stream = thread_streams.at(thread_number);
+void StreamMultiplexer::set_ordered(size_t window) {
+    ordered = true;
+    reorder_window = max(window, (size_t) 1);
+}
+
+void StreamMultiplexer::register_breakpoint(size_t thread_number, size_t sequence_number) {
+    if (!ordered) {
+        throw runtime_error("StreamMultiplexer: sequenced breakpoint outside of ordered mode");
+    }
     
-    // See how much data it has
-    size_t item_bytes = our_stream.tellp();
+    // Get our slot and buffer
+    ThreadSlot& our_slot = get_slot(thread_number);
+    ChunkedStreamBuf& our_buffer = our_slot.buffer;
+    
+    {
+        unique_lock<mutex> lock(reorder_mutex);
+        
+        if (sequence_number < next_sequence || reorder_buffer.count(sequence_number)) {
+            throw runtime_error("StreamMultiplexer: sequence number " + to_string(sequence_number) + " used twice");
+        }
+        
+        // Wait until we are close enough to the front to be buffered.
+        if (sequence_number >= next_sequence + reorder_window) {
+            auto wait_start = chrono::steady_clock::now();
+            reorder_space.wait(lock, [&]() {
+                return sequence_number < next_sequence + reorder_window;
+            });
+            count_blocked(thread_number, chrono::steady_clock::now() - wait_start);
+        }
+        
+#ifdef debug
+        cerr << "StreamMultiplexer registered sequence number " << sequence_number << " for "
+            << our_buffer.size() << " bytes in thread " << thread_number << endl;
+#endif
+        
+        // Hand the chunks over, even if there are none, so the writer can
+        // get past this sequence number.
+        size_t item_bytes = our_buffer.size();
+        our_buffer.take_data(reorder_buffer[sequence_number]);
+        count_enqueue(thread_number, item_bytes, 0, 0);
+        if (reorder_buffer.size() > max_reorder_depth.load(memory_order_relaxed)) {
+            max_reorder_depth.store(reorder_buffer.size(), memory_order_relaxed);
+        }
+    }
+    
+    // Clear the stream's state bits.
+    our_slot.stream.clear();
+    
+    // Reset the breakpoint cursor
+    our_slot.breakpoint_cursor = 0;
+    
+    // Make sure the writer knows there's work
+    wake_writer();
+}
+
+bool StreamMultiplexer::want_breakpoint(size_t thread_number) {
+    // See how much data our buffer has
+    size_t item_bytes = get_slot(thread_number).buffer.size();
     
 #ifdef debug
     cerr << "Checking for breakpoint at " << item_bytes << "/" << MIN_QUEUE_ITEM_BYTES << " bytes" << endl;
@@ -132,83 +356,79 @@ bool StreamMultiplexer::want_breakpoint(size_t thread_number) {
 }
 
 void StreamMultiplexer::register_barrier(size_t thread_number) {
-    // Get our stream
-    stringstream& our_stream = thread_streams.at(thread_number);
+    if (ordered) {
+        // Barriers would have us write out of sequence.
+        throw runtime_error("StreamMultiplexer: barriers are not available in ordered mode");
+    }
+    
+    // Get our slot and buffer
+    ThreadSlot& our_slot = get_slot(thread_number);
+    ChunkedStreamBuf& our_buffer = our_slot.buffer;
     
     // See how much data it has
-    size_t item_bytes = our_stream.tellp();
+    size_t item_bytes = our_buffer.size();
     
     // Whether our block is big enough or not, put it in the queue
     
     // Lock our queue
-    thread_queue_mutexes[thread_number].lock();
+    unique_lock<mutex> lock(our_slot.queue_mutex);
     
-    while (ring_buffer_full(thread_number)) {
-        // The queue is over-full.
-        
-        // Unlock, yield, and lock again, to give the writer time to empty our queue.
-        thread_queue_mutexes[thread_number].unlock();
-        std::this_thread::yield();
-        thread_queue_mutexes[thread_number].lock();
-        // TODO: use a condition variable here to alert the writer that we want writing.
-    }
+    // If the queue is over-full, sleep until the writer empties some of it.
+    wait_for_space(thread_number, lock);
     
     // Add in the space usage
-    thread_queue_byte_counts[thread_number] += item_bytes;
+    our_slot.queue_byte_count += item_bytes;
     
-    // Move the right number of bytes from the stringstream into the queue at the back
-    // TODO: can we avoid a copy here?
-    ring_buffer_push(thread_number) = std::move(our_stream.str().substr(0, item_bytes));
+    // Hand the chunks with the data over to the queue at the back. This
+    // also empties the buffer so it can be filled up again.
+    our_buffer.take_data(ring_buffer_push(thread_number));
+    count_enqueue(thread_number, item_bytes, ring_buffer_size(thread_number), our_slot.queue_byte_count);
     
     // Unlock the queue
-    thread_queue_mutexes[thread_number].unlock();
+    lock.unlock();
+    
+    // Make sure the writer knows there's work
+    wake_writer();
     
-    // Reset the stream so it can be filled up again.
-    // Empty the contents and clear the state bits.
-    // Move might do this but it's not guaranteed.
-    our_stream.str(std::string());
-    our_stream.clear();
+    // Clear the stream's state bits.
+    our_slot.stream.clear();
     
     // Reset the breakpoint cursor
-    thread_breakpoint_cursors[thread_number] = 0;
+    our_slot.breakpoint_cursor = 0;
     
     // Don't return until our queue is empty. If our queue is empty, our data
     // will come out before anything written subsequently, since the writer
     // thread either has already written our data or is currently doing it.
     
-    // Yield at least once to give the writer a chance to write the first time around.
-    std::this_thread::yield();
-    
-    thread_queue_mutexes[thread_number].lock();
-    while (!ring_buffer_empty(thread_number)) {
-        // Unlock, yield, and lock again, to give the writer time to empty our queue.
-        thread_queue_mutexes[thread_number].unlock();
-        std::this_thread::yield();
-        thread_queue_mutexes[thread_number].lock();
-    }
-    thread_queue_mutexes[thread_number].unlock();
+    lock.lock();
+    our_slot.queue_drained.wait(lock, [&]() {
+        // The writer signals us every time it pops from our queue.
+        return ring_buffer_empty(thread_number);
+    });
 }
 
 void StreamMultiplexer::discard_to_breakpoint(size_t thread_number) {
-    // Get our stream
-    stringstream& our_stream = thread_streams.at(thread_number);
+    // Get our slot and buffer
+    ThreadSlot& our_slot = get_slot(thread_number);
+    ChunkedStreamBuf& our_buffer = our_slot.buffer;
     
-    // Get the write position in the stream
-    size_t item_bytes = our_stream.tellp();
+    // Get the write position in the buffer
+    size_t item_bytes = our_buffer.size();
     
-    if (item_bytes > thread_breakpoint_cursors[thread_number]) {
+    if (item_bytes > our_slot.breakpoint_cursor) {
         // We have advanced past the previous breakpoint and need to rewind to it.
-        our_stream.seekp(thread_breakpoint_cursors[thread_number]);
-        // Anything after the put pointer will be ignored when outputting the stream's contents
+        our_buffer.pubseekpos(our_slot.breakpoint_cursor, ios_base::out);
+        // Anything after the put pointer will be ignored when outputting the buffer's contents
     }
 }
 
 void StreamMultiplexer::discard_bytes(size_t thread_number, size_t count) {
-    // Get our stream
-    stringstream& our_stream = thread_streams.at(thread_number);
+    // Get our slot and buffer
+    ThreadSlot& our_slot = get_slot(thread_number);
+    ChunkedStreamBuf& our_buffer = our_slot.buffer;
     
-    // Get the write position in the stream
-    size_t item_bytes = our_stream.tellp();
+    // Get the write position in the buffer
+    size_t item_bytes = our_buffer.size();
     
     if (count > item_bytes) {
         // We want to rewind past the very beginning. Clamp.
@@ -219,10 +439,10 @@ void StreamMultiplexer::discard_bytes(size_t thread_number, size_t count) {
     size_t new_item_bytes = item_bytes - count;
     
     // Clamp to the last breakpoint
-    new_item_bytes = max(thread_breakpoint_cursors[thread_number], new_item_bytes);
+    new_item_bytes = max(our_slot.breakpoint_cursor, new_item_bytes);
     
     // Seek to the new position.
-    our_stream.seekp(new_item_bytes);
+    our_buffer.pubseekpos(new_item_bytes, ios_base::out);
 }
 
 void StreamMultiplexer::writer_thread_function() {
@@ -231,65 +451,115 @@ void StreamMultiplexer::writer_thread_function() {
     cerr << "StreamMultiplexer writer starting" << endl;
 #endif
 
-#ifdef debug
-    // Track the max bytes obeserved in any queue
-    size_t high_water_bytes = 0;
-#endif
+    if (writer_numa_node != -1) {
+        // Stay on the node of the thread that set us up, which is where the
+        // backing stream's buffers are.
+        bind_thread_to_numa_node(writer_numa_node);
+    }
+
+    // Where and when we dump stats, once we are asked to
+    ostream* dump_to = nullptr;
+    chrono::steady_clock::time_point next_dump;
+
+    // How many passes in a row have found nothing to do?
+    size_t idle_passes = 0;
+    
+    // Items to write on each pass, and how many came from each queue
+    vector<ChunkedData*> ready_items;
+    vector<size_t> ready_counts;
 
     while(!writer_stop.load()) {
         // We have not been asked to stop.
         
-        // We set this if we write anything.
-        // If we don't have any work to do on a whole pass, we yield so we
-        // don't constantly spin.
-        bool found_data = false;
-        
-        for (size_t i = 0; i < thread_queues.size(); i++) {
+        // Collect everything that is ready in all the queues, so it can all
+        // go out at once.
+        ready_items.clear();
+        // Slots may be added while we work, but only after this many.
+        ready_counts.resize(slot_count.load(memory_order_acquire));
+        for (size_t i = 0; i < ready_counts.size(); i++) {
             // For each queue
+            ThreadSlot& slot = get_slot(i);
             
             // Lock it
-            thread_queue_mutexes[i].lock();
-            if (!ring_buffer_empty(i)) {
-#ifdef debug
-                // Record data size
-                high_water_bytes = max(high_water_bytes, thread_queue_byte_counts[i]);
-#endif
-                
-                // Find the chunk to write.
-                const string& emptying = ring_buffer_peek(i);
-                
-                // Count how many bytes are in the string.
-                size_t data_bytes = emptying.size();
-                
+            lock_guard<mutex> lock(slot.queue_mutex);
+            // Take everything in it. Nothing will leave the queue unless we
+            // pop it, and the writing threads won't touch full slots.
+            ready_counts[i] = ring_buffer_size(i);
+            for (size_t j = 0; j < ready_counts[i]; j++) {
+                ChunkedData& emptying = ring_buffer_peek(i, j);
 #ifdef debug
-                cerr << "StreamMultiplexer writing " << data_bytes  << " bytes from thread " << i << endl;
+                cerr << "StreamMultiplexer writing " << emptying.bytes << " bytes from thread " << i << endl;
 #endif
-                
                 // Record we removed its data from the queue
-                thread_queue_byte_counts[i] -= data_bytes;
-                
-                // Unlock now
-                thread_queue_mutexes[i].unlock();
-                
-                // Dump the data block. We know it won't leave the queue unless we pop it.
-                backing_stream << emptying;
-                
-                /// Lock again and pop. Nobody else could have removed the thing we were working on.
-                thread_queue_mutexes[i].lock();
-                ring_buffer_pop(i);
-                thread_queue_mutexes[i].unlock();
-                
-                // Say we had work to do
-                found_data = true;
-            } else {
-                // Unlock right away
-                thread_queue_mutexes[i].unlock();
+                slot.queue_byte_count -= emptying.bytes;
+                ready_items.push_back(&emptying);
             }
         }
+        // In ordered mode, also take the run of units that is next in sequence.
+        size_t unordered_items = ready_items.size();
+        take_sequenced_items(ready_items, false);
         
-        if (!found_data) {
+        if (!ready_items.empty()) {
+            // Dump the data blocks
+            write_items(ready_items);
+            
+            for (size_t k = unordered_items; k < ready_items.size(); k++) {
+                // Sequenced items are ours now, so recycle them completely.
+                chunk_pool.give_back(ready_items[k]->chunks);
+                delete ready_items[k];
+            }
+            
+            for (size_t i = 0; i < ready_counts.size(); i++) {
+                if (ready_counts[i] == 0) {
+                    continue;
+                }
+                ThreadSlot& slot = get_slot(i);
+                for (size_t j = 0; j < ready_counts[i]; j++) {
+                    // Recycle the chunks. The slots are still ours until we pop them.
+                    chunk_pool.give_back(ring_buffer_peek(i, j).chunks);
+                }
+                {
+                    // Lock again and pop. Nobody else could have removed the things we were working on.
+                    lock_guard<mutex> lock(slot.queue_mutex);
+                    for (size_t j = 0; j < ready_counts[i]; j++) {
+                        ring_buffer_pop(i);
+                    }
+                }
+                // Wake the thread if it is waiting for space or for a barrier.
+                slot.queue_drained.notify_all();
+            }
+            
+            idle_passes = 0;
+        } else if (idle_passes < WRITER_SPIN_PASSES) {
             // Don't spin constantly with nothing to do.
+            idle_passes++;
             std::this_thread::yield();
+        } else {
+            // Sleep until something is enqueued or we are told to stop, or
+            // it is time to dump stats.
+            unique_lock<mutex> lock(writer_wakeup_mutex);
+            auto wake_condition = [&]() {
+                return writer_work_pending || writer_stop.load();
+            };
+            if (dump_to != nullptr) {
+                writer_wakeup.wait_until(lock, next_dump, wake_condition);
+            } else {
+                writer_wakeup.wait(lock, wake_condition);
+            }
+            writer_work_pending = false;
+            idle_passes = 0;
+        }
+        
+        if (dump_to == nullptr) {
+            // See if we have been asked to start dumping stats.
+            lock_guard<mutex> lock(writer_wakeup_mutex);
+            if (stats_out != nullptr) {
+                dump_to = stats_out;
+                next_dump = chrono::steady_clock::now() + stats_interval;
+            }
+        } else if (chrono::steady_clock::now() >= next_dump) {
+            *dump_to << get_stats().to_json() << endl;
+            next_dump += stats_interval;
         }
     }
     
@@ -297,65 +567,319 @@ void StreamMultiplexer::writer_thread_function() {
     // queues, and the final buffers if they were too small.
     // No locks since none of the other threads are allowed to be writing now
     // (our destructor has started).
-    for (size_t i = 0; i < thread_queues.size(); i++) {
-#ifdef debug
-        // Record sizes
-        high_water_bytes = max(high_water_bytes, thread_queue_byte_counts[i]);
-#endif
+    ready_items.clear();
+    size_t final_slot_count = slot_count.load();
+    for (size_t i = 0; i < final_slot_count; i++) {
         while (!ring_buffer_empty(i)) {
             auto& item = ring_buffer_peek(i);
             
-            // Get how many bytes are in the string buffer.
-            size_t data_bytes = item.size();
-            
 #ifdef debug
-            cerr << "StreamMultiplexer finishing with " << data_bytes << " queued bytes from thread " << i << endl;
+            cerr << "StreamMultiplexer finishing with " << item.bytes << " queued bytes from thread " << i << endl;
 #endif
             
-            backing_stream << item;
+            // Move the item out so the slot can be popped.
+            ready_items.push_back(new ChunkedData(std::move(item)));
+            item.chunks.clear();
+            item.bytes = 0;
             
             ring_buffer_pop(i);
         }
     }
-    for (auto& item : thread_streams) {
-        // Ship out the final partial chunks without sending them through the queues.
+    // Then everything still waiting to be put in order, even if the caller
+    // left gaps in the sequence.
+    take_sequenced_items(ready_items, true);
+    for (size_t i = 0; i < final_slot_count; i++) {
+        // Ship out the final partial items without sending them through the queues.
+        ChunkedStreamBuf& buffer = get_slot(i).buffer;
         
         // Get how many bytes are not rewound.
-        size_t data_bytes = item.tellp();
+        size_t data_bytes = buffer.size();
         
         if (data_bytes > 0) {
 #ifdef debug
             cerr << "StreamMultiplexer finishing with " << data_bytes << " unqueued bytes" << endl;
 #endif
-        
-            backing_stream << item.str().substr(0, data_bytes);
+            
+            ready_items.push_back(new ChunkedData());
+            buffer.take_data(*ready_items.back());
         }
     }
+    write_items(ready_items);
+    for (ChunkedData* item : ready_items) {
+        chunk_pool.give_back(item->chunks);
+        delete item;
+    }
+    finish_output();
+    
+    {
+        // Catch a request to dump stats that came in at the last minute.
+        lock_guard<mutex> lock(writer_wakeup_mutex);
+        dump_to = stats_out;
+    }
+    if (dump_to != nullptr) {
+        // Dump the final stats
+        *dump_to << get_stats().to_json() << endl;
+    }
     
 #ifdef debug
-    cerr << "StreamMultiplexer high water mark: " << high_water_bytes << " bytes across " << thread_queues.size() << " threads" << endl;
+    cerr << "StreamMultiplexer stats: " << get_stats().to_json() << endl;
 #endif
 }
 
+void StreamMultiplexer::take_sequenced_items(vector<ChunkedData*>& items, bool take_all) {
+    bool advanced = false;
+    {
+        lock_guard<mutex> lock(reorder_mutex);
+        while (!reorder_buffer.empty() && (take_all || reorder_buffer.begin()->first == next_sequence)) {
+#ifdef debug
+            cerr << "StreamMultiplexer writing " << reorder_buffer.begin()->second.bytes
+                << " bytes for sequence number " << reorder_buffer.begin()->first << endl;
+#endif
+            if (reorder_buffer.begin()->first != next_sequence) {
+                cerr << "warning[vg::io::StreamMultiplexer]: sequence numbers " << next_sequence
+                    << " through " << (reorder_buffer.begin()->first - 1) << " were never registered" << endl;
+            }
+            items.push_back(new ChunkedData(std::move(reorder_buffer.begin()->second)));
+            next_sequence = reorder_buffer.begin()->first + 1;
+            reorder_buffer.erase(reorder_buffer.begin());
+            advanced = true;
+        }
+    }
+    if (advanced) {
+        // Let threads waiting on the window move ahead.
+        reorder_space.notify_all();
+    }
+}
+
+void StreamMultiplexer::write_items(const vector<ChunkedData*>& items) {
+    auto write_start = chrono::steady_clock::now();
+    size_t item_bytes = 0;
+    for (ChunkedData* item : items) {
+        item_bytes += item->bytes;
+    }
+    
+    if (backing_fd == -1) {
+        // Go through the stream
+        for (ChunkedData* item : items) {
+            item->write_to(*backing_stream);
+        }
+    } else if (staging_buffer != nullptr) {
+        // Pack everything into big aligned writes
+        for (ChunkedData* item : items) {
+            size_t remaining = item->bytes;
+            for (char* chunk : item->chunks) {
+                size_t chunk_bytes = min(remaining, ChunkPool::CHUNK_BYTES);
+                stage(chunk, chunk_bytes);
+                remaining -= chunk_bytes;
+            }
+        }
+    } else {
+        // Gather all the chunks into one vectored write.
+        vector<iovec> pieces;
+        for (ChunkedData* item : items) {
+            size_t remaining = item->bytes;
+            for (char* chunk : item->chunks) {
+                if (remaining == 0) {
+                    break;
+                }
+                size_t chunk_bytes = min(remaining, ChunkPool::CHUNK_BYTES);
+                pieces.push_back(iovec{chunk, chunk_bytes});
+                remaining -= chunk_bytes;
+            }
+        }
+        write_fully(pieces);
+    }
+    
+    // Only we write these, so we don't need read-modify-write atomics.
+    bytes_written.store(bytes_written.load(memory_order_relaxed) + item_bytes, memory_order_relaxed);
+    uint64_t nanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - write_start).count();
+    writer_busy_nanoseconds.store(writer_busy_nanoseconds.load(memory_order_relaxed) + nanoseconds, memory_order_relaxed);
+}
+
+void StreamMultiplexer::write_fully(vector<iovec>& pieces) {
+    size_t first = 0;
+    while (first < pieces.size()) {
+        int count = (int) min(pieces.size() - first, (size_t) IOV_MAX);
+        ssize_t written = ::writev(backing_fd, pieces.data() + first, count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && disable_direct_io()) {
+                // The file system wouldn't take an unaligned direct write.
+                continue;
+            }
+            cerr << "error[vg::io::StreamMultiplexer]: could not write output: " << strerror(errno) << endl;
+            exit(1);
+        }
+        // Skip over what got written, which may end partway through a piece.
+        while (first < pieces.size() && (size_t) written >= pieces[first].iov_len) {
+            written -= pieces[first].iov_len;
+            first++;
+        }
+        if (written > 0) {
+            pieces[first].iov_base = (char*) pieces[first].iov_base + written;
+            pieces[first].iov_len -= written;
+        }
+    }
+}
+
+void StreamMultiplexer::stage(const char* data, size_t length) {
+    while (length > 0) {
+        size_t to_copy = min(length, DIRECT_WRITE_BYTES - staging_bytes);
+        memcpy(staging_buffer + staging_bytes, data, to_copy);
+        staging_bytes += to_copy;
+        data += to_copy;
+        length -= to_copy;
+        if (staging_bytes == DIRECT_WRITE_BYTES) {
+            // The staging buffer is full, and a multiple of the alignment.
+            vector<iovec> pieces{iovec{staging_buffer, staging_bytes}};
+            write_fully(pieces);
+            staging_bytes = 0;
+        }
+    }
+}
+
+bool StreamMultiplexer::disable_direct_io() {
+#ifdef O_DIRECT
+    if (direct_io_flags != -1) {
+        fcntl(backing_fd, F_SETFL, direct_io_flags);
+        direct_io_flags = -1;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void StreamMultiplexer::finish_output() {
+    if (staging_buffer != nullptr) {
+        // Write out whole blocks while we can still do it directly.
+        size_t aligned_bytes = staging_bytes - staging_bytes % DIRECT_ALIGNMENT;
+        if (aligned_bytes > 0) {
+            vector<iovec> pieces{iovec{staging_buffer, aligned_bytes}};
+            write_fully(pieces);
+        }
+        // The tail can't be written directly.
+        disable_direct_io();
+        if (staging_bytes > aligned_bytes) {
+            vector<iovec> pieces{iovec{staging_buffer + aligned_bytes, staging_bytes - aligned_bytes}};
+            write_fully(pieces);
+        }
+        staging_bytes = 0;
+    }
+}
+
+void StreamMultiplexer::wait_for_space(size_t thread_number, unique_lock<mutex>& lock) {
+    if (ring_buffer_full(thread_number)) {
+        auto wait_start = chrono::steady_clock::now();
+        // Make sure the writer is awake to empty our queue. It can't be
+        // waiting on our lock, so this is safe to do while holding it.
+        wake_writer();
+        get_slot(thread_number).queue_drained.wait(lock, [&]() {
+            return !ring_buffer_full(thread_number);
+        });
+        count_blocked(thread_number, chrono::steady_clock::now() - wait_start);
+    }
+}
+
+void StreamMultiplexer::count_enqueue(size_t thread_number, size_t item_bytes, size_t queue_depth, size_t queue_bytes) {
+    // Only this thread writes its counters, so we don't need read-modify-write atomics.
+    ThreadCounters& counters = get_slot(thread_number).counters;
+    counters.bytes.store(counters.bytes.load(memory_order_relaxed) + item_bytes, memory_order_relaxed);
+    counters.items.store(counters.items.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    if (queue_depth > counters.max_queue_depth.load(memory_order_relaxed)) {
+        counters.max_queue_depth.store(queue_depth, memory_order_relaxed);
+    }
+    if (queue_bytes > counters.max_queue_bytes.load(memory_order_relaxed)) {
+        counters.max_queue_bytes.store(queue_bytes, memory_order_relaxed);
+    }
+}
+
+void StreamMultiplexer::count_blocked(size_t thread_number, chrono::steady_clock::duration waited) {
+    ThreadCounters& counters = get_slot(thread_number).counters;
+    uint64_t nanoseconds = chrono::duration_cast<chrono::nanoseconds>(waited).count();
+    counters.blocked_nanoseconds.store(counters.blocked_nanoseconds.load(memory_order_relaxed) + nanoseconds, memory_order_relaxed);
+}
+
+StreamMultiplexerStats StreamMultiplexer::get_stats() const {
+    StreamMultiplexerStats stats;
+    stats.elapsed_seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    size_t slots = slot_count.load(memory_order_acquire);
+    for (size_t i = 0; i < slots; i++) {
+        ThreadCounters& counters = get_slot(i).counters;
+        stats.thread_bytes.push_back(counters.bytes.load(memory_order_relaxed));
+        stats.thread_items.push_back(counters.items.load(memory_order_relaxed));
+        stats.thread_blocked_seconds.push_back(counters.blocked_nanoseconds.load(memory_order_relaxed) / 1e9);
+        stats.max_queue_depth = max(stats.max_queue_depth, counters.max_queue_depth.load(memory_order_relaxed));
+        stats.max_queue_bytes = max(stats.max_queue_bytes, counters.max_queue_bytes.load(memory_order_relaxed));
+    }
+    stats.bytes_written = bytes_written.load(memory_order_relaxed);
+    stats.writer_busy_seconds = writer_busy_nanoseconds.load(memory_order_relaxed) / 1e9;
+    stats.writer_idle_seconds = max(0.0, stats.elapsed_seconds - stats.writer_busy_seconds);
+    stats.max_reorder_depth = max_reorder_depth.load(memory_order_relaxed);
+    return stats;
+}
+
+void StreamMultiplexer::dump_stats_periodically(ostream& out, double interval_seconds) {
+    {
+        lock_guard<mutex> lock(writer_wakeup_mutex);
+        stats_out = &out;
+        stats_interval = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(interval_seconds));
+        // Make the writer notice.
+        writer_work_pending = true;
+    }
+    writer_wakeup.notify_one();
+}
+
+string StreamMultiplexerStats::to_json() const {
+    stringstream json;
+    json << "{\"elapsed_seconds\":" << elapsed_seconds
+        << ",\"bytes_written\":" << bytes_written
+        << ",\"writer_busy_seconds\":" << writer_busy_seconds
+        << ",\"writer_idle_seconds\":" << writer_idle_seconds
+        << ",\"max_queue_depth\":" << max_queue_depth
+        << ",\"max_queue_bytes\":" << max_queue_bytes
+        << ",\"max_reorder_depth\":" << max_reorder_depth
+        << ",\"threads\":[";
+    for (size_t i = 0; i < thread_bytes.size(); i++) {
+        if (i != 0) {
+            json << ",";
+        }
+        json << "{\"bytes\":" << thread_bytes[i]
+            << ",\"items\":" << thread_items[i]
+            << ",\"blocked_seconds\":" << thread_blocked_seconds[i] << "}";
+    }
+    json << "]}";
+    return json.str();
+}
+
+void StreamMultiplexer::wake_writer() {
+    {
+        lock_guard<mutex> lock(writer_wakeup_mutex);
+        writer_work_pending = true;
+    }
+    writer_wakeup.notify_one();
+}
+
 bool StreamMultiplexer::ring_buffer_full(size_t thread_number) const {
-    auto& empty = thread_queue_empty_slots[thread_number];
-    auto& filled = thread_queue_filled_slots[thread_number];
+    auto& empty = get_slot(thread_number).queue_empty_slot;
+    auto& filled = get_slot(thread_number).queue_filled_slot;
 
     // We are full if empty is 1 before filled, because we leave one slot open
     return (empty + 1 == filled || (empty + 1 == RING_BUFFER_SIZE && filled == 0));
 }
 
 bool StreamMultiplexer::ring_buffer_empty(size_t thread_number) const {
-    auto& empty = thread_queue_empty_slots[thread_number];
-    auto& filled = thread_queue_filled_slots[thread_number];
+    auto& empty = get_slot(thread_number).queue_empty_slot;
+    auto& filled = get_slot(thread_number).queue_filled_slot;
 
     // We are empty if empty is filled
     return (empty == filled);
 }
 
-string& StreamMultiplexer::ring_buffer_push(size_t thread_number) {
-    auto& empty = thread_queue_empty_slots[thread_number];
-    auto& buffer = thread_queues[thread_number];
+ChunkedData& StreamMultiplexer::ring_buffer_push(size_t thread_number) {
+    auto& empty = get_slot(thread_number).queue_empty_slot;
+    auto& buffer = get_slot(thread_number).queue;
     
     // Grab the empty slot
     auto& slot = buffer[empty];
@@ -370,15 +894,23 @@ string& StreamMultiplexer::ring_buffer_push(size_t thread_number) {
     return slot;
 }
 
-const string& StreamMultiplexer::ring_buffer_peek(size_t thread_number) {
-    auto& filled = thread_queue_filled_slots[thread_number];
-    auto& buffer = thread_queues[thread_number];
+size_t StreamMultiplexer::ring_buffer_size(size_t thread_number) const {
+    auto& empty = get_slot(thread_number).queue_empty_slot;
+    auto& filled = get_slot(thread_number).queue_filled_slot;
+    
+    // The used slots run from filled up to empty, maybe wrapping around.
+    return empty >= filled ? empty - filled : RING_BUFFER_SIZE - filled + empty;
+}
+
+ChunkedData& StreamMultiplexer::ring_buffer_peek(size_t thread_number, size_t offset) {
+    auto& filled = get_slot(thread_number).queue_filled_slot;
+    auto& buffer = get_slot(thread_number).queue;
     
-    return buffer[filled];
+    return buffer[(filled + offset) % RING_BUFFER_SIZE];
 }
 
 void StreamMultiplexer::ring_buffer_pop(size_t thread_number) {
-    auto& filled = thread_queue_filled_slots[thread_number];
+    auto& filled = get_slot(thread_number).queue_filled_slot;
     
     // Advance the filled cursor
     filled++;
@@ -0,0 +1,209 @@
+/**
+ * \file wire_filter.cpp
+ * Implementations for filters on serialized Protobuf messages.
+ */
+
+#include "vg/io/wire_filter.hpp"
+
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+// Give the static member variable a .o home
+const size_t WireFilter::MAX_PREDICATES;
+
+/// Protobuf wire types we need to know about
+enum wire_type_t {
+    WIRE_VARINT = 0,
+    WIRE_FIXED64 = 1,
+    WIRE_LENGTH_DELIMITED = 2,
+    WIRE_FIXED32 = 5
+};
+
+/// Read a varint from the given cursor, advancing it. Returns false if the
+/// varint runs off the end of the buffer or is too long.
+static inline bool read_varint(const char*& cursor, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && cursor != end; shift += 7) {
+        uint8_t byte = (uint8_t) *cursor;
+        ++cursor;
+        value |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+WireFilter& WireFilter::require_range(uint32_t field_number, int64_t min, int64_t max) {
+    return add(Predicate{field_number, RANGE, min, max, ""});
+}
+
+WireFilter& WireFilter::require_bool(uint32_t field_number, bool value) {
+    return require_range(field_number, value ? 1 : 0, value ? 1 : 0);
+}
+
+WireFilter& WireFilter::require_prefix(uint32_t field_number, const string& prefix) {
+    return add(Predicate{field_number, PREFIX, 0, 0, prefix});
+}
+
+WireFilter& WireFilter::require_equal(uint32_t field_number, const string& value) {
+    return add(Predicate{field_number, EQUAL, 0, 0, value});
+}
+
+bool WireFilter::empty() const {
+    return predicates.empty();
+}
+
+bool WireFilter::accepts(const string& serialized) const {
+    return accepts(serialized.data(), serialized.size());
+}
+
+bool WireFilter::accepts(const char* data, size_t length) const {
+    if (predicates.empty()) {
+        return true;
+    }
+
+    // Track which predicates currently pass. Later occurrences of a field
+    // override earlier ones.
+    uint64_t passing = pass_on_default;
+
+    const char* cursor = data;
+    const char* end = data + length;
+    while (cursor != end) {
+        uint64_t key;
+        if (!read_varint(cursor, end, key)) {
+            // Can't scan this. Let the real parser complain.
+            return true;
+        }
+        uint64_t field_number = key >> 3;
+        int wire_type = key & 0x7;
+
+        // Find the value
+        uint64_t value = 0;
+        const char* value_data = nullptr;
+        size_t value_length = 0;
+        switch (wire_type) {
+        case WIRE_VARINT:
+            if (!read_varint(cursor, end, value)) {
+                return true;
+            }
+            break;
+        case WIRE_FIXED64:
+            if (end - cursor < 8) {
+                return true;
+            }
+            cursor += 8;
+            break;
+        case WIRE_LENGTH_DELIMITED:
+            if (!read_varint(cursor, end, value) || value > (uint64_t) (end - cursor)) {
+                return true;
+            }
+            value_data = cursor;
+            value_length = value;
+            cursor += value_length;
+            break;
+        case WIRE_FIXED32:
+            if (end - cursor < 4) {
+                return true;
+            }
+            cursor += 4;
+            break;
+        default:
+            // Groups and garbage aren't something we can filter on.
+            return true;
+        }
+
+        for (size_t i = 0; i < predicates.size(); i++) {
+            const Predicate& predicate = predicates[i];
+            if (predicate.field_number != field_number) {
+                continue;
+            }
+            bool pass;
+            if (wire_type == WIRE_VARINT) {
+                pass = passes(predicate, value);
+            } else if (wire_type == WIRE_LENGTH_DELIMITED) {
+                pass = passes(predicate, value_data, value_length);
+            } else {
+                // Fixed-width fields aren't supported by any predicate kind.
+                pass = false;
+            }
+            if (pass) {
+                passing |= ((uint64_t) 1 << i);
+            } else {
+                passing &= ~((uint64_t) 1 << i);
+            }
+        }
+    }
+
+    uint64_t all = predicates.size() == 64 ? numeric_limits<uint64_t>::max() : (((uint64_t) 1 << predicates.size()) - 1);
+    return passing == all;
+}
+
+WireFilter& WireFilter::add(Predicate&& predicate) {
+    if (predicates.size() == MAX_PREDICATES) {
+        throw runtime_error("io::WireFilter: too many predicates");
+    }
+    // An absent field reads as 0 or the empty string.
+    bool default_pass = (predicate.kind == RANGE) ? passes(predicate, 0) : passes(predicate, "", 0);
+    if (default_pass) {
+        pass_on_default |= ((uint64_t) 1 << predicates.size());
+    }
+    predicates.emplace_back(std::move(predicate));
+    return *this;
+}
+
+bool WireFilter::passes(const Predicate& predicate, uint64_t value) {
+    if (predicate.kind != RANGE) {
+        return false;
+    }
+    // Negative int32 and int64 values are sign-extended to 64 bits on the wire.
+    int64_t signed_value = (int64_t) value;
+    return signed_value >= predicate.min && signed_value <= predicate.max;
+}
+
+bool WireFilter::passes(const Predicate& predicate, const char* data, size_t length) {
+    switch (predicate.kind) {
+    case PREFIX:
+        return length >= predicate.text.size() && memcmp(data, predicate.text.data(), predicate.text.size()) == 0;
+    case EQUAL:
+        return length == predicate.text.size() && memcmp(data, predicate.text.data(), length) == 0;
+    default:
+        return false;
+    }
+}
+
+AlignmentWireFilter& AlignmentWireFilter::min_mapping_quality(int32_t mapq) {
+    require_range(Alignment::kMappingQualityFieldNumber, mapq, numeric_limits<int32_t>::max());
+    return *this;
+}
+
+AlignmentWireFilter& AlignmentWireFilter::min_score(int32_t score) {
+    require_range(Alignment::kScoreFieldNumber, score, numeric_limits<int32_t>::max());
+    return *this;
+}
+
+AlignmentWireFilter& AlignmentWireFilter::is_secondary(bool secondary) {
+    require_bool(Alignment::kIsSecondaryFieldNumber, secondary);
+    return *this;
+}
+
+AlignmentWireFilter& AlignmentWireFilter::name_prefix(const string& prefix) {
+    require_prefix(Alignment::kNameFieldNumber, prefix);
+    return *this;
+}
+
+AlignmentWireFilter& AlignmentWireFilter::read_group(const string& group) {
+    require_equal(Alignment::kReadGroupFieldNumber, group);
+    return *this;
+}
+
+}
+
+}
@@ -1,8 +1,342 @@
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "vg/vg.pb.h"
+#include "vg/io/chunked_streambuf.hpp"
+#include "vg/io/gaf_binary.hpp"
+#include "vg/io/gaf_index.hpp"
+#include "vg/io/gafkluge.hpp"
+#include "vg/io/stream_multiplexer.hpp"
 #include <google/protobuf/descriptor.h>
+#include <htslib/bgzf.h>
+
+/// Throw if a condition that should hold doesn't.
+void check(bool condition, const std::string& description) {
+    if (!condition) {
+        throw std::runtime_error("Check failed: " + description);
+    }
+}
+
+/// Print a GAF record back out as a line of text, without the newline.
+std::string gaf_text(const gafkluge::GafRecord& record) {
+    std::string text;
+    gafkluge::append_gaf_record(text, record);
+    if (!text.empty() && text.back() == '\n') {
+        text.pop_back();
+    }
+    return text;
+}
+
+/// Make a GAF line for a read visiting nodes first_node and first_node + 1,
+/// each 10 bp long.
+std::string two_node_gaf_line(int64_t first_node) {
+    return "read" + std::to_string(first_node) + "\t20\t0\t20\t+\t>" + std::to_string(first_node) +
+        ">" + std::to_string(first_node + 1) + "\t20\t0\t20\t20\t20\t60\tcs:Z::20";
+}
+
+void test_gaf_round_trip() {
+    std::cerr << "Checking GAF parsing and formatting..." << std::endl;
+    
+    // Optional fields come back out in tag order, so write them that way.
+    std::string line = "q1\t150\t0\t150\t+\t>1<2>3\t300\t10\t160\t148\t150\t60\tAS:i:-5\tcs:Z::40*ag:109\tdv:f:0.01";
+    gafkluge::GafRecord record;
+    gafkluge::parse_gaf_record(line, record);
+    check(record.query_name == "q1" && record.path.size() == 3 && record.mapq == 60, "GAF columns parse");
+    check(record.opt_fields.size() == 3, "GAF optional fields parse");
+    check(record.opt_fields.count("cs") == 1 && record.opt_fields.at("cs").first == "Z" &&
+          record.opt_fields.at("cs").second == ":40*ag:109", "cs field is found by tag");
+    check(record.opt_fields.find("zz") == record.opt_fields.end(), "missing field is not found");
+    check(gaf_text(record) == line, "GAF line formats back the same");
+    
+    // Edit the fields the way a map would be edited.
+    record.opt_fields["bq"] = std::make_pair(std::string("Z"), std::string("IIII"));
+    record.opt_fields.erase("dv");
+    record.opt_fields["AS"].second = "-7";
+    check(gaf_text(record) == "q1\t150\t0\t150\t+\t>1<2>3\t300\t10\t160\t148\t150\t60\tAS:i:-7\tbq:Z:IIII\tcs:Z::40*ag:109",
+          "edited GAF optional fields format in tag order");
+    
+    // Fields left over from a longer record must not leak into the next one.
+    gafkluge::parse_gaf_record("q2\t*\t*\t*\t*\t*\t*\t*\t*\t*\t*\t255", record);
+    check(record.opt_fields.empty() && record.path.empty(), "reused record is cleared");
+    check(gaf_text(record) == "q2\t*\t*\t*\t*\t*\t*\t*\t*\t*\t*\t255", "missing GAF columns format back the same");
+}
+
+void test_gaf_binary_round_trip() {
+    std::cerr << "Checking GAFB encoding and decoding..." << std::endl;
+    
+    std::vector<std::string> lines = {
+        "q1\t150\t0\t150\t+\t>1<2>3\t300\t10\t160\t148\t150\t60\tAS:i:-5\tcs:Z::40*AG:109",
+        "q2\t9\t0\t9\t-\tchr1\t1000\t5\t14\t9\t9\t7\tcs:Z::3*ag*ct:2+acgt-g:1",
+        "q3\t9\t0\t9\t+\t>1<2\t40\t0\t9\t9\t9\t7\tcs:Z::3*aG:2\tfq:f:0.5",
+        "q4\t9\t0\t9\t+\t>007<12\t40\t0\t9\t9\t9\t7\tcs:Z::0+A",
+        "q5\t9\t0\t9\t+\t>s1>s2\t40\t0\t9\t9\t9\t7\tcs:Z:=ACGT",
+        "q6\t*\t*\t*\t*\t*\t*\t*\t*\t*\t*\t255"
+    };
+    for (int64_t i = 0; i < 100; i++) {
+        lines.push_back(two_node_gaf_line(i * 3 + 1));
+    }
+    
+    // Encode in small blocks, so records span several.
+    gafkluge::GafRecord record;
+    std::vector<std::string> expected;
+    std::stringstream file;
+    vg::io::write_gaf_binary_header(file);
+    vg::io::GafBinaryEncoder encoder(7);
+    std::string block;
+    size_t block_count = 0;
+    for (auto& line : lines) {
+        gafkluge::parse_gaf_record(line, record);
+        expected.push_back(gaf_text(record));
+        encoder.add(record);
+        if (encoder.full()) {
+            block.clear();
+            encoder.finish_block(block);
+            file << block;
+            block_count++;
+        }
+    }
+    block.clear();
+    encoder.finish_block(block);
+    file << block;
+    block_count++;
+    vg::io::write_gaf_binary_end(file);
+    std::string data = file.str();
+    
+    // Decode it again.
+    std::vector<std::string> observed;
+    std::stringstream in(data);
+    vg::io::read_gaf_binary_header(in);
+    vg::io::GafBinaryDecoder decoder;
+    size_t blocks_read = 0;
+    while (vg::io::read_gaf_binary_block(in, block)) {
+        decoder.load_block(block);
+        blocks_read++;
+        while (decoder.next(record)) {
+            observed.push_back(gaf_text(record));
+        }
+    }
+    check(blocks_read == block_count, "GAFB has every block");
+    check(observed == expected, "GAFB records come back as they went in");
+    
+    // The end block must be there, and cut-off blocks must be noticed.
+    for (size_t cut : {(size_t) 4, data.size() / 2, data.size() - 1}) {
+        std::stringstream truncated(data.substr(0, data.size() - cut));
+        bool threw = false;
+        try {
+            vg::io::read_gaf_binary_header(truncated);
+            while (vg::io::read_gaf_binary_block(truncated, block)) {
+                // Keep reading
+            }
+        } catch (std::runtime_error& e) {
+            threw = true;
+        }
+        check(threw, "truncated GAFB throws");
+    }
+    
+    std::stringstream not_gafb(std::string("@HD\tVN:1.6\n"));
+    bool threw = false;
+    try {
+        vg::io::read_gaf_binary_header(not_gafb);
+    } catch (std::runtime_error& e) {
+        threw = true;
+    }
+    check(threw, "non-GAFB data is rejected");
+}
+
+void test_gaf_binary_index() {
+    std::cerr << "Checking GAFB index range queries..." << std::endl;
+    
+    std::string filename = "test_libvgio.gafb";
+    {
+        std::ofstream out(filename, std::ios::binary);
+        vg::io::write_gaf_binary_header(out);
+        vg::io::GafBinaryEncoder encoder(10);
+        gafkluge::GafRecord record;
+        std::string block;
+        for (int64_t i = 0; i < 1000; i++) {
+            gafkluge::parse_gaf_record(two_node_gaf_line(i + 1), record);
+            encoder.add(record);
+            if (encoder.full()) {
+                block.clear();
+                encoder.finish_block(block);
+                out << block;
+            }
+        }
+        block.clear();
+        encoder.finish_block(block);
+        out << block;
+        vg::io::write_gaf_binary_end(out);
+    }
+    vg::io::GafBinaryIndex index;
+    index.index(filename);
+    check(index.get_blocks().size() == 100, "GAFB index has every block");
+    
+    // Reads visiting nodes 500 to 510 start at 499 to 510.
+    std::vector<uint64_t> offsets = index.find(500, 510);
+    check(offsets.size() == 2, "GAFB index finds only the blocks in range");
+    size_t found = 0;
+    std::ifstream in(filename, std::ios::binary);
+    vg::io::GafBinaryDecoder decoder;
+    gafkluge::GafRecord record;
+    std::string block;
+    for (uint64_t offset : offsets) {
+        in.seekg(offset);
+        check(vg::io::read_gaf_binary_block(in, block), "GAFB index offset is a block");
+        decoder.load_block(block);
+        while (decoder.next(record)) {
+            vg::io::nid_t min_node, max_node;
+            if (vg::io::gaf_node_range(record, min_node, max_node) && min_node <= 510 && max_node >= 500) {
+                found++;
+            }
+        }
+    }
+    check(found == 12, "GAFB index blocks hold every read in range");
+    check(index.find(2000, 3000).empty(), "GAFB index finds nothing past the end");
+    
+    std::remove(filename.c_str());
+}
+
+void test_gaf_node_index() {
+    std::cerr << "Checking bgzipped GAF index range queries..." << std::endl;
+    
+    std::string filename = "test_libvgio.gaf.gz";
+    BGZF* fp = bgzf_open(filename.c_str(), "w");
+    check(fp != nullptr, "can write bgzipped GAF");
+    for (int64_t i = 0; i < 1000; i++) {
+        std::string line = two_node_gaf_line(i + 1) + "\n";
+        check(bgzf_write(fp, line.data(), line.size()) == (ssize_t) line.size(), "can write GAF line");
+        if (i % 50 == 49) {
+            // End the BGZF block, so there are several to pick from.
+            bgzf_flush(fp);
+        }
+    }
+    bgzf_close(fp);
+    
+    vg::io::GafNodeIndex index;
+    index.index(filename);
+    check(index.get_blocks().size() == 20, "GAF index has every BGZF block");
+    // Reads visiting nodes 500 to 510 start in the 10th and 11th blocks, which
+    // make one range.
+    auto ranges = index.find(500, 510);
+    check(ranges.size() == 1 && ranges[0].first == index.get_blocks()[9].virtual_offset &&
+          ranges[0].second == index.get_blocks()[11].virtual_offset, "GAF index finds only the blocks in range");
+    check(index.find(2000, 3000).empty(), "GAF index finds nothing past the end");
+    
+    // Every node is 10 bp.
+    std::string sequence = "ACGTACGTAC";
+    size_t found = vg::io::gaf_for_each_in_node_range([](vg::io::nid_t id) { return (size_t) 10; },
+                                                      [&](vg::io::nid_t id, bool is_reverse) { return sequence; },
+                                                      filename, index, 500, 510, [&](vg::Alignment& aln) {
+        bool in_range = false;
+        for (auto& mapping : aln.path().mapping()) {
+            in_range |= mapping.position().node_id() >= 500 && mapping.position().node_id() <= 510;
+        }
+        check(in_range, "GAF range query only finds reads in range");
+    });
+    check(found == 12, "GAF range query finds every read in range");
+    
+    std::remove(filename.c_str());
+}
+
+void test_ordered_multiplexer() {
+    std::cerr << "Checking ordered multiplexer output..." << std::endl;
+    
+    size_t thread_count = 4;
+    size_t unit_count = 1000;
+    std::string expected;
+    for (size_t i = 0; i < unit_count; i++) {
+        // Make the units different sizes, so threads get out of step.
+        expected += "unit " + std::to_string(i) + " " + std::string(i % 37, 'x') + "\n";
+    }
+    
+    for (size_t run = 0; run < 3; run++) {
+        std::stringstream out;
+        {
+            vg::io::StreamMultiplexer multiplexer(out, thread_count);
+            multiplexer.set_ordered(thread_count * 2);
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < thread_count; t++) {
+                threads.emplace_back([&, t]() {
+                    for (size_t i = t; i < unit_count; i += thread_count) {
+                        std::ostream& stream = multiplexer.get_thread_stream(t);
+                        stream << "unit " << i << " ";
+                        // Write part of the unit, and take it back, to make
+                        // sure discarded output stays out.
+                        multiplexer.register_breakpoint(t);
+                        stream << "discarded";
+                        multiplexer.discard_to_breakpoint(t);
+                        stream << std::string(i % 37, 'x') << "\n";
+                        multiplexer.register_breakpoint(t, i);
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        }
+        check(out.str() == expected, "ordered multiplexer output is in sequence order");
+    }
+}
+
+void test_chunked_streambuf() {
+    std::cerr << "Checking chunked stream buffer..." << std::endl;
+    
+    vg::io::ChunkPool pool;
+    vg::io::ChunkedStreamBuf buffer(pool);
+    std::ostream out(&buffer);
+    
+    // Write across several chunks.
+    std::string expected;
+    for (size_t i = 0; expected.size() < vg::io::ChunkPool::CHUNK_BYTES * 3 + 100; i++) {
+        std::string line = "line " + std::to_string(i) + "\n";
+        out << line;
+        expected += line;
+    }
+    out.flush();
+    check(buffer.size() == expected.size(), "chunked buffer counts what was written");
+    
+    // Rewind back into an earlier chunk and write over the end.
+    size_t keep = vg::io::ChunkPool::CHUNK_BYTES + 10;
+    out.seekp(keep);
+    check(out.good() && buffer.size() == keep, "chunked buffer rewinds");
+    expected.resize(keep);
+    out << "end\n";
+    expected += "end\n";
+    
+    // Rewinding onto a chunk boundary and seeking ahead of the data.
+    out.seekp(vg::io::ChunkPool::CHUNK_BYTES);
+    check(buffer.size() == vg::io::ChunkPool::CHUNK_BYTES, "chunked buffer rewinds to a chunk boundary");
+    out.seekp(keep + 4);
+    check(out.fail(), "chunked buffer can't seek past its data");
+    out.clear();
+    out << std::string(expected, vg::io::ChunkPool::CHUNK_BYTES);
+    out.flush();
+    check(buffer.size() == expected.size(), "chunked buffer writes after a boundary");
+    
+    vg::io::ChunkedData data;
+    buffer.take_data(data);
+    check(data.bytes == expected.size() && buffer.size() == 0, "chunked buffer hands off its data");
+    std::stringstream written;
+    data.write_to(written);
+    check(written.str() == expected, "chunked data holds what was written");
+    pool.give_back(data.chunks);
+    
+    // The buffer starts over empty.
+    out << "again\n";
+    out.flush();
+    buffer.take_data(data);
+    written.str("");
+    data.write_to(written);
+    check(written.str() == "again\n", "chunked buffer is reusable");
+    pool.give_back(data.chunks);
+}
 
 int main (int arcg, char** argv) {
     std::cerr << "Testing libvgio..." << std::endl;
@@ -28,6 +362,13 @@ int main (int arcg, char** argv) {
         std::cerr << "Found " << message_name << " as " << descriptor->full_name() << " at " << descriptor << std::endl;
     }
     
+    test_gaf_round_trip();
+    test_gaf_binary_round_trip();
+    test_gaf_binary_index();
+    test_gaf_node_index();
+    test_ordered_multiplexer();
+    test_chunked_streambuf();
+    
     std::cerr << "Tests complete!" << std::endl;
     return 0;
 }